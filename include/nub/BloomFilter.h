@@ -0,0 +1,213 @@
+/*  <nub/BloomFilter.h> -- A Bloom filter of the keys of an index, kept in a file beside it
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    mayContain() answers false for most keys that were never add()ed, and true for every
+    key that was, so a lookup of a key that is not there can skip the index.  It is sized
+    by init() for a number of keys (its capacity) and the rate of false positives wanted
+    at that many: about 9.6 bits a key for 1%, with 7 hashes.  Keys can not be taken out,
+    so removes leave their keys answering true; added() and removed() count the keys since
+    init() for the owner to decide when to build it again.
+
+    A key's bytes are hashed once (FNV-1a, then mixed), and the bit positions are derived
+    from the two halves of the hash (double hashing), all of them within one 512 bit block
+    picked by mixing the hash again, so a lookup touches one cache line.
+
+    On disk: a FilterHeader, then the blocks.  The header is written last, so a file cut
+    short has no valid header.  Used by IndexT::attachFilter().
+*/
+
+#ifndef __NUB_BLOOMFILTER_H__
+#define __NUB_BLOOMFILTER_H__
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "Base.h"
+#include "FileSystem.h"
+
+namespace nub {
+
+class BloomFilter
+{
+public:
+	/// What a filter file says about the index it was written for, checked by the owner
+	struct Stamp
+	{
+		uint32 version;   // of the index's keys
+		uint32 n;         // # of keys
+		uint64 root;      // the root node
+		uint64 eof;       // the end of the file
+	};
+
+	BloomFilter() : nBlocks(0), nHashes(0), nCapacity(0), nAdded(0), nRemoved(0) {}
+
+	/// Empty, sized for capacity keys with about falsePositiveRate of false positives
+	void init(int64 capacity, double falsePositiveRate) // throw(...) // can throw bad_alloc
+	{
+		if (capacity < 1)
+			capacity = 1;
+		if (falsePositiveRate <= 0 || falsePositiveRate >= 1)
+			falsePositiveRate = 0.01;
+		const double ln2 = 0.69314718055994530942;
+		double bits = -(double)capacity * log(falsePositiveRate) / (ln2 * ln2);
+		nBlocks = (int64)(bits / cBlockBits) + 1;
+		int k = (int)(bits / capacity * ln2 + 0.5);
+		nHashes = k < 1 ? 1 : k > 16 ? 16 : k;
+		nCapacity = capacity;
+		nAdded = nRemoved = 0;
+		words.assign((size_t)(nBlocks * cBlockWords), 0);
+	}
+
+	bool empty() const // noexcept
+		{ return words.empty(); }
+
+	void add(const void* key, int size) // noexcept
+	{
+		uint64 h = hash(key, size);
+		uint64* block = &words[blockOf(h) * cBlockWords];
+		uint32 h1 = (uint32)h, h2 = (uint32)(h >> 32) | 1;
+		for (int i = 0; i < nHashes; i++, h1 += h2)
+			block[(h1 >> 6) & (cBlockWords - 1)] |= (uint64)1 << (h1 & 63);
+		nAdded++;
+	}
+
+	/// false if the key was never added, true if it may have been
+	bool mayContain(const void* key, int size) const // noexcept
+	{
+		if (words.empty())
+			return true;
+		uint64 h = hash(key, size);
+		const uint64* block = &words[blockOf(h) * cBlockWords];
+		uint32 h1 = (uint32)h, h2 = (uint32)(h >> 32) | 1;
+		for (int i = 0; i < nHashes; i++, h1 += h2)
+			if (!(block[(h1 >> 6) & (cBlockWords - 1)] & ((uint64)1 << (h1 & 63))))
+				return false;
+		return true;
+	}
+
+	/// A key that was added is gone (it still answers true)
+	void noteRemoved(int keys = 1) // noexcept
+		{ nRemoved += keys; }
+
+	int64 capacity() const // noexcept
+		{ return nCapacity; }
+	int64 added() const // noexcept
+		{ return nAdded; }
+	int64 removed() const // noexcept
+		{ return nRemoved; }
+	int64 bytes() const // noexcept
+		{ return (int64)words.size() * sizeof(uint64); }
+
+	/// Read a filter file written for the index stamp describes.  Returns false (and the
+	//     filter is empty) if there is no such file, or it is not whole or not for that index.
+	template <class FileSystemT>
+	bool load(const char* name, const Stamp& stamp) // throw(...) // can throw io_error or bad_alloc
+	{
+		words.clear();
+		typename FileSystemT::FileHandle fh = FileSystemT::open(name);
+		if (!fh)
+			return false;
+		FilterHeader head;
+		int64 size = FileSystemT::size(fh);
+		bool ok = size >= (int64)sizeof(head);
+		if (ok) {
+			FileSystemT::readAt(fh, 0, &head, sizeof(head));
+			ok = !memcmp(head.magic, magic(), sizeof(head.magic)) && head.nHashes > 0 &&
+			     head.nBlocks > 0 && size == (int64)sizeof(head) + head.nBlocks * cBlockWords * (int64)sizeof(uint64) &&
+			     !memcmp(&head.stamp, &stamp, sizeof(stamp));
+		}
+		if (ok) {
+			words.resize((size_t)(head.nBlocks * cBlockWords));
+			FileSystemT::readAt(fh, sizeof(head), &words[0], (int)(words.size() * sizeof(uint64)));
+			nBlocks = head.nBlocks;
+			nHashes = head.nHashes;
+			nCapacity = head.capacity;
+			nAdded = head.added;
+			nRemoved = head.removed;
+		}
+		FileSystemT::close(fh);
+		return ok;
+	}
+
+	/// Write the filter to a file, for the index stamp describes
+	template <class FileSystemT>
+	void save(const char* name, const Stamp& stamp) const // throw(...) // can throw io_error
+	{
+		typename FileSystemT::FileHandle fh = FileSystemT::create(name);
+		if (!fh) {
+			char message[1024];
+			sprintf(message, "Cannot create the filter file %s", name);
+			throw io_error(message);
+		}
+		FilterHeader head;
+		memset(&head, 0, sizeof(head));
+		FileSystemT::writeAt(fh, sizeof(head), &words[0], (int)(words.size() * sizeof(uint64)));
+		memcpy(head.magic, magic(), sizeof(head.magic));
+		head.stamp = stamp;
+		head.nBlocks = nBlocks;
+		head.nHashes = nHashes;
+		head.capacity = nCapacity;
+		head.added = nAdded;
+		head.removed = nRemoved;
+		FileSystemT::writeAt(fh, 0, &head, sizeof(head));   // last: the file is whole
+		FileSystemT::close(fh);
+	}
+
+private:
+	static const int cBlockBits  = 512;   // a cache line
+	static const int cBlockWords = cBlockBits / 64;
+
+	struct FilterHeader
+	{
+		char   magic[8];
+		Stamp  stamp;
+		int64  nBlocks;
+		int32  nHashes;
+		int32  reserved;
+		int64  capacity;
+		int64  added;
+		int64  removed;
+	};
+
+	std::vector<uint64> words;   // nBlocks blocks of cBlockWords
+	int64               nBlocks;
+	int                 nHashes;
+	int64               nCapacity;
+	int64               nAdded;
+	int64               nRemoved;
+
+	static const char* magic() // noexcept
+		{ return "nubbloom"; }
+
+	static uint64 mix(uint64 h) // noexcept
+	{
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	static uint64 hash(const void* key, int size) // noexcept
+	{
+		uint64 h = 14695981039346656037ull;
+		for (const byte* p = (const byte*)key; size--; p++)
+			h = (h ^ *p) * 1099511628211ull;
+		return mix(h);                 // FNV-1a's low bits are weak
+	}
+
+	/// The block of a hash, from bits of it other than the ones that pick the bits
+	size_t blockOf(uint64 h) const // noexcept
+		{ return (size_t)(((mix(h ^ 0x9e3779b97f4a7c15ull) >> 32) * (uint64)nBlocks) >> 32); }
+};
+
+} // namespace nub
+
+#endif // __NUB_BLOOMFILTER_H__
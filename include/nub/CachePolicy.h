@@ -0,0 +1,392 @@
+/*  <nub/CachePolicy.h> -- Replacement policies for the IndexT node cache
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+*/
+
+#ifndef __NUB_CACHEPOLICY_H__
+#define __NUB_CACHEPOLICY_H__
+
+#include "Base.h"
+
+namespace nub {
+
+/* A cache policy decides which cached node IndexT reuses when it needs a cache frame
+   and all of them are in use.  Frames are numbered 0 .. nFrames-1.
+
+     void init(int nFrames)             - allocate for nFrames frames, called once
+     void reset()                       - forget everything (index opened or created)
+     void fill(int frame, tFilePos ofs) - frame now holds the node at ofs
+     void hit(int frame)                - the node in frame was used again
+     void erase(int frame)              - the node in frame was freed, do not remember it
+     int  victim(const Busy& busy)      - pick a frame to reuse and forget it.
+                                          Frames for which busy(frame) is true must be skipped.
+                                          At least one frame is never busy.
+     static const char* name()          - for reports
+*/
+
+/// Node cache statistics
+struct CacheStats
+{
+	int64 hits;        // getNode() found the node in the cache
+	int64 misses;      // getNode() had to read the node
+	int64 evictions;   // cached nodes dropped to make room for another
+	int64 writeBacks;  // dirty nodes written to evict them (or nodes near them, see setWriteBack())
+	int64 writes;      // writes of dirty nodes: a run of nodes next to each other in the file is one
+
+	CacheStats() { clear(); }
+
+	void clear()
+		{ hits = misses = evictions = writeBacks = writes = 0; }
+
+	double hitRate() const
+		{ return hits + misses ? (double)hits / (double)(hits + misses) : 0; }
+};
+
+
+/// Least recently used.  Cheap and good for point lookups, but a long scan flushes the cache.
+class CacheLRU
+{
+public:
+	CacheLRU() : link(0) {}
+	~CacheLRU() { delete[] link; }
+
+	void init(int nFrames)
+	{
+		link = new Link[nFrames];
+		reset();
+	}
+
+	void reset()
+		{ mru = lru = -1; }
+
+	void fill(int frame, tFilePos)
+		{ front(frame); }
+
+	void hit(int frame)
+	{
+		if (frame != mru) {
+			unlink(frame);
+			front(frame);
+		}
+	}
+
+	void erase(int frame)
+		{ unlink(frame); }
+
+	template <class Busy>
+	int victim(const Busy& busy)
+	{
+		int frame = lru;
+		while (busy(frame))
+			frame = link[frame].newer;
+		unlink(frame);
+		return frame;
+	}
+
+	static const char* name() { return "LRU"; }
+
+private:
+	struct Link
+	{
+		int newer;   // toward the most recently used frame (-1 at the end)
+		int older;   // toward the least recently used frame (-1 at the end)
+	};
+
+	Link* link;
+	int   mru;
+	int   lru;
+
+	void unlink(int frame)
+	{
+		Link& l = link[frame];
+		if (l.newer >= 0) link[l.newer].older = l.older;
+		else              mru = l.older;
+		if (l.older >= 0) link[l.older].newer = l.newer;
+		else              lru = l.newer;
+	}
+
+	void front(int frame)
+	{
+		Link& l = link[frame];
+		l.newer = -1;
+		l.older = mru;
+		if (mru >= 0) link[mru].newer = frame;
+		else          lru = frame;
+		mru = frame;
+	}
+
+	CacheLRU(const CacheLRU&);
+	CacheLRU& operator=(const CacheLRU&);
+};
+
+
+/// CLOCK (second chance).  A hit only sets a reference bit, so hits need no list updates.
+class CacheCLOCK
+{
+public:
+	CacheCLOCK() : state(0) {}
+	~CacheCLOCK() { delete[] state; }
+
+	void init(int nFrames)
+	{
+		state = new byte[n = nFrames];
+		reset();
+	}
+
+	void reset()
+	{
+		memset(state, cEmpty, n);
+		hand = 0;
+	}
+
+	void fill(int frame, tFilePos)
+		{ state[frame] = cReferenced; }
+
+	void hit(int frame)
+		{ state[frame] = cReferenced; }
+
+	void erase(int frame)
+		{ state[frame] = cEmpty; }
+
+	template <class Busy>
+	int victim(const Busy& busy)
+	{
+		while (1) {
+			int frame = hand;
+			if (++hand == n)
+				hand = 0;
+			if (state[frame] == cEmpty || busy(frame))
+				continue;
+			if (state[frame] == cReferenced)
+				state[frame] = cResident;      // second chance
+			else {
+				state[frame] = cEmpty;
+				return frame;
+			}
+		}
+	}
+
+	static const char* name() { return "CLOCK"; }
+
+private:
+	enum { cEmpty, cResident, cReferenced };
+
+	byte* state;
+	int   n;
+	int   hand;
+
+	CacheCLOCK(const CacheCLOCK&);
+	CacheCLOCK& operator=(const CacheCLOCK&);
+};
+
+
+/* 2Q (Johnson & Shasha, VLDB '94).  Nodes read for the first time go into the FIFO A1in.
+   A node used again goes into Am, which is LRU, and so does a node that is read again
+   while its offset is still remembered in A1out (the nodes recently evicted from A1in).
+   A1in gives up frames first while it holds more than a quarter of them, so a scan, which
+   uses each leaf once, only churns A1in and the nodes in Am (the upper levels of the tree
+   and any hot leaves) stay cached.
+   The paper ignores hits in A1in because a scan uses a page several times in a row.
+   IndexT does not report those repeated uses (see IndexT::getNode()), so promoting on a
+   hit in A1in is safe and lets hot nodes reach Am without first being evicted.
+*/
+class Cache2Q
+{
+public:
+	Cache2Q() : link(0), offsets(0), ghost(0), ghostHash(0) {}
+
+	~Cache2Q()
+	{
+		delete[] link;
+		delete[] offsets;
+		delete[] ghost;
+		delete[] ghostHash;
+	}
+
+	void init(int nFrames)
+	{
+		link = new Link[nFrames];
+		offsets = new tFilePos[nFrames];
+		kIn = nFrames / 4;
+		if (kIn < 1) kIn = 1;
+		kOut = nFrames / 2;
+		if (kOut < 1) kOut = 1;
+		ghost = new tFilePos[kOut];
+		for (ghostMask = 15; ghostMask < 2 * kOut - 1; ghostMask = ghostMask * 2 + 1)
+			;
+		ghostHash = new GhostBucket[ghostMask + 1];
+		reset();
+	}
+
+	void reset()
+	{
+		for (int q = 0; q < cQueues; q++) {
+			queue[q].mru = queue[q].lru = -1;
+			queue[q].size = 0;
+		}
+		memset(ghostHash, 0, (ghostMask + 1) * sizeof(GhostBucket));
+		ghostCount = 0;
+		ghostSeq = 0;
+	}
+
+	void fill(int frame, tFilePos ofs)
+	{
+		offsets[frame] = ofs;
+		front(ghostRemove(ofs) ? cAm : cA1in, frame);
+	}
+
+	void hit(int frame)
+	{
+		if (frame != queue[cAm].mru) {
+			unlink(frame);
+			front(cAm, frame);
+		}
+	}
+
+	void erase(int frame)
+		{ unlink(frame); }
+
+	template <class Busy>
+	int victim(const Busy& busy)
+	{
+		int q = queue[cA1in].size > kIn ? cA1in : cAm;
+		int frame = oldest(q, busy);
+		if (frame < 0)
+			frame = oldest(q = cA1in + cAm - q, busy);
+		unlink(frame);
+		if (q == cA1in)
+			ghostAdd(offsets[frame]);
+		return frame;
+	}
+
+	static const char* name() { return "2Q"; }
+
+private:
+	enum { cA1in, cAm, cQueues };
+
+	struct Link
+	{
+		int newer;
+		int older;
+		int queue;   // cA1in or cAm
+	};
+
+	struct Queue
+	{
+		int mru;
+		int lru;
+		int size;
+	};
+
+	struct GhostBucket
+	{
+		tFilePos offset;  // 0 if the bucket is empty
+		int64    seq;     // ghost[] entry # that entered this offset
+	};
+
+	Link*        link;
+	tFilePos*    offsets;     // offset of the node in each frame
+	Queue        queue[cQueues];
+	int          kIn;         // A1in is trimmed first while it holds more than kIn frames
+	int          kOut;        // # of offsets remembered in A1out
+
+	tFilePos*    ghost;       // A1out, circular FIFO of kOut offsets
+	int64        ghostSeq;    // # of offsets ever entered in A1out
+	int          ghostCount;
+	GhostBucket* ghostHash;   // offset -> A1out entry (open addressing, linear probing)
+	int          ghostMask;
+
+	template <class Busy>
+	int oldest(int q, const Busy& busy) const
+	{
+		int frame = queue[q].lru;
+		while (frame >= 0 && busy(frame))
+			frame = link[frame].newer;
+		return frame;
+	}
+
+	void unlink(int frame)
+	{
+		Link& l = link[frame];
+		Queue& q = queue[l.queue];
+		if (l.newer >= 0) link[l.newer].older = l.older;
+		else              q.mru = l.older;
+		if (l.older >= 0) link[l.older].newer = l.newer;
+		else              q.lru = l.newer;
+		q.size--;
+	}
+
+	void front(int qi, int frame)
+	{
+		Link& l = link[frame];
+		Queue& q = queue[qi];
+		l.queue = qi;
+		l.newer = -1;
+		l.older = q.mru;
+		if (q.mru >= 0) link[q.mru].newer = frame;
+		else            q.lru = frame;
+		q.mru = frame;
+		q.size++;
+	}
+
+	int ghostBucket(tFilePos ofs) const
+		{ return (int)(((std::uint64_t)ofs * 0x9E3779B97F4A7C15ull) >> 40) & ghostMask; }
+
+	void ghostAdd(tFilePos ofs)
+	{
+		if (ghostCount == kOut) {          // forget the oldest
+			tFilePos old = ghost[ghostSeq % kOut];
+			int64 oldSeq = ghostSeq - kOut;
+			int h = find(old);
+			if (h >= 0 && ghostHash[h].seq == oldSeq)  // unless it has been reentered since
+				drop(h);
+		} else
+			ghostCount++;
+		ghost[ghostSeq % kOut] = ofs;
+		int h = find(ofs);
+		if (h < 0)
+			for (h = ghostBucket(ofs); ghostHash[h].offset; h = (h + 1) & ghostMask)
+				;
+		ghostHash[h].offset = ofs;
+		ghostHash[h].seq = ghostSeq++;
+	}
+
+	/// Remove an offset from A1out.  Returns false if it was not there.
+	bool ghostRemove(tFilePos ofs)
+	{
+		int h = find(ofs);
+		if (h < 0)
+			return false;
+		drop(h);    // its ghost[] entry goes stale and is skipped when it comes up
+		return true;
+	}
+
+	int find(tFilePos ofs) const
+	{
+		for (int h = ghostBucket(ofs); ghostHash[h].offset; h = (h + 1) & ghostMask)
+			if (ghostHash[h].offset == ofs)
+				return h;
+		return -1;
+	}
+
+	void drop(int h)
+	{
+		// close the gap so that the probe chains of the following entries stay intact
+		for (int j = (h + 1) & ghostMask; ghostHash[j].offset; j = (j + 1) & ghostMask) {
+			int home = ghostBucket(ghostHash[j].offset);
+			if (h <= j ? (home <= h || home > j) : (home <= h && home > j)) {
+				ghostHash[h] = ghostHash[j];
+				h = j;
+			}
+		}
+		ghostHash[h].offset = 0;
+	}
+
+	Cache2Q(const Cache2Q&);
+	Cache2Q& operator=(const Cache2Q&);
+};
+
+} // namespace nub
+
+#endif // __NUB_CACHEPOLICY_H__
@@ -11,8 +11,24 @@
 
 #include "Base.h"
 
+#include <vector>
+
+#if NUB_PLATFORM == NUB_PLATFORM_WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 namespace nub {
 
+/// One read of a batch, for readMany()
+struct ReadAt
+{
+	int64 pos;
+	void* buffer;
+	int   size;
+};
+
 class FileSystem
 {
 private:
@@ -21,6 +37,8 @@ private:
 public:
 	typedef FileInfo* FileHandle;
 
+	static const bool cConcurrentIO = false;  // readAt() and writeAt() share the file position
+
 	static FileHandle create(const char* name) // throw (...)
 	{
 		FILE* f = fopen(name, "w+b");
@@ -66,6 +84,62 @@ public:
 			Throw(fh, "Write");
 	}
 
+	/// Read at a file offset (the backends in PositionalFileSystem.h and MmapFileSystem.h
+	//    do this without a seek)
+	static void readAt(FileHandle fh, int64 pos, void* buffer, int size) // throw(...)
+	{
+		seek(fh, pos);
+		read(fh, buffer, size);
+	}
+
+	/// Read a batch of places in the file (UringFileSystem has them all in flight at once)
+	static void readMany(FileHandle fh, const ReadAt* reads, int n) // throw(...)
+	{
+		for (int i = 0; i < n; i++)
+			readAt(fh, reads[i].pos, reads[i].buffer, reads[i].size);
+	}
+
+	/// Write at a file offset
+	static void writeAt(FileHandle fh, int64 pos, const void* buffer, int size) // throw(...)
+	{
+		seek(fh, pos);
+		write(fh, (void*)buffer, size);
+	}
+
+	/// Write n buffers of size bytes each one after another from a file offset, as one write
+	static void writeGather(FileHandle fh, int64 pos, const void* const* buffers, int n, int size) // throw(...)
+	{
+		std::vector<byte> joined((size_t)n * size);
+		for (int i = 0; i < n; i++)
+			memcpy(&joined[(size_t)i * size], buffers[i], size);
+		writeAt(fh, pos, &joined[0], n * size);
+	}
+
+	/// Make what was written to the file durable (for a write-ahead log)
+	static void sync(FileHandle fh) // throw(...)
+	{
+#if NUB_PLATFORM == NUB_PLATFORM_WIN32
+		if (fflush(fh->f) || _commit(_fileno(fh->f)))
+#else
+		if (fflush(fh->f) || fsync(fileno(fh->f)))
+#endif
+			Throw(fh, "Sync");
+	}
+
+	/// # of bytes in the file
+	static int64 size(FileHandle fh) // throw(...)
+	{
+#if NUB_PLATFORM == NUB_PLATFORM_WIN32
+		if (_fseeki64(fh->f, 0, SEEK_END))
+			Throw(fh, "Seek");
+		return _ftelli64(fh->f);
+#else
+		if (fseeko(fh->f, 0, SEEK_END) == -1)
+			Throw(fh, "Seek");
+		return ftello(fh->f);
+#endif
+	}
+
 private:
 	struct FileInfo {
 		FILE* f;
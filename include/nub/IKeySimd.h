@@ -0,0 +1,251 @@
+/*  <nub/IKeySimd.h> -- Key policies that find the end of a key and the first difference
+                        between keys 16 or 32 bytes at a time
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    IKeyASCIIZSimd and IKeyUTF16Simd order keys exactly like IKeyASCIIZ and IKeyUTF16
+    (and so read and write the same index files), but size(), compare() and common()
+    use SSE2, or AVX2 when the CPU has it (checked once, at run time).  They are used
+    as the IKey template argument of IndexT:
+
+        typedef IndexT<IKeyASCIIZSimd> FastIndex;
+
+    The loads are unaligned, so a load that would run past the end of a page (4K, the
+    smallest page there is) is done a character at a time instead; a key is never read
+    past the page that holds its terminator.  On other processors the policies are the
+    plain ones.
+*/
+
+#ifndef __NUB_IKEYSIMD_H__
+#define __NUB_IKEYSIMD_H__
+
+#include "Index.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	define NUB_SIMD 1
+#endif
+
+#ifdef NUB_SIMD
+
+#include <immintrin.h>
+#if NUB_COMPILER == NUB_COMPILER_MSVC
+#	include <intrin.h>
+#	define NUB_TARGET_AVX2
+#	define NUB_NO_ASAN
+#else
+#	define NUB_TARGET_AVX2 __attribute__((target("avx2")))
+	// reading the rest of a 16 or 32 byte block after a terminator is safe, but not to ASan
+#	define NUB_NO_ASAN __attribute__((no_sanitize_address))
+#endif
+
+namespace nub {
+
+namespace simd {
+
+inline bool detectAVX2()
+{
+#if NUB_COMPILER == NUB_COMPILER_MSVC
+	int r[4];
+	__cpuid(r, 0);
+	if (r[0] < 7) return false;
+	__cpuid(r, 1);
+	const int osxsave = 1 << 27, avx = 1 << 28;
+	if ((r[2] & (osxsave | avx)) != (osxsave | avx) || (_xgetbv(0) & 6) != 6)
+		return false;   // no AVX, or the OS does not save the ymm registers
+	__cpuidex(r, 7, 0);
+	return (r[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+// Set during static initialization, so the check costs no more than a load.
+//     (Until it is set, SSE2 is used.)
+template <int unused> struct CPU
+{
+	static const bool avx2;
+};
+
+template <int unused> const bool CPU<unused>::avx2 = detectAVX2();
+
+inline bool hasAVX2()
+	{ return CPU<0>::avx2; }
+
+inline int firstBit(unsigned mask)  // mask != 0
+{
+#if NUB_COMPILER == NUB_COMPILER_MSVC
+	unsigned long i;
+	_BitScanForward(&i, mask);
+	return (int)i;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// true if a load of n bytes at p would cross into the next page
+inline bool nearPageEnd(const void* p, int n)
+	{ return ((size_t)p & 4095) > (size_t)(4096 - n); }
+
+// Equal lanes of 1, 2 or 4 byte characters, as a byte mask
+template <int nChar> struct Lanes;
+
+template <> struct Lanes<1>
+{
+	static __m128i eq(__m128i a, __m128i b)                 { return _mm_cmpeq_epi8(a, b); }
+	static NUB_TARGET_AVX2 __m256i eq(__m256i a, __m256i b) { return _mm256_cmpeq_epi8(a, b); }
+};
+
+template <> struct Lanes<2>
+{
+	static __m128i eq(__m128i a, __m128i b)                 { return _mm_cmpeq_epi16(a, b); }
+	static NUB_TARGET_AVX2 __m256i eq(__m256i a, __m256i b) { return _mm256_cmpeq_epi16(a, b); }
+};
+
+template <> struct Lanes<4>
+{
+	static __m128i eq(__m128i a, __m128i b)                 { return _mm_cmpeq_epi32(a, b); }
+	static NUB_TARGET_AVX2 __m256i eq(__m256i a, __m256i b) { return _mm256_cmpeq_epi32(a, b); }
+};
+
+/* Index of the terminator of s, or of the first character where l and r differ
+   or l ends.  Each loop step handles one block, or a block's worth of characters
+   one at a time when a load there could cross a page. */
+
+template <typename Char> NUB_NO_ASAN
+int findEndSSE2(const Char* s)
+{
+	const int n = 16 / sizeof(Char);
+	const __m128i zero = _mm_setzero_si128();
+	for (int i = 0; ; i += n) {
+		if (nearPageEnd(s + i, 16)) {
+			for (int j = i; j < i + n; j++)
+				if (!s[j]) return j;
+			continue;
+		}
+		__m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+		unsigned mask = _mm_movemask_epi8(Lanes<sizeof(Char)>::eq(a, zero));
+		if (mask)
+			return i + firstBit(mask) / (int)sizeof(Char);
+	}
+}
+
+template <typename Char> NUB_NO_ASAN
+int findDiffSSE2(const Char* l, const Char* r)
+{
+	const int n = 16 / sizeof(Char);
+	const __m128i zero = _mm_setzero_si128();
+	for (int i = 0; ; i += n) {
+		if (nearPageEnd(l + i, 16) || nearPageEnd(r + i, 16)) {
+			for (int j = i; j < i + n; j++)
+				if (!l[j] || l[j] != r[j]) return j;
+			continue;
+		}
+		__m128i a = _mm_loadu_si128((const __m128i*)(l + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(r + i));
+		unsigned mask = (_mm_movemask_epi8(Lanes<sizeof(Char)>::eq(a, b)) ^ 0xFFFF) |
+		                 _mm_movemask_epi8(Lanes<sizeof(Char)>::eq(a, zero));
+		if (mask)
+			return i + firstBit(mask) / (int)sizeof(Char);
+	}
+}
+
+template <typename Char> NUB_NO_ASAN NUB_TARGET_AVX2
+int findEndAVX2(const Char* s)
+{
+	const int n = 32 / sizeof(Char);
+	const __m256i zero = _mm256_setzero_si256();
+	for (int i = 0; ; i += n) {
+		if (nearPageEnd(s + i, 32)) {
+			for (int j = i; j < i + n; j++)
+				if (!s[j]) return j;
+			continue;
+		}
+		__m256i a = _mm256_loadu_si256((const __m256i*)(s + i));
+		unsigned mask = (unsigned)_mm256_movemask_epi8(Lanes<sizeof(Char)>::eq(a, zero));
+		if (mask)
+			return i + firstBit(mask) / (int)sizeof(Char);
+	}
+}
+
+template <typename Char> NUB_NO_ASAN NUB_TARGET_AVX2
+int findDiffAVX2(const Char* l, const Char* r)
+{
+	const int n = 32 / sizeof(Char);
+	const __m256i zero = _mm256_setzero_si256();
+	for (int i = 0; ; i += n) {
+		if (nearPageEnd(l + i, 32) || nearPageEnd(r + i, 32)) {
+			for (int j = i; j < i + n; j++)
+				if (!l[j] || l[j] != r[j]) return j;
+			continue;
+		}
+		__m256i a = _mm256_loadu_si256((const __m256i*)(l + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(r + i));
+		unsigned mask = ~(unsigned)_mm256_movemask_epi8(Lanes<sizeof(Char)>::eq(a, b)) |
+		                 (unsigned)_mm256_movemask_epi8(Lanes<sizeof(Char)>::eq(a, zero));
+		if (mask)
+			return i + firstBit(mask) / (int)sizeof(Char);
+	}
+}
+
+template <typename Char>
+int findEnd(const Char* s)
+	{ return hasAVX2() ? findEndAVX2(s) : findEndSSE2(s); }
+
+template <typename Char>
+int findDiff(const Char* l, const Char* r)
+	{ return hasAVX2() ? findDiffAVX2(l, r) : findDiffSSE2(l, r); }
+
+} // namespace simd
+
+
+struct IKeyASCIIZSimd : IKeyASCIIZ
+{
+	static int size(const void* key)
+		{ return simd::findEnd((const byte*)key) + 1; }
+
+	static int compare(const void* lhs, const void* rhs)
+	{
+		const byte* l = (const byte*)lhs;
+		const byte* r = (const byte*)rhs;
+		int i = simd::findDiff(l, r);
+		return (int)l[i] - (int)r[i];  // unsigned, like strcmp()
+	}
+
+	static int common(const void* lhs, const void* rhs)
+		{ return simd::findDiff((const byte*)lhs, (const byte*)rhs); }
+};
+
+
+struct IKeyUTF16Simd : IKeyUTF16
+{
+	static int size(const void* key)
+		{ return (simd::findEnd((const wchar_t*)key) + 1) * (int)sizeof(wchar_t); }
+
+	static int compare(const void* lhs, const void* rhs)
+	{
+		const wchar_t* l = (const wchar_t*)lhs;
+		const wchar_t* r = (const wchar_t*)rhs;
+		int i = simd::findDiff(l, r);
+		return l[i] < r[i] ? -1 : l[i] > r[i];  // as wchar_t, like wcscmp()
+	}
+
+	static int common(const void* lhs, const void* rhs)
+		{ return simd::findDiff((const wchar_t*)lhs, (const wchar_t*)rhs) * (int)sizeof(wchar_t); }
+};
+
+} // namespace nub
+
+#else // NUB_SIMD
+
+namespace nub {
+
+typedef IKeyASCIIZ IKeyASCIIZSimd;
+typedef IKeyUTF16  IKeyUTF16Simd;
+
+} // namespace nub
+
+#endif // NUB_SIMD
+
+#endif // __NUB_IKEYSIMD_H__
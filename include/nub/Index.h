@@ -18,15 +18,34 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <wchar.h>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
 
 #include "Base.h"
 #include "FileSystem.h"
+#include "CachePolicy.h"
+#include "WriteAheadLog.h"
+#include "WriteBehind.h"
+#include "BloomFilter.h"
 
 namespace nub {
 
 const byte ndxMAJOR = 6;      // Version numbers of the index files
 const byte ndxMINOR = 0;
+const byte ndxMAJORFrontCoded = 7;  // major version of index files with front coded nodes
+const byte ndxMAJORFixed = 8;       // major version of index files of fixed size keys (no keyofs)
+const byte ndxMAJORCounted = 9;     // major version of index files with counted nodes
 const int  ndxMaxStack = 64;  // Maximum tree height
+const int  ndxMaxRecent = 8;  // # of most recently used nodes that are never evicted
+const int  ndxMinCache = 4;   // # of nodes a merge holds at once: node, parent, sibling, grandparent
 
 
 /* Exception specifictions removed as of 0.3.3 
@@ -37,21 +56,102 @@ const int  ndxMaxStack = 64;  // Maximum tree height
    Otherwise (when a comment is given) the function should throw only those exceptions listed.
 */
 
+/// What the threads writing an IndexT in concurrent write mode share besides the tree
+//     (kept out of the packed IndexT, so that the atomics and the mutex are aligned)
+struct WriteGate
+{
+	std::atomic<int>   leafWriters;  // inserts and removes running that change only a leaf
+	std::atomic<bool>  treeWanted;   // one that changes more waits for them to finish, or runs
+	std::mutex         treeLock;     // held by that one
+	std::atomic<int>   added;        // keys added by leaf writers less those removed, not yet in count()
+	std::atomic<int64> hits;         // cache hits of leaf writers, not yet in cacheStats()
+	std::vector<int>   touched;      // frames the one with the tree has used
+
+	WriteGate() : leafWriters(0), treeWanted(false), added(0), hits(0) {}
+};
+
+/// The state of an IndexT in copy-on-write mode (see IndexT::beginCopyOnWrite())
+//     (kept out of the packed IndexT, like WriteGate)
+template <class ndxFilePosT>
+struct CopyOnWriteState
+{
+	typedef std::map<ndxFilePosT, ndxFilePosT> Moved;
+
+	std::mutex               lock;       // for snapshots opening and closing in other threads:
+	uint32                   version;    //    # of publish()es,
+	std::vector<byte>        published;  //    the header as of the last one
+	std::map<uint32, int>    readers;    //    and # of snapshots open on each version
+	std::set<ndxFilePosT>    fresh;      // nodes written since the last publish(): changed in place
+	Moved                    moved;      // changed nodes of the last version evicted: where they went
+	std::vector<ndxFilePosT> freed;      // nodes of the last version the changes left behind
+	std::deque<std::pair<uint32, ndxFilePosT> > retired; // older ones: the version that left them
+	std::vector<ndxFilePosT> reusable;   // free nodes no snapshot can see
+};
+
+/// The free nodes of an IndexT once read from its free list (see IndexT::countFree())
+//     (kept out of the packed IndexT, like WriteGate)
+template <class ndxFilePosT>
+struct FreeNodes
+{
+	typedef std::set<ndxFilePosT>              Set;
+	typedef std::map<ndxFilePosT, ndxFilePosT> Links;
+
+	Set   nodes;    // the free nodes
+	Links links;    // free node -> its link in the file
+};
+
 #pragma pack(push, 1)
 
 //#define FIELDOFFSET(type, field) ((size_t)&(((type*)0)->field))
 #define FIELDOFFSET(type, field) (offsetof(type, field))
 
 
+/* An IKey class tells IndexT how to handle its keys:
+     size, compare, copy      - like strlen() + 1, strcmp() and strcpy()
+     common(lhs, rhs)         - # of leading bytes two keys share (whole characters, not the end)
+     prefix(key, skip)        - the key after its first skip bytes as an integer that orders keys
+                                like compare() does, as far as it goes: keys that share their first
+                                skip bytes and have different prefixes compare like the prefixes.
+                                Nodes keep the prefixes of their keys, so most of the comparisons
+                                of a search are of integers in one array.
+     toString, emptyKey, emptyKeySize
+     cFixedSize               - size of every key, or 0 if keys differ in size.  Nodes of fixed
+                                size keys have no keyofs (key i is at key0 + i * the entry size)
+                                and are searched by their prefixes without branches.
+*/
+
 struct IKeyASCIIZ
 // also works to some degree for UTF-8, but the sorting order may be off
 {
+	enum { cFixedSize = 0 };
+
 	static int size(const void* key)
 		{ return (int)strlen((char*)key) + 1; }
 
 	static int compare(const void* lhs, const void* rhs)
 		{ return strcmp((char*)lhs, (char*)rhs); }
 
+	static int common(const void* lhs, const void* rhs)
+	{
+		const byte* l = (const byte*)lhs;
+		const byte* r = (const byte*)rhs;
+		int i = 0;
+		while (l[i] && l[i] == r[i])
+			i++;
+		return i;
+	}
+
+	static uint64 prefix(const void* key, int skip)  // the next 8 bytes, big endian
+	{
+		const byte* k = (const byte*)key + skip;
+		uint64 p = 0;
+		for (int i = 0; i < 8; i++) {
+			p = p << 8 | *k;
+			if (*k) k++;       // zeros after the end
+		}
+		return p;
+	}
+
 	static void copy(void* target, const void* source)
 		{ strcpy((char*)target, (char*)source); }
 
@@ -65,6 +165,8 @@ struct IKeyASCIIZ
 
 struct IKeyUTF16 // Unicode keys
 {
+	enum { cFixedSize = 0 };
+
 	static int size(const void* key)
 	{
 		const wchar_t* eos = (const wchar_t*)key;
@@ -76,10 +178,32 @@ struct IKeyUTF16 // Unicode keys
 	static int compare(const void* lhs, const void* rhs)
 		{ return wcscmp((wchar_t*)lhs, (wchar_t*)rhs); }
 
+	static int common(const void* lhs, const void* rhs)
+	{
+		const wchar_t* l = (const wchar_t*)lhs;
+		const wchar_t* r = (const wchar_t*)rhs;
+		int i = 0;
+		while (l[i] && l[i] == r[i])
+			i++;
+		return i * (int)sizeof(wchar_t);
+	}
+
+	static uint64 prefix(const void* key, int skip)  // the next 64 bits of characters
+	{
+		const wchar_t* k = (const wchar_t*)((const byte*)key + skip);
+		uint64 p = 0;
+		for (int i = 0; i < (int)(8 / sizeof(wchar_t)); i++) {
+			// wchar_t can be signed, so offset the characters to keep their order
+			p = p << (8 * sizeof(wchar_t)) | (uint64)((int64)*k - WCHAR_MIN);
+			if (*k) k++;
+		}
+		return p;
+	}
+
 	static void copy(void* target, const void* source)
 		{ wcscpy((wchar_t*)target, (wchar_t*)source); }
 
-	static const char* toString(const void *key)   { return "Unicode"; }
+	static const char* toString(const void*)       { return "Unicode"; }
 	// Used only for error reporting
 
 	static const void* emptyKey()                  { return L""; }
@@ -87,19 +211,183 @@ struct IKeyUTF16 // Unicode keys
 };
 
 
+template <int N>
+struct IKeyFixed // N byte binary keys (hashes, GUIDs), ordered like memcmp()
+{
+	enum { cFixedSize = N };
+
+	static int size(const void*)
+		{ return N; }
+
+	static int compare(const void* lhs, const void* rhs)
+		{ return memcmp(lhs, rhs, N); }
+
+	static int common(const void* lhs, const void* rhs)
+	{
+		const byte* l = (const byte*)lhs;
+		const byte* r = (const byte*)rhs;
+		int i = 0;
+		while (i < N && l[i] == r[i])
+			i++;
+		return i;
+	}
+
+	static uint64 prefix(const void* key, int skip)  // the next 8 bytes, big endian
+	{
+		const byte* k = (const byte*)key;
+		uint64 p = 0;
+		for (int i = skip; i < skip + 8; i++)
+			p = p << 8 | (i < N ? k[i] : 0);
+		return p;
+	}
+
+	static void copy(void* target, const void* source)
+		{ memcpy(target, source, N); }
+
+	static const char* toString(const void *key)   // in hex
+	{
+		static char s[2 * N + 1];
+		for (int i = 0; i < N; i++)
+			sprintf(s + 2 * i, "%02x", ((const byte*)key)[i]);
+		return s;
+	}
+	// Used only for error reporting
+
+	static const void* emptyKey()                  { static const byte zero[N] = { 0 }; return zero; }
+	static int   emptyKeySize()                    { return N; }
+};
+
+
+template <typename T>
+struct IKeyInt // native integers (int32, uint64, ...), ordered by value
+{
+	enum { cFixedSize = sizeof(T) };
+
+	static T value(const void* key)   // keys are not aligned in a node
+		{ T v; memcpy(&v, key, sizeof(T)); return v; }
+
+	// the value as unsigned, offset so that signed values keep their order
+	static uint64 biased(const void* key)
+		{ return (uint64)value(key) - (uint64)std::numeric_limits<T>::min(); }
+
+	static int size(const void*)
+		{ return sizeof(T); }
+
+	static int compare(const void* lhs, const void* rhs)
+	{
+		T l = value(lhs), r = value(rhs);
+		return l < r ? -1 : l > r;
+	}
+
+	static int common(const void* lhs, const void* rhs)  // of the biased values, big endian
+	{
+		uint64 x = biased(lhs) ^ biased(rhs);
+		int i = 0;
+		while (i < (int)sizeof(T) && !(x >> 8 * (sizeof(T) - 1 - i) & 0xff))
+			i++;
+		return i;
+	}
+
+	static uint64 prefix(const void* key, int skip)
+		{ return skip < (int)sizeof(T) ? biased(key) << 8 * (8 - sizeof(T) + skip) : 0; }
+
+	static void copy(void* target, const void* source)
+		{ memcpy(target, source, sizeof(T)); }
+
+	static const char* toString(const void *key)
+	{
+		static char s[24];
+		if (std::numeric_limits<T>::is_signed)
+			sprintf(s, "%lld", (long long)value(key));
+		else
+			sprintf(s, "%llu", (unsigned long long)value(key));
+		return s;
+	}
+	// Used only for error reporting
+
+	static const void* emptyKey()                  { static const T zero = 0; return &zero; }
+	static int   emptyKeySize()                    { return sizeof(T); }
+};
+
+
+/* Node formats, the last template parameter of IndexT.
+
+   NodePlain stores every key whole.
+
+   NodeFrontCoded stores each key as the length of the prefix it shares with the previous
+   key in the node and the bytes that follow it.  Every nRestart'th key (and the first) is
+   stored whole, and their positions are kept at the end of the node, so an encoded node
+   can be binary searched on its restart keys.  Taking a key out of a node, or splitting
+   it, moves later keys to other restart places and can make the node larger; a node that
+   does not fit then is stored with only its first key whole, which takes no more room
+   than before.  Keys that share long prefixes (file paths)
+   take much less room, so a node holds more of them and the tree is shallower.
+   Nodes are decoded when they are read into the cache and encoded when they are written,
+   so a cached node holds up to 4 times as many key bytes as a node on disk.
+   Index files with front coded nodes have the major version ndxMAJORFrontCoded.
+
+   NodeCounted stores every key whole, and with each son the # of keys in its subtree,
+   so that seek(), rank() and countRange() take one path down the tree instead of a scan.
+   The counts take 4 bytes a key (and the rson's); they are kept in an array of the
+   node in the cache and stored after the rson on disk.  Inserts and removes update
+   them on the path to the leaf, and splits and merges in the nodes they change.
+   Concurrent writes (beginConcurrentWrites()) are not supported with them.
+   Index files with counted nodes have the major version ndxMAJORCounted.
+*/
+struct NodePlain
+{
+	enum { cFrontCoded = 0, cRestart = 0, cCounted = 0 };
+};
+
+template <int nRestart = 16>
+struct NodeFrontCoded
+{
+	enum { cFrontCoded = 1, cRestart = nRestart, cCounted = 0 };
+};
+
+struct NodeCounted
+{
+	enum { cFrontCoded = 0, cRestart = 0, cCounted = 1 };
+};
+
+
 template <class    IKey          = IKeyASCIIZ,
           typename FileSystemT   = FileSystem,
           unsigned int nNodeSize = 4096,
 		  typename ndxFilePosT   = uint32,
-		  typename datFilePosT   = uint32>
+		  typename datFilePosT   = uint32,
+		  class    CachePolicy   = CacheLRU,
+		  class    NodeFormat    = NodePlain>
 struct IndexT
 {
 	typedef IKey         IKeyType;
 	typedef FileSystemT  FileSystemType;
+	typedef CachePolicy  CachePolicyType;
+	typedef NodeFormat   NodeFormatType;
 	typedef ndxFilePosT  ndxFilePosType;
 	typedef datFilePosT  datFilePosType;
 	typedef uint16       nodeLookupType;
 
+	enum {
+		cFrontCoded = NodeFormat::cFrontCoded,
+		cCounted = NodeFormat::cCounted,
+		// bytes of a node in the cache: a decoded front coded node can be larger than on disk
+		nNodeBuf = !cFrontCoded ? nNodeSize :
+		           4 * nNodeSize <= 32768 ? 4 * nNodeSize :
+		           nNodeSize < 32768 ? 32768 : nNodeSize,
+		// fixed size keys in plain nodes: key i is at key0 + i * cStride, there are no keyofs
+		cFixed = IKey::cFixedSize != 0 && !cFrontCoded && !cCounted,
+		cStride = sizeof(ndxFilePosT) + sizeof(datFilePosT) + IKey::cFixedSize,
+		cLookup = (cFixed ? 0 : sizeof(nodeLookupType)) +  // bytes of keyofs per key
+		          (cCounted ? sizeof(uint32) : 0),         //    and of its subtree count
+		// bytes of a node in the cache for the keys, the rson and cLookup per key
+		//    (the rson's subtree count takes the rest)
+		nNodeRoom = nNodeBuf - (cCounted ? sizeof(uint32) : 0),
+		// most keys a node can hold (keys of 1 byte, or of the fixed size)
+		nMaxNodeKeys = (nNodeBuf - sizeof(int32) - sizeof(ndxFilePosT)) /
+		               (sizeof(ndxFilePosT) + sizeof(datFilePosT) + (cFixed ? IKey::cFixedSize : 1) + cLookup) + 1
+	};
+
 protected:
 	struct KeyEntry
 	{
@@ -126,26 +414,163 @@ protected:
 			ndxFilePosT lson;  // left son node offset in index file
 			KeyEntry    key0;  // 1st key
 		};
-		byte moreKeys[nNodeSize              // The rest of the KeyEntry structures
+		byte moreKeys[nNodeBuf               // The rest of the KeyEntry structures
 					  - sizeof(int32)        // count 
 					  - sizeof(KeyEntry)];   // Key0
 		// rson immediately follows the packed keys (could be lson of next added key)
 
-		// only the above data is stored on disk
+		// only the above data is stored on disk (encoded to nNodeSize bytes if front coded)
 
-		nodeLookupType keyofs[1];  // Offset of keys from the beginning of the node
+		nodeLookupType  keyofs0;   // keyofs[0], not stored in the node on disk (always FIELDOFFSET(Node,Key0))
+		nodeLookupType* keyofs;    // Offset of keys from the beginning of the node
 						   // note: this array is accessed with negative indices
 						   // to access the offsets of keys within the node.
 						   // The key data grows upwards while the offsets to the keys grows downwards
-						   // [0] is not stored in the node on disk (always FIELDOFFSET(Node,Key0))
-
-//		byte           filler[sizeof(int)-sizeof(nodeLookupType)];  // align following offset
+						   // Points at keyofs0.  Going through a pointer keeps the optimizer from
+						   // treating the negative indices as out of bounds.
+						   // Not used for fixed size keys (see ofs()).
 
 		ndxFilePosT    offset; // Node offset within the index file
 		bool           dirty;     // true if node has been modified and needs to be written to disk
 
+		Node*          nextSpare; // links unused cache frames
+		int            frame;     // index of this node in IndexT::cache
+		bool           recent;    // one of the last ndxMaxRecent nodes used (see touch())
+
+		uint64*        prefix;      // IKey::prefix() of each key past the prefixSkip bytes all keys share
+		int            prefixSkip;
+		bool           prefixValid; // false if the keys changed since prefix[] was made
+
+		uint32*        sizes;       // counted nodes: # of keys in the subtree of each son,
+		                            //    the lsons of the keys, then rson (0 in a leaf)
+
+		Node() : keyofs(&keyofs0), offset(0), dirty(false), recent(false),
+		         prefix(new uint64[nMaxNodeKeys]), prefixValid(false),
+		         sizes(cCounted ? new uint32[nMaxNodeKeys + 1] : 0)
+		{
+			memset(this, 0, nNodeBuf);  // no stray heap bytes in the unused part of nodes on disk
+			keyofs0 = (nodeLookupType)FIELDOFFSET(Node, key0);
+			clearSizes();
+		}
+
+		~Node() { delete[] prefix; delete[] sizes; }
+
+		/// # of keys in the subtree of the node
+		uint32 total() const
+		{
+			uint32 keys = count;
+			for (int i = 0; cCounted && i <= count; i++)
+				keys += sizes[i];
+			return keys;
+		}
+
+		void clearSizes()
+		{
+			if (cCounted)
+				memset(sizes, 0, (nMaxNodeKeys + 1) * sizeof(uint32));
+		}
+
+		/// Put the subtree counts after rson, to be written with the node
+		void storeSizes()
+			{ memcpy((byte*)this + ofs(count) + sizeof(ndxFilePosT), sizes, (count + 1) * sizeof(uint32)); }
+
+		/// Get the subtree counts of a node that was read
+		void loadSizes()
+			{ memcpy(sizes, (byte*)this + ofs(count) + sizeof(ndxFilePosT), (count + 1) * sizeof(uint32)); }
+
+		/// The keys changed: the node must be written and its prefixes made again
+		void changed()
+		{
+			dirty = true;
+			prefixValid = false;
+		}
+
+		/// Prefix of a key to search for with compare()
+		uint64 searchPrefix(const void* key)
+		{
+			if (!prefixValid)
+				makePrefixes();
+			if (prefixSkip && IKey::common(key, key0.key) < prefixSkip)
+				// the key differs from all of the keys in the node in the bytes they share
+				return IKey::compare(key, key0.key) < 0 ? 0 : ~(uint64)0;
+			return IKey::prefix(key, prefixSkip);
+		}
+
+		/// Fixed size keys: the position of a key in the node and whether it is there.
+		//     Binary searches prefix[] without branches, then compares the keys with
+		//     the same prefix (there are none unless the keys are over 8 bytes).
+		int search(const void* key, bool& found)
+		{
+			if (!prefixValid)
+				makePrefixes();
+			found = false;
+			if (!count)
+				return 0;
+			if (prefixSkip && IKey::common(key, key0.key) < prefixSkip)
+				return IKey::compare(key, key0.key) < 0 ? 0 : count;
+			uint64 kp = IKey::prefix(key, prefixSkip);
+			const uint64* base = prefix;
+			for (int n = count; n > 1; ) {
+				int half = n / 2;
+				base = base[half] < kp ? base + half : base;
+				n -= half;
+			}
+			int i = (int)(base - prefix) + (*base < kp);
+			for (; i < count && prefix[i] == kp; i++) {
+				int cmp = IKey::compare(key, keyI(i)->key);
+				if (cmp <= 0) {
+					found = cmp == 0;
+					break;
+				}
+			}
+			return i;
+		}
+
+		/// Compare a key with the Ith key.  Only equal prefixes need IKey::compare().
+		int compare(const void* key, uint64 keyPrefix, int i)
+		{
+			if (keyPrefix != prefix[i])
+				return keyPrefix < prefix[i] ? -1 : 1;
+			return IKey::compare(key, keyI(i)->key);
+		}
+
+		/// Key i was inserted (count includes it): make room for its prefix in prefix[]
+		void inserted(int i)
+		{
+			dirty = true;
+			if (!prefixValid)
+				return;
+			// the prefixes stay valid if the new key shares the prefixSkip bytes of the others
+			if (prefixSkip && count > 1 && IKey::common(keyI(i)->key, keyI(i ? 0 : 1)->key) < prefixSkip)
+				prefixValid = false;
+			else {
+				memmove(prefix + i + 1, prefix + i, (count - 1 - i) * sizeof(uint64));
+				prefix[i] = IKey::prefix(keyI(i)->key, prefixSkip);
+			}
+		}
+
+		/// Key i was removed, but not yet subtracted from count
+		void removing(int i)
+		{
+			dirty = true;
+			if (prefixValid)   // the keys left share at least the prefixSkip bytes
+				memmove(prefix + i, prefix + i + 1, (count - 1 - i) * sizeof(uint64));
+		}
+
+		void makePrefixes()
+		{
+			prefixSkip = count > 1 ? IKey::common(key0.key, keyI(count - 1)->key) : 0;
+			for (int i = 0; i < count; i++)
+				prefix[i] = IKey::prefix(keyI(i)->key, prefixSkip);
+			prefixValid = true;
+		}
+
+		/// Offset of the Ith key (of rson if i == count) from the beginning of the node
+		nodeLookupType ofs(int i) const
+			{ return cFixed ? (nodeLookupType)(FIELDOFFSET(Node, key0) + i * cStride) : keyofs[-i]; }
+
 		/// get pointer to Ith key
-		KeyEntry* keyI(int i) { return (KeyEntry*)((byte*)this + keyofs[-i]); }
+		KeyEntry* keyI(int i) { return (KeyEntry*)((byte*)this + ofs(i)); }
 
 		/// Get pointer to right son
 		ndxFilePosT* rson() { return &(keyI(count)->lson); }
@@ -153,77 +578,119 @@ protected:
 		/// Split node in two
 		int	split(IndexT* ndx) // throw(...)
 		{
-			// Find entry to be moved up a level
-			nodeLookupType endkeys = keyofs[-count];
-			nodeLookupType m = (endkeys - (nodeLookupType)FIELDOFFSET(Node, key0)) / 2 + 
-				               (nodeLookupType)FIELDOFFSET(Node, key0); // peek into the middle of the keys
-			// (m points somewhere in the middle of the key to use for a pivot)
-			// find 1st key past pivot
-			int i;
-			for (i = 1; i < count; i++)
-				if (keyofs[-i] >= m)
-					break;
-			// i was incremented 1 past pivot key
-			nodeLookupType pivoto = keyofs[1-i];
-			nodeLookupType moveo  = keyofs[-i]; // moveo is offset of keys to move to new node
-			nodeLookupType pivotlen = moveo - pivoto;
+			int i = middle(ndx);
 
 			Node*     parent;
 			KeyEntry* parentk;
 			int       parenti;
-			if (ndx->stacktop) {
+			if (ndx->path.stacktop) {
 			// If parent full, split it, then we will be back
 				parent = ndx->pop(parentk, parenti);
-				if (pivotlen +                               // the pivot to put in parent
-					sizeof(nodeLookupType) +				 // pivot's keyofs for parent
-					parent->keyofs[-parent->count] +         // parent's key data
-					parent->count * sizeof(nodeLookupType) + // & keyofs's
-					sizeof(ndxFilePosT) >                    // rson
-					   nNodeSize)
-				{
+				if (!pivotFits(ndx, parent, parenti, i)) {
 					parent->split(ndx);
 					return -1;
 				}
 			} else {
 			// If it was the root, create a new one
-				parent = ndx->newNode();
-				parentk = &parent->key0;
+				parent = ndx->newNode(offset);
 				parenti = 0;
 				ndx->root = parent->offset;
 			}
 
-			// create a new node and move the keys after the pivot to it
-			Node* added = ndx->newNode();
+			splitInto(parent, parenti, i, ndx->newNode(offset));
+			return 0;
+		}
+
+		/// Where to split the node: the key past the pivot, which moves up a level
+		int middle(IndexT* ndx) // noexcept
+		{
+			nodeLookupType endkeys = ofs(count);
+			nodeLookupType m = (endkeys - (nodeLookupType)FIELDOFFSET(Node, key0)) / 2 + 
+				               (nodeLookupType)FIELDOFFSET(Node, key0); // peek into the middle of the keys
+			// (m points somewhere in the middle of the key to use for a pivot)
+			// find 1st key past pivot
+			int i;
+			if (cFrontCoded)
+				i = ndx->packedMiddle(this);  // split the encoded bytes in half instead
+			else if (cFixed)
+				i = (count + 1) / 2;
+			else
+				for (i = 1; i < count; i++)
+					if (keyofs[-i] >= m)
+						break;
+			// i was incremented 1 past pivot key
+			return i;
+		}
+
+		/// Whether the pivot of a split at i fits into parent before key parenti
+		bool pivotFits(IndexT* ndx, Node* parent, int parenti, int i) // noexcept
+		{
+			nodeLookupType pivoto = ofs(i-1);
+			nodeLookupType pivotlen = ofs(i) - pivoto;
+			return pivotlen +                                // the pivot to put in parent
+			       cLookup +                                 // pivot's keyofs for parent
+			       parent->ofs(parent->count) +              // parent's key data
+			       parent->count * cLookup +                 // & keyofs's
+			       sizeof(ndxFilePosT) <=                    // rson
+			          nNodeRoom &&
+			       (!cFrontCoded ||
+			        ndx->packedSize(parent, parenti, 0, ((KeyEntry*)((byte*)this + pivoto))->key,
+			                        pivotlen - FIELDOFFSET(KeyEntry, key)) <= (int)nNodeSize);
+		}
+
+		/// Split at i: move the keys after the pivot to the empty node added, and the pivot
+		//    into parent before key parenti (whose son this node is)
+		void splitInto(Node* parent, int parenti, int i, Node* added) // noexcept
+		{
+			KeyEntry*      parentk = parent->keyI(parenti);
+			nodeLookupType endkeys = ofs(count);
+			nodeLookupType pivoto = ofs(i-1);
+			nodeLookupType moveo  = ofs(i); // moveo is offset of keys to move to new node
+			nodeLookupType pivotlen = moveo - pivoto;
+
+			// move the keys after the pivot to the added node
 			memcpy(&added->key0, (byte*)this + moveo, endkeys - moveo + sizeof(ndxFilePosT));
 
 			// set the key offsets within the added node
 			moveo -= (nodeLookupType)FIELDOFFSET(Node, key0);
 			int j = i + 1;
-			nodeLookupType* w = added->keyofs - 1;
-			nodeLookupType* w1 = keyofs - j;
-			for (; j <= count; j++)
-				*w-- = *w1-- - moveo;
+			nodeLookupType* w;
+			if (!cFixed) {
+				w = added->keyofs - 1;
+				nodeLookupType* w1 = keyofs - j;
+				for (; j <= count; j++)
+					*w-- = *w1-- - moveo;
+			}
+			if (cCounted)      // the sons after the pivot move with the keys
+				memcpy(added->sizes, sizes + i, (count - i + 1) * sizeof(uint32));
 			added->count = count - i;
 			count -= added->count + 1;
-			dirty = true;
+			changed();
 
 			// make room for the pivot in parent
 			memmove((byte*)parentk + pivotlen, parentk, 
-					parent->keyofs[-parent->count] - ((byte*)parentk - (byte*)parent) + sizeof(ndxFilePosT));
+					parent->ofs(parent->count) - ((byte*)parentk - (byte*)parent) + sizeof(ndxFilePosT));
 			j = ++parent->count;
-			w = parent->keyofs - j;
-			while (j > parenti) {
-				*w = w[1] + pivotlen;
-				w++;
-				j--;
+			if (!cFixed) {
+				w = parent->keyofs - j;
+				while (j > parenti) {
+					*w = w[1] + pivotlen;
+					w++;
+					j--;
+				}
 			}
 			// put the pivot in the parent
 			memcpy(parentk, (byte*)this + pivoto, pivotlen);
 			parentk->lson = offset;  // point the pivot's lson to this node
 			// point the lson of key after pivot to added node
 			((KeyEntry*)((byte*)parentk + pivotlen))->lson = added->offset;
-			parent->dirty = true;
-			return 0;
+			if (cCounted) {    // this node's subtree is now two
+				memmove(parent->sizes + parenti + 2, parent->sizes + parenti + 1,
+				        (parent->count - parenti - 1) * sizeof(uint32));
+				parent->sizes[parenti] = total();
+				parent->sizes[parenti + 1] = added->total();
+			}
+			parent->changed();
 		}
 	};
 
@@ -233,10 +700,97 @@ protected:
 		int i;               // # of key in the node
 	};
 
+	struct Path // a current key: the nodes and keys from the root down to it
+	{
+		int         stacktop;            // Current stack top index
+		StackFrame  stack[ndxMaxStack];
+		ndxFilePosT curNode;             // the current key's node
+		int         curI;                // the current key's # with node
+		Node*       pinned[2];           // the last nodes got, held in the cache in concurrent read mode
+		int64       hits;                // cache hits not yet added to the index's stats
+
+		Path() : stacktop(0), curNode(0), hits(0) { pinned[0] = pinned[1] = 0; }
+	};
+
+	struct CacheBucket // Node cache hash table entry (changed under cacheLock, read without it by findPinned())
+	{
+		std::atomic<ndxFilePosT> offset;  // offset of the cached node (0 if the bucket is empty)
+		std::atomic<int>         frame;   // index of the node in cache
+	};
+
+	struct FrameBusy // tells the cache policy which frames it may not evict
+	{
+		Node**                  cache;
+		const std::atomic<int>* pins;      // in concurrent read mode, pinned frames are busy,
+		int                     reserved;  //    except one the evicting reader has claimed
+		bool operator()(int frame) const
+		{
+			return cache[frame]->recent ||
+			       (pins && frame != reserved && pins[frame].load(std::memory_order_relaxed) != 0);
+		}
+	};
+
+	struct Packer // Adds up the size of a front coded node on disk as its keys are added in order
+	{
+		int         size;      // bytes so far
+		int         count;     // keys so far
+		const byte* prev;      // the previous key
+		int         prevSize;
+
+		Packer() : size(sizeof(int32) + sizeof(ndxFilePosT)), count(0) {}  // count and rson
+
+		/// Bytes that adding a key would take
+		int cost(const byte* key, int keySize) const
+		{
+			if (isRestart(count))
+				return FIELDOFFSET(KeyEntry, key) + 1 + lengthSize(keySize) + keySize +
+				       sizeof(nodeLookupType);   // restart position
+			int shared = sharedPrefix(prev, prevSize, key, keySize);
+			return FIELDOFFSET(KeyEntry, key) + lengthSize(shared) + lengthSize(keySize - shared) +
+			       keySize - shared;
+		}
+
+		/// Add a key.  It must stay in place until the next one is added.
+		void add(const byte* key, int keySize)
+		{
+			size += cost(key, keySize);
+			prev = key;
+			prevSize = keySize;
+			count++;
+		}
+
+		/// Add keys from .. to-1 of a node
+		void add(Node* node, int from, int to)
+		{
+			for (int i = from; i < to; i++)
+				add(node->keyI(i)->key, keySize(node, i));
+		}
+	};
+
+	struct BulkLoad // State of a bulk load, see beginLoad()
+	{
+		Node*       node[ndxMaxStack]; // node being filled on each level (the leaves are level 0)
+		ndxFilePosT son[ndxMaxStack];  // written node that becomes the lson of the next key on a level
+		uint32      sonKeys[ndxMaxStack]; // # of keys in its subtree, for counted nodes
+		int         levels;            // # of levels started
+		int         limit;             // fill nodes up to this many bytes
+		byte*       lastKey;           // the previous key, to check the order
+		datFilePosT lastOfs;
+		Packer      packed[ndxMaxStack]; // encoded size of the node on each level, if front coded
+	};
+
+	typedef CopyOnWriteState<ndxFilePosT> CopyOnWrite;
+	typedef typename CopyOnWrite::Moved   Moved;
+	typedef FreeNodes<ndxFilePosT>        Free;
+
 public:
-    /// Constructor.
+    /// Constructor.  The cache holds maxCache nodes, at least ndxMinCache.
 	IndexT(int maxCache=10) : // throw(...) :   // can throw bad_alloc
-		f(0), cacheUsed(0), stacktop(0), n(0), nMaxCache(maxCache)
+		n(0), changes(0), f(0), writeBackMax(1), cacheUsed(0),
+		nMaxCache(maxCache < ndxMinCache ? ndxMinCache : maxCache),
+		concurrent(false), writers(false), levels(0), loading(0), wal(0), cow(0), snapshotOf(0),
+		flusher(0), cleanHand(0), freeLoaded(false), freeChanged(false), filter(0),
+		filterStale(false), filterDirty(false)
 	{
 		const int cNodeExtra  = sizeof(int32)           // Overhead per node: count &
 							  + sizeof(ndxFilePosT);    // rson
@@ -244,18 +798,37 @@ public:
 							  - cNodeExtra; 
 		const int cKeyExtra   = sizeof(ndxFilePosT)     // lson
 							  + sizeof(datFilePosT)     // offset
-							  + sizeof(nodeLookupType); // keyofs
+							  + cLookup                 // keyofs
+							  + (cFrontCoded ? 4 : 0);  // lengths of the shared prefix and the rest
 		// need room for at least 3 keys in a node so split() will work
 		nMaxKeySize = cMaxKeyData/3 - cKeyExtra;
 		clearCurKey();
-		cache = new Node*[maxCache];
-		Node** c = cache;
-		Node* node;
+		cache = new Node*[nMaxCache];
 		for (int i = 0; i < nMaxCache; i++) {
-			node = new Node;
-			*c++ = node;
-			node->keyofs[0] = (nodeLookupType)FIELDOFFSET(Node, key0);
+			cache[i] = new Node;
+			cache[i]->frame = i;
 		}
+		pins = new std::atomic<int>[nMaxCache];
+		frameOffset = new std::atomic<ndxFilePosT>[nMaxCache];
+		used = new std::atomic<bool>[nMaxCache];
+		for (int i = 0; i < nMaxCache; i++) {
+			pins[i].store(0);
+			frameOffset[i].store(0);
+			used[i].store(false);
+		}
+		cacheLock = new std::mutex;
+		gate = new WriteGate;
+		freeNodes = new Free;
+		latches = new std::mutex[nMaxCache];
+		// size the hash table to at least twice the cache to keep the probe chains short
+		for (cacheMask = 15; cacheMask < 2 * nMaxCache - 1; cacheMask = cacheMask * 2 + 1)
+			;
+		cacheHash = new CacheBucket[cacheMask + 1];
+		packBuf = cFrontCoded ? new byte[nNodeSize] : 0;
+		// a policy must always have a node it may evict
+		maxRecent = nMaxCache <= ndxMaxRecent ? nMaxCache - 1 : ndxMaxRecent;
+		policy.init(nMaxCache);
+		resetCache();
 	}
 
     /// Destructor, closes index
@@ -266,17 +839,29 @@ public:
 		for (int i = 0; i < nMaxCache; i++)
 			delete *c++;
 		delete[] cache;
+		delete[] cacheHash;
+		delete[] packBuf;
+		delete[] pins;
+		delete[] frameOffset;
+		delete[] used;
+		delete cacheLock;
+		delete gate;
+		delete freeNodes;
+		delete[] latches;
 	}
 
-    /// Create new index
+    /// Create new index (and remove a filter file of its name, see attachFilter())
 	void create(const char* name, bool _dups=false) // throw(...)  // can throw bad_alloc or io_error
 	{
+		detachLog();
+		if (cow || snapshotOf || flusher) close();
 		if (f) FileSystemT::close(f);
+		dropFilter();
 		resetCache();
 		f = FileSystemT::create(name);
 
-		stacktop = 0;
-		major = ndxMAJOR;
+		path.stacktop = 0;
+		major = majorVersion();
 		minor = ndxMINOR;
 		hNdxPosSize = sizeof(ndxFilePosT);
 		hDatPosSize = sizeof(datFilePosT);
@@ -284,12 +869,19 @@ public:
 		hNodeSize = nNodeSize;
 		root = eof = nNodeSize;
 		freelist = 0;
+		dropFree();
 		n = 0;
 		dups = _dups;
+		memset(keysVersion, 0, sizeof(keysVersion));
+		versionChanges = changes;
+		std::vector<char> fname;                 // of a file of this name before
+		defaultFilterName(name, fname);
+		::remove(&fname[0]);
 		clearCurKey();
-		const int cHeaderSize = FIELDOFFSET(IndexT, stacktop) - FIELDOFFSET(IndexT, major);
+		const int cHeaderSize = FIELDOFFSET(IndexT, path) - FIELDOFFSET(IndexT, major);
 		Node* temp = cache[0];
-		memcpy(temp, &major, cHeaderSize);  // Write virgin file header
+		memset((void*)temp, 0, nNodeSize);        // the raw node bytes only, before keyofs0
+		memcpy((void*)temp, &major, cHeaderSize); // Write virgin file header
 		write(0, temp, nNodeSize);
 		newNode();
 	}
@@ -297,18 +889,22 @@ public:
     /// Open existing index.  Returns false if file does not exist
 	bool open(const char* name) // throw(...)  // can throw bad_alloc or io_error
 	{
+		detachLog();
+		if (cow || snapshotOf || flusher) close();
 		if (f) FileSystemT::close(f);
+		dropFilter();
 		resetCache();
-		stacktop = 0;
+		path.stacktop = 0;
 
 		f = FileSystemT::open(name);
 		if (!f) return false;
-		const int cHeaderSize = FIELDOFFSET(IndexT, stacktop) - FIELDOFFSET(IndexT, major);
+		const int cHeaderSize = FIELDOFFSET(IndexT, path) - FIELDOFFSET(IndexT, major);
 		clearCurKey();
 		read(0, &major, cHeaderSize);     // Read the index file header
 		char message[1024] = "";
-		if (major != ndxMAJOR)
-			sprintf(message, "Index file major version number is not the expected %d, but %d. %s", ndxMAJOR, major, name);
+		const byte cMajor = majorVersion();
+		if (major != cMajor)
+			sprintf(message, "Index file major version number is not the expected %d, but %d. %s", cMajor, major, name);
 		else if (hNodeSize != nNodeSize)
 			sprintf(message, "Index file NodeSize (%x) in %s does not match compiled code (%x)", hNodeSize, name, nNodeSize);
 		else if (hNdxPosSize != sizeof(ndxFilePosT))
@@ -322,26 +918,64 @@ public:
 			f = 0;
 			throw io_error(message);
 		}
+		dropFree();
+		versionChanges = changes;
 		return true;
 	}
 
+	/// Write the changed nodes in the cache and the header, so that the file holds the index
+	//     as it is, without closing it.  The nodes are written in file order, and each run of
+	//     adjacent ones with one write.  In copy-on-write mode the nodes go to their new
+	//     places and the header is left alone (see publish()).  With a log, see commit().
+	//     The free nodes and the filter are written too (see countFree(), attachFilter()).
+	//     With a flusher, waits until it has written them.
+	void flush() // throw(...) // can throw io_error or logic_error
+	{
+		if (!f || loading || wal) {
+			char message[1024];
+			sprintf(message, "flush() needs an open index, not a bulk load or a log: %s", f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
+		}
+		exclusive();
+		writeDirty();
+		if (!cow) {
+			saveFree();
+			stampKeys();
+			const int cHeaderSize = FIELDOFFSET(IndexT, path) - FIELDOFFSET(IndexT, major);
+			write(0, &major, cHeaderSize);
+		}
+		if (flusher)
+			flusher->drain();
+		if (!cow)
+			saveFilter();
+	}
+
     /// Close the index in order to open another
 	void close() // throw(...) // can throw io_error
 	{
 		if (f) {
-			Node** c = cache;
-			Node*  node;
-			int i;
-			for (i = 0; i < cacheUsed; i++) {
-				node = *c++;
-				if (node->dirty)
-					write(node->offset, node, nNodeSize);
+			if (snapshotOf) {
+				closeSnapshot();
+				return;
 			}
-			const int cHeaderSize = FIELDOFFSET(IndexT, stacktop) - FIELDOFFSET(IndexT, major);
+			if (cow)
+				stopCopyOnWrite();
+			detachLog();
+			if (loading)
+				endLoad();
+			writeDirty();
+			saveFree();
+			stampKeys();
+			const int cHeaderSize = FIELDOFFSET(IndexT, path) - FIELDOFFSET(IndexT, major);
 			write(0, &major, cHeaderSize);
+			stopFlusher();
+			saveFilter();
+			dropFilter();
 			FileSystemT::close(f);
 			f = 0;
+			dropFree();
 			n = 0;
+			changes++;
 			clearCurKey();
 		}
 	}
@@ -352,17 +986,119 @@ public:
 	const int maxKeySize() const // noexcept // throw ()
 		{ return nMaxKeySize; }
 
-	/// Retrieve parameters of the current key and data offset
-	bool getCurKey(void* &key, datFilePosT& offset)
+	/// Node cache hits, misses and evictions since the index was opened or created
+	const CacheStats& cacheStats() const // noexcept // throw()
+		{ return stats; }
+	void resetCacheStats() // noexcept // throw()
+		{ stats.clear(); }
+
+	/// # of free nodes, the ones removes left that inserts reuse.  They are kept in memory,
+	//     and written to the file's free list by flush(), close(), commit() and the others
+	//     that write the header, each link only if it changed.  A new node is the free one
+	//     nearest the node split for it, so related nodes stay close in the file.
+	int countFree() // throw(...) // can throw io_error
 	{
-		if (f == 0 || curNode == 0) return false;
-		Node* node = getNode(curNode);
-		KeyEntry* ke = node->keyI(curI);
-		key = (void*)&ke->key;
-		offset = ke->offset;
-		return true;
+		loadFree();
+		return cow ? (int)cow->reusable.size() : (int)freeNodes->nodes.size();
+	}
+
+	/// Keep a Bloom filter of the keys (see <nub/BloomFilter.h>) in a file beside the index
+	//     (name, or the index's name and ".filter"), so that mayContain() turns away most
+	//     keys that are not there without reading a node.  Inserts, removes and bulk loads
+	//     keep it up to date, and flush() and close() write it; close() detaches it.  It is
+	//     built again from the keys, with a scan at the next mayContain(), when the file is
+	//     missing or was written for other keys (a version in the header changes with them),
+	//     when the keys added pass its capacity (twice the keys it was built for), and when
+	//     the keys removed pass a quarter of it (removed keys still answer true).
+	void attachFilter(const char* name = 0, double falsePositiveRate = 0.01) // throw(...) // can throw io_error or logic_error
+	{
+		if (!f || loading || snapshotOf) {
+			char message[1024];
+			sprintf(message, "attachFilter() needs an open index, not a bulk load or a snapshot: %s", f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
+		}
+		dropFilter();
+		if (name)
+			filterName.assign(name, name + strlen(name) + 1);
+		else
+			defaultFilterName(FileSystemT::getName(f), filterName);
+		filter = new BloomFilter;
+		filterRate = falsePositiveRate;
+		filterStale = changes != versionChanges ||   // keys not in the file's header yet
+		              !filter->load<FileSystemT>(&filterName[0], filterStamp());
+		filterDirty = false;
+		if (!filterStale)
+			checkFilter();
+	}
+
+	/// Write the filter, and stop keeping it
+	void detachFilter() // throw(...) // can throw io_error
+	{
+		saveFilter();
+		dropFilter();
+	}
+
+	bool filtering() const // noexcept
+		{ return filter != 0; }
+
+	/// false if the key is surely not in the index; true if it may be, or there is no filter.
+	//     Builds the filter if it is out of date (not in concurrent modes: true then).
+	bool mayContain(const void* key) // throw(...)
+	{
+		if (!filter || (filterStale && concurrent))
+			return true;
+		if (filterStale)
+			buildFilter();
+		return filter->mayContain(key, IKey::size(key));
+	}
+
+	/// # of changed nodes written at once when one has to be evicted: it and the changed nodes
+	//     next to it in the file, which stay cached but clean.  1 (the default) writes just the
+	//     one; 16 or so pays where a seek costs more than writing a few more nodes, as on disks.
+	void setWriteBack(int nodes) // noexcept
+		{ writeBackMax = nodes < 1 ? 1 : nodes; }
+
+	/// Write the index from a thread of its own (see <nub/WriteBehind.h>) until stopFlusher()
+	//     or close(): a changed node that is evicted is copied to the flusher's queue instead
+	//     of written, and a hand going around the cache hands changed nodes over ahead of
+	//     their eviction, so that inserts and removes mostly find clean frames.  They wait
+	//     for the disk only while more than dirtyRatio of the cache's size is queued.  Not
+	//     with a log or copy-on-write, which order their writes themselves.
+	void startFlusher(double dirtyRatio = 0.25) // throw(...) // can throw logic_error
+	{
+		if (!f || loading || wal || cow || snapshotOf || flusher) {
+			char message[1024];
+			sprintf(message, "startFlusher() needs an open index, not a bulk load, a log, copy-on-write, a snapshot or a flusher: %s", f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
+		}
+		int nodes = (int)(nMaxCache * dirtyRatio);
+		flusher = new WriteBehindT<FileSystemT>;
+		flusher->start(f, (size_t)(nodes < 1 ? 1 : nodes) * nNodeSize);
+		cleanHand = 0;
 	}
 
+	/// Wait until the flusher has written everything handed to it, and stop it
+	void stopFlusher() // throw(...) // can throw io_error
+	{
+		if (!flusher) return;
+		WriteBehindT<FileSystemT>* stopping = flusher;
+		flusher = 0;
+		try {
+			stopping->stop();
+		} catch (...) {
+			delete stopping;
+			throw;
+		}
+		delete stopping;
+	}
+
+	bool flushing() const // noexcept
+		{ return flusher != 0; }
+
+	/// Retrieve parameters of the current key and data offset
+	bool getCurKey(void* &key, datFilePosT& offset)
+		{ return getCurKey(path, key, offset); }
+
 	/// Test index validity (true if valid)
 	bool valid() // throw(...)
 	{
@@ -392,81 +1128,170 @@ public:
 	{
 		if (!f) return false;
 
-		paramSize = IKey::size(key);
-		if (paramSize > nMaxKeySize) {
+		int size = IKey::size(key);
+		if (size > nMaxKeySize) {
 			char message[4096];
 			sprintf(message, "Key (%s) too long (must be <= %d bytes)", IKey::toString(key), nMaxKeySize);
 			throw invalid_argument(message);
 		}
-		paramSize += (uint16)(FIELDOFFSET(KeyEntry, key));
-		paramOfs = offset;
-		paramKey = (void*)key;
-
-		int result;
-		do {
-			stacktop = 0;
-			result = _insert(root);
-		} while (result < 0);
+		size += (uint16)(FIELDOFFSET(KeyEntry, key));
+		if (writers)
+			return insertShared(key, size, offset);
+		exclusive();
+		LoggedWrite op(this);
+		bool result = insertKey(key, size, offset);
+		op.done();
+		return result;
+	}
 
-		if (result) n++;
-		return result != 0;
+	/// Insert many keys at once: keys[i] with data offset offsets[i].  The keys are sorted and
+	//     the ones that go into the same leaf are put in together: the next key is looked for
+	//     from the lowest node on the path whose subtree holds it, not from the root, and a
+	//     leaf that fills up is split once and the keys go on into the halves.  With replace
+	//     (an upsert), keys that are already there get offsets[i] as their data offset (if
+	//     duplicates are not allowed), the last one if a key is given twice.  Returns the #
+	//     of keys added.  There is no current key afterwards.
+	int insertMany(const void* const* keys, const datFilePosT* offsets, int count, bool replace = false) // throw(...)
+	{                                                  // can throw io_error, runtime_error or invalid_argument (key too long)
+		if (!f) return 0;
+		for (int i = 0; i < count; i++)
+			if (IKey::size(keys[i]) > nMaxKeySize) {
+				char message[4096];
+				sprintf(message, "Key (%s) too long (must be <= %d bytes)", IKey::toString(keys[i]), nMaxKeySize);
+				throw invalid_argument(message);
+			}
+		// sort by the integer prefixes of the keys, then the keys, the data offsets and the order given
+		std::vector<std::pair<uint64, int> > sorted(count);
+		for (int i = 0; i < count; i++)
+			sorted[i] = std::make_pair(IKey::prefix(keys[i], 0), i);
+		std::sort(sorted.begin(), sorted.end(), KeyOrder(keys, dups ? offsets : 0));
+		std::vector<int> order(count + 1);
+		for (int i = 0; i < count; i++)
+			order[i] = sorted[i].second;
+		if (writers) {
+			TreeWrite op(this);
+			int added = _insertMany(keys, offsets, &order[0], count, replace);
+			op.done();
+			return added;
+		}
+		exclusive();
+		LoggedWrite op(this);
+		int added = _insertMany(keys, offsets, &order[0], count, replace);
+		op.done();
+		return added;
 	}
 
 	/// Find a key.  If duplicates are allowed, finds the first instance of a key (lowest data offset).
     //   Note that duplicates are in sorted order by data offset
 	bool find(const void* key) // throw(...)
+		{ return find(path, key); }
+
+    /// Find key, specific record
+	bool find(const void* key, const datFilePosT& offset) // throw(...)
+		{ return find(path, key, offset); }
+
+	/// Find many keys at once: offsets[i] and found[i] for keys[i] (the first instance, if
+	//     duplicates are allowed).  The keys are sorted and the tree is walked once: the keys
+	//     that fall into the same subtree go down into it together, and each node is searched
+	//     from where the last key was found.  Returns the # of keys found; the current key
+	//     is left alone.
+	int findMany(const void* const* keys, int count, datFilePosT* offsets, bool* found) // throw(...)
 	{
-		if (!f) return false;
-		stacktop = 0;
-		if (!dups) {
-			bool ret = _find(key, root);    // Inner routine
-			if (!ret) _findNext();
-			return ret;
-		} else {
-			_find(key, ((datFilePosT)-1 >> 1) + 1, root);  // should be 0x80000000 for int32 (most negative number)
-			_findNext();
-			void* k = NULL;
-			datFilePosT ofs;
-			getCurKey(k, ofs);
-			return IKey::compare(key, k) == 0;
+		if (!f) return 0;
+		reading();
+		// sort by the integer prefixes of the keys, comparing keys only when those tie, and
+		//    leave out the ones the filter turns away
+		std::vector<std::pair<uint64, int> > sorted;
+		sorted.reserve(count);
+		for (int i = 0; i < count; i++) {
+			if (mayContain(keys[i]))
+				sorted.push_back(std::make_pair(IKey::prefix(keys[i], 0), i));
+			found[i] = false;
+		}
+		count = (int)sorted.size();
+		std::sort(sorted.begin(), sorted.end(), KeyOrder(keys));
+		std::vector<int> order(count);
+		for (int i = 0; i < count; i++)
+			order[i] = sorted[i].second;
+		Path p;
+		int nFound = 0;
+		try {
+			if (count)
+				nFound = _findMany(p, root, keys, &order[0], 0, count, offsets, found);
+		} catch (...) {
+			release(p);
+			throw;
 		}
+		release(p);
+		return nFound;
 	}
 
-    /// Find key, specific record
-	bool find(const void* key, const datFilePosT& offset) // throw(...)
+	/// Find many keys at once, like findMany(), as lookups that each go down the tree on
+	//     their own and wait when they miss the cache: the nodes all the waiting lookups
+	//     need are then read together with FileSystemT::readMany() (UringFileSystem keeps
+	//     them in flight at once), and the lookups go on.  For keys spread over an index
+	//     much larger than the cache, where findMany() waits for one read at a time.  In
+	//     concurrent read mode it is findMany().  The keys the filter turns away are not
+	//     looked up.  The current key is left alone.
+	int findAsync(const void* const* keys, int count, datFilePosT* offsets, bool* found) // throw(...)
 	{
-		if (!f) return false;
-		stacktop = 0;
-		bool ret;
-		if (dups)
-			ret = _find(key, offset, root);    // Inner routine
-		else {
-			ret = _find(key, root);
-			void* k = NULL;
-			datFilePosT ofs;
-			getCurKey(k, ofs);
-			if (ret && offset != ofs)
-				ret = false; 
+		if (!f) return 0;
+		reading();
+		if (concurrent)
+			return findMany(keys, count, offsets, found);
+		std::vector<ndxFilePosT> at(count, root);   // the node each lookup waits for, 0 when done
+		std::vector<ndxFilePosT> wanted;
+		int batch = (nMaxCache - maxRecent) / 2;     // frames to read into at once
+		if (batch < 1)
+			batch = 1;
+		for (int i = 0; i < count; i++) {
+			found[i] = false;
+			if (!mayContain(keys[i]))
+				at[i] = 0;
 		}
-		if (!ret) _findNext();
-		return ret;
+		while (1) {
+			wanted.clear();
+			for (int i = 0; i < count; i++)
+				while (at[i]) {
+					Node* node = cacheFind(at[i]);
+					if (!node) {
+						wanted.push_back(at[i]);
+						break;
+					}
+					stats.hits++;
+					policy.hit(node->frame);
+					at[i] = lookupStep(node, keys[i], offsets[i], found[i]);
+				}
+			if (wanted.empty())
+				break;
+			std::sort(wanted.begin(), wanted.end());
+			wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+			fetch(&wanted[0], (int)wanted.size() < batch ? (int)wanted.size() : batch);
+		}
+		int nFound = 0;
+		for (int i = 0; i < count; i++)
+			nFound += found[i];
+		return nFound;
 	}
 
     /// Change the data offset of the current key
 	bool change(const datFilePosT& offset) // throw(...) // can throw io_error or logic_error (no current key)
 	{
 		if (!f) return false;
-		if (!stacktop) {
+		exclusive();
+		if (!path.stacktop) {
 			char message[1024];
 			sprintf(message, "Stack underflow: no current key. File: %s", FileSystemT::getName(f));
 			throw logic_error(message);
 		}
+		LoggedWrite op(this);
 		KeyEntry* k;
 		int i;
 		Node* node = top(k, i);
 		k->offset = offset;
 		setCurKey(node, i);
-		node->dirty = true;
+		node->changed();
+		op.done();
 		return true;
 	}
 
@@ -474,6 +1299,8 @@ public:
     //      current key is set to the key following the removed key
 	bool remove(const void* key) // throw(...)
 	{
+		if (writers)
+			return removeShared(key, 0, false);
 		if (!find(key)) return false;
 		return remove_current();
 	}
@@ -482,7 +1309,10 @@ public:
     //      current key is set to the key following the removed key
 	bool remove(const void* key, const datFilePosT& offset) // throw(...)
 	{
+		if (writers)
+			return removeShared(key, offset, true);
 		if (!find(key, offset)) return false;
+
 		return remove_current();
 	}
 
@@ -491,152 +1321,95 @@ public:
 	bool remove_current() // throw(...)
 	{
 		if (!f) return false;
-		if (!stacktop) return false;
+		if (!path.stacktop) return false;
+		exclusive();
 
 		KeyEntry*      k;
-		int            ttop = stacktop;
+
+		int            ttop = path.stacktop;
 		int            i, j;
 		nodeLookupType moveo;
 
 		Node* node = pop(k, i);
 		if (i == node->count) return false;
-		nodeLookupType klen = (moveo = node->keyofs[-i-1]) - node->keyofs[-i];
+		changes++;
+		filterRemove();
+		LoggedWrite op(this);
+		nodeLookupType klen = (moveo = node->ofs(i+1)) - node->ofs(i);
 		if (!k->lson) {              // Key is simply deleted
-			memmove(k, (byte*)k + klen,
-					node->keyofs[-node->count] - moveo + sizeof(ndxFilePosT));
-			nodeLookupType* w = node->keyofs - i - 1;
-			for (j = i + 1; j < node->count; j++, w--)
-				*w = w[-1] - klen;
-			node->dirty = true;
-			if (!--node->count && stacktop) {
+			dropKey(node, i);
+			node = countKey(node, -1);
+			k = node->keyI(i);
+			bool freed = false;
+			if (!node->count && path.stacktop) {
 				ndxFilePosT son = k->lson;
 				freeNode(node);
 				KeyEntry* pk;
 				Node* parent = top(pk, j);
 				pk->lson = son;
-				parent->dirty = true;
+				parent->changed();
 				if (son) {
 					node = getNode(son);
 					k = &node->key0; // i must be 0
-				}
+				} else
+					freed = true;    // nothing left to combine
+			} else if (!node->count && k->lson) {
+				// emptied the root, its only son becomes the new root
+				root = k->lson;
+				freeNode(node);
+				node = getNode(root);
+				k = &node->key0;
 			}
 			// just deleted a key -- see if we can combine sibling nodes
-			if (stacktop) {
-				moveo = node->keyofs[-node->count];
+			if (path.stacktop && !freed) {
+				moveo = node->ofs(node->count);
 				nodeLookupType nodeSize = moveo +                       // node key data
 						                  sizeof(ndxFilePosT) +         // rson
-				                          node->count * sizeof(uint16); // keyofs's
-				if (nodeSize <= nNodeSize/2) {
+				                          node->count * cLookup;        // keyofs's
+				if ((cFrontCoded ? packedSize(node) : nodeSize) <= (int)nNodeSize/2) {
 					KeyEntry* pk;
 					Node* parent = top(pk, j);
 					if (j < parent->count) {
-					    nodeLookupType pkSize = parent->keyofs[-j-1] - parent->keyofs[-j];
+					    nodeLookupType pkSize = parent->ofs(j+1) - parent->ofs(j);
 						KeyEntry* q = (KeyEntry*)((byte*)pk + pkSize);
 						if (q->lson) { // if parent key has a right child
 							Node* rsib = getNode(q->lson);
-							nodeLookupType rsibSize = rsib->keyofs[-rsib->count];
-							if (nodeSize + pkSize + sizeof(uint16) +
-								rsibSize - FIELDOFFSET(Node, key0) +
-								rsib->count * sizeof(uint16)
-								<= nNodeSize)
-							{	// move parent key to end of this node
-								// leave rson of node alone (will be lson of new parent key)
-								memcpy((byte*)node + moveo + sizeof(ndxFilePosT),
-									   &pk->offset, pkSize - sizeof(ndxFilePosT));
-								nodeLookupType* w = &node->keyofs[-(node->count+1)];
-								nodeLookupType  y;
-								*w-- = y = moveo + pkSize;
-
-								// put rsib keys after parent key
-								memcpy((byte*)node + moveo + pkSize,
-									   &rsib->key0,
-									   rsibSize - FIELDOFFSET(Node, key0) + sizeof(ndxFilePosT));
-								nodeLookupType* x = &rsib->keyofs[-1];
-								y -= FIELDOFFSET(Node, key0);
-								for (int r = 0; r < rsib->count; r++)
-									*w-- = *x-- + y;
-								node->count += 1 + rsib->count;
+							if (sonsFit(node, pk, pkSize, rsib)) {
+								mergeSons(parent, j, node, rsib);
 								freeNode(rsib);
-
-								// remove parent key from parent
-								memmove(&pk->offset, // leave ptr to node
-										(byte*)&pk->offset + pkSize,
-										parent->keyofs[-parent->count] - parent->keyofs[-(j+1)]);
-								int jj = j+1;
-								for (w = &parent->keyofs[-jj]; jj < parent->count; jj++, w--)
-									*w = w[-1] - pkSize;
-								parent->dirty = true;
-
-								if (!--parent->count) {
+								if (!parent->count) {
 									freeNode(parent);
-									if (--stacktop) {
+									if (--path.stacktop) {
 										// grandparent is now parent
 										parent = top(pk, j);
-										parent->lson = node->offset;
-										parent->dirty = true;
+										pk->lson = node->offset;
+										parent->changed();
 									} else
 										root = node->offset;
 								}
-								// recalculate for possible merge left
-								moveo = node->keyofs[-node->count];
-								nodeSize = moveo + // node key data
-										   sizeof(ndxFilePosT) +        // rson
-										   node->count * sizeof(uint16);// keyofs's
 							}
 						}
 					}
-					if (stacktop && j > 0) {
+					if (path.stacktop && j > 0) {
 						pk = parent->keyI(--j);
 						if (pk->lson) {
-							nodeLookupType pkSize = parent->keyofs[-j-1] - parent->keyofs[-j];
+							nodeLookupType pkSize = parent->ofs(j+1) - parent->ofs(j);
 							Node* lsib = getNode(pk->lson);
-							nodeLookupType lsibSize = lsib->keyofs[-lsib->count];
-							if (lsibSize + lsib->count * sizeof(nodeLookupType) +
-								pkSize + sizeof(nodeLookupType) +
-								nodeSize - FIELDOFFSET(Node, key0) 
-								<= nNodeSize)
-							{	// move parent key to end of lsib
-								// leave rson of lsib alone (will be lson of new parent key)
-								memcpy((byte*)lsib + lsibSize + sizeof(ndxFilePosT),
-									   &pk->offset, pkSize - sizeof(ndxFilePosT));
-								nodeLookupType* w = &lsib->keyofs[-(lsib->count+1)];
-								nodeLookupType  y;
-								*w-- = y = lsibSize + pkSize;
-
-								// put rsib keys in lsib after parent key
-								memcpy((byte*)lsib + lsibSize + pkSize,
-									   &node->key0,
-									   moveo - FIELDOFFSET(Node, key0) + sizeof(ndxFilePosT));
-								nodeLookupType* x = &node->keyofs[-1];
-								y -= FIELDOFFSET(Node, key0);
-								for (int r = 0; r < node->count; r++)
-									*w-- = *x-- + y;
-
-								// remove parent key from parent
-								memmove(&pk->offset, // leave ptr to node
-										(byte*)&pk->offset + pkSize,
-										parent->keyofs[-parent->count] - parent->keyofs[-(j+1)]);
-								int jj = j+1;
-								for (w = &parent->keyofs[-jj]; jj < parent->count; jj++, w--)
-									*w = w[-1] - pkSize;
-
+							if (sonsFit(lsib, pk, pkSize, node)) {
 								i += 1 + lsib->count;
-								lsib->count += 1 + node->count;
-								lsib->dirty = true;
+								mergeSons(parent, j, lsib, node);
 								freeNode(node);
 
-								stack[stacktop-1].i = j;
+								path.stack[path.stacktop-1].i = j;
 
 								node = lsib;
 								k = node->keyI(i);
-
-								parent->dirty = true;
-								if (!--parent->count) {
+								if (!parent->count) {
 									freeNode(parent);
-									if (--stacktop) {
+									if (--path.stacktop) {
 										parent = top(pk, j);
-										parent->lson = node->offset;
-										parent->dirty = true;
+										pk->lson = node->offset;
+										parent->changed();
 									} else
 										root = node->offset;
 								}
@@ -649,9 +1422,10 @@ public:
 			// If at end of node, up to next key
 			if (i == node->count && !k->lson) {
 				do {
-					if (!stacktop) {
+					if (!path.stacktop) {
 						n--;
 						clearCurKey();
+						op.done();
 						return true;
 					}
 					node = pop(k, i);
@@ -666,7 +1440,7 @@ public:
 				}
 			}
 		} else {
-			++stacktop;                 // Retain node on stack
+			++path.stacktop;                 // Retain node on stack
 			do {                        // Find lower rightmost key to pull up
 				node = getNode(k->lson);
 				i = node->count;
@@ -677,32 +1451,37 @@ public:
 			i--;
 			k = node->keyI(i);
 			// need only the offset and key
-			nodeLookupType tlen = node->keyofs[-1-i] - node->keyofs[-i];
+			nodeLookupType tlen = node->ofs(i+1) - node->ofs(i);
 			KeyEntry* tkey = (KeyEntry*) new byte[tlen];
 			memcpy(tkey, k, tlen);
-			node->dirty = true;
-			if (!--node->count && stacktop) {
+			node = countKey(node, -1);       // it leaves the subtrees above it
+			k = node->keyI(i);
+			node->changed();
+			if (!--node->count && path.stacktop) {
 				ndxFilePosT son = k->lson;
 				freeNode(node);
 				node = pop(k, i);              // Back up to poppa
 				k->lson = son;                 // No son now
-				node->dirty = true;
+				node->changed();
 			}
-			stacktop = ttop;
+			path.stacktop = ttop;
 			node = pop(k, i);
 			int lendiff = tlen - klen;
 			/* Substitute tkey for key being deleted */
 			while (lendiff +                              // length difference between keys
-				   node->keyofs[-node->count] +           // key data
+				   node->ofs(node->count) +               // key data
 				   sizeof(ndxFilePosT) +                  // rson
-				   + node->count * sizeof(nodeLookupType) // keyofs's
-					   > nNodeSize)
+				   + node->count * cLookup                // keyofs's
+					   > nNodeRoom ||
+				   (cFrontCoded &&
+				    packedSize(node, i, 1, tkey->key, tlen - FIELDOFFSET(KeyEntry, key)) > (int)nNodeSize))
 			{
 				int ret;
-				void* kk = (void*)new byte[nMaxKeySize];
+				byte* kk = new byte[nMaxKeySize];
+				void* ck = NULL;
 				datFilePosT ofs;
-				getCurKey(kk, ofs);
-				IKeyType::copy((void*)k, (const void*)kk);
+				getCurKey(ck, ofs);
+				IKeyType::copy(kk, ck);
 				do {
 					ret = node->split(this);
 					find(kk, ofs);
@@ -711,9 +1490,9 @@ public:
 				delete[] kk;
 			}
 			tkey->lson = k->lson; // Preserve the original lson
-			if (lendiff) {
+			if (lendiff) {   // never for fixed size keys
 				memmove((byte*)k + tlen, (byte*)k + klen,
-						node->keyofs[-node->count] - node->keyofs[-1-i] + sizeof(ndxFilePosT));
+						node->ofs(node->count) - node->ofs(i+1) + sizeof(ndxFilePosT));
 				j = i + 1;
 				nodeLookupType* w = node->keyofs - j;
 				while (j <= node->count) {
@@ -723,15 +1502,16 @@ public:
 			}
 			memcpy(k, tkey, tlen);
 			delete[] tkey;
-			node->dirty = true;
+			node->changed();
 			k = (KeyEntry*)((byte*)k + tlen);
 			i++;
 			if (i == node->count && !k->lson) {
 				// If at end of node, up to next key
 				while (i == node->count) {
-					if (!stacktop) {
+					if (!path.stacktop) {
 						n--;
 						clearCurKey();
+						op.done();
 						return true;
 					}
 					node = pop(k, i);
@@ -749,450 +1529,2998 @@ public:
 		}
 		setCurKey(node, i);
 		n--;
+		op.done();
 		return true;
 	}
 
     /// Goto beginning of index for sequential scanning
 	bool first() // throw(...)
-	{
-		if (!f) return false;
-		stacktop = 0;
-		Node* node = getNode(root);
-		if (!node->count) return false;
-		/* Find lowermost leftmost key in the index, setting the stack */
-		KeyEntry* k;
-		while (1) {
-			push(node, 0);
-			k = &node->key0;
-			if (!k->lson) 
-				break;
-			node = getNode(k->lson);
-		}
-		setCurKey(node, 0);
-		return true;
-	}
+		{ return first(path); }
 
     /// Goto end of index for reverse scanning
 	bool last() // throw(...)
-	{
-		if (!f) return false;
-		stacktop = 0;
-		Node* node = getNode(root);
-		if (!node->count) return false;
-		// Find lowermost rightmost key in the index, setting the stack
-		KeyEntry* k;
-		int i;
-		while (1) {
-			k = node->keyI(i = node->count);
-			if (!k->lson)
-				break;
-			push(node, i);
-			node = getNode(k->lson);
-		};
-		k = node->keyI(--i);
-		push(node, i);
-		setCurKey(node, i);
-		return true;
-	}
+		{ return last(path); }
 
     /// Goto next key from the current. returns false at eof
 	bool next() // throw(...)
-	{
-		if (!f || !stacktop) return false;
-
-		KeyEntry* k;
-		int       i;
-		/* The state at return is that left by find(): The top of the stack is the
-		 * node in which a key was last found and the offset is that of the key.  */
-		Node* node = pop(k, i);
-		if (++i > node->count) {
-			assert(0);   // should never happen
-			clearCurKey();
-			return false;
-		}
-		k = node->keyI(i);
-		while (k->lson) {            // While left son, descend to lowest one
-			push(node, i);
-			node = getNode(k->lson);
-			k = &node->key0;
-			i = 0;
-		}
-		// While at end of current node, back up a level
-		while (i == node->count)
-			if (stacktop)
-				node = pop(k, i);
-			else {
-				clearCurKey();
-				return false;
-			}
-
-		push(node, i);
-		setCurKey(node, i);
-		return true;
-	}
+		{ return next(path); }
 
     /// Goto previous key. returns false at bof
 	bool prev() // throw(...)
-	{
-		if (!f || !stacktop) return false;
+		{ return prev(path); }
 
-		KeyEntry* k;
-		int       i;
-		Node* node = pop(k, i);
-		while (k->lson) {
-			push(node, i);
-			node = getNode(k->lson);
-			i = node->count;
-			k = node->keyI(i);
-		}
-		while (i == 0)
-			if (stacktop)
-				node = pop(k, i);
-			else  {
-				clearCurKey();
-				return false;
-			}
-		i--;
-		k = node->keyI(i);
-		push(node, i);
-		setCurKey(node, i);
-		return true;
-	}
+	/// Visit the keys from lo up to but not including hi, in order, with
+	//     bool visit(const void* key, const datFilePosT& offset)
+	//     which returns false to stop.  lo == 0 starts at the first key, hi == 0 goes to the
+	//     last.  The keys of a leaf are visited in one loop, without moving the current key
+	//     from key to key.  The key is good only during the call, which must not use the index.
+	//     Returns the # of keys visited.  Afterwards the current key is the key visit()
+	//     stopped at or the first key not visited (none at the end), so next() goes on.
+	template <class Visitor>
+	int scan(const void* lo, const void* hi, Visitor& visit) // throw(...)
+		{ return scan(path, lo, hi, visit); }
 
-    /// Returns true if duplicate keys are permitted
-	bool dupsAllowed() const // noexcept // throw()
-		{ return dups; }
+	/// Counted nodes (NodeCounted): make the key of rank i, the i'th key in order from 0,
+	//     the current key, going down one path of the tree.  Returns false (and there is no
+	//     current key) if the index does not have more than i keys.
+	bool seek(int i) // throw(...) // can throw io_error or logic_error (nodes not counted)
+		{ return seek(path, i); }
 
-    /// Debugging code to output the index tree
-	void print(const char* filename) // throw(...)
+	/// Counted nodes: the # of keys before key (before its first instance, with duplicates),
+	//     which is its rank if it is there, going down one path of the tree
+	int rank(const void* key) // throw(...) // can throw io_error or logic_error (nodes not counted)
 	{
-		FILE* outf = fopen(filename, "w");
-		_print(outf, root, 0);
-		fclose(outf);
+		needCounts("rank()");
+		if (!f) return 0;
+		reading();
+		Path p;
+		int  keys = 0;
+		try {
+			for (ndxFilePosT at = root; at; ) {
+				Node* node = getNode(p, at);
+				// the first key of the node >= key: the keys and subtrees before it are before key
+				int    i = 0, j = node->count;
+				uint64 kp = j ? node->searchPrefix(key) : 0;
+				while (i < j) {
+					int m = (i + j) / 2;
+					if (node->compare(key, kp, m) > 0)
+						i = m + 1;
+					else
+						j = m;
+				}
+				keys += i;
+				for (j = 0; j < i; j++)
+					keys += node->sizes[j];
+				at = node->keyI(i)->lson;
+			}
+		} catch (...) {
+			release(p);
+			throw;
+		}
+		release(p);
+		return keys;
 	}
 
-protected:
-	byte           major;        // Version number
-	byte           minor;
-	byte           hNdxPosSize;  // stored index file offset size
-	byte           hDatPosSize;  // stored data file offset size
-    nodeLookupType hNodeSize;    // Stored nNodeSize for open() sanity check
-	nodeLookupType hMaxKeySize;  // Stored for sanity check
-
-	ndxFilePosT    root;         // File offset of the root node
-	ndxFilePosT    eof;          // File offset of the end of file
-	ndxFilePosT    freelist;	  // File offset of free node list
-	int32          n;			  // File size (# keys, that is)
-
-	bool           dups;         // index allows duplicate keys
+	/// Counted nodes: the # of keys from lo up to but not including hi, as rank(hi) - rank(lo).
+	//     lo == 0 counts from the first key, hi == 0 to the last (as scan() visits them).
+	int countRange(const void* lo, const void* hi) // throw(...) // can throw io_error or logic_error (nodes not counted)
+	{
+		needCounts("countRange()");
+		int keys = (hi ? rank(hi) : count()) - (lo ? rank(lo) : 0);
+		return keys > 0 ? keys : 0;
+	}
 
-	byte           filler[3];    // align stacktop
+	/// A position in the index of its own, so several scans (and finds) can run at once
+	//     over one open index and its node cache, without disturbing the current key
+	//     of the index.  Inserting or removing keys (through the index) ends every
+	//     scan: next(), prev() and getCurKey() return false until the cursor is
+	//     positioned again with first(), last() or find().
+	//     In concurrent read mode each thread uses cursors of its own; a cursor holds
+	//     the last two nodes it visited in the cache until it moves on or is destroyed.
+	class Cursor
+	{
+	public:
+		Cursor(IndexT& ndx) : ndx(ndx)
+			{ seen = ndx.changes; }
+		~Cursor()
+			{ ndx.release(p); }
 
-	/// Fields above stacktop are stored in the index header
+		bool first()                                            // throw(...)
+			{ seen = ndx.changes; return ndx.first(p); }
+		bool last()                                             // throw(...)
+			{ seen = ndx.changes; return ndx.last(p); }
+		bool find(const void* key)                              // throw(...)
+			{ seen = ndx.changes; return ndx.find(p, key); }
+		bool find(const void* key, const datFilePosT& offset)   // throw(...)
+			{ seen = ndx.changes; return ndx.find(p, key, offset); }
+		bool seek(int i)                                        // throw(...)
+			{ seen = ndx.changes; return ndx.seek(p, i); }
+		bool next()                                             // throw(...)
+			{ return valid() && ndx.next(p); }
+		bool prev()                                             // throw(...)
+			{ return valid() && ndx.prev(p); }
+		bool getCurKey(void* &key, datFilePosT& offset)         // throw(...)
+			{ return valid() && ndx.getCurKey(p, key, offset); }
+		template <class Visitor>
+		int scan(const void* lo, const void* hi, Visitor& visit) // throw(...)
+			{ seen = ndx.changes; return ndx.scan(p, lo, hi, visit); }
 
-	int            stacktop;            // Current stack top index
-	StackFrame     stack[ndxMaxStack];  // Current state
+	private:
+		IndexT& ndx;
+		Path    p;
+		uint32  seen;   // ndx.changes when the cursor was positioned
 
-	FileSystem::FileHandle f;        // Index file handle
+		bool valid()
+		{
+			if (seen == ndx.changes)
+				return true;
+			p.stacktop = 0;
+			p.curNode = 0;
+			return false;
+		}
 
-	Node**         cache;     // The node cache
-	int            cacheUsed; // number of used cache nodes
-	int            nMaxCache; // max cache nodes
+		Cursor(const Cursor&);
+		Cursor& operator=(const Cursor&);
+	};
 
-	ndxFilePosT    curNode;   // the current key's node
-	int            curI;      // the current key's # with node
+	/// Let several threads find keys and scan the index at once, each with Cursors of its
+	//     own, until endConcurrentReads().  Meanwhile nothing may insert, remove or change
+	//     keys (they throw logic_error), and the index's own find(), first(), next()... are
+	//     for one of the threads only.  A node found in the cache is pinned there without a
+	//     lock; reading one that is not takes a lock.  The cache needs more frames than
+	//     two per cursor: a reader waits while every other frame is pinned.
+	void beginConcurrentReads() // throw(...) // can throw logic_error (bulk load)
+	{
+		if (loading || cow) {
+			char message[1024];
+			sprintf(message, "Concurrent reads during a bulk load or in copy-on-write mode: %s", FileSystemT::getName(f));
+			throw logic_error(message);
+		}
+		shareCache();
+		concurrent = true;
+	}
 
-	void*          paramKey;  // saved parameters for insert, _insert, and remove_current
-	datFilePosT    paramOfs; // to avoid passing redundant values on the stack
-	int            paramSize;
+	/// Back to one thread using the index.  The readers must have stopped.
+	void endConcurrentReads() // noexcept
+	{
+		std::lock_guard<std::mutex> lock(*cacheLock);
+		noteHits();
+		concurrent = false;
+	}
 
-	int  	       nMaxKeySize;  // calculated
+	bool concurrentReads() const // noexcept
+		{ return concurrent && !writers; }
 
-	// set the current key and datafile offset for retrieval by getCurKey
-	void setCurKey(Node* node, int i)
+	/// Let several threads insert and remove keys at once with insert(), remove(key) and
+	//     remove(key, offset), until endConcurrentWrites().  Writers latch each node on the
+	//     way down before letting go of the one above it, and change a leaf holding only its
+	//     latch, so writers of different leaves run in parallel.  Splitting a full leaf, or
+	//     merging one under half full with a sibling, also holds the latch of their parent.
+	//     Only a write that would split the parent or the root, empty a leaf or change an
+	//     inner node waits for the others to finish and has the tree to itself.  Meanwhile
+	//     finds and scans throw logic_error, and count() is only brought up to date by such
+	//     writes and by endConcurrentWrites().  Every writer latches the root on its way down,
+	//     briefly, and with a small cache writers can be slower than one lock (see test_writers).
+	void beginConcurrentWrites() // throw(...) // can throw io_error or logic_error
 	{
-		curNode = node->offset;
-		curI = i;
+		if (!f || loading || wal || cow) {
+			char message[1024];
+			sprintf(message, "Concurrent writes need an open index, not a bulk load, a log or copy-on-write: %s", f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
+		}
+		if (cCounted) {        // the writers of the leaves would all change the counts above them
+			char message[1024];
+			sprintf(message, "Concurrent writes do not keep the subtree counts of counted nodes: %s", FileSystemT::getName(f));
+			throw logic_error(message);
+		}
+		exclusive();           // not while reading concurrently
+		path.stacktop = 0;
+		clearCurKey();
+		changes++;             // ends the scans of cursors
+		levels = countLevels();
+		shareCache();
+		filterStale = true;    // the writers do not keep the filter: built again after them
+		writers = true;
+		concurrent = true;
 	}
 
-	void clearCurKey()
+	/// Back to one thread using the index.  The writers must have stopped.
+	void endConcurrentWrites() // noexcept
 	{
-		curNode = 0;
-		//curI = 0;
+		if (!writers) return;
+		n += gate->added.exchange(0);
+		stats.hits += gate->hits.exchange(0);
+		writers = false;
+		endConcurrentReads();
 	}
 
-	/// reset the cache.  used by open() and create()
-	void resetCache()
+	bool concurrentWrites() const // noexcept
+		{ return writers; }
+
+	/// Start a bulk load of an empty index.  Give load() the keys in sorted order
+	//     (duplicates in order of data offset), then call endLoad().
+	//     The nodes are filled to fillPercent and written in one sequential pass,
+	//     which is much faster than insert() and leaves the nodes fuller.
+	//     Use fillPercent < 100 to leave room for later inserts.
+	void beginLoad(int fillPercent = 100) // throw(...) // can throw io_error or logic_error (index not empty)
 	{
-		Node** c = cache;
-		for (int i = 0; i < cacheUsed; i++)
-			(*c++)->dirty = false;
-		cacheUsed = 0;
+		if (!f || loading || n || wal || cow || snapshotOf || flusher) {
+			char message[1024];
+			sprintf(message, "Bulk load needs an open, empty index without a log, copy-on-write or a flusher: %s", f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
+		}
+		exclusive();
+		resetCache();           // drop the empty root, the nodes are rewritten from the start of the file
+		path.stacktop = 0;
+		clearCurKey();
+		eof = nNodeSize;
+		freelist = 0;
+		dropFree();
+		if (filter) {           // the loaded keys go in, in one the size of the last
+			filter->init(filter->empty() ? 1024 : filter->capacity(), filterRate);
+			filterStale = false;
+			filterDirty = true;
+		}
+		loading = new BulkLoad;
+		loading->levels = 0;
+		for (int i = 0; i < ndxMaxStack; i++) {
+			loading->son[i] = 0;
+			loading->sonKeys[i] = 0;
+		}
+		if (fillPercent > 100) fillPercent = 100;
+		loading->limit = (cFrontCoded ? (int)nNodeSize : (int)nNodeRoom) * fillPercent / 100;
+		loading->lastKey = new byte[nMaxKeySize];
 	}
 
-    /// Read header or node
-	void read(const ndxFilePosT& offset, void* buffer, uint16 size) // throw(...)  // can throw io_error
-	{
-		FileSystemT::seek(f, offset);
-		FileSystemT::read(f, buffer, size);
+	/// Add the next key of a bulk load
+	void load(const void* key, const datFilePosT& offset) // throw(...) // can throw io_error, runtime_error, logic_error (no beginLoad())
+	{                                                     //   or invalid_argument (key too long or out of order)
+		if (!loading) {
+			char message[1024];
+			sprintf(message, "load() without beginLoad(): %s", f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
+		}
+		int size = IKey::size(key);
+		char message[4096] = "";
+		if (size > nMaxKeySize)
+			sprintf(message, "Key (%s) too long (must be <= %d bytes)", IKey::toString(key), nMaxKeySize);
+		else if (n) {
+			int cmp = IKey::compare(key, loading->lastKey);
+			if (cmp < 0 || (cmp == 0 && (!dups || offset <= loading->lastOfs)))
+				sprintf(message, "Key (%s) out of order in bulk load of %s", IKey::toString(key), FileSystemT::getName(f));
+		}
+		if (message[0])
+			throw invalid_argument(message);
+		IKey::copy(loading->lastKey, key);
+		loading->lastOfs = offset;
+		loadKey(0, key, size, offset);
+		filterAdd(key, size);
+		n++;
 	}
 
-	/// Write header or node
-    void write(const ndxFilePosT& offset, void* buffer, uint16 size) // throw(...)  // can throw io_error
+	/// Finish a bulk load: write the partly filled nodes on the right edge of the tree
+	void endLoad() // throw(...) // can throw io_error
 	{
-		FileSystemT::seek(f, offset);
-		FileSystemT::write(f, buffer, size);
+		if (!loading) return;
+		ndxFilePosT son = 0;   // the last node written on the level below
+		uint32 sonKeys = 0;    //    and the # of keys in its subtree
+		for (int level = 0; level < loading->levels; level++) {
+			Node* node = loading->node[level];
+			if (node->count) {
+				*node->rson() = son;
+				if (cCounted)
+					node->sizes[node->count] = sonKeys;
+				sonKeys = node->total();
+				son = loadWrite(node);
+			} // an empty node is left out, its parent points to its son instead
+		}
+		for (int level = 0; level < loading->levels; level++)
+			delete loading->node[level];
+		delete[] loading->lastKey;
+		delete loading;
+		loading = 0;
+		root = son ? son : newNode()->offset;
+		changes++;
 	}
 
-     /// Get a specific node
-	Node* getNode(const ndxFilePosT& offset) // throw(...) // can throw io_error(), called by almost everything
+	/// Rewrite the index with its nodes fillPercent full and as few levels as the keys need.
+	//     The keys are read in order with scan() and bulk loaded (see beginLoad()) into a new
+	//     file, name.pack, which is synced and then replaces the index file (where rename()
+	//     does not replace a file, the index file is renamed to name.old until the new one
+	//     is in place, and put back if it can not be).  The leaves are in key order in
+	//     the new file, each inner node right after the last node of its subtree, so a scan
+	//     reads the file from the start to the end, and there are no free nodes.  Takes one
+	//     pass over the keys and writes each node once.  There is no current key afterwards.
+	void pack(int fillPercent = 100) // throw(...) // can throw io_error or logic_error
 	{
-		Node* node = 0;
-		int i = cacheUsed;
-		if (offset) {
-			Node** c = cache;
-			for (i = 0; i < cacheUsed; i++) { // It may be in the cache
-				node = *c++;
-				if (node->offset == offset)
-					break;
-			}
+		if (!f || loading || wal || cow || flusher) {
+			char message[1024];
+			sprintf(message, "pack() needs an open index, not a bulk load, a log, copy-on-write or a flusher: %s", f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
 		}
-		if (i == cacheUsed) {
-			if (cacheUsed < nMaxCache)       // if not using all the cache slots,
-				node = cache[i = cacheUsed++];  //    use another slot
-			else {
-				node = cache[i = nMaxCache-1];  // reuse oldest node in cache
-				if (node->dirty) {
-					write(node->offset, node, nNodeSize);
-					node->dirty = false;
-				}
-			}
-			if (offset) {
-				read(offset, node, nNodeSize);
-				node->offset = offset;
-			}
+		exclusive();
+		const char* fileName = FileSystemT::getName(f);
+		std::vector<char> name(fileName, fileName + strlen(fileName) + 1);
+		std::vector<char> temp(name.begin(), name.end() - 1);
+		const char* suffix = ".pack";
+		temp.insert(temp.end(), suffix, suffix + strlen(suffix) + 1);
+		std::vector<char> old(name.begin(), name.end() - 1);
+		suffix = ".old";
+		old.insert(old.end(), suffix, suffix + strlen(suffix) + 1);
+		try {
+			IndexT packed;
+			packed.create(&temp[0], dups);
+			packed.beginLoad(fillPercent);
+			LoadInto load(packed);
+			scan(0, 0, load);
+			packed.endLoad();
+			packed.flush();
+			FileSystemT::sync(packed.f);          // on disk before it replaces the index
+			packed.close();
+		} catch (...) {
+			::remove(&temp[0]);
+			throw;
 		}
-		if (i) {  // bubble up cache slots
-			memmove(cache + 1, cache, i * sizeof(Node*));
-			cache[0] = node;
+		bool filtered = filter != 0;
+		std::vector<char> fname(filterName);
+		double rate = filterRate;
+		close();
+		// rename() does not replace a file everywhere: keep the index until the new one is in place
+		if (::rename(&temp[0], &name[0])) {
+			bool moved = !::rename(&name[0], &old[0]);
+			if (!moved || ::rename(&temp[0], &name[0])) {
+				if (moved)
+					::rename(&old[0], &name[0]);
+				::remove(&temp[0]);
+				open(&name[0]);
+				if (filtered)
+					attachFilter(&fname[0], rate);
+				char message[1024];
+				sprintf(message, "pack() could not rename %s to %s", &temp[0], &name[0]);
+				throw io_error(message);
+			}
+			::remove(&old[0]);
 		}
-		return node;
+		open(&name[0]);
+		if (filtered)
+			attachFilter(&fname[0], rate);
 	}
 
-    // Get an empty node (maybe from freelist)
-	Node* newNode() // throw(...) // can throw io_error(), called by insert(), create()
+	/// Write the index through a write-ahead log (see <nub/WriteAheadLog.h>) from now on, so
+	//     that a crash leaves it as of the last commit the log synced.  Inserts, removes and
+	//     changes each commit a transaction of their own, unless one is open: then they are
+	//     part of it and only commit() makes them count (in memory at once).  Attaching
+	//     replays the transactions committed in the log; attach the files that share a log
+	//     in the same order every time.  The log must stay open until detachLog() or close().
+	void attachLog(WriteAheadLogT<FileSystemT>& log) // throw(...) // can throw io_error or logic_error
 	{
-		Node* node = getNode(0); // New slot in the cache
-		if (freelist) {          // If we can use an old node
-			node->offset = freelist;
-			read(freelist, &freelist, sizeof(freelist));
-		} else {                      // extend the file
-			write(node->offset = eof, node, nNodeSize);
-			eof += nNodeSize;
+		if (!f || loading || concurrent || wal || cow || snapshotOf || flusher) {
+			char message[1024];
+			sprintf(message, "attachLog() needs an open index, not a bulk load, concurrent mode, a log, copy-on-write or a flusher: %s", f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
 		}
-		node->count = 0;
-		node->lson = 0;
-		node->dirty = true;
-		return node;
+		writeDirty();                            // the file as it is, before the log takes over
+		saveFree();
+		stampKeys();
+		const int cHeaderSize = FIELDOFFSET(IndexT, path) - FIELDOFFSET(IndexT, major);
+		write(0, &major, cHeaderSize);
+		walFile = log.attach(f);
+		wal = &log;
+		dropChanges();                           // the replayed header and nodes
+		wal->setEnd(walFile, eof);
 	}
 
-	// add a node to the free list on disk
-	void freeNode(Node* node) // noexcept
+	/// Commit the open transaction and write the index directly again
+	void detachLog() // throw(...) // can throw io_error
 	{
-		write(node->offset, &freelist, sizeof(ndxFilePosT));
-		freelist = node->offset;
-		node->dirty = false;
-		Node** c = cache;
-		int i;
-		for (i = 0; *c != node; i++, c++)
-			;
-		cacheUsed--;
-		memmove(c, c + 1, (cacheUsed - i) * sizeof(Node*));
-		cache[cacheUsed] = node;
+		if (!wal) return;
+		if (wal->inTransaction())
+			commit();
+		WriteAheadLogT<FileSystemT>* log = wal;
+		wal = 0;
+		log->detach(walFile);
 	}
 
-	// put a node and key index onto the stack
-	void push(Node* node, int i) // throw(...)
+	/// Group inserts, removes and changes into one transaction, until commit() or rollback()
+	void beginTransaction() // throw(...) // can throw logic_error (no log, or a transaction is open)
 	{
-		StackFrame* stk = &stack[stacktop++];
-		if (stacktop > ndxMaxStack) {
+		if (!wal) {
 			char message[1024];
-			sprintf(message, "Index stack overflow in file %s", FileSystemT::getName(f));
-			throw runtime_error(message);
+			sprintf(message, "A transaction needs a log: %s", f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
 		}
-		stk->offset = node->offset;
-		stk->i = i;
+		wal->begin();
 	}
 
-	// get top node and key offset the stack and pop it
-	Node* pop(KeyEntry* &k, int &i) // throw(...)
+	void commit() // throw(...) // can throw io_error or logic_error (no transaction)
 	{
-		if (!stacktop) {
-			char message[1024];
-			sprintf(message, "Stack underflow: no current key. File: %s", FileSystemT::getName(f));
-			throw logic_error(message);
-		}
-		StackFrame* stk = &stack[--stacktop];
-		Node* node = getNode(stk->offset);
-		k = node->keyI(stk->i);
-		i = stk->i;
-		return node;
+		if (!wal) return;
+		logChanges();
+		wal->commit();
 	}
 
-	// get the top node and key off the stack
-	Node* top(KeyEntry* &k, int &i) // noexcept
+	/// Forget the changes since beginTransaction().  There is no current key afterwards.
+	void rollback() // throw(...) // can throw io_error
 	{
-		Node* node = pop(k, i);
-		stacktop++;
-		return node;
+		if (!wal) return;
+		wal->rollback();
+		dropChanges();
 	}
 
-	// Inner insert
-	int	_insert(const ndxFilePosT& root) // throw(...)
+	/// Write the changed nodes and the header to the log's open transaction.  Used by
+	//     commit(), and by the owner of a log other files share before it commits.
+	void logChanges() // throw(...) // can throw io_error
 	{
-		Node* node = getNode(root);
-		KeyEntry* k;
-		int i = 0;
+		writeDirty();
+		saveFree();
+		stampKeys();
+		const int cHeaderSize = FIELDOFFSET(IndexT, path) - FIELDOFFSET(IndexT, major);
+		write(0, &major, cHeaderSize);
+		wal->setEnd(walFile, eof);
+	}
+
+	/// Drop the cached nodes and read the header again, after the log's transaction was
+	//     rolled back.  Used by rollback(), and by the owner of a log other files share.
+	void dropChanges() // throw(...) // can throw io_error
+	{
+		resetCache();
+		const int cHeaderSize = FIELDOFFSET(IndexT, path) - FIELDOFFSET(IndexT, major);
+		read(0, &major, cHeaderSize);
+		dropFree();                              // the free list as of the header
+		path.stacktop = 0;
+		clearCurKey();
+	}
+
+	/// Copy-on-write mode, until endCopyOnWrite(): the nodes of the index as of the last
+	//     publish() are never written over.  Inserts, removes and changes write the nodes
+	//     they change somewhere else, and publish() makes them the index: it writes them,
+	//     syncs, and writes the header with the new root.  Until then (and after a crash)
+	//     the file holds the index as of the last publish(); discard() drops the changes.
+	//     Snapshots (see openSnapshot()) read the index as of a publish() in other threads
+	//     and never wait for the writer.  The nodes a publish() leaves behind are reused
+	//     once no snapshot that could see them is open.  The free nodes are kept in memory
+	//     meanwhile, so a crash loses them (pack() gets them back).
+	void beginCopyOnWrite() // throw(...) // can throw io_error or logic_error
+	{
+		if (!f || loading || concurrent || wal || cow || snapshotOf || flusher) {
+			char message[1024];
+			sprintf(message, "Copy-on-write needs an open index, not a bulk load, concurrent mode, a log, a snapshot or a flusher: %s", f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
+		}
+		writeDirty();
+		const int cHeaderSize = FIELDOFFSET(IndexT, path) - FIELDOFFSET(IndexT, major);
+		cow = new CopyOnWrite;
+		cow->version = 0;
+		cow->published.resize(cHeaderSize);
+		loadFree();                              // the header published from now on has none
+		cow->reusable.assign(freeNodes->nodes.rbegin(), freeNodes->nodes.rend()); // taken from the lowest
+		freeNodes->nodes.clear();
+		freeNodes->links.clear();                // their links are written over
+		freelist = 0;
+		publish();
+	}
+
+	/// Make the changes since the last publish() the index, for the snapshots opened from
+	//     now on and in the file.  There is no current key afterwards.
+	void publish() // throw(...) // can throw io_error or logic_error
+	{
+		if (!cow) {
+			char message[1024];
+			sprintf(message, "publish() without copy-on-write: %s", f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
+		}
+		exclusive();
+		relocate();
+		writeDirty();
+		FileSystemT::sync(f);                    // the nodes before the header that points to them
+		stampKeys();
+		const int cHeaderSize = FIELDOFFSET(IndexT, path) - FIELDOFFSET(IndexT, major);
+		write(0, &major, cHeaderSize);
+		FileSystemT::sync(f);
+		{
+			std::lock_guard<std::mutex> lock(cow->lock);
+			cow->version++;
+			memcpy(&cow->published[0], &major, cHeaderSize);
+		}
+		for (size_t i = 0; i < cow->freed.size(); i++)
+			cow->retired.push_back(std::make_pair(cow->version, cow->freed[i]));
+		cow->freed.clear();
+		cow->fresh.clear();
+		reclaim();
+		path.stacktop = 0;
+		clearCurKey();
+		changes++;
+	}
+
+	/// Drop the changes since the last publish().  There is no current key afterwards.
+	void discard() // throw(...) // can throw logic_error
+	{
+		if (!cow) {
+			char message[1024];
+			sprintf(message, "discard() without copy-on-write: %s", f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
+		}
+		exclusive();
+		cow->reusable.insert(cow->reusable.end(), cow->fresh.begin(), cow->fresh.end());
+		for (typename Moved::iterator m = cow->moved.begin(); m != cow->moved.end(); ++m)
+			cow->reusable.push_back(m->second);
+		cow->fresh.clear();
+		cow->moved.clear();
+		cow->freed.clear();
+		resetCache();
+		ndxFilePosT end = eof;                   // the nodes added past the end are free now
+		memcpy(&major, &cow->published[0], cow->published.size());
+		eof = end;
+		path.stacktop = 0;
+		clearCurKey();
+	}
+
+	/// Publish the changes and leave copy-on-write mode: the free nodes go back into the
+	//     free list in the file.  The snapshots must be closed.
+	void endCopyOnWrite() // throw(...) // can throw io_error or logic_error
+	{
+		if (!cow) return;
+		bool open;
+		{
+			std::lock_guard<std::mutex> lock(cow->lock);
+			open = !cow->readers.empty();
+		}
+		if (open) {
+			char message[1024];
+			sprintf(message, "endCopyOnWrite() with snapshots open: %s", FileSystemT::getName(f));
+			throw logic_error(message);
+		}
+		stopCopyOnWrite();
+	}
+
+	bool copyOnWrite() const // noexcept
+		{ return cow != 0; }
+
+	/// Open a read-only snapshot of an index in copy-on-write mode, as of its last publish().
+	//     It has a cache and a file handle of its own, so one thread can use it while another
+	//     changes the index.  Close it (with close()) before the index leaves copy-on-write
+	//     mode or is closed.
+	void openSnapshot(IndexT& index) // throw(...) // can throw io_error or logic_error
+	{
+		close();
+		if (!index.cow) {
+			char message[1024];
+			sprintf(message, "Snapshots need an index in copy-on-write mode: %s", index.f ? FileSystemT::getName(index.f) : "(closed)");
+			throw logic_error(message);
+		}
+		f = FileSystemT::open(FileSystemT::getName(index.f));
+		if (!f) {
+			char message[1024];
+			sprintf(message, "Cannot open %s for a snapshot", FileSystemT::getName(index.f));
+			throw io_error(message);
+		}
+		resetCache();
+		path.stacktop = 0;
+		clearCurKey();
+		std::lock_guard<std::mutex> lock(index.cow->lock);
+		memcpy(&major, &index.cow->published[0], index.cow->published.size());
+		snapshotVersion = index.cow->version;
+		index.cow->readers[snapshotVersion]++;
+		snapshotOf = &index;
+	}
+
+	bool isSnapshot() const // noexcept
+		{ return snapshotOf != 0; }
+
+    /// Returns true if duplicate keys are permitted
+	bool dupsAllowed() const // noexcept // throw()
+		{ return dups; }
+
+    /// Debugging code to output the index tree
+	void print(const char* filename) // throw(...)
+	{
+		FILE* outf = fopen(filename, "w");
+		_print(outf, root, 0);
+		fclose(outf);
+	}
+
+protected:
+	byte           major;        // Version number
+	byte           minor;
+	byte           hNdxPosSize;  // stored index file offset size
+	byte           hDatPosSize;  // stored data file offset size
+    nodeLookupType hNodeSize;    // Stored nNodeSize for open() sanity check
+	nodeLookupType hMaxKeySize;  // Stored for sanity check
+
+	ndxFilePosT    root;         // File offset of the root node
+	ndxFilePosT    eof;          // File offset of the end of file
+	ndxFilePosT    freelist;	  // File offset of free node list
+	int32          n;			  // File size (# keys, that is)
+
+	bool           dups;         // index allows duplicate keys
+
+	byte           keysVersion[3]; // changes with the keys, see stampKeys() (and aligns path)
+
+	/// Fields above path are stored in the index header
+
+	Path           path;      // the current key of the index, see also Cursor
+	uint32         changes;   // counts inserts and removals, to end the scans of cursors
+
+	typename FileSystemT::FileHandle f;  // Index file handle
+
+	Node**         cache;     // The node cache
+	CacheBucket*   cacheHash; // node offset -> cache frame (open addressing, linear probing)
+	CachePolicy    policy;    // picks the node to evict when all frames are in use
+	CacheStats     stats;
+	Node*          recent[ndxMaxRecent]; // most recently used nodes, most recent first
+	Node*          spare;     // unused cache frames, linked through nextSpare
+	int            cacheMask; // # of hash buckets - 1
+	int            nRecent;
+	int            maxRecent; // # of nodes protected from eviction (< nMaxCache)
+	int            writeBackMax; // # of changed nodes written at once to evict one
+	int            cacheUsed; // number of used cache nodes
+	int            nMaxCache; // max cache nodes
+
+	std::atomic<int>*         pins;        // per frame: # of paths holding the node, -1 while a reader fills the frame
+	std::atomic<ndxFilePosT>* frameOffset; // per frame: the node's offset, checked by readers once they pinned it
+	std::atomic<bool>*        used;        // per frame: hit without the lock, not yet told to the policy
+	std::mutex*               cacheLock;   // held by readers changing the cache
+	bool                      concurrent;  // between beginConcurrentReads() and endConcurrentReads()
+	bool                      writers;     // between beginConcurrentWrites() and endConcurrentWrites()
+	WriteGate*                gate;        // lets inserts and removes that change one leaf run at once
+	std::mutex*               latches;     // per frame: held by the writer changing the leaf there
+	int                       levels;      // levels of the tree in concurrent write mode (0 if not known)
+
+	void*          paramKey;  // saved parameters for insert, _insert, and remove_current
+	datFilePosT    paramOfs; // to avoid passing redundant values on the stack
+	int            paramSize;
+
+	BulkLoad*      loading;   // non-zero between beginLoad() and endLoad()
+	WriteAheadLogT<FileSystemT>* wal;  // the index is written through it, if not 0
+	int            walFile;   // the index file's id in the log
+	CopyOnWrite*   cow;       // non-zero in copy-on-write mode
+	IndexT*        snapshotOf;      // the index this is a snapshot of, if not 0
+	WriteBehindT<FileSystemT>* flusher; // the index is written through it, if not 0
+	int            cleanHand; // the next frame cleanAhead() looks at
+	Free*          freeNodes; // the free nodes, see countFree()
+	bool           freeLoaded; // freeNodes holds the free list of the header
+	bool           freeChanged; // since saveFree()
+	uint32         versionChanges; // changes when keysVersion was last changed
+	BloomFilter*   filter;    // of the keys, if not 0: see attachFilter()
+	std::vector<char> filterName;
+	double         filterRate; // of false positives
+	bool           filterStale; // to be built again before it is used
+	bool           filterDirty; // changed since it was read or written
+	uint32         snapshotVersion; // of the publish() it sees
+	byte*          packBuf;   // a node as on disk, if front coded
+
+	int  	       nMaxKeySize;  // calculated
+
+	/// Major version of the index files of this node layout
+	static byte majorVersion()
+		{ return cFrontCoded ? ndxMAJORFrontCoded : cCounted ? ndxMAJORCounted : cFixed ? ndxMAJORFixed : ndxMAJOR; }
+
+	/// Inserts, removes and changes need the index to themselves
+	void exclusive() // throw(...) // can throw logic_error
+	{
+		if (concurrent || snapshotOf) {
+			char message[1024];
+			sprintf(message, snapshotOf ? "A snapshot is read-only: %s" : "The index is shared by several threads: %s", FileSystemT::getName(f));
+			throw logic_error(message);
+		}
+	}
+
+	/// Finds and scans do not latch leaves, so they can not run with concurrent writers
+	void reading() // throw(...) // can throw logic_error
+	{
+		if (writers && concurrent) {
+			char message[1024];
+			sprintf(message, "The index is in concurrent write mode: %s", FileSystemT::getName(f));
+			throw logic_error(message);
+		}
+	}
+
+	/// An insert, remove or change with a log attached and no transaction open: a transaction
+	//    of its own, rolled back if it throws
+	struct LoggedWrite
+	{
+		IndexT* ndx;
+		bool    own;
+
+		LoggedWrite(IndexT* ndx) : ndx(ndx), own(ndx->wal && !ndx->wal->inTransaction())
+		{
+			if (own)
+				ndx->wal->begin();
+		}
+
+		void done() // throw(...)
+		{
+			if (own) {
+				ndx->commit();
+				own = false;
+			}
+		}
+
+		~LoggedWrite()
+		{
+			if (own)
+				try {
+					ndx->rollback();
+				} catch (...) {
+				}
+		}
+	};
+
+	/// An insert or remove in concurrent write mode that changes a leaf, and maybe its parent
+	//    and a sibling, latching them.  Many run at once.
+	struct LeafWrite
+	{
+		IndexT* ndx;
+		Path    p;    // of its own, the index's path is for a TreeWrite
+
+		LeafWrite(IndexT* ndx) : ndx(ndx)
+		{
+			WriteGate* gate = ndx->gate;
+			while (1) {
+				gate->leafWriters.fetch_add(1);
+				if (!gate->treeWanted.load())
+					break;
+				gate->leafWriters.fetch_sub(1);
+				std::lock_guard<std::mutex> wait(gate->treeLock);   // until the TreeWrite is done
+			}
+		}
+
+		~LeafWrite()
+		{
+			for (int i = 0; i < 2; i++)
+				if (p.pinned[i])
+					ndx->unpin(p.pinned[i]);
+			if (p.hits)
+				ndx->gate->hits.fetch_add(p.hits, std::memory_order_relaxed);
+			ndx->gate->leafWriters.fetch_sub(1);
+		}
+	};
+
+	/// An insert or remove in concurrent write mode that needs the tree to itself.  It waits
+	//    for the LeafWrites to finish, keeps new ones out and runs the single threaded code.
+	struct TreeWrite
+	{
+		IndexT* ndx;
+
+		TreeWrite(IndexT* ndx) : ndx(ndx)
+		{
+			WriteGate* gate = ndx->gate;
+			gate->treeLock.lock();
+			gate->treeWanted.store(true);
+			while (gate->leafWriters.load())
+				std::this_thread::yield();
+			ndx->n += gate->added.exchange(0);
+			ndx->stats.hits += gate->hits.exchange(0);
+			ndx->concurrent = false;
+			ndx->levels = 0;          // until done()
+		}
+
+		/// The tree may have grown or shrunk a level
+		void done() // throw(...)
+			{ ndx->levels = ndx->countLevels(); }
+
+		~TreeWrite()
+		{
+			std::vector<int>& touched = ndx->gate->touched;
+			for (size_t i = 0; i < touched.size(); i++)
+				ndx->shareFrame(touched[i]);
+			touched.clear();
+			ndx->concurrent = true;
+			ndx->gate->treeWanted.store(false);
+			ndx->gate->treeLock.unlock();
+		}
+	};
+
+	/// Insert in concurrent write mode
+	bool insertShared(const void* key, int size, const datFilePosT& offset) // throw(...)
+	{
+		{
+			LeafWrite op(this);
+			int result = levels ? insertLeaf(op.p, key, size, offset) : -1;
+			if (result >= 0) {
+				if (result)
+					gate->added.fetch_add(1, std::memory_order_relaxed);
+				return result != 0;
+			}
+		}
+		TreeWrite op(this);         // the leaf and its parent are full
+		bool result = insertKey(key, size, offset);
+		op.done();
+		return result;
+	}
+
+	/// The latches a writer holds on its way down: of a node and of its parent
+	struct Latches
+	{
+		std::unique_lock<std::mutex> node;
+		std::unique_lock<std::mutex> parent;
+	};
+
+	/// Go down to the leaf a key belongs in, latching each node before letting go of the
+	//    latch of the one above it, which a writer splitting or merging its sons holds.
+	//    Stops where the key is found, at a son of 0 or on the level of the leftmost leaf,
+	//    with the node and its parent (0 for the root) latched.
+	Node* latchDown(Path& p, const void* key, const datFilePosT& offset, Latches& held,
+	                Node*& parent, int& parenti, int& i, bool& found) // throw(...) // can throw io_error
+	{
+		Node* node = getNode(p, root);
+		held.node = std::unique_lock<std::mutex>(latches[node->frame]);
+		parent = 0;
+		parenti = 0;
+		for (int level = 1; ; level++) {
+			i = locate(node, key, offset, found);
+			if (found || level == levels || !node->keyI(i)->lson)
+				return node;
+			if (held.parent.owns_lock())
+				held.parent.unlock();    // before the path lets go of the node
+			held.parent.swap(held.node);
+			parent = node;
+			parenti = i;
+			node = getNode(p, node->keyI(i)->lson);
+			held.node = std::unique_lock<std::mutex>(latches[node->frame]);
+		}
+	}
+
+	/// Insert into a leaf, latching it: 1 if inserted, 0 if the key is there, -1 if the
+	//    key goes in an inner node, or the leaf is full and so is its parent
+	int insertLeaf(Path& p, const void* key, int size, const datFilePosT& offset) // throw(...)
+	{
+		Latches held;
+		Node*   parent;
+		int     parenti, i;
+		bool    found;
+		Node*   node = latchDown(p, key, offset, held, parent, parenti, i, found);
+		if (found)
+			return 0;
+		if (!isLeaf(node))
+			return -1;
+		if (!keyFits(node, i, key, size))
+			return parent ? splitLeaf(parent, parenti, node, key, size, offset) : -1;
+		if (held.parent.owns_lock())
+			held.parent.unlock();
+		putKey(node, i, key, size, offset);
+		if (!node->prefixValid)
+			node->makePrefixes();
+		return 1;
+	}
+
+	/// Split a full leaf, son parenti of parent, holding the latches of both, and insert a
+	//    key: 1 if inserted, -1 if the pivot does not fit into the parent (or the key into
+	//    its half).  The new node is not in the tree until the pivot is in the parent.
+	int splitLeaf(Node* parent, int parenti, Node* node, const void* key, int size, const datFilePosT& offset) // throw(...)
+	{
+		int m = node->middle(this);
+		if (!node->pivotFits(this, parent, parenti, m))
+			return -1;
+		Node* added = newShared(node->offset);
+		node->splitInto(parent, parenti, m, added);
+		bool  found;
+		Node* half = locate(parent, key, offset, found) == parenti ? node : added;
+		int   i = locate(half, key, offset, found);
+		bool  fits = keyFits(half, i, key, size);
+		if (fits)
+			putKey(half, i, key, size, offset);
+		parent->makePrefixes();
+		node->makePrefixes();
+		added->makePrefixes();
+		unpin(added);
+		return fits ? 1 : -1;
+	}
+
+	/// Remove in concurrent write mode
+	bool removeShared(const void* key, const datFilePosT& offset, bool exact) // throw(...)
+	{
+		if (exact || !dups) {       // the first of several duplicates could be in any of their nodes
+			LeafWrite op(this);
+			int result = levels ? removeLeaf(op.p, key, offset, exact) : -1;
+			if (result >= 0) {
+				if (result)
+					gate->added.fetch_sub(1, std::memory_order_relaxed);
+				return result != 0;
+			}
+		}
+		TreeWrite op(this);
+		bool result = (exact ? find(key, offset) : find(key)) && remove_current();
+		op.done();
+		return result;
+	}
+
+	/// Remove a key from a leaf, latching it, and merge the leaf with a sibling if it is
+	//    left under half full, latching their parent too: 1 if removed, 0 if the key is
+	//    not there, -1 if the key is in an inner node or the leaf would be emptied
+	int removeLeaf(Path& p, const void* key, const datFilePosT& offset, bool exact) // throw(...)
+	{
+		Latches held;
+		Node*   parent;
+		int     parenti, i;
+		bool    found;
+		Node*   node = latchDown(p, key, offset, held, parent, parenti, i, found);
+		if (!found)
+			return node->keyI(i)->lson ? -1 : 0;    // the leaves under it are deeper
+		if (exact && node->keyI(i)->offset != offset)
+			return 0;
+		if (!isLeaf(node) || (parent && node->count == 1))
+			return -1;
+		bool merge = parent && !keepsHalf(node, i);
+		if (!merge && held.parent.owns_lock())
+			held.parent.unlock();
+		dropKey(node, i);
+		if (!node->prefixValid)
+			node->makePrefixes();
+		if (merge && parent->count > 1)         // the parent keeps a key
+			mergeLeaf(parent, parenti, node);
+		return 1;
+	}
+
+	/// Merge a leaf under half full, son j of parent, with its right or else its left
+	//    sibling if they are leaves and fit into one, holding the latches of the leaf and
+	//    the parent (which keeps a key).  Latches the sibling: only a writer holding the
+	//    latch of a node latches two of its sons.
+	void mergeLeaf(Node* parent, int j, Node* node) // throw(...) // can throw io_error
+	{
+		Path side;                                  // holds the sibling in the cache
+		try {
+			ndxFilePosT son;
+			if (j < parent->count && (son = parent->keyI(j + 1)->lson)) {
+				Node* rsib = getNode(side, son);
+				std::lock_guard<std::mutex> latch(latches[rsib->frame]);
+				if (isLeaf(rsib) && sonsFit(node, parent->keyI(j), parent->ofs(j+1) - parent->ofs(j), rsib)) {
+					mergeSons(parent, j, node, rsib);
+					freeShared(rsib);
+					parent->makePrefixes();
+					node->makePrefixes();
+					release(side);
+					return;
+				}
+			}
+			if (j > 0 && (son = parent->keyI(j - 1)->lson)) {
+				Node* lsib = getNode(side, son);
+				std::lock_guard<std::mutex> latch(latches[lsib->frame]);
+				if (isLeaf(lsib) && sonsFit(lsib, parent->keyI(j - 1), parent->ofs(j) - parent->ofs(j-1), node)) {
+					mergeSons(parent, j - 1, lsib, node);
+					freeShared(node);
+					parent->makePrefixes();
+					lsib->makePrefixes();
+				}
+			}
+		} catch (...) {
+			release(side);
+			throw;
+		}
+		release(side);
+	}
+
+	/// Whether all the sons of a node are 0.  remove_current() leaves a son of 0 in an inner
+	//    node for a leaf it empties, and lifts a merged node into the place of a parent it
+	//    empties, so the leaves are not all on the level countLevels() finds.
+	static bool isLeaf(Node* node) // noexcept
+	{
+		for (int i = 0; i <= node->count; i++)
+			if (node->keyI(i)->lson)
+				return false;
+		return true;
+	}
+
+	/// # of levels of the tree
+	int countLevels() // throw(...)
+	{
+		int levels = 1;
+		for (Node* node = getNode(root); node->key0.lson; node = getNode(node->key0.lson))
+			levels++;
+		return levels;
+	}
+
+	/// Make the cached nodes ready to be shared by threads: readers never change a node
+	void shareCache() // noexcept
+	{
+		for (int i = 0; i < nMaxCache; i++) {
+			shareFrame(i);
+			used[i].store(false, std::memory_order_relaxed);
+		}
+	}
+
+	void shareFrame(int frame) // noexcept
+	{
+		Node* node = cache[frame];
+		if (node->offset && !node->prefixValid)
+			node->makePrefixes();
+		frameOffset[frame].store(node->offset, std::memory_order_relaxed);
+	}
+
+
+	// set the current key and datafile offset for retrieval by getCurKey
+	void setCurKey(Path& p, Node* node, int i)
+	{
+		p.curNode = node->offset;
+		p.curI = i;
+	}
+
+	void clearCurKey(Path& p)
+	{
+		p.curNode = 0;
+		//p.curI = 0;
+	}
+
+	void setCurKey(Node* node, int i)  { setCurKey(path, node, i); }
+	void clearCurKey()                 { clearCurKey(path); }
+
+	bool getCurKey(Path& p, void* &key, datFilePosT& offset) // throw(...)
+	{
+		if (f == 0 || p.curNode == 0) return false;
+		Node* node = getNode(p, p.curNode);
+		KeyEntry* ke = node->keyI(p.curI);
+		key = (void*)&ke->key;
+		offset = ke->offset;
+		return true;
+	}
+
+	bool find(Path& p, const void* key) // throw(...)
+	{
+		if (!f) return false;
+		reading();
+		p.stacktop = 0;
+		if (!dups) {
+			bool ret = _find(p, key, root);    // Inner routine
+			if (!ret) _findNext(p);
+			return ret;
+		} else {
+			_find(p, key, std::numeric_limits<datFilePosT>::min(), root);  // lowest possible data offset
+			_findNext(p);
+			void* k = NULL;
+			datFilePosT ofs;
+			return getCurKey(p, k, ofs) && IKey::compare(key, k) == 0;
+		}
+	}
+
+	bool find(Path& p, const void* key, const datFilePosT& offset) // throw(...)
+	{
+		if (!f) return false;
+		reading();
+		p.stacktop = 0;
+		bool ret;
+		if (dups)
+			ret = _find(p, key, offset, root);    // Inner routine
+		else {
+			ret = _find(p, key, root);
+			void* k = NULL;
+			datFilePosT ofs;
+			getCurKey(p, k, ofs);
+			if (ret && offset != ofs)
+				ret = false; 
+		}
+		if (!ret) _findNext(p);
+		return ret;
+	}
+
+	bool seek(Path& p, int i) // throw(...) // can throw io_error or logic_error (nodes not counted)
+	{
+		needCounts("seek()");
+		if (!f) return false;
+		reading();
+		p.stacktop = 0;
+		clearCurKey(p);
+		if (i < 0 || i >= n)
+			return false;
+		uint32 rest = (uint32)i;   // keys still to pass
+		Node*  node = getNode(p, root);
+		while (1) {
+			int j;
+			for (j = 0; j < node->count && rest >= node->sizes[j]; j++) {
+				rest -= node->sizes[j];    // past son j
+				if (!rest) {
+					push(p, node, j);
+					setCurKey(p, node, j);
+					return true;
+				}
+				rest--;                    // and key j
+			}
+			ndxFilePosT son = node->keyI(j)->lson;
+			if (!son || rest >= node->sizes[j]) {
+				char message[1024];
+				sprintf(message, "Index file node at %x in %s has wrong subtree counts", (unsigned)node->offset, FileSystemT::getName(f));
+				throw io_error(message);
+			}
+			push(p, node, j);
+			node = getNode(p, son);
+		}
+	}
+
+	/// seek(), rank() and countRange() need the subtree counts of NodeCounted
+	void needCounts(const char* what) // throw(...) // can throw logic_error
+	{
+		if (!cCounted) {
+			char message[1024];
+			sprintf(message, "%s needs counted nodes (NodeCounted): %s", what, f ? FileSystemT::getName(f) : "(closed)");
+			throw logic_error(message);
+		}
+	}
+
+	bool first(Path& p) // throw(...)
+	{
+		if (!f) return false;
+		reading();
+		p.stacktop = 0;
+		Node* node = getNode(p, root);
+		if (!node->count) return false;
+		/* Find lowermost leftmost key in the index, setting the stack */
+		KeyEntry* k;
+		while (1) {
+			push(p, node, 0);
+			k = &node->key0;
+			if (!k->lson) 
+				break;
+			node = getNode(p, k->lson);
+		}
+		setCurKey(p, node, 0);
+		return true;
+	}
+
+	bool last(Path& p) // throw(...)
+	{
+		if (!f) return false;
+		reading();
+		p.stacktop = 0;
+		Node* node = getNode(p, root);
+		if (!node->count) return false;
+		// Find lowermost rightmost key in the index, setting the stack
+		KeyEntry* k;
+		int i;
+		while (1) {
+			k = node->keyI(i = node->count);
+			if (!k->lson)
+				break;
+			push(p, node, i);
+			node = getNode(p, k->lson);
+		};
+		k = node->keyI(--i);
+		push(p, node, i);
+		setCurKey(p, node, i);
+		return true;
+	}
+
+	bool next(Path& p) // throw(...)
+	{
+		if (!f || !p.stacktop) return false;
+
+		KeyEntry* k;
+		int       i;
+		/* The state at return is that left by find(): The top of the stack is the
+		 * node in which a key was last found and the offset is that of the key.  */
+		Node* node = pop(p, k, i);
+		if (++i > node->count) {
+			assert(0);   // should never happen
+			clearCurKey(p);
+			return false;
+		}
+		k = node->keyI(i);
+		while (k->lson) {            // While left son, descend to lowest one
+			push(p, node, i);
+			node = getNode(p, k->lson);
+			k = &node->key0;
+			i = 0;
+		}
+		// While at end of current node, back up a level
+		while (i == node->count)
+			if (p.stacktop)
+				node = pop(p, k, i);
+			else {
+				clearCurKey(p);
+				return false;
+			}
+
+		push(p, node, i);
+		setCurKey(p, node, i);
+		return true;
+	}
+
+	bool prev(Path& p) // throw(...)
+	{
+		if (!f || !p.stacktop) return false;
+
+		KeyEntry* k;
+		int       i;
+		Node* node = pop(p, k, i);
+		while (k->lson) {
+			push(p, node, i);
+			node = getNode(p, k->lson);
+			i = node->count;
+			k = node->keyI(i);
+		}
+		while (i == 0)
+			if (p.stacktop)
+				node = pop(p, k, i);
+			else  {
+				clearCurKey(p);
+				return false;
+			}
+		i--;
+		k = node->keyI(i);
+		push(p, node, i);
+		setCurKey(p, node, i);
+		return true;
+	}
+
+	template <class Visitor>
+	int scan(Path& p, const void* lo, const void* hi, Visitor& visit) // throw(...)
+	{
+		if (!(lo ? (find(p, lo), p.curNode != 0) : first(p)))
+			return 0;
+		int visited = 0;
+		do {
+			Node* node = getNode(p, p.curNode);
+			int   i = p.curI;
+			// the keys up to the next son, the rest of a leaf (an inner node can have sons of 0
+			//    where leaves were emptied): compare with hi only if the last is not below hi
+			int end = i + 1;
+			while (end < node->count && !node->keyI(end)->lson)
+				end++;
+			bool last = hi && IKey::compare(node->keyI(end - 1)->key, hi) >= 0;
+			for (; i < end; i++) {
+				KeyEntry* k = node->keyI(i);
+				if (last && IKey::compare(k->key, hi) >= 0)
+					break;
+				visited++;
+				if (!visit((const void*)k->key, k->offset))
+					break;
+			}
+			if (i < end) {                      // stopped in the leaf
+				p.stack[p.stacktop - 1].i = i;
+				setCurKey(p, node, i);
+				return visited;
+			}
+			p.stack[p.stacktop - 1].i = end - 1;   // next() goes on from the last key
+			setCurKey(p, node, end - 1);
+		} while (next(p));
+		return visited;
+	}
+
+	/// reset the cache.  used by open() and create()
+	void resetCache()
+	{
+		spare = 0;
+		for (int i = nMaxCache; i-- > 0; ) {
+			Node* node = cache[i];
+			node->dirty = false;
+			node->offset = 0;
+			node->recent = false;
+			node->nextSpare = spare;
+			spare = node;
+		}
+		for (int h = 0; h <= cacheMask; h++) {
+			cacheHash[h].offset.store(0, std::memory_order_relaxed);
+			cacheHash[h].frame.store(0, std::memory_order_relaxed);
+		}
+		policy.reset();
+		stats.clear();
+		changes++;        // the nodes cursors point to are gone
+		nRecent = 0;
+		cacheUsed = 0;
+	}
+
+	/// Home bucket of a node offset
+	int cacheBucket(const ndxFilePosT& offset) const // noexcept
+		{ return (int)((uint32)(offset / nNodeSize) * 2654435761u) & cacheMask; }
+
+	/// Find a node in the cache (0 if not there)
+	Node* cacheFind(const ndxFilePosT& offset) const // noexcept
+	{
+		for (int h = cacheBucket(offset); ; h = (h + 1) & cacheMask) {
+			ndxFilePosT at = cacheHash[h].offset.load(std::memory_order_relaxed);
+			if (!at)
+				return 0;
+			if (at == offset)
+				return cache[cacheHash[h].frame.load(std::memory_order_relaxed)];
+		}
+	}
+
+	/// Enter a node in the cache hash table under its offset
+	void cacheAdd(Node* node) // noexcept
+	{
+		int h = cacheBucket(node->offset);
+		while (cacheHash[h].offset.load(std::memory_order_relaxed))
+			h = (h + 1) & cacheMask;
+		cacheHash[h].frame.store(node->frame, std::memory_order_relaxed);
+		cacheHash[h].offset.store(node->offset, std::memory_order_relaxed);
+	}
+
+	/// Remove a node from the cache hash table
+	void cacheDrop(Node* node) // noexcept
+	{
+		int h = cacheBucket(node->offset);
+		while (cacheHash[h].offset.load(std::memory_order_relaxed) != node->offset)
+			h = (h + 1) & cacheMask;
+		// close the gap so that the probe chains of the following entries stay intact
+		for (int j = (h + 1) & cacheMask; ; j = (j + 1) & cacheMask) {
+			ndxFilePosT at = cacheHash[j].offset.load(std::memory_order_relaxed);
+			if (!at)
+				break;
+			int home = cacheBucket(at);
+			if (h <= j ? (home <= h || home > j) : (home <= h && home > j)) {
+				cacheHash[h].frame.store(cacheHash[j].frame.load(std::memory_order_relaxed), std::memory_order_relaxed);
+				cacheHash[h].offset.store(at, std::memory_order_relaxed);
+				h = j;
+			}
+		}
+		cacheHash[h].offset.store(0, std::memory_order_relaxed);
+	}
+
+	/// Note a node as just used.  Callers hold pointers to the last few nodes they got
+	//    (a node, its parent, a sibling...), so the policy must not evict those.
+	void touch(Node* node) // noexcept
+	{
+		if (writers)                     // a TreeWrite: share the node again when it is done
+			gate->touched.push_back(node->frame);
+		if (!maxRecent || (nRecent && recent[0] == node))
+			return;
+
+		int i;
+		if (node->recent)
+			for (i = 1; recent[i] != node; i++)
+				;
+		else {
+			if (nRecent < maxRecent)
+				i = nRecent++;
+			else
+				recent[i = nRecent - 1]->recent = false;
+			node->recent = true;
+		}
+		for (; i; i--)
+			recent[i] = recent[i-1];
+		recent[0] = node;
+	}
+
+	/// Forget a freed node in the list of recently used nodes
+	void untouch(Node* node) // noexcept
+	{
+		int i;
+		for (i = 0; recent[i] != node; i++)
+			;
+		for (nRecent--; i < nRecent; i++)
+			recent[i] = recent[i+1];
+		node->recent = false;
+	}
+
+	/// Get an unused cache frame, writing out and evicting a node if all are in use
+	Node* takeFrame() // throw(...) // can throw io_error
+	{
+		Node* node;
+		if (spare) {                     // if not using all the cache frames,
+			node = spare;                //    use another frame
+			spare = node->nextSpare;
+			cacheUsed++;
+		} else {
+			FrameBusy busy = { cache, 0, -1 };
+			node = cache[policy.victim(busy)];
+			stats.evictions++;
+			if (node->dirty) {
+				if (writeBackMax > 1 && !concurrent && !wal && !flusher)
+					writeBackNear(node);
+				else {
+					writeNode(cow ? shadow(node->offset) : node->offset, node);
+					node->dirty = false;
+					stats.writeBacks++;
+					stats.writes++;
+				}
+			}
+			if (flusher && !concurrent)
+				cleanAhead();
+			cacheDrop(node);
+		}
+		node->offset = 0;
+		return node;
+	}
+
+	/// Give back a frame from takeFrame() that could not be filled (reading the node failed)
+	void returnFrame(Node* node) // noexcept
+	{
+		node->offset = 0;
+		node->nextSpare = spare;
+		spare = node;
+		cacheUsed--;
+	}
+
+	/// Write a changed node that is being evicted together with the changed nodes next to it
+	//    in the file (up to writeBackMax in all), with one write.  They stay cached but clean,
+	//    so that evicting them later costs no write.  The nodes in use (see touch()) are left
+	//    alone.
+	void writeBackNear(Node* victim) // throw(...) // can throw io_error
+	{
+		std::vector<Node*> run(1, victim);
+		Node* node;
+		for (ndxFilePosT at = victim->offset; (int)run.size() < writeBackMax && at > nNodeSize &&
+		     (node = cacheFind(at -= nNodeSize)) && node->dirty && !node->recent; )
+			run.push_back(node);
+		for (ndxFilePosT at = victim->offset; (int)run.size() < writeBackMax &&
+		     (node = cacheFind(at += nNodeSize)) && node->dirty && !node->recent; )
+			run.push_back(node);
+		writeBack(&run[0], (int)run.size());
+		stats.writeBacks += run.size();
+	}
+
+	/// With a flusher: hand the changed nodes of the next two frames (around the cache) to it,
+	//    so that they are clean when they are evicted.  Not the nodes in use, nor while half
+	//    of what the flusher holds before inserts wait is queued.
+	void cleanAhead() // throw(...) // can throw io_error
+	{
+		if (flusher->queued() * 2 > flusher->limit())
+			return;
+		for (int i = 0; i < 2; i++) {
+			Node* node = cache[cleanHand];
+			if (++cleanHand == nMaxCache)
+				cleanHand = 0;
+			if (node->dirty && !node->recent) {
+				writeNode(node->offset, node);
+				node->dirty = false;
+				stats.writeBacks++;
+				stats.writes++;
+			}
+		}
+	}
+
+	/// Write all the changed nodes in the cache
+	void writeDirty() // throw(...) // can throw io_error
+	{
+		std::vector<Node*> dirty;
+		for (int i = 0; i < nMaxCache; i++)
+			if (cache[i]->dirty)
+				dirty.push_back(cache[i]);
+		if (!dirty.empty())
+			writeBack(&dirty[0], (int)dirty.size());
+	}
+
+	/// Write changed nodes in file order, each run of adjacent ones with one
+	//    FileSystemT::writeGather() (one by one into the log or the flusher, if there is one)
+	void writeBack(Node** nodes, int count) // throw(...) // can throw io_error
+	{
+		std::vector<std::pair<ndxFilePosT, Node*> > order(count);
+		for (int i = 0; i < count; i++)
+			order[i] = std::make_pair(cow ? shadow(nodes[i]->offset) : nodes[i]->offset, nodes[i]);
+		std::sort(order.begin(), order.end());
+		std::vector<const void*> buffers(count);
+		std::vector<byte>        packed(cFrontCoded ? count * nNodeSize : 0);
+		for (int i = 0; i < count; i++) {
+			if (cCounted)
+				order[i].second->storeSizes();
+			buffers[i] = cFrontCoded ? memcpy(&packed[i * nNodeSize], pack(order[i].second), nNodeSize)
+			                         : (void*)order[i].second;
+		}
+		for (int a = 0, b; a < count; a = b) {
+			for (b = a + 1; b < count && order[b].first == order[b - 1].first + nNodeSize; b++)
+				;
+			if (wal || flusher) {
+				for (int i = a; i < b; i++)
+					write(order[i].first, (void*)buffers[i], nNodeSize);
+				stats.writes += b - a;
+			} else {
+				FileSystemT::writeGather(f, order[a].first, &buffers[a], b - a, nNodeSize);
+				stats.writes++;
+			}
+		}
+		for (int i = 0; i < count; i++)
+			nodes[i]->dirty = false;
+	}
+
+	/// Where a changed node is written in copy-on-write mode: in place if it was added since
+	//    the last publish(), else to a new place, which it keeps until then
+	ndxFilePosT shadow(const ndxFilePosT& offset) // throw(...)
+	{
+		if (cow->fresh.count(offset))
+			return offset;
+		ndxFilePosT& to = cow->moved[offset];
+		if (!to)
+			to = allocNode();
+		return to;
+	}
+
+	/// Where to read a node from in copy-on-write mode
+	ndxFilePosT location(const ndxFilePosT& offset) const // noexcept
+	{
+		typename Moved::const_iterator m = cow->moved.find(offset);
+		return m == cow->moved.end() ? offset : m->second;
+	}
+
+	/// A free node in copy-on-write mode
+	ndxFilePosT allocNode() // throw(...)
+	{
+		if (cow->reusable.empty())
+			reclaim();
+		if (cow->reusable.empty()) {
+			ndxFilePosT offset = eof;
+			eof += nNodeSize;
+			return offset;
+		}
+		ndxFilePosT offset = cow->reusable.back();
+		cow->reusable.pop_back();
+		return offset;
+	}
+
+	/// Free a node in copy-on-write mode.  One of the last version is free after the next
+	//    publish(), once the snapshots that see it are closed.
+	void dropNode(const ndxFilePosT& offset) // throw(...)
+	{
+		if (cow->fresh.erase(offset)) {
+			cow->reusable.push_back(offset);
+			return;
+		}
+		cow->freed.push_back(offset);
+		typename Moved::iterator m = cow->moved.find(offset);
+		if (m != cow->moved.end()) {
+			cow->reusable.push_back(m->second);
+			cow->moved.erase(m);
+		}
+	}
+
+	/// Reuse the nodes no open snapshot sees
+	void reclaim() // throw(...)
+	{
+		uint32 oldest;
+		{
+			std::lock_guard<std::mutex> lock(cow->lock);
+			oldest = cow->readers.empty() ? cow->version : cow->readers.begin()->first;
+		}
+		while (!cow->retired.empty() && cow->retired.front().first <= oldest) {
+			cow->reusable.push_back(cow->retired.front().second);
+			cow->retired.pop_front();
+		}
+	}
+
+	/// Give the changed nodes of the last version their new places, changing the nodes that
+	//    point to them (up to the root) as well.  A node's parent is found by looking for its
+	//    first key from the root.
+	void relocate() // throw(...)
+	{
+		std::vector<ndxFilePosT> todo;
+		for (int i = 0; i < nMaxCache; i++)
+			if (cache[i]->dirty && !cow->fresh.count(cache[i]->offset) && !cow->moved.count(cache[i]->offset))
+				todo.push_back(cache[i]->offset);
+		for (typename Moved::iterator m = cow->moved.begin(); m != cow->moved.end(); ++m)
+			todo.push_back(m->first);
+		std::set<ndxFilePosT> queued(todo.begin(), todo.end());
+		std::vector<byte> key(nMaxKeySize + 1);
+		while (!todo.empty()) {
+			ndxFilePosT offset = todo.back();
+			todo.pop_back();
+			StackFrame parent = { 0, 0 };
+			if (offset != root) {
+				Node* node = getNode(offset);
+				KeyEntry* k = &node->key0;
+				IKey::copy(&key[0], k->key);
+				datFilePosT ofs = k->offset;
+				Path p;
+				try {
+					if (dups)
+						_find(p, &key[0], ofs, root);
+					else
+						_find(p, &key[0], root);
+				} catch (...) {
+					release(p);
+					throw;
+				}
+				release(p);
+				parent = p.stack[p.stacktop - 2];
+			}
+			ndxFilePosT to;
+			typename Moved::iterator m = cow->moved.find(offset);
+			if (m != cow->moved.end()) {
+				to = m->second;
+				cow->moved.erase(m);
+			} else
+				to = allocNode();
+			cow->fresh.insert(to);
+			cow->freed.push_back(offset);
+			Node* node = cacheFind(offset);
+			if (node) {
+				cacheDrop(node);
+				node->offset = to;
+				cacheAdd(node);
+				policy.erase(node->frame);
+				policy.fill(node->frame, to);
+			}
+			if (!parent.offset)
+				root = to;
+			else {
+				Node* up = getNode(parent.offset);
+				up->keyI(parent.i)->lson = to;
+				up->changed();
+				if (!cow->fresh.count(parent.offset) && queued.insert(parent.offset).second)
+					todo.push_back(parent.offset);
+			}
+		}
+	}
+
+	/// Publish, and put the free nodes back into the free list in the file.  The nodes open
+	//    snapshots still see are lost.
+	void stopCopyOnWrite() // throw(...)
+	{
+		publish();
+		freeNodes->nodes.insert(cow->reusable.begin(), cow->reusable.end());
+		freeChanged = true;
+		saveFree();
+		stampKeys();
+		const int cHeaderSize = FIELDOFFSET(IndexT, path) - FIELDOFFSET(IndexT, major);
+		write(0, &major, cHeaderSize);
+		delete cow;
+		cow = 0;
+	}
+
+	/// Close a snapshot
+	void closeSnapshot() // noexcept
+	{
+		{
+			std::lock_guard<std::mutex> lock(snapshotOf->cow->lock);
+			std::map<uint32, int>& readers = snapshotOf->cow->readers;
+			if (!--readers[snapshotVersion])
+				readers.erase(snapshotVersion);
+		}
+		snapshotOf = 0;
+		FileSystemT::close(f);
+		f = 0;
+		n = 0;
+		changes++;
+		clearCurKey();
+	}
+
+    /// Read header or node
+	//    A failed read closes the file (see FileSystemT::Throw()), so f is cleared: in concurrent
+	//    read mode this is under cacheLock, and the other readers find it cleared there.
+	void read(const ndxFilePosT& offset, void* buffer, uint16 size) // throw(...)  // can throw io_error
+	{
+		try {
+			if (wal)
+				wal->read(walFile, offset, buffer, size);
+			else if (flusher)
+				flusher->read(offset, buffer, size);
+			else
+				FileSystemT::readAt(f, offset, buffer, size);
+		} catch (io_error&) {
+			f = 0;
+			throw;
+		}
+	}
+
+	/// Read a batch of nodes as on disk, like read()
+	void readMany(ReadAt* reads, int n) // throw(...)  // can throw io_error
+	{
+		try {
+			if (wal)
+				for (int i = 0; i < n; i++)
+					wal->read(walFile, reads[i].pos, reads[i].buffer, reads[i].size);
+			else if (flusher)
+				flusher->readMany(reads, n);
+			else
+				FileSystemT::readMany(f, reads, n);
+		} catch (io_error&) {
+			f = 0;
+			throw;
+		}
+	}
+
+	/// Write header or node (f is cleared like read() does, unless the log's file failed)
+    void write(const ndxFilePosT& offset, void* buffer, uint16 size) // throw(...)  // can throw io_error
+	{
+		if (wal)
+			wal->write(walFile, offset, buffer, size);
+		else
+			try {
+				if (flusher)
+					flusher->write(offset, buffer, size);
+				else
+					FileSystemT::writeAt(f, offset, buffer, size);
+			} catch (io_error&) {
+				f = 0;
+				throw;
+			}
+	}
+
+     /// Get a specific node
+	Node* getNode(const ndxFilePosT& offset) // throw(...) // can throw io_error(), called by almost everything
+	{
+		Node* node = cacheFind(offset);
+		if (node) {                      // It may be in the cache
+			stats.hits++;
+			if (!nRecent || recent[0] != node)  // not just the same node again (next(), getCurKey()...)
+				policy.hit(node->frame);
+		} else {
+			stats.misses++;
+			node = takeFrame();
+			try {
+				readNode(cow ? location(offset) : offset, node);
+			} catch (...) {
+				returnFrame(node);
+				throw;
+			}
+			node->offset = offset;
+			cacheAdd(node);
+			policy.fill(node->frame, offset);
+		}
+		touch(node);
+		return node;
+	}
+
+	/// Get a node for a path.  In concurrent read mode the node is pinned in the cache,
+	//    and so is the one the path got before it (whose keys callers still use).
+	Node* getNode(Path& p, const ndxFilePosT& offset) // throw(...) // can throw io_error
+	{
+		if (!concurrent) {
+			if (p.pinned[0])
+				release(p);
+			return getNode(offset);
+		}
+		Node* node = p.pinned[0];
+		if (node && node->offset == offset)  // the same node again (next(), getCurKey()...)
+			return node;
+		node = findPinned(p, offset);
+		if (!node)
+			node = readPinned(p, offset);
+		if (p.pinned[1])
+			unpin(p.pinned[1]);
+		p.pinned[1] = p.pinned[0];
+		p.pinned[0] = node;
+		return node;
+	}
+
+	/// Let go of the nodes a path holds in the cache
+	void release(Path& p) // noexcept
+	{
+		for (int i = 0; i < 2; i++)
+			if (p.pinned[i]) {
+				unpin(p.pinned[i]);
+				p.pinned[i] = 0;
+			}
+		if (p.hits) {
+			std::lock_guard<std::mutex> lock(*cacheLock);
+			stats.hits += p.hits;
+			p.hits = 0;
+		}
+	}
+
+	/// Pin a frame, unless a reader is filling it
+	bool pin(int frame) // noexcept
+	{
+		int count = pins[frame].load(std::memory_order_relaxed);
+		do
+			if (count < 0)
+				return false;
+		while (!pins[frame].compare_exchange_weak(count, count + 1, std::memory_order_acquire));
+		return true;
+	}
+
+	void unpin(Node* node) // noexcept
+		{ pins[node->frame].fetch_sub(1, std::memory_order_release); }
+
+	/// Claim a frame no path has pinned, to fill it
+	bool claim(int frame) // noexcept
+	{
+		int count = 0;
+		return pins[frame].compare_exchange_strong(count, -1, std::memory_order_acquire);
+	}
+
+	/// Find and pin a node in the cache without the lock (0 if not found).  The hash
+	//    table may be changing, so a bucket's offset and frame may not belong together:
+	//    the frame found is checked once it is pinned, when it can no longer be refilled.
+	Node* findPinned(Path& p, const ndxFilePosT& offset) // noexcept
+	{
+		int h = cacheBucket(offset);
+		for (int probes = 0; probes <= cacheMask; probes++, h = (h + 1) & cacheMask) {
+			ndxFilePosT at = cacheHash[h].offset.load(std::memory_order_relaxed);
+			if (!at)
+				return 0;
+			if (at != offset)
+				continue;
+			int frame = cacheHash[h].frame.load(std::memory_order_relaxed);
+			if (frame < 0 || frame >= nMaxCache || !pin(frame))
+				return 0;
+			if (frameOffset[frame].load(std::memory_order_acquire) != offset) {
+				pins[frame].fetch_sub(1, std::memory_order_release);
+				return 0;
+			}
+			p.hits++;
+			if (!used[frame].load(std::memory_order_relaxed))  // hot nodes are only read
+				used[frame].store(true, std::memory_order_relaxed);
+			return cache[frame];
+		}
+		return 0;
+	}
+
+	/// Read a node into the cache for a reader, under the lock, and pin it
+	Node* readPinned(Path& p, const ndxFilePosT& offset) // throw(...) // can throw io_error
+	{
+		std::unique_lock<std::mutex> lock(*cacheLock);
+		stats.hits += p.hits;
+		p.hits = 0;
+		Node* node = 0;
+		while (f && !(node = cacheFind(offset)) && !(node = claimFrame())) {
+			lock.unlock();                   // every frame is pinned, wait for a reader to move on
+			std::this_thread::yield();
+			lock.lock();
+		}
+		if (!f)                              // another reader's failed read or write closed the file
+			throw io_error("Index file closed by an earlier read or write failure");
+		if (node->offset == offset) {        // another reader has just read it
+			stats.hits++;
+			pins[node->frame].fetch_add(1, std::memory_order_acquire);
+			policy.hit(node->frame);
+			return node;
+		}
+		stats.misses++;
+		try {
+			readNode(offset, node);
+		} catch (...) {
+			returnFrame(node);
+			pins[node->frame].store(0, std::memory_order_release);
+			throw;
+		}
+		node->offset = offset;
+		node->makePrefixes();
+		cacheAdd(node);
+		policy.fill(node->frame, offset);
+		frameOffset[node->frame].store(offset, std::memory_order_relaxed);
+
+		pins[node->frame].store(1, std::memory_order_release);   // publishes the node
+		return node;
+	}
+
+	/// Take a frame for a reader (under the lock): an unused one, or the one the policy picks
+	//    among those no path has pinned.  0 if every frame is pinned.
+	Node* claimFrame() // throw(...) // can throw io_error (writing back a node)
+	{
+		noteHits();
+		Node* node = spare;
+		if (node && claim(node->frame)) {
+			spare = node->nextSpare;
+			cacheUsed++;
+			return node;
+		}
+		// claim a frame first, so the policy has one to pick even if readers pin the rest meanwhile
+		FrameBusy busy = { cache, pins, -1 };
+		for (int i = 0; i < nMaxCache && busy.reserved < 0; i++)
+			if (cache[i]->offset && !cache[i]->recent && claim(i))
+				busy.reserved = i;
+		if (busy.reserved < 0)
+			return 0;
+		int frame = policy.victim(busy);
+		if (frame != busy.reserved) {
+			if (claim(frame))
+				pins[busy.reserved].store(0, std::memory_order_release);
+			else {                            // pinned since the policy looked
+				policy.fill(frame, cache[frame]->offset);
+				policy.erase(frame = busy.reserved);
+			}
+		}
+		node = cache[frame];
+		stats.evictions++;
+		if (node->dirty) {                    // changed by a writer, which has let go of it
+			try {
+				writeNode(node->offset, node);
+			} catch (...) {
+				policy.fill(frame, node->offset);
+				pins[frame].store(0, std::memory_order_release);
+				throw;
+			}
+			node->dirty = false;
+			stats.writeBacks++;
+			stats.writes++;
+		}
+		cacheDrop(node);
+
+		frameOffset[frame].store(0, std::memory_order_relaxed);
+		node->offset = 0;
+		return node;
+	}
+
+	/// Tell the policy about the hits readers had without the lock (under the lock)
+	void noteHits() // noexcept
+	{
+		for (int i = 0; i < nMaxCache; i++)
+			if (used[i].load(std::memory_order_relaxed)) {
+				used[i].store(false, std::memory_order_relaxed);
+				if (cache[i]->offset)
+					policy.hit(i);
+			}
+	}
+
+    // Get an empty node (maybe a free one, the nearest to near)
+
+	Node* newNode(const ndxFilePosT& near = 0) // throw(...) // can throw io_error(), called by insert(), create()
+	{
+		Node* node = takeFrame(); // New slot in the cache
+		if (cow)                      // never over a node a snapshot sees
+			cow->fresh.insert(node->offset = allocNode());
+		else if (takeFree(near, node->offset))
+			;                         // an old node
+		else {                        // extend the file
+			write(node->offset = eof, node, nNodeSize);
+			eof += nNodeSize;
+		}
+		cacheAdd(node);
+		policy.fill(node->frame, node->offset);
+		touch(node);
+		node->count = 0;
+		node->lson = 0;
+		node->clearSizes();
+		node->changed();
+		return node;
+	}
+
+	/// Get an empty node for a writer in concurrent write mode, pinned, like newNode()
+	Node* newShared(const ndxFilePosT& near) // throw(...) // can throw io_error
+	{
+		std::unique_lock<std::mutex> lock(*cacheLock);
+		Node* node = 0;
+		while (f && !(node = claimFrame())) {
+			lock.unlock();                   // every frame is pinned, wait for a writer to move on
+			std::this_thread::yield();
+			lock.lock();
+		}
+		if (!f)                              // another writer's failed read or write closed the file
+			throw io_error("Index file closed by an earlier read or write failure");
+		try {
+			if (!takeFree(near, node->offset)) {
+				write(node->offset = eof, node, nNodeSize);
+				eof += nNodeSize;
+			}
+		} catch (...) {
+			returnFrame(node);
+			pins[node->frame].store(0, std::memory_order_release);
+			throw;
+		}
+		node->count = 0;
+		node->lson = 0;
+		node->clearSizes();
+		node->changed();
+		cacheAdd(node);
+		policy.fill(node->frame, node->offset);
+		frameOffset[node->frame].store(node->offset, std::memory_order_relaxed);
+
+		pins[node->frame].store(1, std::memory_order_release);
+		return node;
+	}
+
+	/// Free a node a writer in concurrent write mode has taken out of the tree, like
+	//    freeNode().  Other writers may still have it pinned, but none can reach it.
+	void freeShared(Node* node) // throw(...) // can throw io_error
+	{
+		std::lock_guard<std::mutex> lock(*cacheLock);
+		freeNode(node);
+		frameOffset[node->frame].store(0, std::memory_order_relaxed);
+	}
+
+	// add a node to the free nodes (written to the free list by saveFree())
+	void freeNode(Node* node) // throw(...) // can throw io_error
+	{
+		if (cow)
+			dropNode(node->offset);
+		else {
+			loadFree();
+			freeNodes->nodes.insert(node->offset);
+			freeChanged = true;
+		}
+		node->dirty = false;
+		cacheDrop(node);
+		policy.erase(node->frame);
+		if (node->recent)
+			untouch(node);
+		node->offset = 0;
+		node->nextSpare = spare; // the frame is reused first
+		spare = node;
+		cacheUsed--;
+	}
+
+	/// The version of the keys in the header
+	uint32 getKeysVersion() const // noexcept
+		{ return keysVersion[0] | keysVersion[1] << 8 | keysVersion[2] << 16; }
+
+	void setKeysVersion(uint32 version) // noexcept
+	{
+		keysVersion[0] = (byte)version;
+		keysVersion[1] = (byte)(version >> 8);
+		keysVersion[2] = (byte)(version >> 16);
+	}
+
+	/// Before the header is written: a new version of the keys if they changed since the
+	//    last one, so that a filter file written for the keys before does not fit them
+	void stampKeys() // noexcept
+	{
+		if (changes == versionChanges) return;
+		setKeysVersion(getKeysVersion() + 1);
+		versionChanges = changes;
+		filterDirty = true;
+	}
+
+	/// What the filter file is written for: the index as the header describes it
+	BloomFilter::Stamp filterStamp() const // noexcept
+	{
+		BloomFilter::Stamp stamp = { getKeysVersion(), (uint32)n, (uint64)root, (uint64)eof };
+		return stamp;
+	}
+
+	/// The index's name and ".filter"
+	static void defaultFilterName(const char* name, std::vector<char>& fname) // throw(...) // can throw bad_alloc
+	{
+		const char* suffix = ".filter";
+		fname.assign(name, name + strlen(name));
+		fname.insert(fname.end(), suffix, suffix + strlen(suffix) + 1);
+	}
+
+	/// Out of date once the keys added pass its capacity, or the keys removed a quarter of it
+	void checkFilter() // noexcept
+	{
+		if (filter->added() > filter->capacity() || filter->removed() * 4 > filter->capacity())
+			filterStale = true;
+	}
+
+	void filterAdd(const void* key, int size) // noexcept
+	{
+		if (!filter || filterStale) return;
+		filter->add(key, size);
+		filterDirty = true;
+		checkFilter();
+	}
+
+	void filterRemove() // noexcept
+	{
+		if (!filter || filterStale) return;
+		filter->noteRemoved();
+		filterDirty = true;
+		checkFilter();
+	}
+
+	/// Adds each key a scan visits to a filter
+	struct FilterAdd
+	{
+		BloomFilter& filter;
+		FilterAdd(BloomFilter& filter) : filter(filter) {}
+		bool operator()(const void* key, const datFilePosT&)
+		{
+			filter.add(key, IKey::size(key));
+			return true;
+		}
+	};
+
+	/// Build the filter from the keys, for twice as many
+	void buildFilter() // throw(...) // can throw io_error or bad_alloc
+	{
+		filter->init(2 * (int64)(n > 512 ? n : 512), filterRate);
+		FilterAdd add(*filter);
+		Cursor all(*this);
+		all.scan(0, 0, add);
+		filterStale = false;
+		filterDirty = true;
+	}
+
+	/// Write the filter file if it changed, or remove it if it is out of date
+	void saveFilter() // throw(...) // can throw io_error
+	{
+		if (!filter) return;
+		if (filterStale)
+			::remove(&filterName[0]);
+		else if (filterDirty) {
+			filter->save<FileSystemT>(&filterName[0], filterStamp());
+			filterDirty = false;
+		}
+	}
+
+	void dropFilter() // noexcept
+	{
+		delete filter;
+		filter = 0;
+	}
+
+	/// Take the free node nearest to near (the lowest one if near is 0), false if there is none
+	bool takeFree(const ndxFilePosT& near, ndxFilePosT& offset) // throw(...) // can throw io_error
+	{
+		loadFree();
+		typename Free::Set& nodes = freeNodes->nodes;
+		if (nodes.empty())
+			return false;
+		typename Free::Set::iterator it = nodes.lower_bound(near), below = it;
+		if (it == nodes.end())
+			--it;
+		else if (it != nodes.begin() && near - *--below < *it - near)
+			it = below;
+		offset = *it;
+		nodes.erase(it);
+		freeNodes->links.erase(offset); // the node is written over
+		freeChanged = true;
+		return true;
+	}
+
+	/// Read the free list of the header into freeNodes, once
+	void loadFree() // throw(...) // can throw io_error
+	{
+		if (freeLoaded) return;
+		for (ndxFilePosT at = freelist, next; at; at = next) {
+			read(at, &next, sizeof(next));
+			freeNodes->nodes.insert(at);
+			freeNodes->links[at] = next;
+		}
+		freeLoaded = true;
+		freeChanged = false;
+	}
+
+	/// Write the free nodes as a free list in file order, only the links that changed
+	void saveFree() // throw(...) // can throw io_error
+	{
+		if (!freeLoaded || !freeChanged) return;
+		typename Free::Set& nodes = freeNodes->nodes;
+		typename Free::Links links;
+		for (typename Free::Set::iterator it = nodes.begin(); it != nodes.end(); ) {
+			ndxFilePosT at = *it;
+			ndxFilePosT next = ++it == nodes.end() ? 0 : *it;
+			typename Free::Links::iterator d = freeNodes->links.find(at);
+			if (d == freeNodes->links.end() || d->second != next)
+				write(at, &next, sizeof(next));
+			links.insert(links.end(), std::make_pair(at, next));
+		}
+		freeNodes->links.swap(links);
+		freelist = nodes.empty() ? 0 : *nodes.begin();
+		freeChanged = false;
+	}
+
+	/// Forget the free nodes, for loadFree() to read them from the header's free list
+	void dropFree() // noexcept
+	{
+		freeNodes->nodes.clear();
+		freeNodes->links.clear();
+		freeLoaded = false;
+		freeChanged = false;
+	}
+
+	// put a node and key index onto the stack
+	void push(Path& p, Node* node, int i) // throw(...)
+	{
+		StackFrame* stk = &p.stack[p.stacktop++];
+		if (p.stacktop > ndxMaxStack) {
+			char message[1024];
+			sprintf(message, "Index stack overflow in file %s", FileSystemT::getName(f));
+			throw runtime_error(message);
+		}
+		stk->offset = node->offset;
+		stk->i = i;
+	}
+
+	// get top node and key offset the stack and pop it
+	Node* pop(Path& p, KeyEntry* &k, int &i) // throw(...)
+	{
+		if (!p.stacktop) {
+			char message[1024];
+			sprintf(message, "Stack underflow: no current key. File: %s", FileSystemT::getName(f));
+			throw logic_error(message);
+		}
+		StackFrame* stk = &p.stack[--p.stacktop];
+		Node* node = getNode(p, stk->offset);
+		k = node->keyI(stk->i);
+		i = stk->i;
+		return node;
+	}
+
+	// get the top node and key off the stack
+	Node* top(KeyEntry* &k, int &i) // noexcept
+	{
+		Node* node = pop(k, i);
+		path.stacktop++;
+		return node;
+	}
+
+	// the index's own path, for insert and remove
+	void  push(Node* node, int i)        { push(path, node, i); }
+	Node* pop(KeyEntry* &k, int &i)      { return pop(path, k, i); }
+
+	// Add a key to the node being filled on a level of a bulk load.
+	//    If the node is full, it is written and the key moves up to the next level.
+	void loadKey(int level, const void* key, int keySize, const datFilePosT& offset) // throw(...)
+	{
+		int size = FIELDOFFSET(KeyEntry, key) + keySize;
+		while (1) {
+			if (level == loading->levels) {    // start a new top level
+				if (level == ndxMaxStack) {
+					char message[1024];
+					sprintf(message, "Index stack overflow in file %s", FileSystemT::getName(f));
+					throw runtime_error(message);
+				}
+				loading->node[level] = new Node;
+				loading->levels++;
+			}
+			Node* node = loading->node[level];
+			Packer& packed = loading->packed[level];
+			nodeLookupType end = node->ofs(node->count);
+			unsigned nodeSize = end + size +                   // key data with the new key
+			                    sizeof(ndxFilePosT) +          // rson
+			                    (node->count + 1) * cLookup;   // keyofs's
+			if (!node->count ||
+				(cFrontCoded ? nodeSize <= nNodeBuf &&
+				               packed.size + packed.cost((const byte*)key, keySize) <= loading->limit
+				             : nodeSize <= (unsigned)loading->limit))
+			{
+				KeyEntry* k = (KeyEntry*)((byte*)node + end);
+				k->lson = loading->son[level];
+				k->offset = offset;
+				memcpy(k->key, key, keySize);
+				if (cCounted)
+					node->sizes[node->count] = loading->sonKeys[level];
+				node->count++;
+				if (!cFixed)
+					node->keyofs[-node->count] = end + size;
+				loading->son[level] = 0;
+				loading->sonKeys[level] = 0;
+				if (cFrontCoded)
+					packed.add(k->key, keySize);
+				return;
+			}
+			// full: the pending son is its rson, the key goes up with this node as its lson
+			*node->rson() = loading->son[level];
+			if (cCounted)
+				node->sizes[node->count] = loading->sonKeys[level];
+			uint32 keys = node->total();
+			loading->son[level] = 0;
+			loading->sonKeys[level] = 0;
+			packed = Packer();
+			loading->son[++level] = loadWrite(node);
+			loading->sonKeys[level] = keys;
+		}
+	}
+
+	// Write a node filled by a bulk load at the end of the file and clear it for reuse
+	ndxFilePosT loadWrite(Node* node) // throw(...)
+	{
+		ndxFilePosT offset = eof;
+		writeNode(offset, node);
+		eof += nNodeSize;
+		memset((void*)node, 0, nNodeBuf);  // the bytes stored on disk, which end before keyofs0
+		node->clearSizes();
+		return offset;
+	}
+
+	/// Read a node, decoding it if front coded (with its subtree counts, if counted)
+	void readNode(const ndxFilePosT& offset, Node* node) // throw(...)  // can throw io_error
+	{
+		node->prefixValid = false;
+		if (!cFrontCoded)
+			read(offset, node, nNodeSize);
+		else {
+			read(offset, packBuf, nNodeSize);
+			unpack(offset, node);
+		}
+		if (cCounted)
+			node->loadSizes();
+	}
+
+	/// Write a node, encoding it if front coded
+	void writeNode(const ndxFilePosT& offset, Node* node) // throw(...)  // can throw io_error
+	{
+		if (cCounted)
+			node->storeSizes();
+		write(offset, cFrontCoded ? pack(node) : (void*)node, nNodeSize);
+	}
+
+	static bool isRestart(int i)
+		{ return !i || (NodeFormat::cRestart != 0 && i % NodeFormat::cRestart == 0); }
+
+	/// Size of the Ith key of a node
+	static int keySize(Node* node, int i)
+		{ return node->ofs(i+1) - node->ofs(i) - FIELDOFFSET(KeyEntry, key); }
+
+	/// # of leading bytes two keys have in common
+	static int sharedPrefix(const byte* a, int aSize, const byte* b, int bSize)
+	{
+		int n = aSize < bSize ? aSize : bSize;
+		int i = 0;
+		while (i < n && a[i] == b[i])
+			i++;
+		return i;
+	}
+
+	/// Prefix and suffix lengths take 1 byte if < 0x80, else 2 bytes
+	static int lengthSize(int length)
+		{ return length < 0x80 ? 1 : 2; }
+
+	static byte* putLength(byte* p, int length)
+	{
+		if (length >= 0x80)
+			*p++ = (byte)(0x80 | length >> 8);
+		*p++ = (byte)length;
+		return p;
+	}
+
+	static const byte* getLength(const byte* p, int& length)
+	{
+		length = *p++;
+		if (length & 0x80)
+			length = (length & 0x7f) << 8 | *p++;
+		return p;
+	}
+
+	/// Size of a node on disk when front coded: keys 0 .. i-1, then key (unless 0),
+	//     then keys i+drop .. count-1
+	int packedSize(Node* node, int i = 0, int drop = 0, const byte* key = 0, int size = 0)
+	{
+		Packer packed;
+		packed.add(node, 0, i);
+		if (key)
+			packed.add(key, size);
+		packed.add(node, i + drop, node->count);
+		return packed.size;
+	}
+
+	/// Size on disk of a front coded node holding the keys of lhs, k and the keys of rhs
+	int packedMerge(Node* lhs, KeyEntry* k, int kSize, Node* rhs)
+	{
+		Packer packed;
+		packed.add(lhs, 0, lhs->count);
+		packed.add(k->key, kSize - FIELDOFFSET(KeyEntry, key));
+		packed.add(rhs, 0, rhs->count);
+		return packed.size;
+	}
+
+	/// The key to split a front coded node before, so the halves take about as much room on disk
+	int packedMiddle(Node* node)
+	{
+		int total = packedSize(node);
+		Packer packed;
+		int i;
+		for (i = 1; i < node->count; i++) {
+			packed.add(node, i - 1, i);
+			if (2 * packed.size >= total)
+				break;
+		}
+		return i;
+	}
+
+	/* Encode a node into packBuf.  On disk a front coded node is
+	       int32 count
+	       per key:  lson, offset, length of the prefix shared with the previous key,
+	                 length of the rest, the rest of the key
+	       rson
+	       ... unused (zeros)
+	       the positions of the restart keys (stored whole), as nodeLookupType's
+	       from the end of the node down
+	*/
+	byte* pack(Node* node) // throw(...) // can throw logic_error (node too big, a bug)
+	{
+		if (!packInto(node, true) && !packInto(node, false)) {
+			char message[1024];
+			sprintf(message, "Front coded node at %x does not fit in file %s", (unsigned)node->offset, FileSystemT::getName(f));
+			throw logic_error(message);
+		}
+		return packBuf;
+	}
+
+	/// Encode a node into packBuf with the restart keys of isRestart(), or only the first
+	//    key whole: false if it does not fit
+	bool packInto(Node* node, bool restarts) // noexcept
+	{
+		memset(packBuf, 0, nNodeSize);
+		byte* p = packBuf;
+		nodeLookupType* restart = (nodeLookupType*)(packBuf + nNodeSize);
+		memcpy(p, &node->count, sizeof(int32));
+		p += sizeof(int32);
+		const byte* prev = 0;
+		int prevSize = 0;
+		for (int i = 0; i < node->count; i++) {
+			KeyEntry* k = node->keyI(i);
+			int size = keySize(node, i);
+			int shared = 0;
+			if (restarts ? isRestart(i) : !i)
+				*--restart = (nodeLookupType)(p - packBuf);
+			else
+				shared = sharedPrefix(prev, prevSize, k->key, size);
+			if (p + FIELDOFFSET(KeyEntry, key) + lengthSize(shared) + lengthSize(size - shared) +
+				size - shared + sizeof(ndxFilePosT) > (byte*)restart)
+				return false;
+			memcpy(p, k, FIELDOFFSET(KeyEntry, key));   // lson and offset
+			p += FIELDOFFSET(KeyEntry, key);
+			p = putLength(p, shared);
+			p = putLength(p, size - shared);
+			memcpy(p, k->key + shared, size - shared);
+			p += size - shared;
+			prev = k->key;
+			prevSize = size;
+		}
+		memcpy(p, node->rson(), sizeof(ndxFilePosT));
+		return true;
+	}
+
+	/// Decode the front coded node in packBuf into node
+	void unpack(const ndxFilePosT& offset, Node* node) // throw(...) // can throw io_error (corrupted node)
+	{
+		const byte* p = packBuf;
+		const byte* end = packBuf + nNodeSize;
+		int32 count;
+		memcpy(&count, p, sizeof(int32));
+		p += sizeof(int32);
+		nodeLookupType o = FIELDOFFSET(Node, key0);
+		const byte* prev = 0;
+		int prevSize = 0;
+		int i;
+		for (i = 0; i < count; i++) {
+			KeyEntry* k = (KeyEntry*)((byte*)node + o);
+			int shared, rest;
+			if (p + FIELDOFFSET(KeyEntry, key) + 4 > end)
+				break;
+			memcpy(k, p, FIELDOFFSET(KeyEntry, key));
+			p += FIELDOFFSET(KeyEntry, key);
+			p = getLength(p, shared);
+			p = getLength(p, rest);
+			if (shared > prevSize || p + rest + sizeof(ndxFilePosT) > end ||
+				o + FIELDOFFSET(KeyEntry, key) + shared + rest + sizeof(ndxFilePosT) +
+				(i + 1) * sizeof(nodeLookupType) > nNodeBuf)
+				break;
+			if (shared)        // prev is 0 for the first key
+				memcpy(k->key, prev, shared);
+			memcpy(k->key + shared, p, rest);
+			p += rest;
+			prev = k->key;
+			prevSize = shared + rest;
+			o += (nodeLookupType)(FIELDOFFSET(KeyEntry, key) + prevSize);
+			node->keyofs[-i-1] = o;
+		}
+		if (i < count || count < 0) {
+			char message[1024];
+			sprintf(message, "Index file node at %x in %s is corrupted", (unsigned)offset, FileSystemT::getName(f));
+			throw io_error(message);
+		}
+		node->count = count;
+		memcpy((byte*)node + o, p, sizeof(ndxFilePosT));   // rson
+	}
+
+	/// Insert a key of size bytes (with its KeyEntry) into the index, which the caller has to itself
+	bool insertKey(const void* key, int size, const datFilePosT& offset) // throw(...)
+	{
+		paramSize = size;
+		paramOfs = offset;
+		paramKey = (void*)key;
+
+		int result;
+		do {
+			path.stacktop = 0;
+			result = _insert(root);
+		} while (result < 0);
+
+		if (result) {
+			n++;
+			changes++;
+			filterAdd(key, size - FIELDOFFSET(KeyEntry, key));
+		}
+		return result != 0;
+	}
+
+	/// Position of a key (and of its data offset, if duplicates are allowed) in a node,
+	//    and whether it is there
+	int locate(Node* node, const void* key, const datFilePosT& offset, bool& found)
+	{
+		int i = 0;
 		int j = node->count;
+		found = false;
+		if (cFixed && !dups) {
+			i = j = node->search(key, found);
+			if (found)
+				return i;
+		}
+		uint64 kp = j > i ? node->searchPrefix(key) : 0;
 		while (j > i) {
 			int m = (i + j) / 2;
-			k = node->keyI(m);
-			int cmp = IKey::compare(paramKey, k->key);
+			int cmp = node->compare(key, kp, m);
+			KeyEntry* k;
 			if (cmp < 0)
 				j = m;
 			else if (cmp > 0)
 				i = m + 1;
-			else if (!dups) {
-				push(node, m);
-				setCurKey(node, m);
-				return false;
-			} else if (paramOfs < k->offset)
+			else if (!dups || offset == (k = node->keyI(m))->offset) {
+				found = true;
+				return m;
+			} else if (offset < k->offset)
 				j = m;
-			else if (paramOfs > k->offset)
+			else
 				i = m + 1;
-			else {
-				push(node, m);
-				setCurKey(node, m);
-				return false;
+		}
+		return i;
+	}
+
+	/// Whether a key of size bytes (with its KeyEntry) fits into a node before key i
+	bool keyFits(Node* node, int i, const void* key, int size)
+	{
+		if (size + cLookup +                 // new KeyEntry & it's keyofs
+			node->ofs(node->count) +         // node->count & current key data
+			sizeof(ndxFilePosT) +            // rson
+			node->count * cLookup >          // current keyofs's
+			nNodeRoom)
+			return false;
+		return !cFrontCoded ||
+		       packedSize(node, i, 0, (const byte*)key, size - FIELDOFFSET(KeyEntry, key)) <= (int)nNodeSize;
+	}
+
+	/// Put a key of size bytes (with its KeyEntry) into a leaf before key i.  See keyFits().
+	void putKey(Node* node, int i, const void* key, int size, const datFilePosT& offset)
+	{
+		// make room for key in the node
+		KeyEntry* k = node->keyI(i);
+		memmove((byte*)k + size, k,
+			node->ofs(node->count) - ((byte*)k - (byte*)node) + sizeof(ndxFilePosT));
+
+		// adjust the keyofs's
+		int j = ++node->count;
+		if (!cFixed) {
+			nodeLookupType* w = node->keyofs - j;
+			while (j > i) {
+				*w = w[1] + size;
+				w++;
+				j--;
 			}
 		}
-		k = node->keyI(i);
+		memcpy(k->key, key, size - FIELDOFFSET(KeyEntry, key));
+		k->lson = 0;
+		k->offset = offset;
+		if (cCounted) {        // a 0 son before key i's (a node over a freed leaf has others too)
+			memmove(node->sizes + i + 1, node->sizes + i, (node->count - i) * sizeof(uint32));
+			node->sizes[i] = 0;
+		}
+		node->inserted(i);
+	}
+
+	/// Take key i out of a leaf
+	void dropKey(Node* node, int i)
+	{
+		KeyEntry*      k = node->keyI(i);
+		nodeLookupType moveo = node->ofs(i+1);
+		nodeLookupType klen = moveo - node->ofs(i);
+		memmove(k, (byte*)k + klen,
+				node->ofs(node->count) - moveo + sizeof(ndxFilePosT));
+		if (!cFixed) {
+			nodeLookupType* w = node->keyofs - i - 1;
+			for (int j = i + 1; j < node->count; j++, w--)
+				*w = w[-1] - klen;
+		}
+		if (cCounted)          // key i's son, 0, goes with it
+			memmove(node->sizes + i, node->sizes + i + 1, (node->count - i) * sizeof(uint32));
+		node->removing(i);
+		node->count--;
+	}
+
+	/// Counted nodes: a key was put into (delta 1) or taken out of (-1) node, below the
+	//    path, so the nodes on it count one key more or less for their son on it.  Getting
+	//    them can evict node when the cache is small, so node is got again and returned
+	Node* countKey(Node* node, int delta) // throw(...) // can throw io_error
+	{
+		if (!cCounted)
+			return node;
+		ndxFilePosT offset = node->offset;
+		for (int j = 0; j < path.stacktop; j++) {
+			Node* above = getNode(path.stack[j].offset);
+			above->sizes[path.stack[j].i] += delta;
+			above->dirty = true;
+		}
+		return getNode(offset);
+	}
+
+	/// Counted nodes: the sons j and j+1 of a node are merged into son j (with the key
+	//    between them, which the caller takes out of the node)
+	static void dropSon(Node* node, int j) // noexcept
+	{
+		node->sizes[j] += 1 + node->sizes[j + 1];
+		memmove(node->sizes + j + 1, node->sizes + j + 2, (node->count - j - 1) * sizeof(uint32));
+	}
+
+	/// Whether two sons of a node fit into one with the key pk between them
+	bool sonsFit(Node* left, KeyEntry* pk, int pkSize, Node* right) // noexcept
+	{
+		return left->ofs(left->count) + left->count * cLookup +           // left's key data & keyofs's
+		       pkSize + cLookup +                                         // pk & its keyofs
+		       right->ofs(right->count) - FIELDOFFSET(Node, key0) +       // right's key data
+		       sizeof(ndxFilePosT) + right->count * cLookup               // rson & keyofs's
+		          <= nNodeRoom &&
+		       (!cFrontCoded || packedMerge(left, pk, pkSize, right) <= (int)nNodeSize);
+	}
+
+	/// Merge son j+1 of a node into son j, with key j of the node between their keys,
+	//    and take key j out of the node (see sonsFit()).  The caller frees right.
+	void mergeSons(Node* parent, int j, Node* left, Node* right) // noexcept
+	{
+		KeyEntry*      pk = parent->keyI(j);
+		nodeLookupType pkSize = parent->ofs(j+1) - parent->ofs(j);
+		nodeLookupType leftSize = left->ofs(left->count);
+		nodeLookupType rightSize = right->ofs(right->count);
+
+		// move parent key to end of left
+		// leave rson of left alone (will be lson of new parent key)
+		memcpy((byte*)left + leftSize + sizeof(ndxFilePosT),
+			   &pk->offset, pkSize - sizeof(ndxFilePosT));
+
+		// put right keys after parent key
+		memcpy((byte*)left + leftSize + pkSize,
+			   &right->key0,
+			   rightSize - FIELDOFFSET(Node, key0) + sizeof(ndxFilePosT));
+		if (!cFixed) {
+			nodeLookupType* w = &left->keyofs[-(left->count+1)];
+			nodeLookupType  y;
+			*w-- = y = leftSize + pkSize;
+			nodeLookupType* x = &right->keyofs[-1];
+			y -= FIELDOFFSET(Node, key0);
+			for (int r = 0; r < right->count; r++)
+				*w-- = *x-- + y;
+		}
+		if (cCounted) {   // right's sons follow left's, one son of parent less
+			memcpy(left->sizes + left->count + 1, right->sizes, (right->count + 1) * sizeof(uint32));
+			dropSon(parent, j);
+		}
+		left->count += 1 + right->count;
+		left->changed();
+
+		// remove parent key from parent
+		memmove(&pk->offset, // leave ptr to left
+				(byte*)&pk->offset + pkSize,
+				parent->ofs(parent->count) - parent->ofs(j+1));
+		if (!cFixed) {
+			int jj = j+1;
+			for (nodeLookupType* w = &parent->keyofs[-jj]; jj < parent->count; jj++, w--)
+				*w = w[-1] - pkSize;
+		}
+		parent->count--;
+		parent->changed();
+	}
+
+	/// Whether a node keeps over half of its room after key i is taken out, so that
+	//    remove_current() would not try to merge it with a sibling
+	bool keepsHalf(Node* node, int i)
+	{
+		if (cFrontCoded)
+			return packedSize(node, i, 1) > (int)nNodeSize/2;
+		int klen = node->ofs(i+1) - node->ofs(i);
+		return (int)node->ofs(node->count) - klen + (int)sizeof(ndxFilePosT) +
+		       (node->count - 1) * cLookup > (int)nNodeSize/2;
+	}
+
+	// Inner insert
+	int	_insert(const ndxFilePosT& root) // throw(...)
+	{
+		Node* node = getNode(root);
+		bool found;
+		int i = locate(node, paramKey, paramOfs, found);
+		if (found) {
+			push(node, i);
+			setCurKey(node, i);
+			return false;
+		}
+		KeyEntry* k = node->keyI(i);
 		if (k->lson) {                /* Recurse */
 			push(node, i);
 			return _insert(k->lson);
 		}
 
-		if (paramSize + sizeof(nodeLookupType) + // new KeyEntry & it's keyofs
-			node->keyofs[-node->count] +    // node->count & current key data
-			sizeof(ndxFilePosT) +           // rson
-			node->count * sizeof(nodeLookupType) >  // current keyofs's 
-			nNodeSize) {
+		if (!keyFits(node, i, paramKey, paramSize)) {
 			// Node full, so split
 			node->split(this);
 			return -1;
 		}
-
-		// make room for key in the node
-		KeyEntry* m = (KeyEntry*)((byte*)k + paramSize);
-		memmove((byte*)k + paramSize, k,
-			node->keyofs[-node->count] - ((byte*)k - (byte*)node) + sizeof(ndxFilePosT));
-
-		// adjust the keyofs's
-		j = ++node->count;
-		nodeLookupType* w = node->keyofs - j;
-		while (j > i) {
-			*w = w[1] + paramSize;
-			w++;
-			j--;
-		}
-		memcpy(k->key, paramKey, paramSize - FIELDOFFSET(KeyEntry, key));
-//		KeyEntry* q = (KeyEntry*)((byte*)k + size);
-		k->lson = 0;
-		k->offset = paramOfs;
-		node->dirty = true;
+		putKey(node, i, paramKey, paramSize, paramOfs);
+		node = countKey(node, 1);
 		push(node, i);
 		setCurKey(node, i);
 		return true;
 	}
 
+	/// Insert keys[order[0..count-1]], which are in order, into the tree.  See insertMany().
+	int _insertMany(const void* const* keys, const datFilePosT* offsets, const int* order, int count,
+	                bool replace) // throw(...)
+	{
+		int         added = 0;
+		ndxFilePosT at = root;      // the node to look for the next key in, path holds the ones above it
+		path.stacktop = 0;
+		clearCurKey();
+		try {
+			for (int a = 0; a < count; ) {
+				const void* key = keys[order[a]];
+				datFilePosT offset = offsets[order[a]];
+				Node* node = getNode(at);
+				bool  found;
+				int   i = locate(node, key, offset, found);
+				if (found) {
+					KeyEntry* k = node->keyI(i);
+					if (replace && k->offset != offset) {
+						k->offset = offset;
+						node->dirty = true;
+					}
+				} else if (node->keyI(i)->lson) {
+					push(node, i);
+					at = node->keyI(i)->lson;
+					continue;
+				} else {
+					int size = IKey::size(key) + FIELDOFFSET(KeyEntry, key);
+					if (!keyFits(node, i, key, size)) {
+						node->split(this);   // split() used the path, so down from the root again
+						path.stacktop = 0;
+						at = root;
+						continue;
+					}
+					putKey(node, i, key, size, offset);
+					countKey(node, 1);
+					filterAdd(key, size - FIELDOFFSET(KeyEntry, key));
+					added++;
+				}
+				if (++a < count)
+					at = climb(at, keys[order[a]], offsets[order[a]]);
+			}
+		} catch (...) {
+			n += added;
+			changes++;
+			path.stacktop = 0;
+			throw;
+		}
+		n += added;
+		changes++;
+		path.stacktop = 0;
+		return added;
+	}
+
+	/// The lowest node on the path to the node at (which is below the path) whose subtree
+	//     holds key, for the next key of _insertMany().  Pops the nodes below it off the path.
+	ndxFilePosT climb(ndxFilePosT at, const void* key, const datFilePosT& offset) // throw(...)
+	{
+		int j = path.stacktop;
+		while (j > 0) {
+			// the subtree of the node on level j holds the keys before the key that follows
+			//     it in the lowest node above it that has one
+			int   m = j - 1;
+			Node* node;
+			while (m >= 0 && path.stack[m].i == (node = getNode(path.stack[m].offset))->count)
+				m--;
+			if (m < 0)
+				break;
+			KeyEntry* k = node->keyI(path.stack[m].i);
+			int cmp = IKey::compare(key, k->key);
+			if (cmp < 0 || (cmp == 0 && dups && offset < k->offset))
+				break;
+			j = m;
+		}
+		if (j < path.stacktop) {
+			at = path.stack[j].offset;
+			path.stacktop = j;
+		}
+		return at;
+	}
+
+	/// Adds the keys visited by scan() to the bulk load of another index, for pack()
+	struct LoadInto
+	{
+		IndexT& ndx;
+		LoadInto(IndexT& ndx) : ndx(ndx) {}
+		bool operator()(const void* key, const datFilePosT& offset)
+		{
+			ndx.load(key, offset);
+			return true;
+		}
+	};
+
+	/// Orders (prefix, index) pairs of keys by their keys (and data offsets, if given),
+	//     then by index, for findMany() and insertMany()
+	struct KeyOrder
+	{
+		const void* const* keys;
+		const datFilePosT* offsets;
+		KeyOrder(const void* const* keys, const datFilePosT* offsets = 0) : keys(keys), offsets(offsets) {}
+		bool operator()(const std::pair<uint64, int>& a, const std::pair<uint64, int>& b) const
+		{
+			if (a.first != b.first)
+				return a.first < b.first;
+			int cmp = IKey::compare(keys[a.second], keys[b.second]);
+			if (cmp)
+				return cmp < 0;
+			if (offsets && offsets[a.second] != offsets[b.second])
+				return offsets[a.second] < offsets[b.second];
+			return a.second < b.second;
+		}
+	};
+
+
+	/// Find the keys keys[order[from..to-1]], in order, in the subtree at offset
+	int _findMany(Path& p, ndxFilePosT offset, const void* const* keys, const int* order, int from, int to,
+	              datFilePosT* offsets, bool* found) // throw(...)
+	{
+		int   nFound = 0;
+		Node* node = getNode(p, offset);
+		int   i = 0;                         // where the previous key was, the keys only go up
+		for (int a = from; a < to; ) {
+			const void* key = keys[order[a]];
+			// the first key of the node >= key, found if equal (with duplicates: only in the
+			//     subtree to its left or else there, as it is the first instance)
+			int    j = node->count;
+			uint64 kp = j > i ? node->searchPrefix(key) : 0;
+			bool   hit = false;
+			while (j > i) {
+				int m = (i + j) / 2;
+				int cmp = node->compare(key, kp, m);
+				if (cmp > 0)
+					i = m + 1;
+				else if (cmp < 0 || dups)
+					j = m;
+				else {
+					i = m;
+					hit = true;
+					break;
+				}
+			}
+			if (hit) {
+				offsets[order[a]] = node->keyI(i)->offset;
+				found[order[a]] = true;
+				nFound++;
+				a++;
+				continue;
+			}
+			// the following keys that fall before the same key of the node
+			int b = a + 1;
+			if (i < node->count)
+				while (b < to && IKey::compare(keys[order[b]], node->keyI(i)->key) < (dups ? 1 : 0))
+					b++;
+			else
+				b = to;
+			ndxFilePosT son = node->keyI(i)->lson;
+			if (son) {
+				nFound += _findMany(p, son, keys, order, a, b, offsets, found);
+				node = getNode(p, offset);   // it may have left the cache meanwhile
+			}
+			if (dups && i < node->count)
+				for (int c = a; c < b; c++)
+					if (!found[order[c]] && IKey::compare(keys[order[c]], node->keyI(i)->key) == 0) {
+						offsets[order[c]] = node->keyI(i)->offset;
+						found[order[c]] = true;
+						nFound++;
+					}
+			a = b;
+		}
+		return nFound;
+	}
+
+	/// A lookup of findAsync() in a node: notes the key if it is there (with duplicates, the
+	//     leftmost instance so far) and returns the son to go on to, 0 when done
+	ndxFilePosT lookupStep(Node* node, const void* key, datFilePosT& offset, bool& found) // noexcept
+	{
+		int    i = 0, j = node->count;
+		uint64 kp = j ? node->searchPrefix(key) : 0;
+		while (i < j) {
+			int m = (i + j) / 2;
+			int cmp = node->compare(key, kp, m);
+			if (cmp > 0)
+				i = m + 1;
+			else {
+				if (!cmp) {
+					offset = node->keyI(m)->offset;
+					found = true;
+					if (!dups)
+						return 0;
+				}
+				j = m;
+			}
+		}
+		return node->keyI(i)->lson;
+	}
+
+	/// Read nodes that are not in the cache into it with one FileSystemT::readMany().  The
+	//    frames taken are out of the policy's sight, so that taking one does not evict another,
+	//    and join the cache only once all are read.  If a read fails they are given back.
+	void fetch(const ndxFilePosT* offsets, int n) // throw(...) // can throw io_error
+	{
+		std::vector<Node*>  nodes;
+		std::vector<ReadAt> reads(n);
+		std::vector<byte>   packed(cFrontCoded ? n * nNodeSize : 0);
+		nodes.reserve(n);
+		try {
+			for (int i = 0; i < n; i++) {
+				Node* node = takeFrame();
+				nodes.push_back(node);
+				node->prefixValid = false;
+				stats.misses++;
+				reads[i].pos = cow ? location(offsets[i]) : offsets[i];
+				reads[i].buffer = cFrontCoded ? (void*)&packed[i * nNodeSize] : (void*)node;
+				reads[i].size = nNodeSize;
+			}
+			readMany(&reads[0], n);
+			for (int i = 0; i < n; i++) {
+				if (cFrontCoded) {
+					memcpy(packBuf, reads[i].buffer, nNodeSize);
+					unpack(reads[i].pos, nodes[i]);
+				}
+				if (cCounted)
+					nodes[i]->loadSizes();
+			}
+		} catch (...) {
+			for (size_t i = 0; i < nodes.size(); i++)
+				returnFrame(nodes[i]);
+			throw;
+		}
+		for (int i = 0; i < n; i++) {
+			nodes[i]->offset = offsets[i];
+			cacheAdd(nodes[i]);
+			policy.fill(nodes[i]->frame, offsets[i]);
+		}
+	}
+
 	// Inner key search routine
-	bool _find(const void* key, const ndxFilePosT& root) // throw(...)
+	bool _find(Path& p, const void* key, const ndxFilePosT& root) // throw(...)
+
 	{
-		Node* node = getNode(root);
+		Node* node = getNode(p, root);
 		KeyEntry* k; // = &node->key0;
 		int i = 0;
 		int j = node->count;
+		if (cFixed) {
+			bool found;
+			i = j = node->search(key, found);
+			if (found) {
+				push(p, node, i);
+				setCurKey(p, node, i);
+				return true;
+			}
+		}
+		uint64 kp = j > i ? node->searchPrefix(key) : 0;
 		while (j > i) {
 			int m = (i + j) / 2;
-			k = node->keyI(m);
-			int cmp = IKey::compare(key, k->key);
+			int cmp = node->compare(key, kp, m);
 			if (cmp < 0)
 				j = m;
 			else if (cmp > 0)
 				i = m + 1;
 			else {
-				push(node, m);
-				setCurKey(node, m);
+				push(p, node, m);
+				setCurKey(p, node, m);
 				return true;
 			}
 		}
 		k = node->keyI(i);
 		// Ran into larger key or at end of this level
-		push(node, i);
+		push(p, node, i);
 		bool rcd = false;
 		if (k->lson)                 // More keys on right -- recurse
-			rcd = _find(key, k->lson);
+			rcd = _find(p, key, k->lson);
 		return rcd;
 	}
 
  // Inner key search routine
-	bool _find(const void* key, const datFilePosT& offset, const ndxFilePosT& root) // throw(...)
+	bool _find(Path& p, const void* key, const datFilePosT& offset, const ndxFilePosT& root) // throw(...)
 	{
-		Node* node = getNode(root);
+		Node* node = getNode(p, root);
 		KeyEntry* k = &node->key0;
 		int i = 0;
 		int j = node->count;
+		uint64 kp = node->searchPrefix(key);
 		while (j > i) {
 			int m = (i + j) / 2;
-			k = node->keyI(m);
-			int cmp = IKey::compare(key, k->key);
+			int cmp = node->compare(key, kp, m);
 			if (cmp < 0)
 				j = m;
 			else if (cmp > 0)
 				i = m + 1;
-			else if (offset < k->offset)
+			else if (offset < (k = node->keyI(m))->offset)
 				j = m;
 			else if (offset > k->offset)
 				i = m + 1;
 			else {
-				push(node, m);
-				setCurKey(node, m);
+				push(p, node, m);
+				setCurKey(p, node, m);
 				return true;
 			}
 		}
 		k = node->keyI(i);
 		// Ran into larger key or at end of this level
-		push(node, i);
+		push(p, node, i);
 		bool rcd = false;
 		if (k->lson)                  // More keys on right -- recurse
-			rcd = _find(key, offset, k->lson);
+			rcd = _find(p, key, offset, k->lson);
 		return rcd;
 	}
 
-	void _findNext(void) // throw(...)
+	void _findNext(Path& p) // throw(...)
 	{
 		KeyEntry* k;
 		int i;
-		Node* node = pop(k, i);
+		Node* node = pop(p, k, i);
 		while (i == node->count)
-			if (stacktop)
-				node = pop(k, i);
+			if (p.stacktop)
+				node = pop(p, k, i);
 			else {
-				clearCurKey();
+				clearCurKey(p);
 				return;
 			}
-		stacktop++;
-		setCurKey(node, i);
+		p.stacktop++;
+		setCurKey(p, node, i);
 	}
 
 	// debugging helper
@@ -1201,12 +4529,12 @@ protected:
 		uint16 ofs = FIELDOFFSET(Node, key0);
 		int i;
 		for (i = 0; i < node->count; i++) {
-			if (node->keyofs[-i] != ofs)
+			if (node->ofs(i) != ofs)
 				return false;
 			KeyEntry* k = (KeyEntry*)((byte*)node + ofs);
 			ofs += k->size();
 		}
-		return node->keyofs[-i] == ofs;
+		return node->ofs(i) == ofs;
 	}
 
 	void _print(FILE* outf, const ndxFilePosT& offset, int level) // throw(...)
@@ -0,0 +1,362 @@
+/*  <nub/IndexBuilder.h> -- Build an index from keys in any order with an external sort
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Keys are collected in memory up to the memory budget.  Each time the memory is full,
+    the keys are sorted and written to a temporary run file.  build() merges the runs
+    (in several passes if there are more than the budget can buffer at once) and feeds
+    the keys in order to the bulk load of the index (see IndexT::beginLoad()).
+    If every key fits in memory, no run files are used at all.
+
+    Keys are ordered by IKey::compare(), then by data offset, which is the order that an
+    index with duplicates keeps them in.  When the index does not allow duplicates, only
+    the key with the lowest data offset is kept.
+
+        Index ndx;
+        ndx.create("assets.ndx");
+        IndexBuilder builder(ndx, 256 << 20);
+        while (...)
+            builder.add(path, offset);
+        builder.build();
+*/
+
+#ifndef __NUB_INDEXBUILDER_H__
+#define __NUB_INDEXBUILDER_H__
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "Index.h"
+
+namespace nub {
+
+template <class IndexType>
+class IndexBuilderT
+{
+public:
+	typedef typename IndexType::IKeyType       IKey;
+	typedef typename IndexType::datFilePosType datFilePosT;
+
+	/// Keys are added to ndx, which must be open and empty when build() is called.
+	//     Run files are created with tmpfile(), or named tempPrefix.0, tempPrefix.1, ...
+	//     if tempPrefix is given (to put them on a disk with more room).
+	IndexBuilderT(IndexType& ndx, size_t memoryBudget = 64 << 20, const char* tempPrefix = 0) // throw(...) // can throw bad_alloc
+		: ndx(ndx), used(0), nRecords(0), added(0), runSeq(0), lastKey(0)
+	{
+		maxRecord = recordSize(ndx.maxKeySize());
+		minBuffer = 2 * maxRecord < cMinBuffer ? cMinBuffer : 2 * maxRecord;
+		if (memoryBudget < 4 * minBuffer)
+			memoryBudget = 4 * minBuffer;
+		budget = memoryBudget / 8 * 8;
+		mem = new byte[budget];
+		prefix = 0;
+		if (tempPrefix) {
+			prefix = new char[strlen(tempPrefix) + 1];
+			strcpy(prefix, tempPrefix);
+		}
+	}
+
+	~IndexBuilderT()
+	{
+		clear();
+		delete[] mem;
+		delete[] prefix;
+		delete[] lastKey;
+	}
+
+	/// Add a key and its data offset, in any order
+	void add(const void* key, const datFilePosT& offset) // throw(...) // can throw io_error or invalid_argument (key too long)
+	{
+		int keySize = IKey::size(key);
+		if (keySize > ndx.maxKeySize()) {
+			char message[4096];
+			sprintf(message, "Key (%s) too long (must be <= %d bytes)", IKey::toString(key), ndx.maxKeySize());
+			throw invalid_argument(message);
+		}
+		size_t size = recordSize(keySize);
+		if (used + size + (nRecords + 1) * sizeof(Record*) > budget)
+			spill();
+		Record* r = (Record*)(mem + used);
+		r->offset = offset;
+		r->size = (uint32)size;
+		memcpy(r->key, key, keySize);
+		memset(r->key + keySize, 0, size - FIELDOFFSET(Record, key) - keySize);  // padding
+		used += size;
+		records()[-++nRecords] = r;
+	}
+
+	/// # of keys added since the last build()
+	int64 count() const // noexcept // throw()
+		{ return added + nRecords; }
+
+	/// # of run files written so far
+	int runCount() const // noexcept // throw()
+		{ return (int)runs.size(); }
+
+	/// Sort the keys and bulk load them into the index.  Returns the number of keys loaded.
+	//     The builder is empty afterwards and can be used again.
+	int build(int fillPercent = 100) // throw(...) // can throw io_error, runtime_error or logic_error (index not empty)
+	{
+		ndx.beginLoad(fillPercent);
+		if (!lastKey)
+			lastKey = new byte[ndx.maxKeySize()];
+		nLoaded = 0;
+		if (runs.empty()) {                   // everything is in memory
+			sortRecords();
+			Record** r = records() - nRecords;
+			for (int i = 0; i < nRecords; i++)
+				emit(r[i]);
+		} else {
+			if (nRecords)
+				spill();
+			// merge fanIn runs at a time into a new run until the rest can be merged at once
+			size_t fanIn = budget / minBuffer;
+			size_t first = 0;
+			while (runs.size() - first > fanIn) {
+				runs.push_back(newRun());
+				merge(first, fanIn, &runs.back());
+				first += fanIn;
+			}
+			merge(first, runs.size() - first, 0);
+		}
+		ndx.endLoad();
+		clear();
+		return nLoaded;
+	}
+
+private:
+	struct Record // a key and its data offset, padded to a multiple of 8 bytes
+	{
+		datFilePosT offset;
+		uint32      size;     // of the whole record
+		byte        key[1];
+	};
+
+	struct Run // a sorted run file
+	{
+		FILE* file;
+		char* name;    // 0 for tmpfile()
+	};
+
+	struct Reader // buffered input from a run while it is merged
+	{
+		Run*    run;
+		byte*   buf;
+		size_t  len;   // bytes in buf
+		size_t  pos;   // of the current record
+		Record* cur;   // 0 at the end of the run
+	};
+
+	struct RecordLess
+	{
+		bool operator()(const Record* lhs, const Record* rhs) const
+			{ return compareRecords(lhs, rhs) < 0; }
+	};
+
+	struct ReaderLater // for a min heap of readers
+	{
+		bool operator()(const Reader* lhs, const Reader* rhs) const
+			{ return compareRecords(lhs->cur, rhs->cur) > 0; }
+	};
+
+	static const size_t cMinBuffer = 64 * 1024;  // smallest buffer for a run while merging
+
+	IndexType&        ndx;
+	byte*             mem;         // records grow up from the start, pointers to them down from the end
+	size_t            budget;      // size of mem, a multiple of 8
+	size_t            used;        // bytes of records in mem
+	int               nRecords;    // # of records in mem
+	int64             added;       // # of records in runs
+	size_t            maxRecord;   // size of a record with the longest key
+	size_t            minBuffer;   // merge buffer size for each run
+	std::vector<Run>  runs;
+	char*             prefix;      // name prefix of run files, 0 for tmpfile()
+	int               runSeq;      // # for the next run file name
+	byte*             lastKey;     // previous key loaded, to drop duplicates
+	datFilePosT       lastOfs;
+	int               nLoaded;
+
+	static size_t recordSize(int keySize)
+		{ return (FIELDOFFSET(Record, key) + keySize + 7) & ~(size_t)7; }
+
+	static int compareRecords(const Record* lhs, const Record* rhs)
+	{
+		int cmp = IKey::compare(lhs->key, rhs->key);
+		if (cmp) return cmp;
+		return lhs->offset < rhs->offset ? -1 : lhs->offset > rhs->offset;
+	}
+
+	// the record pointers, accessed with negative indices like the keyofs of a node
+	Record** records() const
+		{ return (Record**)(mem + budget); }
+
+	void sortRecords()
+	{
+		Record** end = records();
+		std::sort(end - nRecords, end, RecordLess());
+	}
+
+	// Sort the records in memory and write them to a new run
+	void spill() // throw(...)
+	{
+		Run run = newRun();
+		runs.push_back(run);
+		sortRecords();
+		Record** r = records() - nRecords;
+		for (int i = 0; i < nRecords; i++)
+			put(run, r[i]);
+		finishRun(run);
+		added += nRecords;
+		nRecords = 0;
+		used = 0;
+	}
+
+	Run newRun() // throw(...)
+	{
+		Run run;
+		run.name = 0;
+		if (prefix) {
+			run.name = new char[strlen(prefix) + 16];
+			sprintf(run.name, "%s.%d", prefix, runSeq++);
+			run.file = fopen(run.name, "w+b");
+		} else
+			run.file = tmpfile();
+		if (!run.file) {
+			char message[1024];
+			sprintf(message, "Cannot create sort run file %s", run.name ? run.name : "(tmpfile)");
+			delete[] run.name;
+			throw io_error(message);
+		}
+		setvbuf(run.file, 0, _IOFBF, cMinBuffer);
+		return run;
+	}
+
+	void put(Run& run, const Record* r) // throw(...)
+	{
+		if (fwrite(r, r->size, 1, run.file) != 1)
+			Throw("Write", run);
+	}
+
+	void finishRun(Run& run) // throw(...)
+	{
+		if (fflush(run.file) || fseek(run.file, 0, SEEK_SET))
+			Throw("Write", run);
+	}
+
+	// Merge count runs starting at first, into out or into the index if out is 0.
+	//    The merged runs are closed.
+	void merge(size_t first, size_t count, Run* out) // throw(...)
+	{
+		size_t bufSize = budget / count / 8 * 8;
+		std::vector<Reader>  readers(count);
+		std::vector<Reader*> heap;
+		for (size_t i = 0; i < count; i++) {
+			Reader& r = readers[i];
+			r.run = &runs[first + i];
+			r.buf = mem + i * bufSize;
+			r.len = bufSize;  // empty buffer positioned at its end
+			r.pos = bufSize;
+			r.cur = 0;
+			if (advance(r, bufSize, 0))
+				heap.push_back(&r);
+		}
+		std::make_heap(heap.begin(), heap.end(), ReaderLater());
+		while (!heap.empty()) {
+			std::pop_heap(heap.begin(), heap.end(), ReaderLater());
+			Reader* r = heap.back();
+			if (out)
+				put(*out, r->cur);
+			else
+				emit(r->cur);
+			if (advance(*r, bufSize, r->cur->size))
+				std::push_heap(heap.begin(), heap.end(), ReaderLater());
+			else
+				heap.pop_back();
+		}
+		if (out)
+			finishRun(*out);
+		for (size_t i = first; i < first + count; i++)
+			closeRun(runs[i]);
+	}
+
+	// Move a reader past size bytes to its next record.  Returns false at the end of the run.
+	bool advance(Reader& r, size_t bufSize, size_t size) // throw(...)
+	{
+		r.pos += size;
+		if (r.len - r.pos < FIELDOFFSET(Record, key) ||
+			r.len - r.pos < ((Record*)(r.buf + r.pos))->size)
+		{	// move the partial record to the start of the buffer and refill
+			size_t rest = r.len - r.pos;
+			memmove(r.buf, r.buf + r.pos, rest);
+			r.pos = 0;
+			r.len = rest + fread(r.buf + rest, 1, bufSize - rest, r.run->file);
+			if (ferror(r.run->file))
+				Throw("Read", *r.run);
+			if (r.len == 0)
+				return false;
+			if (r.len < FIELDOFFSET(Record, key) || r.len < ((Record*)r.buf)->size)
+				Throw("Read", *r.run);  // truncated run
+		}
+		r.cur = (Record*)(r.buf + r.pos);
+		return true;
+	}
+
+	// Load a key into the index unless it is a duplicate that the index does not allow
+	void emit(const Record* r) // throw(...)
+	{
+		if (nLoaded) {
+			int cmp = IKey::compare(r->key, lastKey);
+			if (cmp == 0 && (!ndx.dupsAllowed() || r->offset == lastOfs))
+				return;
+		}
+		ndx.load(r->key, r->offset);
+		IKey::copy(lastKey, r->key);
+		lastOfs = r->offset;
+		nLoaded++;
+	}
+
+	void closeRun(Run& run)
+	{
+		if (run.file) {
+			fclose(run.file);
+			run.file = 0;
+		}
+		if (run.name) {
+			::remove(run.name);
+			delete[] run.name;
+			run.name = 0;
+		}
+	}
+
+	// Drop the records in memory and the run files
+	void clear()
+	{
+		for (size_t i = 0; i < runs.size(); i++)
+			closeRun(runs[i]);
+		runs.clear();
+		nRecords = 0;
+		used = 0;
+		added = 0;
+	}
+
+	void Throw(const char* reason, Run& run) // throw(...)
+	{
+		char message[1024];
+		sprintf(message, "%s failure on sort run file %s", reason, run.name ? run.name : "(tmpfile)");
+		throw io_error(message);
+	}
+
+	IndexBuilderT(const IndexBuilderT&);
+	IndexBuilderT& operator=(const IndexBuilderT&);
+};
+
+typedef IndexBuilderT<Index>    IndexBuilder;
+typedef IndexBuilderT<UniIndex> UniIndexBuilder;
+
+} // namespace nub
+
+#endif // __NUB_INDEXBUILDER_H__
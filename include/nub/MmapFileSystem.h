@@ -0,0 +1,221 @@
+/*  <nub/MmapFileSystem.h> -- Memory mapped file access, a drop-in for FileSystem
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    The whole file is mapped, so reads and writes are memory copies instead of system calls.
+    Writes past the end of the file grow it (and the mapping) in large steps; close() trims
+    the file back to the bytes actually written, so the files are the same as FileSystem's.
+    Usable as the FileSystemT of IndexT:  IndexT<IKeyASCIIZ, MmapFileSystem>
+*/
+
+#ifndef __NUB_MMAPFILESYSTEM_H__
+#define __NUB_MMAPFILESYSTEM_H__
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "FileSystem.h"
+
+#if NUB_PLATFORM == NUB_PLATFORM_WIN32
+
+namespace nub {
+	typedef FileSystem MmapFileSystem;  // not implemented for Win32 yet
+}
+
+#else
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace nub {
+
+class MmapFileSystem
+{
+private:
+	struct FileInfo;
+
+public:
+	typedef FileInfo* FileHandle;
+
+	static const bool cConcurrentIO = false;  // a write past the end moves the mapping
+
+	static FileHandle create(const char* name) // throw (...)
+	{
+		int fd = ::open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		return fd >= 0 ? makeFileInfo(fd, name) : 0;
+	}
+
+	static FileHandle open(const char* name) // throw (...)
+	{
+		int fd = ::open(name, O_RDWR);
+		return fd >= 0 ? makeFileInfo(fd, name) : 0;
+	}
+
+	static void close(FileHandle fh) {
+		release(fh);
+	}
+
+	static const char* getName(FileHandle fh) {
+		return fh->name;
+	}
+
+	static void seek(FileHandle fh, int64 pos) // throw (...)
+	{
+		if (pos < 0)
+			Throw(fh, "Seek");
+		fh->pos = pos;
+	}
+
+	static void read(FileHandle fh, void* buffer, int size) // throw(...)
+	{
+		readAt(fh, fh->pos, buffer, size);
+		fh->pos += size;
+	}
+
+	static void write(FileHandle fh, void* buffer, int size) // throw(...)
+	{
+		writeAt(fh, fh->pos, buffer, size);
+		fh->pos += size;
+	}
+
+	static void readAt(FileHandle fh, int64 pos, void* buffer, int size) // throw(...)
+	{
+		if (pos < 0 || pos + size > fh->size)
+			Throw(fh, "Read");
+		memcpy(buffer, fh->map + pos, size);
+	}
+
+	/// Read a batch of places in the file (copies: the pages fault in one at a time)
+	static void readMany(FileHandle fh, const ReadAt* reads, int n) // throw(...)
+	{
+		for (int i = 0; i < n; i++)
+			readAt(fh, reads[i].pos, reads[i].buffer, reads[i].size);
+	}
+
+	static void writeAt(FileHandle fh, int64 pos, const void* buffer, int size) // throw(...)
+	{
+		int64 end = pos + size;
+		if (pos < 0)
+			Throw(fh, "Write");
+		if (end > fh->mapSize)
+			grow(fh, end);
+		memcpy(fh->map + pos, buffer, size);
+		if (end > fh->size)
+			fh->size = end;
+	}
+
+	/// Write n buffers of size bytes each one after another from a file offset, growing the
+	//    file once for them all
+	static void writeGather(FileHandle fh, int64 pos, const void* const* buffers, int n, int size) // throw(...)
+	{
+		if (n > 0 && pos >= 0 && pos + (int64)n * size > fh->mapSize)
+			grow(fh, pos + (int64)n * size);
+		for (int i = 0; i < n; i++)
+			writeAt(fh, pos + (int64)i * size, buffers[i], size);
+	}
+
+	/// Make what was written to the file durable (for a write-ahead log)
+	static void sync(FileHandle fh) // throw(...)
+	{
+		if ((fh->map && msync(fh->map, fh->mapSize, MS_SYNC)) || fsync(fh->fd))
+			Throw(fh, "Sync");
+	}
+
+	/// # of bytes written to the file
+	static int64 size(FileHandle fh) // noexcept
+		{ return fh->size; }
+
+private:
+	struct FileInfo {
+		int   fd;
+		byte* map;      // the mapped file (0 if nothing is mapped yet)
+		int64 mapSize;  // bytes mapped (and the size of the file on disk while open)
+		int64 size;     // bytes written to the file
+		int64 pos;      // current position for read() and write()
+		char* name;
+	};
+
+	static const int64 cMinGrowth = 1 << 20;  // grow the file at least this much at a time
+
+	static FileHandle makeFileInfo(int fd, const char* name) // throw (...)
+	{
+		FileHandle fh = new FileInfo;
+		fh->fd = fd;
+		fh->map = 0;
+		fh->mapSize = fh->size = fh->pos = 0;
+		size_t len = strlen(name) + 1;
+		if (!(fh->name = (char*) malloc(len))) {
+			::close(fd);
+			delete fh;
+			throw bad_alloc();
+		}
+		memcpy(fh->name, name, len);
+		struct stat st;
+		if (fstat(fd, &st))
+			Throw(fh, "Stat");
+		if (st.st_size) {
+			fh->map = (byte*) mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (fh->map == (byte*) MAP_FAILED) {
+				fh->map = 0;
+				Throw(fh, "Map");
+			}
+			fh->mapSize = fh->size = st.st_size;
+		}
+		return fh;
+	}
+
+	/// Extend the file and the mapping to hold at least end bytes
+	static void grow(FileHandle fh, int64 end) // throw(...)
+	{
+		int64 newSize = fh->mapSize * 2;
+		if (newSize < fh->mapSize + cMinGrowth)
+			newSize = fh->mapSize + cMinGrowth;
+		if (newSize < end)
+			newSize = end;
+		if (ftruncate(fh->fd, newSize))
+			Throw(fh, "Write");
+		byte* map;
+#if NUB_PLATFORM == NUB_PLATFORM_LINUX
+		map = (byte*) (fh->map ? mremap(fh->map, fh->mapSize, newSize, MREMAP_MAYMOVE)
+		                       : mmap(0, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fh->fd, 0));
+#else
+		if (fh->map) {
+			munmap(fh->map, fh->mapSize);
+			fh->map = 0;
+		}
+		map = (byte*) mmap(0, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fh->fd, 0);
+#endif
+		if (map == (byte*) MAP_FAILED)
+			Throw(fh, "Map");
+		fh->map = map;
+		fh->mapSize = newSize;
+	}
+
+	/// Unmap, trim the file to what was written and close it
+	static void release(FileHandle fh) // noexcept
+	{
+		if (fh->map)
+			munmap(fh->map, fh->mapSize);
+		if (fh->mapSize != fh->size)
+			ftruncate(fh->fd, fh->size);
+		::close(fh->fd);
+		free(fh->name);
+		delete fh;
+	}
+
+	static void Throw(FileHandle fh, const char* reason) // throw (...)
+	{
+		char msg[1024];
+		sprintf(msg, "%s failure on file %s", reason, fh->name);
+		release(fh);
+		throw io_error(msg);
+	}
+};
+
+} // namespace nub
+
+#endif // NUB_PLATFORM == NUB_PLATFORM_WIN32
+
+#endif //  __NUB_MMAPFILESYSTEM_H__
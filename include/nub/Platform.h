@@ -204,6 +204,7 @@ typedef unsigned short uint16;
 typedef unsigned char  uint8;
 typedef unsigned char  byte;
 typedef std::int64_t   int64;
+typedef std::uint64_t  uint64;
 // typedef long long   tFilePos;
 
 typedef int64          tFilePos;
@@ -0,0 +1,207 @@
+/*  <nub/PositionalFileSystem.h> -- File access with pread/pwrite, a drop-in for FileSystem
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    readAt() and writeAt() take the file offset, so each costs one system call instead of
+    a seek plus a read or write, and they do not touch a shared file position: a handle can
+    be used by several threads at once as long as they only use readAt() and writeAt().
+    seek(), read() and write() are kept for sequential access by a single thread.
+    Usable as the FileSystemT of IndexT:  IndexT<IKeyASCIIZ, PositionalFileSystem>
+*/
+
+#ifndef __NUB_POSITIONALFILESYSTEM_H__
+#define __NUB_POSITIONALFILESYSTEM_H__
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "FileSystem.h"
+
+#if NUB_PLATFORM == NUB_PLATFORM_WIN32
+
+namespace nub {
+	typedef FileSystem PositionalFileSystem;  // not implemented for Win32 yet
+}
+
+#else
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <vector>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024    // buffers pwritev() takes at once (POSIX does not require the limit)
+#endif
+
+namespace nub {
+
+class PositionalFileSystem
+{
+protected:
+	struct FileInfo;
+
+public:
+	typedef FileInfo* FileHandle;
+
+	static const bool cConcurrentIO = true;   // readAt() and writeAt() in several threads at once
+
+	static FileHandle create(const char* name) // throw (...)
+	{
+		int fd = ::open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		return fd >= 0 ? makeFileInfo(fd, name) : 0;
+	}
+
+	static FileHandle open(const char* name) // throw (...)
+	{
+		int fd = ::open(name, O_RDWR);
+		return fd >= 0 ? makeFileInfo(fd, name) : 0;
+	}
+
+	static void close(FileHandle fh) {
+		::close(fh->fd);
+		free(fh->name);
+		delete fh;
+	}
+
+	static const char* getName(FileHandle fh) {
+		return fh->name;
+	}
+
+	static void seek(FileHandle fh, int64 pos) // throw (...)
+	{
+		if (pos < 0)
+			Throw(fh, "Seek");
+		fh->pos = pos;
+	}
+
+	static void read(FileHandle fh, void* buffer, int size) // throw(...)
+	{
+		readAt(fh, fh->pos, buffer, size);
+		fh->pos += size;
+	}
+
+	static void write(FileHandle fh, void* buffer, int size) // throw(...)
+	{
+		writeAt(fh, fh->pos, buffer, size);
+		fh->pos += size;
+	}
+
+	static void readAt(FileHandle fh, int64 pos, void* buffer, int size) // throw(...)
+	{
+		while (size > 0) {
+			ssize_t n = pread(fh->fd, buffer, size, pos);
+			if (n <= 0) {
+				if (n < 0 && errno == EINTR)
+					continue;
+				Throw(fh, "Read");
+			}
+			buffer = (byte*)buffer + n;
+			pos += n;
+			size -= (int)n;
+		}
+	}
+
+	/// Read a batch of places in the file, one pread() each
+	static void readMany(FileHandle fh, const ReadAt* reads, int n) // throw(...)
+	{
+		for (int i = 0; i < n; i++)
+			readAt(fh, reads[i].pos, reads[i].buffer, reads[i].size);
+	}
+
+	static void writeAt(FileHandle fh, int64 pos, const void* buffer, int size) // throw(...)
+	{
+		while (size > 0) {
+			ssize_t n = pwrite(fh->fd, buffer, size, pos);
+			if (n <= 0) {
+				if (n < 0 && errno == EINTR)
+					continue;
+				Throw(fh, "Write");
+			}
+			buffer = (const byte*)buffer + n;
+			pos += n;
+			size -= (int)n;
+		}
+	}
+
+	/// Write n buffers of size bytes each one after another from a file offset, with one
+	//    pwritev() (or a few, if n is more than IOV_MAX)
+	static void writeGather(FileHandle fh, int64 pos, const void* const* buffers, int n, int size) // throw(...)
+	{
+		std::vector<iovec> iov(n);
+		for (int i = 0; i < n; i++) {
+			iov[i].iov_base = (void*)buffers[i];
+			iov[i].iov_len = size;
+		}
+		for (iovec* v = &iov[0]; n > 0; ) {
+			ssize_t written = pwritev(fh->fd, v, n < IOV_MAX ? n : IOV_MAX, pos);
+			if (written <= 0) {
+				if (written < 0 && errno == EINTR)
+					continue;
+				Throw(fh, "Write");
+			}
+			pos += written;
+			for (; n > 0 && written >= (ssize_t)v->iov_len; v++, n--)
+				written -= v->iov_len;
+			if (written) {                // part of a buffer was written
+				v->iov_base = (byte*)v->iov_base + written;
+				v->iov_len -= written;
+			}
+		}
+	}
+
+	/// Make what was written to the file durable (for a write-ahead log)
+	static void sync(FileHandle fh) // throw(...)
+	{
+		if (fsync(fh->fd))
+			Throw(fh, "Sync");
+	}
+
+	/// # of bytes in the file
+	static int64 size(FileHandle fh) // throw(...)
+	{
+		struct stat st;
+		if (fstat(fh->fd, &st))
+			Throw(fh, "Stat");
+		return st.st_size;
+	}
+
+protected:
+	struct FileInfo {
+		int   fd;
+		int64 pos;   // position for read() and write() only
+		char* name;
+	};
+
+	static FileHandle makeFileInfo(int fd, const char* name) // throw (...)
+	{
+		FileHandle fh = new FileInfo;
+		fh->fd = fd;
+		fh->pos = 0;
+		size_t len = strlen(name) + 1;
+		if (!(fh->name = (char*) malloc(len))) {
+			::close(fd);
+			delete fh;
+			throw bad_alloc();
+		}
+		memcpy(fh->name, name, len);
+		return fh;
+	}
+
+	static void Throw(FileHandle fh, const char* reason) // throw (...)
+	{
+		char msg[1024];
+		sprintf(msg, "%s failure on file %s", reason, fh->name);
+		close(fh);
+		throw io_error(msg);
+	}
+};
+
+} // namespace nub
+
+#endif // NUB_PLATFORM == NUB_PLATFORM_WIN32
+
+#endif //  __NUB_POSITIONALFILESYSTEM_H__
@@ -8,8 +8,25 @@
 #define __NUB_RESOURCEFILE_H__
 
 #include <nub/Index.h>
+#include <nub/PositionalFileSystem.h>
+#include <nub/MmapFileSystem.h>
+#include <nub/WriteAheadLog.h>
 #include <istream>
 
+// The FileSystem backend used for the index and data files.  Can be FileSystem,
+//    PositionalFileSystem or MmapFileSystem.  Define it the same way when building nub and its users.
+#ifndef NUB_RESOURCE_FILESYSTEM
+#define NUB_RESOURCE_FILESYSTEM PositionalFileSystem
+#endif
+
+// The node format of the index: NodePlain, NodeFrontCoded<> for smaller indexes of long
+//    names with common prefixes, or NodeCounted to page through the names by position
+//    (getIndex().seek(), rank() and countRange()).  Index files of one format cannot be
+//    opened by another.
+#ifndef NUB_RESOURCE_NODEFORMAT
+#define NUB_RESOURCE_NODEFORMAT NodePlain
+#endif
+
 namespace nub {
 
 class _NubExport ResourceFile
@@ -17,18 +34,36 @@ class _NubExport ResourceFile
 public:
 	typedef int64  datFilePosType;
 	typedef uint32 ndxFilePosType;
-	typedef IndexT<IKeyASCIIZ, FileSystem, 1024, ndxFilePosType, datFilePosType> ndxFileType;
+	typedef NUB_RESOURCE_FILESYSTEM FileSystemType;
+	typedef IndexT<IKeyASCIIZ, FileSystemType, 1024, ndxFilePosType, datFilePosType,
+	               CacheLRU, NUB_RESOURCE_NODEFORMAT> ndxFileType;
 
     ResourceFile() : dat(0), wrkmem(0) {}
 	_NubExport ~ResourceFile();
 
 	/// open/create the resource file
-	bool open(const char* filename, bool create=false);
+	//     logged: write the index and data files through a write-ahead log, filename.log,
+	//     so that a crash leaves them as of the last commit the log synced.  A log left by
+	//     a crash is replayed when the file is opened again, logged or not.
+	bool open(const char* filename, bool create=false, bool logged=false);
 
 	/// close so it can be opened on another file
 	void close();
 
 	bool isOpen() { return dat != 0; }
+	bool isLogged() { return log.isOpen(); }
+
+	/// group puts and removes into one transaction of a logged file, until commit() or
+	//     rollback().  Otherwise each of them commits one of its own.
+	void beginTransaction();
+	void commit();
+	void rollback();
+	bool inTransaction() { return log.inTransaction(); }
+
+	/// keep a Bloom filter of the names beside the index (filename.0.filter), so that
+	//     get(), getSize() and resolve() of names that are not there seldom read it.
+	//     Call after open(); close() writes it.
+	void useFilter(double falsePositiveRate = 0.01) { ndx.attachFilter(0, falsePositiveRate); }
 
 	/// get named/typed data from the archive
     //     you should delete the data when finished with it
@@ -40,6 +75,11 @@ public:
 	/// get size info from the archive without getting the data
 	bool getSize(const char* name, uint32& size, uint32& compressedSize);
 
+	/// look up many names at once, for get(offset, size): offsets[i] and found[i] for names[i].
+	//     The index is walked once for all of them.  Returns the # of names found.
+	int resolve(const char* const* names, int count, datFilePosType* offsets, bool* found);
+
+
 	/// put named/typed data to the index/data pair
 	void put(const char* name, void* data, uint32 size);
 
@@ -58,6 +98,9 @@ public:
     /// utility to return the index file so you can scan for all entries
     ndxFileType& getIndex() { return ndx; }
 
+    /// utility to return the log, to set when it syncs (see WriteAheadLogT::setSync())
+    WriteAheadLogT<FileSystemType>& getLog() { return log; }
+
 // "protected"
 	// These two functions bypass the index file.  The data will not
 	// be retrievable unless you have an alternate method for remembering
@@ -76,14 +119,17 @@ protected:
 	/// remove unnamed data from the dat file
 	void  remove(const datFilePosType& offset);
 
-    /// internal read - no seek if offset = -1
+    /// internal read - continues after the last read or write if offset = -1
     void read(void* data, uint32 size, const datFilePosType& offset = -1); // throw(...);
-    /// internal write - no seek if offset = -1
+    /// internal write - continues after the last read or write if offset = -1
     void write(void* data, uint32 size, const datFilePosType& offset = -1); // throw(...);
 
-	FileSystem::FileHandle dat;
+	FileSystemType::FileHandle dat;
+	datFilePosType pos;       // data file offset following the last read or write
 	datFilePosType filesize;
 	datFilePosType freelist;
+	WriteAheadLogT<FileSystemType> log;  // the files are written through it if open
+	int datFile;                         // the data file's id in the log
 	ndxFileType ndx;
 
 	byte* wrkmem;  // workspace for lzo (put, putFile only)
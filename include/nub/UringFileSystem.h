@@ -0,0 +1,230 @@
+/*  <nub/UringFileSystem.h> -- PositionalFileSystem with batches of reads through io_uring
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    readMany() puts a batch of reads into an io_uring and waits for them all, so that
+    one thread has up to cRingSize of them in flight at once, where pread() has one.
+    Each thread gets a ring the first time it calls readMany().  Where io_uring is not
+    there (not Linux, an old kernel, or disabled), or if the ring fails, the reads are
+    done with pread() one by one, as in PositionalFileSystem.  Everything else is
+    PositionalFileSystem's.  See IndexT::findAsync(), which reads its nodes this way.
+    Usable as the FileSystemT of IndexT:  IndexT<IKeyASCIIZ, UringFileSystem>
+*/
+
+#ifndef __NUB_URINGFILESYSTEM_H__
+#define __NUB_URINGFILESYSTEM_H__
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "PositionalFileSystem.h"
+
+#if NUB_PLATFORM == NUB_PLATFORM_WIN32
+
+namespace nub {
+	typedef PositionalFileSystem UringFileSystem;  // not implemented for Win32 yet
+}
+
+#else
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#if NUB_PLATFORM == NUB_PLATFORM_LINUX
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define NUB_URING 1
+#else
+#define NUB_URING 0
+#endif
+
+namespace nub {
+
+class UringFileSystem : public PositionalFileSystem
+{
+public:
+	static const int cRingSize = 64;  // reads in flight at once, per thread
+
+	/// Read a batch of places in the file, all in flight at once if this thread has a ring
+	static void readMany(FileHandle fh, const ReadAt* reads, int n) // throw(...)
+	{
+#if NUB_URING
+		Ring& ring = threadRing();
+		if (n > 1 && enabled() && ring.fd >= 0) {
+			std::vector<int> got(n, 0);    // bytes each read got; the ones short are redone
+			ring.run(fh->fd, reads, n, &got[0]);
+			for (int i = 0; i < n; i++)
+				if (got[i] < reads[i].size)
+					readAt(fh, reads[i].pos + got[i], (byte*)reads[i].buffer + got[i], reads[i].size - got[i]);
+			return;
+		}
+#endif
+		PositionalFileSystem::readMany(fh, reads, n);
+	}
+
+	/// Use io_uring where it is there (the default), or pread() always
+	static void enable(bool use) // noexcept
+		{ enabled() = use; }
+
+	/// Whether readMany() goes through io_uring in this thread
+	static bool usingRing() // noexcept
+	{
+#if NUB_URING
+		return enabled() && threadRing().fd >= 0;
+#else
+		return false;
+#endif
+	}
+
+private:
+	static std::atomic<bool>& enabled()
+	{
+		static std::atomic<bool> use(true);
+		return use;
+	}
+
+#if NUB_URING
+	/// A thread's io_uring: its submission and completion queues mapped from the kernel
+	struct Ring
+	{
+		int            fd;         // -1 if there is no ring
+		unsigned*      sqHead;
+		unsigned*      sqTail;
+		unsigned*      sqMask;
+		unsigned*      sqArray;
+		unsigned       sqEntries;
+		io_uring_sqe*  sqes;
+		unsigned*      cqHead;
+		unsigned*      cqTail;
+		unsigned*      cqMask;
+		io_uring_cqe*  cqes;
+		void*          sqMap;
+		size_t         sqMapSize;
+		void*          cqMap;
+		size_t         cqMapSize;
+		size_t         sqesSize;
+
+		Ring() : fd(-1), sqes((io_uring_sqe*)MAP_FAILED), sqMap(MAP_FAILED), cqMap(MAP_FAILED)
+		{
+			io_uring_params p;
+			memset(&p, 0, sizeof(p));
+			if ((fd = (int)syscall(__NR_io_uring_setup, cRingSize, &p)) < 0) {
+				fd = -1;
+				return;
+			}
+			sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+			cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+			sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+			if (p.features & IORING_FEAT_SINGLE_MMAP)
+				sqMapSize = cqMapSize = sqMapSize > cqMapSize ? sqMapSize : cqMapSize;
+			sqMap = mmap(0, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+			if (sqMap != MAP_FAILED)
+				cqMap = p.features & IORING_FEAT_SINGLE_MMAP ? sqMap :
+				        mmap(0, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			if (cqMap != MAP_FAILED)
+				sqes = (io_uring_sqe*)mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+			if (sqes == MAP_FAILED) {
+				close();
+				return;
+			}
+			byte* sq = (byte*)sqMap;
+			byte* cq = (byte*)cqMap;
+			sqHead = (unsigned*)(sq + p.sq_off.head);
+			sqTail = (unsigned*)(sq + p.sq_off.tail);
+			sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+			sqArray = (unsigned*)(sq + p.sq_off.array);
+			sqEntries = p.sq_entries;
+			cqHead = (unsigned*)(cq + p.cq_off.head);
+			cqTail = (unsigned*)(cq + p.cq_off.tail);
+			cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+			cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+		}
+
+		~Ring()
+			{ close(); }
+
+		void close() // noexcept
+		{
+			if (sqes != MAP_FAILED)
+				munmap(sqes, sqesSize);
+			if (cqMap != MAP_FAILED && cqMap != sqMap)
+				munmap(cqMap, cqMapSize);
+			if (sqMap != MAP_FAILED)
+				munmap(sqMap, sqMapSize);
+			sqMap = cqMap = MAP_FAILED;
+			sqes = (io_uring_sqe*)MAP_FAILED;
+			if (fd >= 0)
+				::close(fd);
+			fd = -1;
+		}
+
+		/// Keep as many of the reads in flight as the ring holds until they are all done,
+		//    noting the bytes each got.  If the ring fails, it is closed once the reads it
+		//    took are done, and the rest are left for pread().  It never returns before:
+		//    those reads point at iov and at the caller's buffers.
+		void run(int file, const ReadAt* reads, int n, int* got) // noexcept
+		{
+			std::vector<iovec> iov(n);
+			unsigned start = *sqTail;      // the kernel has taken every entry before it
+			int      queued = 0, done = 0;
+			bool     failed = false;
+			while (done < queued || (!failed && queued < n)) {
+				unsigned tail = *sqTail;
+				for (; !failed && queued < n && queued - done < (int)sqEntries; queued++, tail++) {
+					unsigned      slot = tail & *sqMask;
+					io_uring_sqe* sqe = &sqes[slot];
+					iov[queued].iov_base = reads[queued].buffer;
+					iov[queued].iov_len = reads[queued].size;
+					memset(sqe, 0, sizeof(*sqe));
+					sqe->opcode = IORING_OP_READV;
+					sqe->fd = file;
+					sqe->off = reads[queued].pos;
+					sqe->addr = (unsigned long long)&iov[queued];
+					sqe->len = 1;
+					sqe->user_data = queued;
+					sqArray[slot] = slot;
+				}
+				__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+				unsigned submit = failed ? 0 : tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+				if (syscall(__NR_io_uring_enter, fd, submit, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0 &&
+				    errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+					if (failed)                // can not even wait: the reads the kernel took
+						std::this_thread::yield();  // still complete, look for them again
+					else {
+						failed = true;         // take back the entries the kernel has not
+						unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+						__atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+						queued = (int)(head - start);
+					}
+				}
+				unsigned head = *cqHead;
+				for (; head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE); head++, done++) {
+					io_uring_cqe* cqe = &cqes[head & *cqMask];
+					got[cqe->user_data] = cqe->res > 0 ? cqe->res : 0;
+				}
+				__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+			}
+			if (failed)
+				close();
+		}
+	};
+
+	static Ring& threadRing()
+	{
+		static thread_local Ring ring;
+		return ring;
+	}
+#endif // NUB_URING
+};
+
+} // namespace nub
+
+#endif // NUB_PLATFORM == NUB_PLATFORM_WIN32
+
+#endif //  __NUB_URINGFILESYSTEM_H__
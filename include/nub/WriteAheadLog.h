@@ -0,0 +1,568 @@
+/*  <nub/WriteAheadLog.h> -- A write-ahead log that makes updates of index and data files crash safe
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Files attached to a log are written through it, in transactions.  The writes of a
+    transaction are kept in memory (and reads see them) until commit() appends them to the
+    log with a commit record.  They go to the files only after the log is synced, so a file
+    never holds a write that is not durably committed: after a crash, the transactions
+    committed in the log are replayed into the files as they are attached again, and
+    anything else is as if it never happened.  Rolling back just drops the writes.
+
+    Writes past the end a file had at the last commit go straight to the file, since nothing
+    committed refers to them yet.  The files are synced before the log, so large appended
+    data (resources, new nodes) is written once and not logged.
+
+    The log is synced at every commit (the default), or once for a group of commits (see
+    setSync()) so that many small transactions share one fsync; a crash then loses the
+    commits since the last sync, never part of one.  It is emptied (a checkpoint: the files
+    are synced and the log starts over) when it grows past setCheckpoint() bytes and when
+    a file is detached.
+
+    On disk: a LogHeader, then records: a LogRecord and size bytes of data.  The check of a
+    record is FNV-1a of the rest of it chained from the check of the record before (from the
+    generation for the first), so replaying stops at the first torn or stale record.
+
+    Used by IndexT (attachLog()) and ResourceFile (open(name, create, logged)).
+*/
+
+#ifndef __NUB_WRITEAHEADLOG_H__
+#define __NUB_WRITEAHEADLOG_H__
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stddef.h>
+#include <stdio.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "Base.h"
+#include "FileSystem.h"
+
+namespace nub {
+
+template <class FileSystemT = FileSystem>
+class WriteAheadLogT
+{
+public:
+	typedef typename FileSystemT::FileHandle FileHandle;
+
+	WriteAheadLogT() : // throw(...) // can throw bad_alloc
+		log(0), inTxn(false), syncCommits(1), syncMillis(0), checkpointBytes(32 << 20),
+		unsynced(0), nCommits(0), nSyncs(0) {}
+
+	~WriteAheadLogT() // throw(...)
+		{ close(); }
+
+	/// Start a new, empty log, replacing any log of that name
+	void create(const char* name) // throw(...) // can throw io_error
+	{
+		close();
+		log = FileSystemT::create(name);
+		if (!log) {
+			char message[1024];
+			sprintf(message, "Cannot create the log file %s", name);
+			throw io_error(message);
+		}
+		generation = 1;
+		restart();
+	}
+
+	/// Open a log and find the transactions committed in it, to replay them into the files
+	//     as they are attached.  Returns false if there is no log of that name.
+	bool open(const char* name) // throw(...) // can throw io_error
+	{
+		close();
+		log = FileSystemT::open(name);
+		if (!log) return false;
+		int64 size = FileSystemT::size(log);
+		if (size < (int64)sizeof(LogHeader)) {   // created, but the header never made it
+			generation = 1;
+			restart();
+			return true;
+		}
+		LogHeader header;
+		FileSystemT::readAt(log, 0, &header, sizeof(header));
+		if (memcmp(header.magic, cMagic, sizeof(header.magic))) {
+			char message[1024];
+			sprintf(message, "%s is not a write-ahead log", name);
+			FileSystemT::close(log);
+			log = 0;
+			throw io_error(message);
+		}
+		generation = header.generation;
+		findCommitted(size);
+		return true;
+	}
+
+	/// Checkpoint and close the log.  A transaction still open is dropped.
+	void close() // throw(...) // can throw io_error
+	{
+		if (!log) return;
+		std::lock_guard<std::mutex> lock(mutex);
+		dropTransaction();
+		checkpointLocked();
+		FileSystemT::close(log);
+		log = 0;
+		files.clear();
+		replay.clear();
+	}
+
+	bool isOpen() const // noexcept
+		{ return log != 0; }
+
+	/// Write a file through the log from now on: replays the committed writes to it found by
+	//     open().  Files are known by the order they are attached in, so attach them in the
+	//     same order every time.  Returns the file's id for read() and write().
+	int attach(FileHandle fh) // throw(...) // can throw io_error
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		int id = (int)files.size();
+		files.push_back(File());
+		File& file = files.back();
+		file.fh = fh;
+		file.end = file.newEnd = 0;
+		file.size = FileSystemT::size(fh);
+		file.direct = false;
+		std::vector<byte> data;
+		for (size_t i = 0; i < replay.size(); i++)
+			if (replay[i].file == id) {
+				data.resize(replay[i].size);
+				if (replay[i].size)
+					FileSystemT::readAt(log, replay[i].logPos, &data[0], replay[i].size);
+				FileSystemT::writeAt(fh, replay[i].offset, data.empty() ? 0 : &data[0], replay[i].size);
+				grow(file, replay[i].offset + replay[i].size);
+				file.direct = true;      // synced at the next checkpoint
+			}
+		return id;
+	}
+
+	/// Stop writing a file through the log (before closing it).  Checkpoints the log.
+	void detach(int id) // throw(...) // can throw io_error
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		syncLocked();
+		checkpointLocked();
+		files[id].fh = 0;
+	}
+
+	/// The end of a file as of the open transaction, from its commit on (at once outside of
+	//     a transaction): later writes past it go straight to the file.  Call it before
+	//     commit() whenever the file grows.
+	void setEnd(int id, int64 end) // noexcept
+	{
+		files[id].newEnd = end;
+		if (!inTxn)
+			files[id].end = end;
+	}
+
+	/// Sync the log after every commits commits, or when the first commit not yet synced is
+	//     milliseconds old (checked as transactions commit), whichever comes first.  Both 0:
+	//     only sync() and checkpoints sync.  The default is every commit.
+	void setSync(int commits, int milliseconds = 0) // noexcept
+	{
+		syncCommits = commits;
+		syncMillis = milliseconds;
+	}
+
+	/// Checkpoint when the log grows past this many bytes
+	void setCheckpoint(int64 bytes) // noexcept
+		{ checkpointBytes = bytes; }
+
+	void begin() // throw(...) // can throw logic_error
+	{
+		if (inTxn || !log) {
+			char message[1024];
+			sprintf(message, inTxn ? "A transaction is already open" : "The log is not open");
+			throw logic_error(message);
+		}
+		inTxn = true;
+	}
+
+	bool inTransaction() const // noexcept
+		{ return inTxn; }
+
+	/// Append the transaction's writes and a commit record to the log, and sync it if the
+	//     sync policy says so
+	void commit() // throw(...) // can throw io_error or logic_error
+	{
+		if (!inTxn) {
+			char message[1024];
+			sprintf(message, "commit() without begin()");
+			throw logic_error(message);
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!buffer.empty()) {
+			appendRecord(cCommit, 0, 0, 0, 0);
+			// chain the checks now, so that a checkpoint may come between begin() and commit()
+			for (size_t pos = 0; pos < buffer.size(); ) {
+				LogRecord* r = (LogRecord*)&buffer[pos];
+				r->check = prevCheck = check(prevCheck, r);
+				pos += sizeof(LogRecord) + r->size;
+			}
+			try {
+				FileSystemT::writeAt(log, appendPos, &buffer[0], (int)buffer.size());
+			} catch (...) {
+				log = 0;          // the FileSystem closed it when it threw
+				throw;
+			}
+			appendPos += buffer.size();
+			for (size_t i = 0; i < files.size(); i++)
+				for (typename Extents::iterator e = files[i].txn.begin(); e != files[i].txn.end(); ++e)
+					put(files[i].pending, e->first, &e->second[0], (int)e->second.size());
+			if (!unsynced++)
+				firstUnsynced = std::chrono::steady_clock::now();
+			nCommits++;
+		}
+		for (size_t i = 0; i < files.size(); i++) {
+			files[i].end = files[i].newEnd;
+			files[i].txn.clear();
+		}
+		buffer.clear();
+		inTxn = false;
+		if (unsynced &&
+			((syncCommits && unsynced >= syncCommits) ||
+			 (syncMillis && std::chrono::steady_clock::now() - firstUnsynced >= std::chrono::milliseconds(syncMillis))))
+			syncLocked();
+	}
+
+	/// Drop the writes of the open transaction
+	void rollback() // noexcept
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		dropTransaction();
+	}
+
+	/// Make the commits so far durable and write them to the files
+	void sync() // throw(...) // can throw io_error
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		syncLocked();
+	}
+
+	/// Sync, sync the files and start the log over
+	void checkpoint() // throw(...) // can throw io_error
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		syncLocked();
+		checkpointLocked();
+	}
+
+	/// Read from a file as written through the log
+	void read(int id, int64 offset, void* buffer, int size) // throw(...) // can throw io_error
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		File& file = files[id];
+		// logged writes may end past the end of the file on disk
+		int onDisk = offset + size <= file.size ? size : offset < file.size ? (int)(file.size - offset) : 0;
+		if (onDisk)
+			FileSystemT::readAt(file.fh, offset, buffer, onDisk);
+		memset((byte*)buffer + onDisk, 0, size - onDisk);
+		get(file.pending, offset, (byte*)buffer, size);
+		get(file.txn, offset, (byte*)buffer, size);
+	}
+
+	/// Write to a file in the open transaction
+	void write(int id, int64 offset, const void* data, int size) // throw(...) // can throw io_error or logic_error
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		File& file = files[id];
+		if (offset + size > file.end) {    // past the end as of the last commit: straight to the file
+			int64 from = offset > file.end ? offset : file.end;
+			FileSystemT::writeAt(file.fh, from, (const byte*)data + (from - offset), (int)(offset + size - from));
+			grow(file, offset + size);
+			file.direct = true;
+			if (offset >= file.end)
+				return;
+			size = (int)(file.end - offset);
+		}
+		if (!inTxn) {
+			char message[1024];
+			sprintf(message, "Write outside of a transaction to %s", FileSystemT::getName(file.fh));
+			throw logic_error(message);
+		}
+		appendRecord(cWrite, id, offset, data, size);
+		put(file.txn, offset, (const byte*)data, size);
+	}
+
+	/// Transactions committed, and syncs of the log
+	int64 commits() const { return nCommits; }
+	int64 syncs() const   { return nSyncs; }
+
+protected:
+	static const char* const cMagic;
+	enum { cWrite = 1, cCommit = 2 };
+
+	struct LogHeader
+	{
+		char   magic[8];
+		uint64 generation;   // counts checkpoints, the chain of checks starts from it
+	};
+
+	struct LogRecord
+	{
+		uint64 check;        // FNV-1a of the rest of the record, chained from the record before
+		uint32 size;         // bytes of data following
+		uint16 type;         // cWrite or cCommit
+		uint16 file;         // id of the file written
+		int64  offset;       // where in the file
+	};
+
+	struct Committed         // a committed write found in the log by open(), to replay
+	{
+		int   file;
+		int64 offset;
+		int   size;
+		int64 logPos;        // of the data in the log
+	};
+
+	typedef std::map<int64, std::vector<byte> > Extents;  // writes by file offset, never overlapping
+
+	struct File
+	{
+		FileHandle fh;
+		int64      end;      // the end of the file as of the last commit
+		int64      newEnd;   // as of the open transaction
+		int64      size;     // of the file on disk
+		bool       direct;   // written straight to since the last sync
+		Extents    pending;  // committed, waiting for the log to be synced
+		Extents    txn;      // written by the open transaction
+	};
+
+	FileHandle             log;
+	uint64                 generation;
+	uint64                 prevCheck;      // check of the last record in the log
+	int64                  appendPos;      // where the next commit goes in the log
+	std::vector<byte>      buffer;         // records of the open transaction
+	bool                   inTxn;
+	std::vector<File>      files;
+	std::vector<Committed> replay;         // found by open()
+	std::mutex             mutex;          // serializes reads and writes of the files and the log
+
+	int                    syncCommits;
+	int                    syncMillis;
+	int64                  checkpointBytes;
+	int                    unsynced;       // commits since the last sync
+	std::chrono::steady_clock::time_point firstUnsynced;
+	int64                  nCommits;
+	int64                  nSyncs;
+
+	static uint64 fnv(uint64 h, const void* data, size_t size)
+	{
+		const byte* p = (const byte*)data;
+		while (size--) {
+			h ^= *p++;
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	/// The check of a record (its data follows it) chained from the check before
+	static uint64 check(uint64 prev, const LogRecord* r)
+	{
+		uint64 h = fnv(14695981039346656037ull, &prev, sizeof(prev));
+		h = fnv(h, &r->size, sizeof(LogRecord) - offsetof(LogRecord, size));
+		return fnv(h, r + 1, r->size);
+	}
+
+	void appendRecord(int type, int id, int64 offset, const void* data, int size)
+	{
+		size_t pos = buffer.size();
+		buffer.resize(pos + sizeof(LogRecord) + size);
+		LogRecord* r = (LogRecord*)&buffer[pos];
+		r->check = 0;
+		r->size = size;
+		r->type = (uint16)type;
+		r->file = (uint16)id;
+		r->offset = offset;
+		if (size)
+			memcpy(r + 1, data, size);
+	}
+
+	/// Read the records of the log, keeping the writes of committed transactions.  The
+	//     next commit goes after the last of them.
+	void findCommitted(int64 size) // throw(...) // can throw io_error
+	{
+		uint64 chain = generation;
+		int64  pos = sizeof(LogHeader);
+		appendPos = pos;
+		prevCheck = chain;
+		std::vector<Committed> txn;
+		std::vector<byte> record;
+		while (pos + (int64)sizeof(LogRecord) <= size) {
+			record.resize(sizeof(LogRecord));
+			FileSystemT::readAt(log, pos, &record[0], sizeof(LogRecord));
+			uint32 dataSize = ((LogRecord*)&record[0])->size;
+			if (dataSize > size - pos - sizeof(LogRecord))
+				break;
+			record.resize(sizeof(LogRecord) + dataSize);
+			if (dataSize)
+				FileSystemT::readAt(log, pos + sizeof(LogRecord), &record[sizeof(LogRecord)], dataSize);
+			LogRecord* r = (LogRecord*)&record[0];
+			if (r->check != check(chain, r))
+				break;                          // torn, or left from before the last checkpoint
+			chain = r->check;
+			pos += sizeof(LogRecord) + dataSize;
+			if (r->type == cCommit) {
+				replay.insert(replay.end(), txn.begin(), txn.end());
+				txn.clear();
+				appendPos = pos;
+				prevCheck = chain;
+			} else {
+				Committed c = { r->file, r->offset, (int)dataSize, pos - dataSize };
+				txn.push_back(c);
+			}
+		}
+	}
+
+	/// Write a new header: the records in the log no longer count
+	void restart() // throw(...) // can throw io_error
+	{
+		LogHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, cMagic, sizeof(header.magic));
+		header.generation = generation;
+		try {
+			FileSystemT::writeAt(log, 0, &header, sizeof(header));
+			FileSystemT::sync(log);
+		} catch (...) {
+			log = 0;
+			throw;
+		}
+		appendPos = sizeof(header);
+		prevCheck = generation;
+	}
+
+	void dropTransaction() // noexcept
+	{
+		buffer.clear();
+		for (size_t i = 0; i < files.size(); i++) {
+			files[i].txn.clear();
+			files[i].newEnd = files[i].end;
+		}
+		inTxn = false;
+	}
+
+	void syncLocked() // throw(...) // can throw io_error
+	{
+		if (!unsynced)
+			return;
+		for (size_t i = 0; i < files.size(); i++)   // what the commits appended to the files first
+			if (files[i].fh && files[i].direct) {
+				FileSystemT::sync(files[i].fh);
+				files[i].direct = false;
+			}
+		try {
+			FileSystemT::sync(log);
+		} catch (...) {
+			log = 0;
+			throw;
+		}
+		nSyncs++;
+		unsynced = 0;
+		for (size_t i = 0; i < files.size(); i++) {
+			File& file = files[i];
+			for (typename Extents::iterator e = file.pending.begin(); e != file.pending.end(); ++e) {
+				FileSystemT::writeAt(file.fh, e->first, &e->second[0], (int)e->second.size());
+				grow(file, e->first + e->second.size());
+			}
+			file.pending.clear();
+		}
+		if (appendPos >= checkpointBytes)
+			checkpointLocked();
+	}
+
+	/// Sync the files and start the log over, unless a commit is not synced yet or a file
+	//     with writes to replay was not attached
+	void checkpointLocked() // throw(...) // can throw io_error
+	{
+		if (unsynced || inTxn)
+			return;
+		for (size_t i = 0; i < replay.size(); i++)
+			if (replay[i].file >= (int)files.size() || !files[replay[i].file].fh)
+				return;
+		if (appendPos == sizeof(LogHeader))
+			return;
+		for (size_t i = 0; i < files.size(); i++)
+			if (files[i].fh) {
+				FileSystemT::sync(files[i].fh);
+				files[i].direct = false;
+			}
+		replay.clear();
+		generation++;
+		restart();
+	}
+
+	static void grow(File& file, int64 end) // noexcept
+	{
+		if (end > file.size)
+			file.size = end;
+	}
+
+	/// Add a write to extents, merging it with the ones it overlaps
+	static void put(Extents& extents, int64 offset, const byte* data, int size)
+	{
+		if (!size)
+			return;
+		typename Extents::iterator i = extents.lower_bound(offset);
+		if (i != extents.end() && i->first == offset && (int)i->second.size() == size) {
+			memcpy(&i->second[0], data, size);    // the same node again
+			return;
+		}
+		int64 end = offset + size;
+		if (i != extents.begin()) {
+			typename Extents::iterator before = i;
+			if ((--before)->first + (int64)before->second.size() > offset)
+				i = before;
+		}
+		int64 from = offset, to = end;
+		typename Extents::iterator j;
+		for (j = i; j != extents.end() && j->first < end; ++j) {
+			if (j->first < from)
+				from = j->first;
+			if (j->first + (int64)j->second.size() > to)
+				to = j->first + j->second.size();
+		}
+		std::vector<byte> merged((size_t)(to - from));
+		for (typename Extents::iterator k = i; k != j; ++k)
+			memcpy(&merged[(size_t)(k->first - from)], &k->second[0], k->second.size());
+		memcpy(&merged[(size_t)(offset - from)], data, size);
+		extents.erase(i, j);
+		extents[from].swap(merged);
+	}
+
+	/// Copy the parts of extents that overlap size bytes at offset into buffer
+	static void get(const Extents& extents, int64 offset, byte* buffer, int size)
+	{
+		if (extents.empty())
+			return;
+		int64 end = offset + size;
+		typename Extents::const_iterator i = extents.upper_bound(offset);
+		if (i != extents.begin())
+			--i;
+		for (; i != extents.end() && i->first < end; ++i) {
+			int64 from = i->first > offset ? i->first : offset;
+			int64 to = i->first + (int64)i->second.size();
+			if (to > end)
+				to = end;
+			if (from < to)
+				memcpy(buffer + (from - offset), &i->second[(size_t)(from - i->first)], (size_t)(to - from));
+		}
+	}
+
+private:
+	WriteAheadLogT(const WriteAheadLogT&);
+	WriteAheadLogT& operator=(const WriteAheadLogT&);
+};
+
+template <class FileSystemT>
+const char* const WriteAheadLogT<FileSystemT>::cMagic = "nub WAL";
+
+typedef WriteAheadLogT<> WriteAheadLog;
+
+} // namespace nub
+
+#endif // __NUB_WRITEAHEADLOG_H__
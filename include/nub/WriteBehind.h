@@ -0,0 +1,282 @@
+/*  <nub/WriteBehind.h> -- Writes to a file handed to a background thread
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    write() copies the bytes into a queue and returns at once; a worker thread writes the
+    queue to the file in file order, runs of adjacent writes of one size with one
+    writeGather().  read() sees the writes still in the queue, so the file reads as if they
+    were done.  A write to the same place as a queued one is merged into it.  Writes to
+    different places must not overlap (IndexT's nodes and header do not).
+
+    The worker wakes up when half the limit start() was given is queued, and writes it
+    all, so that it writes batches and write() seldom has to wake it.  write() waits only
+    while more than the limit is queued (backpressure), so the writer never waits for the
+    disk otherwise.  drain() waits until the queue is written.  An io_error of the worker is thrown by the next write(), drain()
+    or stop(); the file handle is gone then, as after any io_error.
+
+    Where FileSystemT::cConcurrentIO is false (FileSystem, MmapFileSystem), the file is read
+    and written under a lock, so the file must be read through read() and readMany() while
+    attached.  Used by IndexT::startFlusher().
+*/
+
+#ifndef __NUB_WRITEBEHIND_H__
+#define __NUB_WRITEBEHIND_H__
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <string.h>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Base.h"
+#include "FileSystem.h"
+
+namespace nub {
+
+template <class FileSystemT = FileSystem>
+class WriteBehindT
+{
+public:
+	typedef typename FileSystemT::FileHandle FileHandle;
+
+	WriteBehindT() : f(0), maxBytes(0), bytes(0), draining(0), stopping(false), nWrites(0) {}
+
+	~WriteBehindT() // throw(...)
+		{ stop(); }
+
+	/// Start the worker for a file, with up to limit bytes queued before write() waits
+	void start(FileHandle fh, size_t limit) // throw(...) // can throw logic_error
+	{
+		if (f) {
+			char message[1024];
+			sprintf(message, "Write-behind already started for %s", FileSystemT::getName(f));
+			throw logic_error(message);
+		}
+		f = fh;
+		maxBytes = limit;
+		stopping = false;
+		error = std::exception_ptr();
+		worker = std::thread(&WriteBehindT::run, this);
+	}
+
+	/// Write what is queued and stop the worker
+	void stop() // throw(...) // can throw io_error
+	{
+		if (!f)
+			return;
+		{
+			std::lock_guard<std::mutex> hold(lock);
+			stopping = true;
+		}
+		work.notify_one();
+		worker.join();
+		f = 0;
+		rethrow();
+	}
+
+	bool running() const // noexcept
+		{ return f != 0; }
+
+	/// Queue a write, waiting while more than the limit is queued
+	void write(int64 pos, const void* buffer, int size) // throw(...) // can throw io_error
+	{
+		std::unique_lock<std::mutex> hold(lock);
+		while (bytes > maxBytes && !error)
+			room.wait(hold);
+		rethrow();
+		std::vector<byte>& data = queue[pos];
+		if ((int)data.size() < size) {
+			bytes += size - data.size();
+			data.resize(size);
+		}
+		memcpy(&data[0], buffer, size);
+		bool wake = writing.empty() && bytes >= wakeBytes();
+		hold.unlock();
+		if (wake)
+			work.notify_one();
+	}
+
+	/// Read the file as if the queued writes were done
+	void read(int64 pos, void* buffer, int size) // throw(...) // can throw io_error
+	{
+		ReadAt r = { pos, buffer, size };
+		readMany(&r, 1);
+	}
+
+	/// Read a batch of places in the file as if the queued writes were done
+	void readMany(const ReadAt* reads, int n) // throw(...) // can throw io_error
+	{
+		// the queued writes the reads overlap, copied first: one the worker writes meanwhile
+		//    is then in the file or in the copy, the same bytes either way
+		//    (one that covers a read spares reading the file, which may not reach that far yet)
+		std::vector<std::pair<int64, std::vector<byte> > > overlaps;
+		std::vector<ReadAt> fileReads;
+		{
+			std::lock_guard<std::mutex> hold(lock);
+			for (int i = 0; i < n; i++) {
+				size_t first = overlaps.size();
+				overlapping(writing, reads[i], overlaps);
+				overlapping(queue, reads[i], overlaps);   // newer: applied after writing's
+				bool covered = false;
+				for (size_t j = first; j < overlaps.size(); j++)
+					covered |= overlaps[j].first <= reads[i].pos &&
+					           overlaps[j].first + (int64)overlaps[j].second.size() >= reads[i].pos + reads[i].size;
+				if (!covered)
+					fileReads.push_back(reads[i]);
+			}
+		}
+		if (fileReads.empty())
+			;
+		else if (FileSystemT::cConcurrentIO)
+			FileSystemT::readMany(f, &fileReads[0], (int)fileReads.size());
+		else {
+			std::lock_guard<std::mutex> hold(io);
+			FileSystemT::readMany(f, &fileReads[0], (int)fileReads.size());
+		}
+		for (size_t j = 0; j < overlaps.size(); j++)
+			for (int i = 0; i < n; i++) {
+				int64 from = overlaps[j].first > reads[i].pos ? overlaps[j].first : reads[i].pos;
+				int64 to = overlaps[j].first + (int64)overlaps[j].second.size();
+				if (to > reads[i].pos + reads[i].size)
+					to = reads[i].pos + reads[i].size;
+				if (from < to)
+					memcpy((byte*)reads[i].buffer + (from - reads[i].pos),
+					       &overlaps[j].second[(size_t)(from - overlaps[j].first)], (size_t)(to - from));
+			}
+	}
+
+	/// Wait until the queue is written
+	void drain() // throw(...) // can throw io_error
+	{
+		std::unique_lock<std::mutex> hold(lock);
+		draining++;
+		work.notify_one();
+		while (bytes && !error)
+			room.wait(hold);
+		draining--;
+		rethrow();
+	}
+
+	/// Bytes queued or being written
+	size_t queued() // noexcept
+	{
+		std::lock_guard<std::mutex> hold(lock);
+		return bytes;
+	}
+
+	size_t limit() const // noexcept
+		{ return maxBytes; }
+
+	/// # of writes the worker has made (a run of adjacent ones is one)
+	int64 writes() // noexcept
+	{
+		std::lock_guard<std::mutex> hold(lock);
+		return nWrites;
+	}
+
+private:
+	typedef std::map<int64, std::vector<byte> > Queue;
+
+	FileHandle              f;
+	std::mutex              lock;      // for the rest:
+	std::condition_variable work;      //    the worker waits for writes,
+	std::condition_variable room;      //    write() and drain() for the worker to write some
+	Queue                   queue;     // writes not taken by the worker yet
+	Queue                   writing;   // the ones it is writing
+	size_t                  maxBytes;
+	size_t                  bytes;     // in both
+	int                     draining;  // # of threads in drain()
+	bool                    stopping;
+	int64                   nWrites;
+	std::exception_ptr      error;     // of the worker
+	std::mutex              io;        // the file, if FileSystemT::cConcurrentIO is false
+	std::thread             worker;
+
+	void rethrow() // throw(...)
+	{
+		if (error) {
+			std::exception_ptr e = error;
+			error = std::exception_ptr();
+			std::rethrow_exception(e);
+		}
+	}
+
+	/// Bytes queued that wake the worker up
+	size_t wakeBytes() const // noexcept
+		{ return maxBytes / 2 ? maxBytes / 2 : 1; }
+
+	/// Copy the writes of a queue that overlap a read
+	static void overlapping(const Queue& q, const ReadAt& r, std::vector<std::pair<int64, std::vector<byte> > >& overlaps)
+	{
+		typename Queue::const_iterator it = q.upper_bound(r.pos);
+		if (it != q.begin())
+			--it;
+		for (; it != q.end() && it->first < r.pos + r.size; ++it)
+			if (it->first + (int64)it->second.size() > r.pos)
+				overlaps.push_back(*it);
+	}
+
+	void run() // noexcept
+	{
+		std::unique_lock<std::mutex> hold(lock);
+		while (1) {
+			while (!stopping && !(draining && !queue.empty()) && bytes < wakeBytes())
+				work.wait(hold);
+			if (queue.empty())
+				break;                             // stopping
+			writing.swap(queue);
+			hold.unlock();
+			size_t written = 0;
+			int64  calls = 0;
+			try {
+				writeOut(written, calls);
+			} catch (...) {
+				hold.lock();
+				error = std::current_exception();
+				queue.clear();                     // the file is closed: nothing more to write
+				writing.clear();
+				bytes = 0;
+				room.notify_all();
+				break;
+			}
+			hold.lock();
+			writing.clear();
+			bytes -= written;
+			nWrites += calls;
+			room.notify_all();
+		}
+	}
+
+	/// Write what the worker took, runs of adjacent writes of one size with one writeGather()
+	void writeOut(size_t& written, int64& calls) // throw(...) // can throw io_error
+	{
+		std::vector<const void*> buffers;
+		for (typename Queue::iterator a = writing.begin(), b; a != writing.end(); a = b) {
+			int size = (int)a->second.size();
+			buffers.clear();
+			buffers.push_back(&a->second[0]);
+			for (b = a, ++b; b != writing.end() && (int)b->second.size() == size &&
+			     b->first == a->first + (int64)buffers.size() * size; ++b)
+				buffers.push_back(&b->second[0]);
+			if (FileSystemT::cConcurrentIO)
+				FileSystemT::writeGather(f, a->first, &buffers[0], (int)buffers.size(), size);
+			else {
+				std::lock_guard<std::mutex> hold(io);
+				FileSystemT::writeGather(f, a->first, &buffers[0], (int)buffers.size(), size);
+			}
+			written += buffers.size() * size;
+			calls++;
+		}
+	}
+};
+
+typedef WriteBehindT<> WriteBehind;
+
+} // namespace nub
+
+#endif // __NUB_WRITEBEHIND_H__
@@ -6,7 +6,7 @@
 
 #include "_ResourceFile.h"
 
-//template IndexT<IKeyASCIIZ, FileSystem, 1024, ResourceFile::ndxFilePosType, ResourceFile::datFilePosType>;
+//template IndexT<IKeyASCIIZ, ResourceFile::FileSystemType, 1024, ResourceFile::ndxFilePosType, ResourceFile::datFilePosType>;
 
 struct Init {
 	Init() { lzo_init(); }
@@ -16,71 +16,66 @@ struct Init {
 void
 ResourceFile::read(void* data, uint32 size, const datFilePosType& offset) // throw(...)
 {
-    const char* op = 0;
+	if (offset != -1)
+		pos = offset;
 	try {
-		if (offset != -1) {
-			op = "Seek";
-			FileSystem::seek(dat, offset);
-		}
-		op = "Read";
-		FileSystem::read(dat, data, size);
+		if (log.isOpen())
+			log.read(datFile, pos, data, size);
+		else
+			FileSystemType::readAt(dat, pos, data, size);
 	} catch (...) {
-        char message[1024];
-        sprintf(message, "%s failure on resource file data: %s", op, FileSystem::getName(dat));
-        FileSystem::close(dat);
-        dat = 0;
-        ndx.close();
-        throw io_error(message);
+		dat = 0;      // the FileSystem closed it when it threw
+		ndx.close();
+		throw;
 	}
+	pos += size;
 }
 
 
 void
 ResourceFile::write(void* data, uint32 size, const datFilePosType& offset) // throw(...)
 {
-    const char* op = 0;
+	if (offset != -1)
+		pos = offset;
 	try {
-		if (offset != -1) {
-			op = "Seek";
-			FileSystem::seek(dat, offset);
-		}
-		op = "Write";
-		FileSystem::write(dat, data, size);
+		if (log.isOpen())
+			log.write(datFile, pos, data, size);
+		else
+			FileSystemType::writeAt(dat, pos, data, size);
 	} catch (...) {
-        char message[1024];
-        sprintf(message, "%s failure on resource file data: %s", op, FileSystem::getName(dat));
-        FileSystem::close(dat);
-        dat = 0;
-        ndx.close();
-        throw io_error(message);
-    }
+		dat = 0;      // the FileSystem closed it when it threw
+		ndx.close();
+		throw;
+	}
+	pos += size;
 }
 
 
 bool
-ResourceFile::open(const char* filename, bool create) // throw(...)
+ResourceFile::open(const char* filename, bool create, bool logged) // throw(...)
 {
     char message[1024];
     bool err = false;
     close();
 	size_t len = strlen(filename);
-	char* tname = new char[len+3];
+	char* tname = new char[len+5];
     strcpy(tname, filename);
 	strcpy(tname + len, ".1");
-	dat = create ? FileSystem::create(tname) : FileSystem::open(tname);
+	dat = create ? FileSystemType::create(tname) : FileSystemType::open(tname);
 	if (!dat) {
-        delete tname;
+        delete[] tname;
         return false;
     }
+	pos = 0;
 	tname[len+1] = '0';
 	if (create) {
         try {
             ndx.create(tname, false);
         }
         catch (...) {
-			FileSystem::close(dat);
+			FileSystemType::close(dat);
 			dat = 0;
-            delete tname;
+            delete[] tname;
             throw;
         }
     	freelist = 0;
@@ -89,26 +84,101 @@ ResourceFile::open(const char* filename, bool create) // throw(...)
         write(&freelist, sizeof(datFilePosType));
 	} else if (!ndx.open(tname)) {
         sprintf(message, "Index file non-existent for resource file: %s", filename);
-        FileSystem::close(dat);
+        FileSystemType::close(dat);
         dat = 0;
-        delete tname;
+        delete[] tname;
         throw io_error(message);
 	} else {
         read(&filesize, sizeof(datFilePosType));
         read(&freelist, sizeof(datFilePosType));
 	}
-    delete tname;
+	strcpy(tname + len, ".log");
+	try {
+		if (create || !log.open(tname)) {
+			if (logged)
+				log.create(tname);
+			else
+				::remove(tname);
+		}
+		if (log.isOpen()) {
+			// the data file first, then the index, every time
+			datFile = log.attach(dat);
+			read(&filesize, sizeof(datFilePosType), 0);     // as replayed
+			read(&freelist, sizeof(datFilePosType));
+			log.setEnd(datFile, filesize);
+			ndx.attachLog(log);
+			if (!logged) {                 // recovered, and on without the log
+				ndx.detachLog();
+				log.close();
+				::remove(tname);
+			}
+		}
+	}
+	catch (...) {
+		delete[] tname;
+		close();
+		throw;
+	}
+    delete[] tname;
 	return true;
 }
 
 
+void
+ResourceFile::beginTransaction()
+{
+	if (!log.isOpen()) {
+		char message[1024];
+		sprintf(message, "A transaction needs a logged resource file: %s", dat ? FileSystemType::getName(dat) : "(closed)");
+		throw logic_error(message);
+	}
+	log.begin();
+}
+
+
+void
+ResourceFile::commit()
+{
+	if (!log.isOpen()) return;
+	ndx.logChanges();
+	write(&filesize, sizeof(filesize), 0);
+	write(&freelist, sizeof(freelist));
+	log.setEnd(datFile, filesize);
+	log.commit();
+}
+
+
+void
+ResourceFile::rollback()
+{
+	if (!log.isOpen()) return;
+	log.rollback();
+	ndx.dropChanges();
+	read(&filesize, sizeof(filesize), 0);
+	read(&freelist, sizeof(freelist));
+}
+
+
 void
 ResourceFile::close()
 {
 	if (dat) {
+		if (log.isOpen()) {
+			if (log.inTransaction())
+				commit();
+			ndx.detachLog();
+			const char* name = FileSystemType::getName(dat);   // filename.1
+			size_t len = strlen(name) - 2;
+			char* tname = new char[len+5];
+			memcpy(tname, name, len);
+			strcpy(tname + len, ".log");
+			log.close();
+			::remove(tname);
+			delete[] tname;
+		}
 		write(&filesize, sizeof(filesize), 0);
 		write(&freelist, sizeof(freelist));
-		FileSystem::close(dat);
+		FileSystemType::close(dat);
 		dat = 0;
 		ndx.close();
 	}
@@ -35,7 +35,7 @@ ResourceFile::get(const datFilePosType& offset, uint32& size)
 		if (r != LZO_E_OK || tsize != head.uncomp_size) {
 			delete buf;
             char message[1024];
-            sprintf(message, "LZO decompression error on resource file data: %s", FileSystem::getName(dat));
+            sprintf(message, "LZO decompression error on resource file data: %s", FileSystemType::getName(dat));
 			throw io_error(message);
 		}
     } else {
@@ -55,7 +55,7 @@ ResourceFile::get(const datFilePosType& offset, uint32& size)
 bool
 ResourceFile::get(const tChar* name, uint32& size, void*& data)
 {
-  if (!ndx.find(name)) return false;
+  if (!ndx.mayContain(name) || !ndx.find(name)) return false;
   void* key = NULL;
   datFilePosType ofs;
   ndx.getCurKey(key, ofs);
@@ -94,7 +94,7 @@ ResourceFile::getStream(const tChar* name)
 bool
 ResourceFile::getSize(const tChar* name, uint32& size, uint32& compressedSize)
 {
-    if (!ndx.find(name)) return false;
+    if (!ndx.mayContain(name) || !ndx.find(name)) return false;
 	void* key = NULL;
 	datFilePosType ofs;
 	ndx.getCurKey(key, ofs);
@@ -103,6 +103,13 @@ ResourceFile::getSize(const tChar* name, uint32& size, uint32& compressedSize)
 }
 
 
+int
+ResourceFile::resolve(const tChar* const* names, int count, datFilePosType* offsets, bool* found)
+{
+    return ndx.findMany((const void* const*)names, count, offsets, found);
+}
+
+
 void
 ResourceFile::getSize(const datFilePosType& offset, uint32& size, uint32& compressedSize)
 {
@@ -23,6 +23,7 @@ typedef ResourceFile::datFilePosType datFilePosType;
 datFilePosType
 ResourceFile::put(void* data, uint32 size)
 {
+	LoggedUpdate update(*this);
 	byte* comp = new byte[size + size / 16 + 64 + 3];	// allocate compressed data buffer
 
 // get wrkmem for lzo
@@ -47,6 +48,10 @@ ResourceFile::put(void* data, uint32 size)
 		data = comp;  // use compressed data
 	} else // unable to compress
 		usedHead.comp_size = 0;
+	// a block must be able to hold a FreeHeader once it is removed
+	uint32 blockSize = size + sizeof(UsedHeader);
+	if (blockSize < sizeof(FreeHeader))
+		blockSize = sizeof(FreeHeader);
 	FreeHeader freeHead; 	// block header in file
 	// search the free list for block big enough for size
 	datFilePosType offset = freelist;
@@ -54,9 +59,9 @@ ResourceFile::put(void* data, uint32 size)
 	FreeHeader prevHead;
 	while (offset) {
         read(&freeHead, sizeof(FreeHeader), offset);
-		if (freeHead.size >= size + sizeof(UsedHeader)) {
+		if (freeHead.size >= blockSize) {
 			// found a block big enough
-			if (freeHead.size <= size + sizeof(UsedHeader) + sizeof(FreeHeader)) {
+			if (freeHead.size <= blockSize + sizeof(FreeHeader)) {
 				// not big enough to split
 				usedHead.size = freeHead.size;
 				if (prevOfs) {
@@ -66,7 +71,7 @@ ResourceFile::put(void* data, uint32 size)
 					freelist = freeHead.next;
 			} else {
 				// split the free block
-				freeHead.size -= usedHead.size = sizeof(UsedHeader) + size;
+				freeHead.size -= usedHead.size = blockSize;
                 write(&freeHead.size, sizeof(datFilePosType), offset);
 				offset += freeHead.size;
 			}
@@ -79,24 +84,15 @@ ResourceFile::put(void* data, uint32 size)
 
 	if (!offset) {
 		// not found, append to end of file
-		try {
-			FileSystem::seek(dat, filesize);
-		} catch (...) {
-            char message[1024];
-            sprintf(message, "Seek error in resource file data: %s", FileSystem::getName(dat));
-            FileSystem::close(dat);
-            dat = 0;
-            ndx.close();
-            throw io_error(message);
-        }
-		usedHead.size = size + sizeof(UsedHeader);
+		usedHead.size = blockSize;
 		offset = filesize;
-		filesize += sizeof(UsedHeader) + size;
+		filesize += blockSize;
 	}
 	write(&usedHead, sizeof(UsedHeader), offset);
 	write(data, size);
 	delete comp;
 	if (!preallocated) postCompress();
+	update.done();
 	return offset;
 }
 
@@ -104,6 +100,7 @@ ResourceFile::put(void* data, uint32 size)
 void
 ResourceFile::put(const char* name, void* data, uint32 size)
 {
+	LoggedUpdate update(*this);
 	datFilePosType offset;
 	if (ndx.find(name)) {
 		void* key = NULL;
@@ -115,6 +112,7 @@ ResourceFile::put(const char* name, void* data, uint32 size)
 		offset = put(data, size);
 		ndx.insert(name, offset);
 	}
+	update.done();
 }
 
 
@@ -247,11 +245,16 @@ ResourceFile::remove(const datFilePosType& offset)
 bool
 ResourceFile::remove(const tChar* name)
 {
-	datFilePosType offset = ndx.find(name);
-	if (!offset)
+	if (!ndx.find(name))
 		return false;
+	LoggedUpdate update(*this);
+	void* key = NULL;
+	datFilePosType offset;
+	ndx.getCurKey(key, offset);
 	remove(offset);
-	return ndx.remove_current();
+	bool removed = ndx.remove_current();
+	update.done();
+	return removed;
 }
 
 
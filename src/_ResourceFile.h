@@ -15,5 +15,35 @@
 
 using namespace nub;
 
+// A put or remove of a logged resource file: a transaction of its own unless one is open
+struct LoggedUpdate
+{
+	ResourceFile& res;
+	bool          own;
+
+	LoggedUpdate(ResourceFile& res) : res(res), own(res.isLogged() && !res.inTransaction())
+	{
+		if (own)
+			res.beginTransaction();
+	}
+
+	void done()
+	{
+		if (own) {
+			res.commit();
+			own = false;
+		}
+	}
+
+	~LoggedUpdate()
+	{
+		if (own)
+			try {
+				res.rollback();
+			} catch (...) {
+			}
+	}
+};
+
 
 
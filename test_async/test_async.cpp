@@ -0,0 +1,290 @@
+/*  test_async.cpp -- Lookups that wait for their nodes together, with findAsync() and io_uring
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Looks up batches of keys (some missing) with findAsync() and one at a time with
+    find(), and checks that they agree: with UringFileSystem through io_uring and with
+    it turned off (the pread() fallback), with duplicate keys, front coded nodes and
+    a cache of a few nodes.  Then times find(), findMany() and findAsync() on an index
+    many times larger than the cache, with the file dropped from the page cache first
+    where the system allows it, so that the reads go to the disk.  Last, checks that a
+    batch of reads that fails, or that reads a corrupted node, leaves no node in the
+    cache that was not read.
+
+    usage: test_async [keys [lookups]]
+*/
+
+#include <nub/Index.h>
+#include <nub/UringFileSystem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#if NUB_PLATFORM == NUB_PLATFORM_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace nub;
+
+// A UringFileSystem whose batches of reads fail after so many, closing the file as a failed read does
+struct FailingFileSystem : UringFileSystem
+{
+	static int batches;   // # of batches until they fail (< 0: never)
+
+	static void readMany(FileHandle fh, const ReadAt* reads, int n) // throw(...)
+	{
+		if (batches >= 0 && batches-- == 0) {
+			char msg[1024];
+			sprintf(msg, "Read failure on file %s", getName(fh));
+			close(fh);
+			throw io_error(msg);
+		}
+		UringFileSystem::readMany(fh, reads, n);
+	}
+};
+
+int FailingFileSystem::batches = -1;
+
+typedef IndexT<IKeyASCIIZ, UringFileSystem> UringIndex;
+typedef IndexT<IKeyASCIIZ, UringFileSystem, 4096, uint32, uint32, CacheLRU, NodeFrontCoded<> > UringFrontIndex;
+typedef IndexT<IKeyASCIIZ, FailingFileSystem> FailingIndex;
+
+const char* filename = "test_async.ndx";
+
+std::vector<std::string> keys;
+
+bool check(bool ok, const char* what)
+{
+	if (!ok)
+		printf("FAILED: %s\n", what);
+	return ok;
+}
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// drop the index file from the page cache, so that reading a node goes to the disk
+void dropPages()
+{
+#if NUB_PLATFORM == NUB_PLATFORM_LINUX
+	int fd = open(filename, O_RDONLY);
+	if (fd >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+#endif
+}
+
+// keys of the index in random order, every fourth one missing
+void makeProbes(std::vector<std::string>& batch, std::vector<const void*>& probes, int size)
+{
+	batch.resize(size);
+	probes.resize(size);
+	for (int i = 0; i < size; i++) {
+		batch[i] = keys[rand() % keys.size()];
+		if (i % 4 == 3)
+			batch[i] += "x";
+		probes[i] = batch[i].c_str();
+	}
+}
+
+template <class I>
+bool agree(bool dups, int cacheSize, int nBatches)
+{
+	{
+		I ndx(cacheSize);
+		ndx.create(filename, dups);
+		for (int i = 0; i < (int)keys.size(); i++) {
+			ndx.insert(keys[i].c_str(), i);
+			if (dups && i % 3 == 0)
+				ndx.insert(keys[i].c_str(), (uint32)keys.size() + i);   // the first instance is i
+		}
+	}
+	I ndx(cacheSize);
+	ndx.open(filename);
+	std::vector<std::string> batch;
+	std::vector<const void*> probes;
+	bool ok = true;
+	for (int n = 0; ok && n < nBatches; n++) {
+		int size = 1 + rand() % 2000;
+		makeProbes(batch, probes, size);
+		std::vector<uint32> offsets(size);
+		bool* found = new bool[size];
+		int nFound = ndx.findAsync(&probes[0], size, &offsets[0], found);
+		int count = 0;
+		for (int i = 0; ok && i < size; i++) {
+			void*  key;
+			uint32 offset;
+			bool   there = ndx.find(probes[i]) && ndx.getCurKey(key, offset);
+			ok = there == found[i] && (!there || offset == offsets[i]);
+			count += there;
+		}
+		delete[] found;
+		ok = ok && count == nFound;
+	}
+	return ok && ndx.valid();
+}
+
+// a batch of reads that fails closes the index, which is then not used
+bool failedBatch()
+{
+	{
+		FailingIndex ndx(20);
+		ndx.create(filename);
+		for (int i = 0; i < (int)keys.size() / 4; i++)
+			ndx.insert(keys[i].c_str(), i);
+	}
+	FailingIndex ndx(20);
+	ndx.open(filename);
+	std::vector<std::string> batch;
+	std::vector<const void*> probes;
+	makeProbes(batch, probes, 500);
+	std::vector<uint32> offsets(probes.size());
+	bool* found = new bool[probes.size()];
+	FailingFileSystem::batches = 2;         // the root and the inner nodes are read
+	bool threw = false;
+	try {
+		ndx.findAsync(&probes[0], (int)probes.size(), &offsets[0], found);
+	} catch (io_error&) {
+		threw = true;
+	}
+	FailingFileSystem::batches = -1;
+	bool ok = check(threw, "findAsync() when reading a batch fails") &&
+	          check(!ndx.find(probes[0]) && !ndx.findAsync(&probes[0], (int)probes.size(), &offsets[0], found),
+	                "lookups in the index closed by the failed batch");
+	delete[] found;
+	ndx.close();
+	return ok;
+}
+
+// a batch that reads a corrupted node: the nodes read with it are read again
+bool corruptedNode()
+{
+	std::vector<std::string> sorted(keys);
+	std::sort(sorted.begin(), sorted.end());
+	int n = (int)sorted.size();
+	{
+		UringFrontIndex ndx;
+		ndx.create(filename);
+		ndx.beginLoad();
+		for (int i = 0; i < n; i++)
+			ndx.load(sorted[i].c_str(), i);
+		ndx.endLoad();
+	}
+	FILE* file = fopen(filename, "r+b");      // the 10th node is a leaf: a bulk load writes them first
+	int32 count = 0x7fffffff;
+	fseek(file, 10 * 4096, SEEK_SET);
+	fwrite(&count, sizeof(count), 1, file);
+	fclose(file);
+
+	UringFrontIndex ndx(20);
+	ndx.open(filename);
+	int lo = -1, hi = -1;                     // the keys in the corrupted leaf
+	for (int i = 0; i < n; i++)
+		try {
+			ndx.find(sorted[i].c_str());
+		} catch (io_error&) {
+			if (lo < 0)
+				lo = i;
+			hi = i;
+		}
+	bool ok = check(lo > 0 && hi < n - 1, "finds in a corrupted leaf");
+	int span = hi - lo + 1;
+	std::vector<const void*> around, good;    // the leaves around it, read in batches with it
+	std::vector<int>         goodAt;
+	for (int i = std::max(0, lo - 3 * span); ok && i <= std::min(n - 1, hi + 3 * span); i++) {
+		around.push_back(sorted[i].c_str());
+		if (i < lo || i > hi) {
+			good.push_back(sorted[i].c_str());
+			goodAt.push_back(i);
+		}
+	}
+	std::vector<uint32> offsets(around.size());
+	bool* found = new bool[around.size()];
+	bool threw = false;
+	try {
+		if (ok)
+			ndx.findAsync(&around[0], (int)around.size(), &offsets[0], found);
+	} catch (io_error&) {
+		threw = true;
+	}
+	ok = ok && check(threw, "findAsync() of a corrupted leaf");
+	int nFound = ok ? ndx.findAsync(&good[0], (int)good.size(), &offsets[0], found) : 0;
+	ok = ok && check(nFound == (int)good.size(), "findAsync() after a batch with a corrupted leaf");
+	for (int i = 0; ok && i < (int)good.size(); i++)
+		ok = check(found[i] && offsets[i] == (uint32)goodAt[i], "a key found after a batch with a corrupted leaf");
+	delete[] found;
+	ndx.close();
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys    = argc > 1 ? atoi(argv[1]) : 200000;
+	int nLookups = argc > 2 ? atoi(argv[2]) : 20000;
+
+	keys.resize(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[32];
+		sprintf(key, "res/%06x/%d.png", (rand() * (unsigned)RAND_MAX + rand()) & 0xffffff, i);
+		keys[i] = key;
+	}
+
+	bool ring = UringFileSystem::usingRing();
+	printf("io_uring %s\n", ring ? "in use" : "not available: pread()");
+	bool ok = check(agree<UringIndex>(false, 20, 20), "findAsync() and find() differ") &&
+	          check(agree<UringIndex>(true, 20, 20), "findAsync() and find() differ, duplicates") &&
+	          check(agree<UringIndex>(false, 3, 5), "findAsync() and find() differ, 3 nodes cached") &&
+	          check(agree<UringFrontIndex>(true, 20, 5), "findAsync() and find() differ, front coded") &&
+	          check(agree<Index>(false, 20, 5), "findAsync() and find() differ, FileSystem");
+	UringFileSystem::enable(false);
+	ok = ok && check(!UringFileSystem::usingRing() && agree<UringIndex>(true, 20, 5),
+	                 "findAsync() and find() differ without io_uring");
+	UringFileSystem::enable(true);
+
+	// timing: a cache of 1/20 of the nodes, and the pages of the file dropped before each
+	UringIndex ndx(nKeys / 600 + 20);
+	std::vector<std::string> batch;
+	std::vector<const void*> probes;
+	makeProbes(batch, probes, nLookups);
+	std::vector<uint32> offsets(nLookups);
+	bool* found = new bool[nLookups];
+	double times[4];
+	for (int way = 0; ok && way < 4; way++) {
+		ndx.close();                         // an empty cache
+		ndx.open(filename);
+		dropPages();
+		UringFileSystem::enable(way != 2);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (way == 0)
+			for (int i = 0; i < nLookups; i++)
+				found[i] = ndx.find(probes[i]);
+		else if (way == 1)
+			ndx.findMany(&probes[0], nLookups, &offsets[0], found);
+		else
+			ndx.findAsync(&probes[0], nLookups, &offsets[0], found);
+		times[way] = seconds(start);
+	}
+	UringFileSystem::enable(true);
+	delete[] found;
+	printf("%d lookups (us/lookup): find() %.2f, findMany() %.2f, findAsync() %.2f with pread(), %.2f with %s\n",
+	       nLookups, times[0] * 1e6 / nLookups, times[1] * 1e6 / nLookups, times[2] * 1e6 / nLookups,
+	       times[3] * 1e6 / nLookups, ring ? "io_uring" : "pread()");
+
+	ndx.close();
+	ok = ok && check(failedBatch(), "a failed batch of reads") &&
+	     check(corruptedNode(), "a corrupted node");
+
+	remove(filename);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+/*  test_build.cpp -- Build indexes from unsorted keys with IndexBuilder
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Builds indexes with and without duplicates, for Index and UniIndex, with the
+    smallest memory budget (many runs, merged in several passes) and with one big
+    enough to sort in memory, and checks every key against a sorted copy.
+
+    usage: test_build [keys]
+*/
+
+#include <nub/IndexBuilder.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using namespace nub;
+
+const char* ndxName = "test_build.ndx";
+const int   keyLen  = 8;   // short keys from a small alphabet, so there are duplicates
+
+struct Entry
+{
+	wchar_t key[keyLen + 1];
+	uint32  offset;
+
+	bool operator<(const Entry& rhs) const
+	{
+		int cmp = wcscmp(key, rhs.key);
+		return cmp ? cmp < 0 : offset < rhs.offset;
+	}
+};
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// the keys as narrow or wide strings
+void keyOf(const Entry& e, char* key)          { for (int i = 0; (key[i] = (char)e.key[i]); i++) ; }
+void keyOf(const Entry& e, wchar_t* key)       { wcscpy(key, e.key); }
+bool sameKey(const char* key, const Entry& e)  { char k[keyLen + 1]; keyOf(e, k); return !strcmp(key, k); }
+bool sameKey(const wchar_t* key, const Entry& e) { return !wcscmp(key, e.key); }
+
+template <class IndexType, typename Char>
+bool test(const char* title, const std::vector<Entry>& entries, bool dups, size_t budget)
+{
+	IndexType ndx(100);
+	ndx.create(ndxName, dups);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	IndexBuilderT<IndexType> builder(ndx, budget);
+	Char key[keyLen + 1];
+	for (size_t i = 0; i < entries.size(); i++) {
+		keyOf(entries[i], key);
+		builder.add(key, entries[i].offset);
+	}
+	int runs = builder.runCount();
+	int loaded = builder.build();
+	ndx.close();
+	double time = seconds(start);
+
+	// what the index should hold: keys and offsets in order, without repeats
+	std::vector<Entry> sorted(entries);
+	std::sort(sorted.begin(), sorted.end());
+	std::vector<Entry> expect;
+	for (size_t i = 0; i < sorted.size(); i++)
+		if (expect.empty() || wcscmp(sorted[i].key, expect.back().key) ||
+			(dups && sorted[i].offset != expect.back().offset))
+			expect.push_back(sorted[i]);
+
+	printf("%-22s %8d keys, %3d runs, %7.3f s\n", title, loaded, runs, time);
+	bool ok = ndx.open(ndxName) && loaded == (int)expect.size() &&
+	          ndx.count() == loaded && ndx.valid();
+	void*  k;
+	uint32 offset;
+	bool   more = ndx.first();
+	for (size_t i = 0; ok && i < expect.size(); i++, more = ndx.next())
+		ok = more && ndx.getCurKey(k, offset) &&
+		     sameKey((Char*)k, expect[i]) && offset == expect[i].offset;
+	ok = ok && !more;
+	ndx.close();
+	remove(ndxName);
+	if (!ok)
+		printf("FAILED: %s\n", title);
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 200000;
+
+	std::vector<Entry> entries(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		int len = 1 + rand() % keyLen;
+		for (int j = 0; j < len; j++)
+			entries[i].key[j] = 'a' + rand() % 8;
+		entries[i].key[len] = 0;
+		entries[i].offset = rand() % nKeys;  // some keys are repeated with the same offset
+	}
+
+	const size_t small = 0;         // the builder raises it to its minimum
+	const size_t large = 64 << 20;
+	bool ok = test<Index,    char   >("Index",              entries, false, small) &
+	          test<Index,    char   >("Index, dups",        entries, true,  small) &
+	          test<Index,    char   >("Index, in memory",   entries, true,  large) &
+	          test<UniIndex, wchar_t>("UniIndex",           entries, false, small) &
+	          test<UniIndex, wchar_t>("UniIndex, dups",     entries, true,  small) &
+	          test<UniIndex, wchar_t>("UniIndex, in memory", entries, false, large);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+/*  test_cache.cpp -- Benchmark of Index::find() latency versus node cache size,
+                      and of the cache policies when point lookups are mixed with scans
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    usage: test_cache [keys [finds]]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+using namespace nub;
+
+const char* filename = "test_cache.ndx";
+const int   keyLen   = 16;
+
+char randKey[keyLen + 1];
+
+char* getRandKey()
+{
+	for (int j = 0; j < keyLen; j++)
+		randKey[j] = 'a' + rand() % 26;
+	randKey[keyLen] = '\0';
+	return randKey;
+}
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* Rounds of finds on a hot set of keys, each followed by a full first()/next() scan.
+   The hot keys are the lowest nHot keys in the index, so they sit in a few leaves that
+   fit in the cache.  Statistics are taken after the first round. */
+template <class Policy>
+int policyRun(int nMaxCache, int nHot, int nFinds, int nRounds)
+{
+	typedef IndexT<IKeyASCIIZ, FileSystem, 4096, uint32, uint32, Policy> PolicyIndex;
+	PolicyIndex ndx(nMaxCache);
+	ndx.open(filename);
+
+	char (*hot)[keyLen + 1] = new char[nHot][keyLen + 1];
+	ndx.first();
+	for (int i = 0; i < nHot; i++) {
+		void* key;
+		uint32 offset;
+		ndx.getCurKey(key, offset);
+		strcpy(hot[i], (char*)key);
+		ndx.next();
+	}
+
+	CacheStats finds, scans;
+	double elapsed = 0;
+	srand(2);
+	for (int round = 0; round < nRounds; round++) {
+		ndx.resetCacheStats();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int i = 0; i < nFinds; i++) {
+			const char* key = hot[rand() % nHot];
+			if (!ndx.find(key)) {
+				printf("Key not found: %s\n", key);
+				return 1;
+			}
+		}
+		if (round) {
+			elapsed += seconds(start);
+			finds.hits += ndx.cacheStats().hits;
+			finds.misses += ndx.cacheStats().misses;
+		}
+		ndx.resetCacheStats();
+		for (bool ok = ndx.first(); ok; ok = ndx.next())
+			;
+		if (round) {
+			scans.hits += ndx.cacheStats().hits;
+			scans.misses += ndx.cacheStats().misses;
+		}
+	}
+	printf("%-6s finds: %6.2f%% hits, %5d reads/round, %6.0f ns/find    scans: %6.2f%% hits\n",
+		   Policy::name(), finds.hitRate() * 100, (int)(finds.misses / (nRounds - 1)),
+		   elapsed * 1e9 / ((double)nFinds * (nRounds - 1)), scans.hitRate() * 100);
+	delete[] hot;
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys  = argc > 1 ? atoi(argv[1]) : 200000;
+	int nFinds = argc > 2 ? atoi(argv[2]) : 200000;
+
+	{
+		Index ndx(1000);
+		ndx.create(filename);
+		srand(1);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int i = 0; i < nKeys; i++)
+			ndx.insert(getRandKey(), i);
+		printf("%d keys inserted in %.2f s\n", nKeys, seconds(start));
+	}
+
+	static const int cacheSizes[] = { 10, 100, 1000, 10000 };
+	for (int c = 0; c < (int)(sizeof(cacheSizes) / sizeof(cacheSizes[0])); c++) {
+		Index ndx(cacheSizes[c]);
+		ndx.open(filename);
+		double elapsed = 0;
+		for (int pass = 0; pass < 2; pass++) {   // the first pass warms the cache
+			srand(1);
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (int i = 0; i < nFinds; i++) {
+				if (i % nKeys == 0)
+					srand(1);
+				if (!ndx.find(getRandKey())) {
+					printf("Key not found: %s\n", randKey);
+					return 1;
+				}
+			}
+			elapsed = seconds(start);
+		}
+		printf("nMaxCache %6d: %8.0f ns/find\n", cacheSizes[c], elapsed * 1e9 / nFinds);
+	}
+
+	const int policyCache = 200;
+	const int nHot = nKeys / 20;
+	printf("\nnMaxCache %d, %d hot keys, scan after every %d finds\n", policyCache, nHot, nFinds / 100);
+	if (policyRun<CacheLRU>(policyCache, nHot, nFinds / 100, 6) ||
+		policyRun<CacheCLOCK>(policyCache, nHot, nFinds / 100, 6) ||
+		policyRun<Cache2Q>(policyCache, nHot, nFinds / 100, 6))
+		return 1;
+	remove(filename);
+	return 0;
+}
@@ -0,0 +1,330 @@
+/*  test_counted.cpp -- Subtree counts: the key of a rank, the rank of a key and range counts
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Inserts and removes keys of many lengths in an index of counted nodes (NodeCounted)
+    with a small cache, so that nodes split and merge, keys are pulled up out of leaves
+    and nodes are written and read again, and checks seek(), rank() and countRange()
+    against the keys in order every so often, and after the index is opened again.
+    Does it again with small nodes and IndexT(2) (the least cache, four nodes), so the
+    tree is five or more levels deep and updating the counts above a leaf evicts it,
+    and puts keys back over leaves that removes emptied.
+    Checks insertMany(), a bulk load, pack(), a rollback of a log, copy-on-write mode,
+    duplicates, Cursor::seek(), and that the other node formats and concurrent writes
+    refuse.  Then times going to a page of a listing and counting a range both ways.
+
+    usage: test_counted [keys]
+*/
+
+#include <nub/Index.h>
+#include <nub/PositionalFileSystem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+typedef IndexT<IKeyASCIIZ, PositionalFileSystem, 4096, uint32, uint32, CacheLRU, NodeCounted> CountedIndex;
+typedef IndexT<IKeyASCIIZ, PositionalFileSystem, 512,  uint32, uint32, CacheLRU, NodeCounted> SmallIndex;
+
+const char* filename = "test_counted.ndx";
+const char* logname  = "test_counted.log";
+
+std::vector<std::string> keys;
+std::set<std::string>    there;   // the keys in the index
+
+bool check(bool ok, const char* what)
+{
+	if (!ok)
+		printf("FAILED: %s\n", what);
+	return ok;
+}
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// seek(), rank() and countRange() agree with the keys there, for every step'th rank
+template <class Ndx>
+bool ranks(Ndx& ndx, int step)
+{
+	std::vector<std::string> sorted(there.begin(), there.end());
+	int n = (int)sorted.size();
+	if (ndx.count() != n || ndx.seek(n) || ndx.seek(-1))
+		return false;
+	for (int i = 0; i < n; i += step) {
+		void*  key;
+		uint32 offset;
+		if (!ndx.seek(i) || !ndx.getCurKey(key, offset) || sorted[i] != (const char*)key ||
+			ndx.rank(sorted[i].c_str()) != i)
+			return false;
+		if (i + 1 < n && (!ndx.next() || !ndx.getCurKey(key, offset) || sorted[i + 1] != (const char*)key))
+			return false;
+	}
+	for (int i = 0; i + step < n; i += step)
+		if (ndx.countRange(sorted[i].c_str(), sorted[i + step].c_str()) != step ||
+			ndx.countRange(sorted[i].c_str(), 0) != n - i || ndx.countRange(0, sorted[i].c_str()) != i)
+			return false;
+	return ndx.countRange(0, 0) == n && ndx.rank("") == 0;
+}
+
+// 512 byte nodes hold ten or so keys, so 20000 keys are five or more levels deep
+template <class Ndx>
+bool insertRemove(int maxCache)
+{
+	int n = (int)keys.size();
+	Ndx ndx(maxCache);
+	ndx.create(filename);
+	there.clear();
+	bool ok = true;
+	for (int i = 0; ok && i < n; i++) {
+		ndx.insert(keys[i].c_str(), i);
+		there.insert(keys[i]);
+		if (i % (n / 8) == 0)
+			ok = check(ranks(ndx, 7), "ranks while inserting");
+	}
+	ok = ok && check(ranks(ndx, 1), "ranks after inserts");
+	for (int i = 0; ok && i < n; i += 2) {
+		ndx.remove(keys[i].c_str());
+		there.erase(keys[i]);
+		if (i % (n / 4) == 0)
+			ok = check(ranks(ndx, 7), "ranks while removing");
+	}
+	ok = ok && check(ranks(ndx, 1), "ranks after removes");
+	ndx.close();
+
+	ndx.open(filename);                      // the counts as written
+	ok = ok && check(ranks(ndx, 1), "ranks after open()");
+	for (int i = 1; i < n; i += 4) {         // down to a few levels
+		ndx.remove(keys[i].c_str());
+		there.erase(keys[i]);
+	}
+	ok = ok && check(ranks(ndx, 1), "ranks after more removes");
+	for (int i = 1; i < n; i += 8) {         // some back, also over leaves emptied and freed
+		ndx.insert(keys[i].c_str(), i);
+		there.insert(keys[i]);
+	}
+	ok = ok && check(ranks(ndx, 1), "ranks after inserting again");
+	ndx.pack(70);
+	ok = ok && check(ranks(ndx, 1), "ranks after pack()");
+	ndx.close();
+	return ok;
+}
+
+// insertMany() and a bulk load
+bool batches()
+{
+	int n = (int)keys.size();
+	std::vector<const void*> batch(n / 2);
+	std::vector<uint32>      offsets(n / 2);
+	for (int i = 0; i < n / 2; i++) {
+		batch[i] = keys[i].c_str();
+		offsets[i] = i;
+	}
+	CountedIndex ndx(30);
+	ndx.create(filename);
+	there.clear();
+	for (int i = n / 2; i < n; i += 3) {
+		ndx.insert(keys[i].c_str(), i);
+		there.insert(keys[i]);
+	}
+	ndx.insertMany(&batch[0], &offsets[0], n / 2);
+	there.insert(keys.begin(), keys.begin() + n / 2);
+	bool ok = check(ranks(ndx, 1), "ranks after insertMany()");
+
+	ndx.create(filename);
+	ndx.beginLoad(80);
+	for (std::set<std::string>::iterator it = there.begin(); it != there.end(); ++it)
+		ndx.load(it->c_str(), 0);
+	ndx.endLoad();
+	ok = ok && check(ranks(ndx, 1), "ranks after a bulk load");
+	ndx.close();
+	return ok;
+}
+
+// the counts of a rolled back transaction, and of copy-on-write mode
+bool logAndCopyOnWrite()
+{
+	int n = (int)keys.size();
+	WriteAheadLogT<PositionalFileSystem> log;
+	log.create(logname);
+	CountedIndex ndx(30);
+	ndx.create(filename);
+	ndx.attachLog(log);
+	there.clear();
+	ndx.beginTransaction();
+	for (int i = 0; i < n / 2; i++) {
+		ndx.insert(keys[i].c_str(), i);
+		there.insert(keys[i]);
+	}
+	ndx.commit();
+	ndx.beginTransaction();
+	for (int i = 0; i < n / 2; i += 3)
+		ndx.remove(keys[i].c_str());
+	for (int i = n / 2; i < n; i++)
+		ndx.insert(keys[i].c_str(), i);
+	ndx.rollback();
+	bool ok = check(ranks(ndx, 1), "ranks after rollback()");
+	ndx.detachLog();
+	log.close();
+	remove(logname);
+
+	ndx.beginCopyOnWrite();
+	for (int i = 0; i < n / 2; i += 3) {
+		ndx.remove(keys[i].c_str());
+		there.erase(keys[i]);
+	}
+	ndx.publish();
+	ndx.endCopyOnWrite();
+	ok = ok && check(ranks(ndx, 1), "ranks after copy-on-write");
+	ndx.close();
+	ndx.open(filename);
+	ok = ok && check(ranks(ndx, 1), "ranks after copy-on-write and open()");
+	ndx.close();
+	return ok;
+}
+
+// duplicates: rank() is the rank of the first instance
+bool duplicates()
+{
+	CountedIndex ndx(30);
+	ndx.create(filename, true);
+	for (int i = 0; i < 1000; i++)
+		for (int d = 0; d < 3; d++)
+			ndx.insert(keys[i].c_str(), d);
+	std::vector<std::string> sorted(keys.begin(), keys.begin() + 1000);
+	std::sort(sorted.begin(), sorted.end());
+	bool ok = true;
+	for (int i = 0; ok && i < 1000; i++) {
+		void*  key;
+		uint32 offset;
+		ok = ndx.rank(sorted[i].c_str()) == 3 * i &&
+		     ndx.countRange(sorted[i].c_str(), i + 1 < 1000 ? sorted[i + 1].c_str() : 0) == 3 &&
+		     ndx.seek(3 * i + 2) && ndx.getCurKey(key, offset) && sorted[i] == (const char*)key && offset == 2;
+	}
+	ndx.close();
+	return check(ok, "ranks of duplicates");
+}
+
+// a cursor goes on from the key it was put on
+bool cursor()
+{
+	CountedIndex ndx(30);
+	ndx.create(filename);
+	there.clear();
+	for (int i = 0; i < (int)keys.size(); i++) {
+		ndx.insert(keys[i].c_str(), i);
+		there.insert(keys[i]);
+	}
+	std::vector<std::string> sorted(there.begin(), there.end());
+	CountedIndex::Cursor c(ndx);
+	bool ok = c.seek((int)sorted.size() / 3);
+	for (int i = (int)sorted.size() / 3; ok && i < (int)sorted.size(); i++) {
+		void*  key;
+		uint32 offset;
+		ok = c.getCurKey(key, offset) && sorted[i] == (const char*)key && c.next() == (i + 1 < (int)sorted.size());
+	}
+	ndx.close();
+	return check(ok, "Cursor::seek()");
+}
+
+bool refused()
+{
+	bool ok = true;
+	Index plain(20);
+	plain.create(filename);
+	try {
+		plain.seek(0);
+		ok = check(false, "seek() of plain nodes");
+	} catch (logic_error&) {
+	}
+	plain.close();
+	CountedIndex ndx(20);
+	ndx.create(filename);
+	try {
+		ndx.beginConcurrentWrites();
+		ok = check(false, "concurrent writes of counted nodes");
+	} catch (logic_error&) {
+	}
+	ndx.close();
+	return ok;
+}
+
+// the 100 keys of a page in the middle, and the keys in a range, by rank and by walking
+void timePages()
+{
+	int n = (int)keys.size();
+	CountedIndex ndx(n / 1200 + 20);
+	ndx.create(filename);
+	for (int i = 0; i < n; i++)
+		ndx.insert(keys[i].c_str(), i);
+	int page = n / 200, pages = 20;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int r = 0; r < pages; r++) {
+		ndx.first();
+		for (int i = 0; i < page * 100 + r; i++)
+			ndx.next();
+	}
+	double walked = seconds(start);
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < pages; r++)
+		ndx.seek(page * 100 + r);
+	double sought = seconds(start);
+
+	struct Counter
+	{
+		int keys;
+		bool operator()(const void*, const uint32&) { keys++; return true; }
+	} counter = { 0 };
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < pages; r++)
+		ndx.scan(keys[r].c_str(), keys[r + 1].c_str(), counter);
+	double scanned = seconds(start);
+	int counted = 0;
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < pages; r++)
+		counted += ndx.countRange(keys[r].c_str(), keys[r + 1].c_str());
+	double ranked = seconds(start);
+	ndx.close();
+	printf("page %d of 100 keys: %8.1f us walking next(), %6.1f us with seek()\n",
+	       page, walked * 1e6 / pages, sought * 1e6 / pages);
+	printf("keys in a range:     %8.1f us with scan(),    %6.1f us with countRange() (%d keys, %d)\n",
+	       scanned * 1e6 / pages, ranked * 1e6 / pages, counter.keys, counted);
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 20000;
+
+	keys.resize(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[80];
+		int  length = sprintf(key, "%08x", rand() * (unsigned)RAND_MAX + rand());
+		for (int j = rand() % 48; j > 0; j--)       // of many lengths
+			key[length++] = 'a' + rand() % 26;
+		sprintf(key + length, "%07d", i);
+		keys[i] = key;
+	}
+
+	bool ok = check(insertRemove<CountedIndex>(30), "inserts and removes") &&
+	          check(insertRemove<SmallIndex>(2), "inserts and removes with a cache of two") &&
+	          check(batches(), "insertMany() and bulk load") &&
+	          check(logAndCopyOnWrite(), "log and copy-on-write") &&
+	          check(duplicates(), "duplicates") &&
+	          check(cursor(), "cursor") &&
+	          check(refused(), "refused");
+	timePages();
+
+	remove(filename);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+/*  test_cursor.cpp -- Several cursors walking one index at once
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Walks an index forwards and backwards with two cursors in step, runs finds on a
+    third cursor and on the index itself in between, and checks that none of them
+    disturbs the others, that the index's cache is shared (one index, no reopening)
+    and that inserting a key ends the scans of the cursors.
+
+    usage: test_cursor [keys]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+const char* filename = "test_cursor.ndx";
+
+bool check(bool ok, const char* what)
+{
+	if (!ok)
+		printf("FAILED: %s\n", what);
+	return ok;
+}
+
+// the key and data offset at a cursor (or the index itself)
+template <class Position>
+bool at(Position& pos, const std::vector<std::string>& keys, int i)
+{
+	void*  key;
+	uint32 offset;
+	return pos.getCurKey(key, offset) && keys[i] == (char*)key && offset == (uint32)i;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 50000;
+
+	std::vector<std::string> keys(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[32];
+		sprintf(key, "%08x%05d", rand() * (unsigned)RAND_MAX + rand(), i);
+		keys[i] = key;
+	}
+	std::sort(keys.begin(), keys.end());
+
+	Index ndx(50);
+	ndx.create(filename);
+	ndx.beginLoad();
+	for (int i = 0; i < nKeys; i++)
+		ndx.load(keys[i].c_str(), i);
+	ndx.endLoad();
+
+	Index::Cursor forward(ndx), backward(ndx), finder(ndx);
+	bool ok = check(forward.first() && backward.last(), "first/last");
+	ok = ok && check(ndx.find(keys[nKeys / 2].c_str()), "find on the index");
+	for (int i = 0; ok && i < nKeys; i++) {
+		ok = check(at(forward, keys, i) && at(backward, keys, nKeys - 1 - i), "scans in step");
+		int r = rand() % nKeys;
+		ok = ok && check(finder.find(keys[r].c_str()) && at(finder, keys, r), "find on a cursor");
+		if (i + 1 < nKeys)
+			ok = ok && check(forward.next() && backward.prev(), "next/prev");
+	}
+	ok = ok && check(!forward.next() && !backward.prev(), "end of the scans");
+	ok = ok && check(at(ndx, keys, nKeys / 2), "the index's current key is left alone");
+
+	// a key that is not there leaves the cursor on the next one
+	std::string missing = keys[10] + "!";
+	ok = ok && check(!finder.find(missing.c_str()) && at(finder, keys, 11), "find of a missing key");
+	ok = ok && check(finder.prev() && at(finder, keys, 10), "prev after a missing key");
+
+	// inserting a key ends the scans of the cursors, until they are positioned again
+	ok = ok && check(forward.first() && ndx.insert("~", nKeys), "insert");
+	ok = ok && check(!forward.next() && !finder.next(), "insert ends the scans");
+	ok = ok && check(forward.last() && at(forward, std::vector<std::string>(nKeys + 1, "~"), nKeys),
+	                 "positioned again");
+	printf("%d keys, %d cache misses\n", nKeys, (int)ndx.cacheStats().misses);
+
+	ndx.close();
+	remove(filename);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,223 @@
+/*  test_filter.cpp -- A Bloom filter of the keys, kept in a file beside the index
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Inserts half the keys with a filter attached (see IndexT::attachFilter()), and checks
+    that mayContain() is true for each of them and false for most of the other half, near
+    the rate of false positives asked for, and that findMany() and findAsync() find the
+    same keys with the filter as without, and skip the index for most of those not there.  Checks that the filter file is used again when the index is
+    opened again, without a scan, and built again when the index was changed without it,
+    when many keys were removed, and after a bulk load.  Then times finds of keys that are
+    not there, with and without asking the filter first.
+
+    usage: test_filter [keys]
+*/
+
+#include <nub/Index.h>
+#include <nub/PositionalFileSystem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+typedef IndexT<IKeyASCIIZ, PositionalFileSystem> PositionalIndex;
+
+const char* filename   = "test_filter.ndx";
+const char* filtername = "test_filter.ndx.filter";
+const double cRate     = 0.01;
+
+std::vector<std::string> keys;
+
+bool check(bool ok, const char* what)
+{
+	if (!ok)
+		printf("FAILED: %s\n", what);
+	return ok;
+}
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// mayContain() is true for the keys in [from, to), and the rate of it for the other keys
+bool filters(PositionalIndex& ndx, int from, int to, double* rate)
+{
+	int n = (int)keys.size(), positives = 0;
+	for (int i = 0; i < n; i++) {
+		bool may = ndx.mayContain(keys[i].c_str());
+		if (i >= from && i < to) {
+			if (!may)
+				return false;
+		} else
+			positives += may;
+	}
+	*rate = n - (to - from) ? (double)positives / (n - (to - from)) : 0;
+	return true;
+}
+
+// # of nodes the index asked for since resetCacheStats()
+int64 nodesAsked(PositionalIndex& ndx)
+{
+	return ndx.cacheStats().hits + ndx.cacheStats().misses;
+}
+
+bool basics()
+{
+	int n = (int)keys.size();
+	PositionalIndex ndx(50);
+	ndx.create(filename);
+	ndx.attachFilter(0, cRate);
+	bool ok = check(ndx.filtering(), "filtering()");
+	for (int i = 0; i < n / 2; i++)
+		ndx.insert(keys[i].c_str(), i);
+	double rate;
+	ok = ok && check(filters(ndx, 0, n / 2, &rate), "a key inserted is turned away") &&
+	     check(rate < 3 * cRate, "the rate of false positives");
+	printf("false positives: %.2f%% (%.0f%% asked for)\n", rate * 100, cRate * 100);
+
+	std::vector<const void*> all(n);
+	std::vector<uint32>      offsets(n);
+	bool*                    found = new bool[n];
+	for (int i = 0; i < n; i++)
+		all[i] = keys[i].c_str();
+	int count = ndx.findMany(&all[0], n, &offsets[0], found);
+	ok = ok && check(count == n / 2, "findMany() with the filter");
+	for (int i = 0; ok && i < n; i++)
+		ok = check(found[i] == (i < n / 2) && (!found[i] || offsets[i] == (uint32)i), "a key findMany() found");
+	count = ndx.findAsync(&all[0], n, &offsets[0], found);
+	ok = ok && check(count == n / 2, "findAsync() with the filter");
+	for (int i = 0; ok && i < n; i++)
+		ok = check(found[i] == (i < n / 2) && (!found[i] || offsets[i] == (uint32)i), "a key findAsync() found");
+	ndx.resetCacheStats();                 // the keys not there: most are not looked up
+	ndx.findMany(&all[n / 2], n - n / 2, &offsets[0], found);
+	ok = ok && check(nodesAsked(ndx) < (n - n / 2) / 10, "findMany() of keys not there asks the filter");
+	ndx.resetCacheStats();
+	ndx.findAsync(&all[n / 2], n - n / 2, &offsets[0], found);
+	ok = ok && check(nodesAsked(ndx) < (n - n / 2) / 10, "findAsync() of keys not there asks the filter");
+	delete[] found;
+	ndx.close();
+
+	PositionalIndex again(50);             // the file is read, no scan
+	again.open(filename);
+	again.attachFilter(0, cRate);
+	again.resetCacheStats();
+	ok = ok && check(filters(again, 0, n / 2, &rate), "a key turned away after open()") &&
+	     check(nodesAsked(again) == 0, "the filter file read again");
+	again.close();
+	return ok;
+}
+
+// changed without the filter, then with it: built again
+bool changedWithout()
+{
+	int n = (int)keys.size();
+	PositionalIndex ndx(50);
+	ndx.open(filename);
+	for (int i = n / 2; i < n * 3 / 4; i++)
+		ndx.insert(keys[i].c_str(), i);
+	ndx.close();
+
+	ndx.open(filename);
+	ndx.attachFilter(0, cRate);
+	ndx.resetCacheStats();
+	double rate;
+	bool ok = check(filters(ndx, 0, n * 3 / 4, &rate), "a key inserted without the filter") &&
+	          check(nodesAsked(ndx) > 0, "the filter built again") &&
+	          check(rate < 3 * cRate, "the rate of false positives, built again");
+	ndx.close();
+	return ok;
+}
+
+// removes of more than a quarter of its capacity: built again, without the keys removed
+bool removes()
+{
+	int n = (int)keys.size();
+	PositionalIndex ndx(50);
+	ndx.open(filename);
+	ndx.attachFilter(0, cRate);
+	for (int i = 0; i < n * 3 / 4; i++)
+		ndx.remove(keys[i].c_str());
+	ndx.insert(keys[0].c_str(), 0);
+	double rate;
+	bool ok = check(filters(ndx, 0, 1, &rate), "a key turned away after removes") &&
+	          check(rate < 3 * cRate, "the keys removed answer true");
+	ndx.close();
+	return ok;
+}
+
+// a bulk load of the keys in order
+bool bulkLoad()
+{
+	int n = (int)keys.size();
+	std::vector<std::pair<std::string, int> > sorted(n);
+	for (int i = 0; i < n; i++)
+		sorted[i] = std::make_pair(keys[i], i);
+	std::sort(sorted.begin(), sorted.end());
+	PositionalIndex ndx(50);
+	ndx.create(filename);
+	ndx.attachFilter(0, cRate);
+	ndx.beginLoad();
+	for (int i = 0; i < n; i++)
+		ndx.load(sorted[i].first.c_str(), sorted[i].second);
+	ndx.endLoad();
+	double rate;
+	bool ok = check(filters(ndx, 0, n, &rate), "a key loaded is turned away");
+	ndx.close();
+	return ok;
+}
+
+// finds of keys that are not there, with a cache of 1/20 of the nodes
+void timeMisses()
+{
+	int n = (int)keys.size();
+	PositionalIndex ndx(n / 1200 + 20);
+	ndx.create(filename);
+	for (int i = 0; i < n / 2; i++)
+		ndx.insert(keys[i].c_str(), i);
+	ndx.attachFilter(0, cRate);
+	ndx.mayContain(keys[0].c_str());       // built now, not while timing
+
+	int found = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = n / 2; i < n; i++)
+		found += ndx.find(keys[i].c_str());
+	double without = seconds(start);
+	start = std::chrono::steady_clock::now();
+	for (int i = n / 2; i < n; i++)
+		found += ndx.mayContain(keys[i].c_str()) && ndx.find(keys[i].c_str());
+	double with = seconds(start);
+	ndx.close();
+	printf("finds of keys not there: %.0f ns each, %.0f ns with the filter (%d found)\n",
+	       without * 1e9 / (n - n / 2), with * 1e9 / (n - n / 2), found);
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 100000;
+
+	keys.resize(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[32];
+		sprintf(key, "%08x%07d", rand() * (unsigned)RAND_MAX + rand(), i);
+		keys[i] = key;
+	}
+
+	bool ok = check(basics(), "basics") &&
+	          check(changedWithout(), "changed without the filter") &&
+	          check(removes(), "removes") &&
+	          check(bulkLoad(), "bulk load");
+	timeMisses();
+
+	remove(filename);
+	remove(filtername);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
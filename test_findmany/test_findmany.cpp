@@ -0,0 +1,132 @@
+/*  test_findmany.cpp -- Looking up many keys at once with findMany() against find()
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Looks up batches of keys (some missing, some asked for twice) with findMany()
+    and one at a time with find(), and checks that they agree, with and without
+    duplicate keys and with a cache too small for the index.  Then times both
+    for batches of several sizes.
+
+    usage: test_findmany [keys [batches]]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+const char* filename = "test_findmany.ndx";
+
+std::vector<std::string> keys;
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// a batch of keys of the index, some asked for twice, and every fourth one missing
+void makeBatch(std::vector<std::string>& batch, std::vector<const void*>& probes, int size)
+{
+	batch.resize(size);
+	probes.resize(size);
+	for (int i = 0; i < size; i++) {
+		batch[i] = keys[rand() % keys.size()];
+		if (i % 4 == 3)
+			batch[i] += "x";
+		else if (i % 7 == 6)
+			batch[i] = batch[i - 1];
+		probes[i] = batch[i].c_str();
+	}
+}
+
+bool agree(Index& ndx, int nBatches)
+{
+	std::vector<std::string> batch;
+	std::vector<const void*> probes;
+	for (int n = 0; n < nBatches; n++) {
+		int size = 1 + rand() % 500;
+		makeBatch(batch, probes, size);
+		std::vector<uint32> offsets(size);
+		bool* found = new bool[size];
+		int nFound = ndx.findMany(&probes[0], size, &offsets[0], found);
+		int count = 0;
+		for (int i = 0; i < size; i++) {
+			void*  key;
+			uint32 offset;
+			bool   there = ndx.find(probes[i]) && ndx.getCurKey(key, offset);
+			if (there != found[i] || (there && offset != offsets[i])) {
+				printf("FAILED: findMany() and find() differ on %s\n", batch[i].c_str());
+				delete[] found;
+				return false;
+			}
+			count += there;
+		}
+		delete[] found;
+		if (count != nFound) {
+			printf("FAILED: findMany() found %d keys, not %d\n", nFound, count);
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys    = argc > 1 ? atoi(argv[1]) : 200000;
+	int nBatches = argc > 2 ? atoi(argv[2]) : 200;
+
+	keys.resize(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[32];
+		sprintf(key, "res/%06x/%d.png", (rand() * (unsigned)RAND_MAX + rand()) & 0xffffff, i % 1000);
+		keys[i] = key;
+	}
+
+	bool ok = true;
+	for (int dups = 0; ok && dups < 2; dups++) {
+		Index ndx(20);
+		ndx.create(filename, dups != 0);
+		for (int i = 0; i < nKeys; i++) {
+			ndx.insert(keys[i].c_str(), i);
+			if (dups && i % 3 == 0)
+				ndx.insert(keys[i].c_str(), nKeys + i);   // the first instance is i
+		}
+		ok = agree(ndx, nBatches);
+	}
+
+	// timing, with a cache that holds every node
+	Index ndx(nKeys / 20 + 100);
+	ndx.open(filename);
+	printf("batch    find()   findMany()  (ns/key)\n");
+	for (int size = 10; ok && size <= 10000; size *= 10) {
+		std::vector<std::string> batch;
+		std::vector<const void*> probes;
+		makeBatch(batch, probes, size);
+		std::vector<uint32> offsets(size);
+		bool* found = new bool[size];
+		int rounds = 200000 / size;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int r = 0; r < rounds; r++)
+			for (int i = 0; i < size; i++)
+				found[i] = ndx.find(probes[i]);
+		double findTime = seconds(start);
+		start = std::chrono::steady_clock::now();
+		for (int r = 0; r < rounds; r++)
+			ndx.findMany(&probes[0], size, &offsets[0], found);
+		double manyTime = seconds(start);
+		delete[] found;
+		printf("%5d  %8.0f   %8.0f\n", size, findTime * 1e9 / rounds / size, manyTime * 1e9 / rounds / size);
+	}
+
+	ndx.close();
+	remove(filename);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
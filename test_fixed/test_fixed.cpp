@@ -0,0 +1,162 @@
+/*  test_fixed.cpp -- Nodes of fixed size keys (64 bit hashes, 16 byte GUIDs) without keyofs,
+                      against the same keys in nodes with keyofs
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Inserts random keys into both layouts, compares the file sizes and the times of
+    insert() and find(), checks that every key is found after the index is reopened
+    and after half of them are removed, and that neither layout opens the other's files.
+
+    usage: test_fixed [keys [finds]]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+using namespace nub;
+
+// The same keys with keyofs in the nodes, as before fixed size keys had their own layout
+template <class IKey>
+struct IKeyVarying : IKey
+{
+	enum { cFixedSize = 0 };
+};
+
+typedef IKeyInt<uint64> IKeyHash;
+typedef IKeyFixed<16>   IKeyGUID;
+
+const char* fixedName   = "test_fixed.ndx";
+const char* varyingName = "test_fixed_keyofs.ndx";
+
+struct GUID { byte b[16]; };
+
+uint64 random64()
+{
+	uint64 r = 0;
+	for (int i = 0; i < 4; i++)
+		r = r << 16 ^ (uint64)(rand() & 0xffff);
+	return r;
+}
+
+void makeKey(uint64& key)  { key = random64(); }
+void makeKey(GUID& key)    { uint64 r[2] = { random64(), random64() }; memcpy(key.b, r, 16); }
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+long fileSize(const char* name)
+{
+	FILE* f = fopen(name, "rb");
+	if (!f) return 0;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+template <class IndexType, class Key>
+bool run(const char* title, const char* name, const std::vector<Key>& keys, int nFinds)
+{
+	int nKeys = (int)keys.size();
+	std::chrono::steady_clock::time_point start;
+	double insertTime, findTime;
+	{
+		IndexType ndx(nKeys / 20 + 100);   // room for every node
+		ndx.create(name);
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < nKeys; i++)
+			ndx.insert(&keys[i], i);
+		insertTime = seconds(start);
+
+		srand(2);
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < nFinds; i++)
+			if (!ndx.find(&keys[rand() % nKeys])) {
+				printf("FAILED: %s find\n", title);
+				return false;
+			}
+		findTime = seconds(start);
+	}
+	printf("%-22s %9ld bytes, %6.0f ns/insert  %6.0f ns/find\n", title, fileSize(name),
+	       insertTime * 1e9 / nKeys, findTime * 1e9 / nFinds);
+
+	// reopen with a small cache, check every key, remove every other one and check again
+	IndexType ndx(10);
+	ndx.open(name);
+	bool ok = ndx.count() == nKeys && ndx.valid();
+	for (int i = 0; ok && i < nKeys; i++) {
+		void*  key;
+		uint32 offset;
+		ok = ndx.find(&keys[i]) && ndx.getCurKey(key, offset) && offset == (uint32)i;
+	}
+	for (int i = 0; ok && i < nKeys; i += 2)
+		ok = ndx.remove(&keys[i]);
+	ok = ok && ndx.valid() && ndx.count() == nKeys / 2;
+	for (int i = 0; ok && i < nKeys; i++)
+		ok = ndx.find(&keys[i]) == (i % 2 == 1);
+	if (!ok)
+		printf("FAILED: %s after reopening or removals\n", title);
+	return ok;
+}
+
+// The layouts have different major versions
+template <class FixedIndex, class VaryingIndex>
+bool rejects()
+{
+	int rejected = 0;
+	try {
+		FixedIndex ndx;
+		ndx.open(varyingName);
+	} catch (io_error&) {
+		rejected++;
+	}
+	try {
+		VaryingIndex ndx;
+		ndx.open(fixedName);
+	} catch (io_error&) {
+		rejected++;
+	}
+	if (rejected != 2)
+		printf("FAILED: an index of the other layout was opened\n");
+	return rejected == 2;
+}
+
+template <class IKey, class Key>
+bool test(const char* title, int nKeys, int nFinds)
+{
+	typedef IndexT<IKey>              FixedIndex;
+	typedef IndexT<IKeyVarying<IKey> > VaryingIndex;
+
+	std::vector<Key> keys(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++)
+		makeKey(keys[i]);
+
+	char fixedTitle[64], varyingTitle[64];
+	sprintf(fixedTitle, "%s", title);
+	sprintf(varyingTitle, "%s, keyofs", title);
+	bool ok = run<FixedIndex>  (fixedTitle,   fixedName,   keys, nFinds) &&
+	          run<VaryingIndex>(varyingTitle, varyingName, keys, nFinds) &&
+	          rejects<FixedIndex, VaryingIndex>();
+	remove(fixedName);
+	remove(varyingName);
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys  = argc > 1 ? atoi(argv[1]) : 200000;
+	int nFinds = argc > 2 ? atoi(argv[2]) : 1000000;
+
+	bool ok = test<IKeyHash, uint64>("64 bit hashes", nKeys, nFinds) &
+	          test<IKeyGUID, GUID>  ("16 byte GUIDs", nKeys, nFinds);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+/*  test_flush.cpp -- Writing changed nodes in file order, adjacent ones with one write
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Inserts keys with a small cache, evicting changed nodes one at a time and in
+    batches of their neighbors in the file (setWriteBack()), with each FileSystem
+    and front coded nodes.  After flush() the file, opened again by a second index
+    while the first is still open, must hold every key, and be the same file either
+    way.  Checks that the batches take fewer writes than nodes, and that flush() of
+    a cache full of changed nodes, all of them next to each other, takes one write.  Then times both ways.
+
+    usage: test_flush [keys]
+*/
+
+#include <nub/Index.h>
+#include <nub/MmapFileSystem.h>
+#include <nub/PositionalFileSystem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+const char* filename  = "test_flush.ndx";
+const char* filename1 = "test_flush1.ndx";
+
+std::vector<std::string> keys;
+
+bool check(bool ok, const char* what)
+{
+	if (!ok)
+		printf("FAILED: %s\n", what);
+	return ok;
+}
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// true if both files have the same contents
+bool sameFile(const char* name1, const char* name2)
+{
+	FILE* f1 = fopen(name1, "rb");
+	FILE* f2 = fopen(name2, "rb");
+	bool same = f1 && f2;
+	while (same) {
+		int c = getc(f1);
+		same = c == getc(f2);
+		if (c == EOF)
+			break;
+	}
+	if (f1) fclose(f1);
+	if (f2) fclose(f2);
+	return same;
+}
+
+// inserts the keys writing back writeBack nodes at a time, flushes and checks the file
+// with another index; the time of the inserts and the flush
+template <class I>
+bool build(const char* name, int cacheSize, int writeBack, CacheStats* stats, double* time)
+{
+	I ndx(cacheSize);
+	ndx.create(name);
+	ndx.setWriteBack(writeBack);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < (int)keys.size(); i++)
+		ndx.insert(keys[i].c_str(), i);
+	ndx.flush();
+	*time = seconds(start);
+	*stats = ndx.cacheStats();
+
+	I other(20);                  // the file as flush() left it, while ndx is open
+	other.open(name);
+	bool ok = other.valid() && other.count() == (int)keys.size();
+	for (int i = 0; ok && i < (int)keys.size(); i++) {
+		void*  key;
+		uint32 offset;
+		ok = other.find(keys[i].c_str()) && other.getCurKey(key, offset) && offset == (uint32)i;
+	}
+	other.close();
+	ndx.close();
+	return ok;
+}
+
+template <class I>
+bool test(const char* fsName, int cacheSize)
+{
+	CacheStats one, batched;
+	double     oneTime, batchedTime;
+	bool ok = check(build<I>(filename1, cacheSize, 1, &one, &oneTime), "flushed file, one at a time") &&
+	          check(build<I>(filename, cacheSize, 16, &batched, &batchedTime), "flushed file, in batches") &&
+	          check(sameFile(filename, filename1), "the files differ") &&
+	          check(batched.writeBacks > 0 && batched.writes < batched.writeBacks, "writes of batches");
+	printf("%-20s %2d nodes cached: one at a time %6.0f ns/insert, %7lld writes; in batches %6.0f ns/insert, %7lld writes\n",
+	       fsName, cacheSize, oneTime * 1e9 / keys.size(), (long long)one.writes,
+	       batchedTime * 1e9 / keys.size(), (long long)batched.writes);
+	return ok;
+}
+
+// flush() of a cache that holds every node, all of them changed
+bool flushAll()
+{
+	int nKeys = (int)keys.size();
+	Index ndx(nKeys / 20 + 100);
+	ndx.create(filename);
+	for (int i = 0; i < nKeys; i++)
+		ndx.insert(keys[i].c_str(), i);
+	ndx.resetCacheStats();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	ndx.flush();
+	double time = seconds(start);
+	int64 writes = ndx.cacheStats().writes;
+	ndx.flush();                  // nothing left to write
+	bool ok = check(writes == 1 && ndx.cacheStats().writes == writes, "flush() of adjacent nodes");
+	printf("flush() of a full cache: %lld writes, %.2f ms\n", (long long)writes, time * 1e3);
+	ndx.close();
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 100000;
+
+	keys.resize(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[32];
+		sprintf(key, "%08x%07d", rand() * (unsigned)RAND_MAX + rand(), i);
+		keys[i] = key;
+	}
+
+	bool ok = test<Index>("FileSystem", 50) &&
+	          test<IndexT<IKeyASCIIZ, PositionalFileSystem> >("PositionalFileSystem", 50) &&
+	          test<IndexT<IKeyASCIIZ, MmapFileSystem> >("MmapFileSystem", 50) &&
+	          test<IndexT<IKeyASCIIZ, PositionalFileSystem, 4096, uint32, uint32, CacheLRU, NodeFrontCoded<> > >
+	              ("front coded", 50) &&
+	          flushAll();
+
+	remove(filename);
+	remove(filename1);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,214 @@
+/*  test_flusher.cpp -- Changed nodes written by a thread of their own, while inserts go on
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Inserts keys (and removes a third of them) with a small cache and a flusher (see
+    IndexT::startFlusher()), with each FileSystem and front coded nodes, and with a
+    flusher that may hold one node only, so that inserts wait for it.  Nodes evicted
+    and read again before the flusher wrote them must come back as they were; after
+    flush() the file, opened by a second index, must hold the keys, and with inserts
+    only be the same file as without a flusher (the free nodes of removes hold what was
+    last written there, which depends on when nodes were written).  Checks that the
+    modes that order their own writes refuse a flusher.  Then times inserts with and
+    without one: the average and the slowest of each thousand.
+
+    usage: test_flusher [keys]
+*/
+
+#include <nub/Index.h>
+#include <nub/MmapFileSystem.h>
+#include <nub/PositionalFileSystem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+const char* filename  = "test_flusher.ndx";
+const char* filename1 = "test_flusher1.ndx";
+const char* logname   = "test_flusher.log";
+
+std::vector<std::string> keys;
+
+bool check(bool ok, const char* what)
+{
+	if (!ok)
+		printf("FAILED: %s\n", what);
+	return ok;
+}
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// true if both files have the same contents
+bool sameFile(const char* name1, const char* name2)
+{
+	FILE* f1 = fopen(name1, "rb");
+	FILE* f2 = fopen(name2, "rb");
+	bool same = f1 && f2;
+	while (same) {
+		int c = getc(f1);
+		same = c == getc(f2);
+		if (c == EOF)
+			break;
+	}
+	if (f1) fclose(f1);
+	if (f2) fclose(f2);
+	return same;
+}
+
+// every key is there with data offset i, but every third one if they were removed
+template <class I>
+bool holds(I& ndx, bool removed)
+{
+	int count = 0;
+	for (int i = 0; i < (int)keys.size(); i++) {
+		void*  key;
+		uint32 offset;
+		bool   found = ndx.find(keys[i].c_str()) && ndx.getCurKey(key, offset) && offset == (uint32)i;
+		if (found != (!removed || i % 3 != 0))
+			return false;
+		count += found;
+	}
+	return ndx.valid() && ndx.count() == count;
+}
+
+// inserts the keys (and removes every third), with a flusher if dirtyRatio > 0
+template <class I>
+bool build(const char* name, int cacheSize, double dirtyRatio, bool remove)
+{
+	I ndx(cacheSize);
+	ndx.create(name);
+	if (dirtyRatio > 0)
+		ndx.startFlusher(dirtyRatio);
+	for (int i = 0; i < (int)keys.size(); i++)
+		ndx.insert(keys[i].c_str(), i);
+	for (int i = 0; remove && i < (int)keys.size(); i += 3)
+		ndx.remove(keys[i].c_str());
+	bool ok = holds(ndx, remove);           // nodes read back while the flusher has them
+	ndx.flush();
+
+	I other(20);                            // the file as flush() left it, while ndx is open
+	other.open(name);
+	ok = ok && holds(other, remove);
+	other.close();
+	ndx.close();
+	return ok;
+}
+
+template <class I>
+bool test(const char* fsName)
+{
+	bool ok = check(build<I>(filename1, 50, 0, false), "without a flusher") &&
+	          check(build<I>(filename, 50, 0.25, false), "with a flusher") &&
+	          check(sameFile(filename, filename1), "the files differ") &&
+	          check(build<I>(filename, 50, 0.01, false), "with a flusher of one node") &&
+	          check(sameFile(filename, filename1), "the files differ, a flusher of one node") &&
+	          check(build<I>(filename, 50, 0.25, true), "removes with a flusher") &&
+	          check(build<I>(filename, 50, 0.01, true), "removes with a flusher of one node");
+	if (!ok)
+		printf("with %s\n", fsName);
+	return ok;
+}
+
+// a log or copy-on-write with a flusher
+bool refused()
+{
+	Index ndx(20);
+	ndx.create(filename);
+	ndx.startFlusher();
+	bool ok = true;
+	try {
+		ndx.startFlusher();
+		ok = check(false, "a second flusher");
+	} catch (logic_error&) {
+	}
+	try {
+		ndx.beginCopyOnWrite();
+		ok = check(false, "copy-on-write with a flusher");
+	} catch (logic_error&) {
+	}
+	WriteAheadLog log;
+	log.open(logname);
+	try {
+		ndx.attachLog(log);
+		ok = check(false, "a log with a flusher");
+	} catch (logic_error&) {
+	}
+	ndx.stopFlusher();
+	ok = ok && check(!ndx.flushing(), "stopFlusher()");
+	ndx.close();
+	log.close();
+	remove(logname);
+	return ok;
+}
+
+// inserts with a cache of 1/20 of the nodes: the time of each thousand, and the slowest insert
+template <class I>
+void timeInserts(const char* what, double dirtyRatio)
+{
+	int nKeys = (int)keys.size();
+	I ndx(nKeys / 600 + 20);
+	ndx.create(filename);
+	if (dirtyRatio > 0)
+		ndx.startFlusher(dirtyRatio);
+	std::vector<double> slowest;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double worst = 0;
+	for (int i = 0; i < nKeys; i++) {
+		std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+		ndx.insert(keys[i].c_str(), i);
+		double s = seconds(t);
+		if (s > worst)
+			worst = s;
+		if (i % 1000 == 999) {
+			slowest.push_back(worst);
+			worst = 0;
+		}
+	}
+	double total = seconds(start);
+	ndx.close();
+	std::sort(slowest.begin(), slowest.end());
+	printf("%-28s %6.0f ns/insert, slowest of 1000: median %5.1f us, 99th percentile %6.1f us\n",
+	       what, total * 1e9 / nKeys, slowest.empty() ? 0 : slowest[slowest.size() / 2] * 1e6,
+	       slowest.empty() ? 0 : slowest[slowest.size() * 99 / 100] * 1e6);
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 100000;
+
+	keys.resize(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[32];
+		sprintf(key, "%08x%07d", rand() * (unsigned)RAND_MAX + rand(), i);
+		keys[i] = key;
+	}
+
+	typedef IndexT<IKeyASCIIZ, PositionalFileSystem> PositionalIndex;
+	bool ok = test<Index>("FileSystem") &&
+	          test<PositionalIndex>("PositionalFileSystem") &&
+	          test<IndexT<IKeyASCIIZ, MmapFileSystem> >("MmapFileSystem") &&
+	          test<IndexT<IKeyASCIIZ, PositionalFileSystem, 4096, uint32, uint32, CacheLRU, NodeFrontCoded<> > >
+	              ("front coded") &&
+	          refused();
+
+	// timing
+	timeInserts<PositionalIndex>("PositionalFileSystem", 0);
+	timeInserts<PositionalIndex>("  with a flusher", 0.25);
+	timeInserts<Index>("FileSystem", 0);
+	timeInserts<Index>("  with a flusher", 0.25);
+
+	remove(filename);
+	remove(filename1);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,239 @@
+/*  test_free.cpp -- Free nodes kept in memory and written to the free list with the header
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Removes and inserts keys over and over with a small cache, through a FileSystem
+    that counts the reads and writes of free list links, and checks that the removes
+    and inserts make none (only flush() and close() write links, each one only if it
+    changed), that the inserts reuse the free nodes instead of growing the file, and
+    that the free nodes are the same after the index is opened again.  Checks that a
+    rollback gives back the free nodes of the transaction, and that copy-on-write
+    mode takes them and gives them back.  Then times rounds of removes and inserts.
+
+    usage: test_free [keys]
+*/
+
+#include <nub/Index.h>
+#include <nub/PositionalFileSystem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+/// PositionalFileSystem counting the reads and writes of one free list link
+struct CountingFileSystem : public PositionalFileSystem
+{
+	static int64 linkReads, linkWrites;
+
+	static void readAt(FileHandle fh, int64 pos, void* buffer, int size) // throw(...)
+	{
+		linkReads += size == sizeof(uint32);
+		PositionalFileSystem::readAt(fh, pos, buffer, size);
+	}
+
+	static void writeAt(FileHandle fh, int64 pos, const void* buffer, int size) // throw(...)
+	{
+		linkWrites += size == sizeof(uint32);
+		PositionalFileSystem::writeAt(fh, pos, buffer, size);
+	}
+};
+
+int64 CountingFileSystem::linkReads = 0;
+int64 CountingFileSystem::linkWrites = 0;
+
+typedef IndexT<IKeyASCIIZ, CountingFileSystem>         CountingIndex;
+typedef WriteAheadLogT<CountingFileSystem>             CountingLog;
+
+const char* filename = "test_free.ndx";
+const char* logname  = "test_free.log";
+
+std::vector<std::string> keys;
+
+bool check(bool ok, const char* what)
+{
+	if (!ok)
+		printf("FAILED: %s\n", what);
+	return ok;
+}
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+long fileSize()
+{
+	FILE* f = fopen(filename, "rb");
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+// keys i < n are there with data offset i, but the ones in [from, to)
+bool holds(CountingIndex& ndx, int n, int from, int to)
+{
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		void*  key;
+		uint32 offset;
+		bool   found = ndx.find(keys[i].c_str()) && ndx.getCurKey(key, offset) && offset == (uint32)i;
+		if (found != (i < from || i >= to))
+			return false;
+		count += found;
+	}
+	return ndx.valid() && ndx.count() == count;
+}
+
+bool churn()
+{
+	int n = (int)keys.size();
+	CountingIndex ndx(50);
+	ndx.create(filename);
+	for (int i = 0; i < n; i++)
+		ndx.insert(keys[i].c_str(), i);
+	ndx.flush();
+	long size = fileSize();
+
+	CountingFileSystem::linkReads = CountingFileSystem::linkWrites = 0;
+	for (int r = 0; r < 4; r++) {
+		int a = r * n / 4, b = a + n / 2 < n ? a + n / 2 : n;
+		for (int i = a; i < b; i++)
+			ndx.remove(keys[i].c_str());
+		for (int i = a; i < b; i++)
+			ndx.insert(keys[i].c_str(), i);
+	}
+	for (int i = 0; i < n / 2; i++)
+		ndx.remove(keys[i].c_str());
+	bool ok = check(CountingFileSystem::linkReads == 0 && CountingFileSystem::linkWrites == 0,
+	                "links read or written by removes and inserts");
+	int nFree = ndx.countFree();
+	ok = ok && check(nFree > 0, "free nodes") && check(holds(ndx, n, 0, n / 2), "keys after removes");
+
+	ndx.flush();                             // the free list in file order, every link
+	ok = ok && check(CountingFileSystem::linkWrites <= nFree, "links written by flush()");
+	CountingFileSystem::linkWrites = 0;
+	ndx.remove(keys[n - 1].c_str());         // a few links change
+	ndx.remove(keys[n - 2].c_str());
+	ndx.flush();
+	ok = ok && check(CountingFileSystem::linkWrites <= 4, "links written by flush() of a few changes");
+	ndx.insert(keys[n - 1].c_str(), n - 1);
+	ndx.insert(keys[n - 2].c_str(), n - 2);
+	ndx.flush();
+	nFree = ndx.countFree();
+	ndx.close();
+
+	CountingIndex again(50);
+	again.open(filename);
+	ok = ok && check(again.countFree() == nFree, "free nodes after open()") &&
+	     check(holds(again, n, 0, n / 2), "keys after open()");
+	for (int i = 0; i < n / 2; i++)
+		again.insert(keys[i].c_str(), i);
+	ok = ok && check(fileSize() <= size + size / 20, "free nodes reused") &&
+	     check(holds(again, n, 0, 0), "keys after reuse");
+	again.close();
+	return ok;
+}
+
+// a rollback gives back the nodes the transaction freed
+bool rollback()
+{
+	int n = (int)keys.size();
+	CountingLog log;
+	log.create(logname);
+	CountingIndex ndx(50);
+	ndx.create(filename);
+	ndx.attachLog(log);
+	ndx.beginTransaction();
+	for (int i = 0; i < n; i++)
+		ndx.insert(keys[i].c_str(), i);
+	for (int i = 0; i < n / 4; i++)
+		ndx.remove(keys[i].c_str());
+	ndx.commit();
+	int nFree = ndx.countFree();
+	ndx.beginTransaction();
+	for (int i = n / 4; i < n / 2; i++)
+		ndx.remove(keys[i].c_str());
+	bool ok = check(ndx.countFree() > nFree, "free nodes of a transaction");
+	ndx.rollback();
+	ok = ok && check(ndx.countFree() == nFree, "free nodes after rollback()") &&
+	     check(holds(ndx, n, 0, n / 4), "keys after rollback()");
+	ndx.close();
+	log.close();
+	remove(logname);
+	return ok;
+}
+
+// copy-on-write takes the free nodes and gives back what is left of them
+bool copyOnWrite()
+{
+	int n = (int)keys.size();
+	CountingIndex ndx(50);
+	ndx.create(filename);
+	for (int i = 0; i < n; i++)
+		ndx.insert(keys[i].c_str(), i);
+	for (int i = 0; i < n / 2; i++)
+		ndx.remove(keys[i].c_str());
+	int nFree = ndx.countFree();
+	ndx.beginCopyOnWrite();
+	bool ok = check(ndx.countFree() == nFree, "free nodes in copy-on-write mode");
+	for (int i = n / 2; i < n * 3 / 4; i++)
+		ndx.remove(keys[i].c_str());
+	ndx.publish();
+	ndx.endCopyOnWrite();
+	ok = ok && check(ndx.countFree() >= nFree, "free nodes after copy-on-write") &&
+	     check(holds(ndx, n, 0, n * 3 / 4), "keys after copy-on-write");
+	nFree = ndx.countFree();
+	ndx.close();
+	ndx.open(filename);
+	ok = ok && check(ndx.countFree() == nFree, "free nodes after copy-on-write and open()");
+	ndx.close();
+	return ok;
+}
+
+// rounds of removing and inserting a quarter of the keys
+void timeChurn()
+{
+	int n = (int)keys.size();
+	IndexT<IKeyASCIIZ, PositionalFileSystem> ndx(n / 600 + 20);
+	ndx.create(filename);
+	for (int i = 0; i < n; i++)
+		ndx.insert(keys[i].c_str(), i);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int r = 0; r < 4; r++) {
+		for (int i = r; i < n; i += 4)
+			ndx.remove(keys[i].c_str());
+		for (int i = r; i < n; i += 4)
+			ndx.insert(keys[i].c_str(), i);
+	}
+	double time = seconds(start);
+	ndx.close();
+	printf("removes and inserts: %.0f ns each\n", time * 1e9 / (2 * n));
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 40000;
+
+	keys.resize(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[32];
+		sprintf(key, "%08x%07d", rand() * (unsigned)RAND_MAX + rand(), i);
+		keys[i] = key;
+	}
+
+	bool ok = check(churn(), "churn") &&
+	          check(rollback(), "rollback") &&
+	          check(copyOnWrite(), "copy-on-write");
+	timeChurn();
+
+	remove(filename);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
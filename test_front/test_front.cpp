@@ -0,0 +1,195 @@
+/*  test_front.cpp -- Front coded nodes versus plain nodes for keys with long common prefixes
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Indexes asset paths with 1024 byte nodes (as ResourceFile does) in both node formats,
+    compares the file sizes and node reads per find(), then checks that the front coded
+    index finds every key after it is reopened, survives removals, and that neither
+    format opens an index file of the other.  Then inserts and removes keys at random,
+    with and without duplicates, so removes and splits move keys to other restart
+    places, and checks the keys after the index is opened again.
+
+    usage: test_front [keys]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+typedef IndexT<IKeyASCIIZ, FileSystem, 1024, uint32, uint32, CacheLRU, NodePlain>         PlainIndex;
+typedef IndexT<IKeyASCIIZ, FileSystem, 1024, uint32, uint32, CacheLRU, NodeFrontCoded<> > FrontIndex;
+
+const char* plainName = "test_front_plain.ndx";
+const char* frontName = "test_front.ndx";
+
+const char* dirs[]  = { "textures/world/terrain/", "textures/world/props/", "textures/characters/",
+                        "models/world/terrain/", "models/characters/", "sounds/ambient/" };
+const char* kinds[] = { "grass", "rock", "sand", "snow", "water", "mud" };
+
+std::string assetPath(int i)
+{
+	char name[256];
+	sprintf(name, "%sregion_%02d/%s_%05d.dds", dirs[rand() % 6], rand() % 40, kinds[rand() % 6], i);
+	return name;
+}
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+long fileSize(const char* name)
+{
+	FILE* f = fopen(name, "rb");
+	if (!f) return 0;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+template <class IndexType>
+bool run(const char* title, const char* name, const std::vector<std::string>& keys)
+{
+	{
+		IndexType ndx(100);
+		ndx.create(name);
+		for (size_t i = 0; i < keys.size(); i++)
+			ndx.insert(keys[i].c_str(), (uint32)i);
+	}
+
+	IndexType ndx(ndxMinCache);  // little more than the root stays, so finds read the rest of their path
+	ndx.open(name);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < keys.size(); i++) {
+		void*  key;
+		uint32 offset;
+		if (!ndx.find(keys[i].c_str()) || !ndx.getCurKey(key, offset) || offset != i) {
+			printf("FAILED: %s find %s\n", title, keys[i].c_str());
+			return false;
+		}
+	}
+	double time = seconds(start);
+	printf("%-13s %9ld bytes, %5.2f node reads/find, %6.0f ns/find\n", title, fileSize(name),
+	       (double)ndx.cacheStats().misses / keys.size(), time * 1e9 / keys.size());
+	return true;
+}
+
+// keys with long shared prefixes and tails of many lengths, at random
+std::string randomKey()
+{
+	char key[256];
+	int  length = sprintf(key, "%sregion_%0*d/", dirs[rand() % 6], 1 + rand() % 40, rand() % 1000);
+	for (int j = rand() % 60; j > 0; j--)
+		key[length++] = 'a' + rand() % 3;
+	key[length] = 0;
+	return key;
+}
+
+// random inserts and removes, checked against a multiset of the keys after open()
+bool randomWrites(int seed, bool dups)
+{
+	srand(seed);
+	std::vector<std::string>   inserted;
+	std::multiset<std::string> there;
+	bool ok = true;
+	try {
+		FrontIndex ndx(8);
+		ndx.create(frontName, dups);
+		for (int i = 0; i < 10000; i++) {
+			if (inserted.empty() || rand() % 3) {
+				std::string key = randomKey();
+				if (ndx.insert(key.c_str(), i)) {
+					inserted.push_back(key);
+					there.insert(key);
+				}
+			} else {
+				int r = rand() % (int)inserted.size();
+				ok = ok && ndx.remove(inserted[r].c_str());
+				there.erase(there.find(inserted[r]));
+				inserted[r] = inserted.back();
+				inserted.pop_back();
+			}
+		}
+		ndx.close();
+		ndx.open(frontName);
+		ok = ok && ndx.valid() && ndx.count() == (int)there.size();
+		std::multiset<std::string>::iterator it = there.begin();
+		for (bool more = ndx.first(); ok && more; more = ndx.next(), ++it) {
+			void*  key;
+			uint32 offset;
+			ok = it != there.end() && ndx.getCurKey(key, offset) && *it == (const char*)key;
+		}
+		ok = ok && it == there.end();
+		ndx.close();
+	} catch (std::exception& e) {
+		printf("%s\n", e.what());
+		ok = false;
+	}
+	if (!ok)
+		printf("FAILED: random inserts and removes, seed %d%s\n", seed, dups ? " with duplicates" : "");
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 100000;
+
+	std::vector<std::string> keys(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++)
+		keys[i] = assetPath(i);
+
+	bool ok = run<PlainIndex>("plain", plainName, keys) &&
+	          run<FrontIndex>("front coded", frontName, keys);
+
+	// remove every other key, then check the rest and the order
+	if (ok) {
+		FrontIndex ndx(10);
+		ndx.open(frontName);
+		for (int i = 0; i < nKeys; i += 2)
+			ok = ok && ndx.remove(keys[i].c_str());
+		ndx.close();
+		ndx.open(frontName);
+		ok = ok && ndx.valid() && ndx.count() == nKeys / 2;
+		for (int i = 0; ok && i < nKeys; i++)
+			ok = ndx.find(keys[i].c_str()) == (i % 2 == 1);
+		if (!ok)
+			printf("FAILED: front coded after removals\n");
+	}
+
+	for (int seed = 1; ok && seed <= 20; seed++)
+		ok = randomWrites(seed, true) && randomWrites(seed, false);
+
+	// the formats have different major versions
+	int rejected = 0;
+	try {
+		PlainIndex ndx;
+		ndx.open(frontName);
+	} catch (io_error&) {
+		rejected++;
+	}
+	try {
+		FrontIndex ndx;
+		ndx.open(plainName);
+	} catch (io_error&) {
+		rejected++;
+	}
+	if (rejected != 2) {
+		printf("FAILED: an index of the other node format was opened\n");
+		ok = false;
+	}
+
+	remove(plainName);
+	remove(frontName);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/*  test_fs.cpp -- Index insert and find times with each FileSystem backend
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    A small node cache is used so that most node accesses go to the file.
+    The index files built by the backends must be identical.
+
+    usage: test_fs [keys [finds [nMaxCache]]]
+*/
+
+#include <nub/Index.h>
+#include <nub/MmapFileSystem.h>
+#include <nub/PositionalFileSystem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+using namespace nub;
+
+const int keyLen = 16;
+
+char randKey[keyLen + 1];
+
+char* getRandKey()
+{
+	for (int j = 0; j < keyLen; j++)
+		randKey[j] = 'a' + rand() % 26;
+	randKey[keyLen] = '\0';
+	return randKey;
+}
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class FileSystemT>
+int run(const char* fsName, const char* filename, int nKeys, int nFinds, int nMaxCache)
+{
+	IndexT<IKeyASCIIZ, FileSystemT> ndx(nMaxCache);
+	ndx.create(filename);
+	srand(1);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < nKeys; i++)
+		ndx.insert(getRandKey(), i);
+	ndx.close();
+	double insertTime = seconds(start);
+
+	ndx.open(filename);
+	srand(1);
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < nFinds; i++) {
+		if (i % nKeys == 0)
+			srand(1);
+		if (!ndx.find(getRandKey())) {
+			printf("%s: key not found: %s\n", fsName, randKey);
+			return 1;
+		}
+	}
+	double findTime = seconds(start);
+	ndx.close();
+	printf("%-20s %8.0f ns/insert %8.0f ns/find\n", fsName,
+		   insertTime * 1e9 / nKeys, findTime * 1e9 / nFinds);
+	return 0;
+}
+
+/// true if both files have the same contents
+bool sameFile(const char* name1, const char* name2)
+{
+	FILE* f1 = fopen(name1, "rb");
+	FILE* f2 = fopen(name2, "rb");
+	bool same = f1 && f2;
+	while (same) {
+		int c = getc(f1);
+		same = c == getc(f2);
+		if (c == EOF)
+			break;
+	}
+	if (f1) fclose(f1);
+	if (f2) fclose(f2);
+	return same;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys     = argc > 1 ? atoi(argv[1]) : 100000;
+	int nFinds    = argc > 2 ? atoi(argv[2]) : 200000;
+	int nMaxCache = argc > 3 ? atoi(argv[3]) : 10;
+
+	printf("%d keys, %d finds, nMaxCache %d\n", nKeys, nFinds, nMaxCache);
+	if (run<FileSystem>("FileSystem", "test_fs.ndx", nKeys, nFinds, nMaxCache) ||
+		run<PositionalFileSystem>("PositionalFileSystem", "test_fs_pos.ndx", nKeys, nFinds, nMaxCache) ||
+		run<MmapFileSystem>("MmapFileSystem", "test_fs_mmap.ndx", nKeys, nFinds, nMaxCache))
+		return 1;
+
+	int ret = 0;
+	if (!sameFile("test_fs.ndx", "test_fs_pos.ndx")) {
+		printf("PositionalFileSystem index differs from FileSystem's\n");
+		ret = 1;
+	}
+	if (!sameFile("test_fs.ndx", "test_fs_mmap.ndx")) {
+		printf("MmapFileSystem index differs from FileSystem's\n");
+		ret = 1;
+	}
+	remove("test_fs.ndx");
+	remove("test_fs_pos.ndx");
+	remove("test_fs_mmap.ndx");
+	return ret;
+}
@@ -0,0 +1,159 @@
+/*  test_insertmany.cpp -- Inserting and upserting batches of keys with insertMany() against insert()
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Builds two indexes from the same keys, one with insert() and change() a key at a
+    time and one with insertMany() in batches of random sizes, then applies batches
+    of updates (new keys, keys already there with new data offsets, keys given twice)
+    to both and checks that they hold the same keys and data offsets, with and without
+    duplicate keys and with a cache too small for the index.  Then times applying
+    a batch of updates to a larger index both ways.
+
+    usage: test_insertmany [keys [updates]]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+const char* filenames[2] = { "test_insertmany1.ndx", "test_insertmany2.ndx" };
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string randomKey()
+{
+	char key[32];
+	sprintf(key, "k%06x", (rand() * (unsigned)RAND_MAX + rand()) & 0xffffff);
+	return key;
+}
+
+// insert a key, or change its data offset if it is there (and there are no duplicates)
+int upsert(Index& ndx, const char* key, uint32 offset, bool replace)
+{
+	if (ndx.insert(key, offset))
+		return 1;
+	if (replace && !ndx.dupsAllowed() && ndx.find(key))
+		ndx.change(offset);
+	return 0;
+}
+
+// apply keys[from..to-1] with offsets from `offset` on to both indexes, in batches of random sizes
+bool apply(Index& one, Index& many, const std::vector<std::string>& keys, int from, int to, uint32 offset, bool replace)
+{
+	for (int a = from; a < to; ) {
+		int b = std::min(to, a + 1 + rand() % 5000);
+		std::vector<const void*> batch;
+		std::vector<uint32>      offsets;
+		int added = 0;
+		for (int i = a; i < b; i++) {
+			batch.push_back(keys[i].c_str());
+			offsets.push_back(offset + i);
+			added += upsert(one, keys[i].c_str(), offset + i, replace);
+		}
+		if (many.insertMany(&batch[0], &offsets[0], b - a, replace) != added) {
+			printf("FAILED: insertMany() did not add %d keys\n", added);
+			return false;
+		}
+		a = b;
+	}
+	return true;
+}
+
+bool same(Index& one, Index& many)
+{
+	if (!one.valid() || !many.valid() || one.count() != many.count()) {
+		printf("FAILED: %d keys, not %d\n", many.count(), one.count());
+		return false;
+	}
+	Index::Cursor c1(one), c2(many);
+	for (bool more = c1.first() && c2.first(); more; more = c1.next() && c2.next()) {
+		void*  k1, *k2;
+		uint32 o1, o2;
+		c1.getCurKey(k1, o1);
+		c2.getCurKey(k2, o2);
+		if (strcmp((char*)k1, (char*)k2) || o1 != o2) {
+			printf("FAILED: %s %u, not %s %u\n", (char*)k2, o2, (char*)k1, o1);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool test(int nKeys, bool dups, int maxCache)
+{
+	std::vector<std::string> keys(nKeys);
+	for (int i = 0; i < nKeys; i++)
+		keys[i] = randomKey();
+	for (int i = 0; i < nKeys / 10; i++)              // some given twice, with another offset
+		keys[rand() % nKeys] = keys[rand() % nKeys];
+
+	Index one(maxCache), many(maxCache);
+	one.create(filenames[0], dups);
+	many.create(filenames[1], dups);
+	int half = nKeys / 2;
+	bool ok = apply(one, many, keys, 0, half, 0, false) && same(one, many);
+	// the updates: the rest of the keys, and some of the first half again, with new offsets
+	for (int i = half; i < nKeys; i += 3)
+		keys[i] = keys[rand() % half];
+	ok = ok && apply(one, many, keys, half, nKeys, nKeys, true) && same(one, many);
+	if (!ok)
+		printf("FAILED: %s, cache of %d nodes\n", dups ? "duplicates" : "no duplicates", maxCache);
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys    = argc > 1 ? atoi(argv[1]) : 200000;
+	int nUpdates = argc > 2 ? atoi(argv[2]) : 100000;
+
+	srand(1);
+	bool ok = true;
+	for (int dups = 0; ok && dups < 2; dups++)
+		ok = test(nKeys / 4, dups != 0, 20) && test(nKeys / 4, dups != 0, nKeys / 80 + 100);
+
+	// timing: a batch of updates (a third of them to keys already there) to an index of nKeys keys
+	std::vector<std::string> keys(nKeys + nUpdates);
+	for (int i = 0; i < nKeys + nUpdates; i++)
+		keys[i] = i >= nKeys && i % 3 == 0 ? keys[rand() % nKeys] : randomKey();
+	double time[2];
+	for (int m = 0; ok && m < 2; m++) {
+		Index ndx(nKeys / 40 + 100);
+		ndx.create(filenames[m]);
+		for (int i = 0; i < nKeys; i++)
+			ndx.insert(keys[i].c_str(), i);
+		std::vector<const void*> batch(nUpdates);
+		std::vector<uint32>      offsets(nUpdates);
+		for (int i = 0; i < nUpdates; i++) {
+			batch[i] = keys[nKeys + i].c_str();
+			offsets[i] = nKeys + i;
+		}
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (m)
+			ndx.insertMany(&batch[0], &offsets[0], nUpdates, true);
+		else
+			for (int i = 0; i < nUpdates; i++)
+				upsert(ndx, (const char*)batch[i], offsets[i], true);
+		ndx.close();              // writes the changed nodes
+		time[m] = seconds(start);
+	}
+	if (ok)
+		printf("%d updates to %d keys: insert()/change() %.0f ns/key, insertMany() %.0f ns/key\n",
+		       nUpdates, nKeys, time[0] * 1e9 / nUpdates, time[1] * 1e9 / nUpdates);
+
+	remove(filenames[0]);
+	remove(filenames[1]);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+/*  test_load.cpp -- Bulk load versus insert()
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Builds the same index with insert() and with a bulk load, compares the times and
+    file sizes, then checks that the loaded index finds every key and can still be updated.
+
+    usage: test_load [keys]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+
+using namespace nub;
+
+const char* insertName = "test_load_insert.ndx";
+const char* loadName   = "test_load.ndx";
+const int   keyLen     = 16;
+
+typedef char Key[keyLen + 1];
+
+void randKey(char* key)
+{
+	for (int j = 0; j < keyLen; j++)
+		key[j] = 'a' + rand() % 26;
+	key[keyLen] = '\0';
+}
+
+bool keyLess(const char* lhs, const char* rhs)
+{
+	return strcmp(lhs, rhs) < 0;
+}
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+long fileSize(const char* name)
+{
+	FILE* f = fopen(name, "rb");
+	if (!f) return 0;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+int fail(const char* what, const char* key)
+{
+	printf("FAILED: %s %s\n", what, key);
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 200000;
+
+	Key* keys = new Key[nKeys];
+	srand(1);
+	for (int i = 0; i < nKeys; i++)
+		randKey(keys[i]);
+
+	Index ndx(100);
+	ndx.create(insertName);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < nKeys; i++)
+		ndx.insert(keys[i], i);
+	ndx.close();
+	double insertTime = seconds(start);
+
+	// sort pointers to the keys, the data offset of a key is its original position
+	const char** sorted = new const char*[nKeys];
+	for (int i = 0; i < nKeys; i++)
+		sorted[i] = keys[i];
+	std::sort(sorted, sorted + nKeys, keyLess);
+
+	ndx.create(loadName);
+	start = std::chrono::steady_clock::now();
+	ndx.beginLoad();
+	for (int i = 0; i < nKeys; i++) {
+		if (i && !strcmp(sorted[i], sorted[i-1]))
+			continue;   // no duplicates allowed
+		ndx.load(sorted[i], (uint32)((Key*)sorted[i] - keys));
+	}
+	ndx.endLoad();
+	ndx.close();
+	double loadTime = seconds(start);
+
+	printf("%d keys\n", nKeys);
+	printf("insert():  %7.3f s, %9ld bytes\n", insertTime, fileSize(insertName));
+	printf("bulk load: %7.3f s, %9ld bytes (sort not included)\n", loadTime, fileSize(loadName));
+
+	if (!ndx.open(loadName)) return fail("open", loadName);
+	if (!ndx.valid())        return fail("valid", loadName);
+	for (int i = 0; i < nKeys; i++) {
+		if (!ndx.find(keys[i])) return fail("find", keys[i]);
+		void* key;
+		uint32 offset;
+		ndx.getCurKey(key, offset);
+		if (strcmp(keys[(int)offset], keys[i])) return fail("offset", keys[i]);
+	}
+
+	// the loaded nodes are full, so updates split them right away
+	Key extra;
+	for (int i = 0; i < nKeys / 10; i++) {
+		randKey(extra);
+		ndx.insert(extra, nKeys + i);
+		ndx.remove(keys[i]);
+	}
+	if (!ndx.valid()) return fail("valid after updates", loadName);
+	ndx.close();
+
+	remove(insertName);
+	remove(loadName);
+	delete[] sorted;
+	delete[] keys;
+	printf("ok\n");
+	return 0;
+}
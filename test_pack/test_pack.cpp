@@ -0,0 +1,147 @@
+/*  test_pack.cpp -- Rewriting an index into full nodes in scan order with pack()
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Inserts random keys, removes most of them again (leaving nodes part full and free
+    nodes in the file), packs the index and checks that it holds the same keys and data
+    offsets, is smaller and takes fewer node reads to scan, with and without duplicate
+    keys.  Also packs an empty index, and checks that pack() refuses to run while a
+    flusher writes the index.  Prints the file sizes, the nodes read by a scan with a
+    small cache and the time pack() takes.
+
+    usage: test_pack [keys]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+const char* filename = "test_pack.ndx";
+
+typedef std::pair<std::string, uint32> Entry;
+
+// Collects the keys and data offsets visited
+struct Collect
+{
+	std::vector<Entry> entries;
+	bool operator()(const void* key, const uint32& offset)
+	{
+		entries.push_back(Entry((const char*)key, offset));
+		return true;
+	}
+};
+
+long fileSize(const char* name)
+{
+	FILE* fp = fopen(name, "rb");
+	if (!fp)
+		return -1;
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fclose(fp);
+	return size;
+}
+
+// the keys, and the nodes read scanning them with a small cache
+int64 scan(std::vector<Entry>& entries)
+{
+	Index ndx(20);
+	ndx.open(filename);
+	Collect all;
+	ndx.scan(0, 0, all);
+	entries.swap(all.entries);
+	return ndx.cacheStats().misses;
+}
+
+bool check(bool ok, const char* what)
+{
+	if (!ok)
+		printf("FAILED: %s\n", what);
+	return ok;
+}
+
+bool test(int nKeys, bool dups)
+{
+	{
+		Index ndx(nKeys / 40 + 100);
+		ndx.create(filename, dups);
+		srand(1);
+		std::vector<std::string> keys(nKeys);
+		for (int i = 0; i < nKeys; i++) {
+			char key[32];
+			sprintf(key, "%08x%d", rand() * (unsigned)RAND_MAX + rand(), dups ? i % 7 : i);
+			keys[i] = key;
+			ndx.insert(key, i);
+			if (dups && i % 5 == 0)
+				ndx.insert(key, nKeys + i);
+		}
+		for (int i = 0; i < nKeys; i++)
+			if (i % 4)
+				ndx.remove(keys[i].c_str(), i);
+	}
+	std::vector<Entry> before, after;
+	int64 readsBefore = scan(before);
+	long  sizeBefore = fileSize(filename);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool ok;
+	{
+		Index ndx(100);
+		ndx.open(filename);
+		ndx.pack();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		ok = check(ndx.valid() && ndx.count() == (int)before.size() && ndx.dupsAllowed() == dups, "valid after pack()");
+		printf("%s%d keys: pack() took %.3f s\n", dups ? "with duplicates, " : "", (int)before.size(), seconds);
+	}
+	int64 readsAfter = scan(after);
+	long  sizeAfter = fileSize(filename);
+	printf("  file %ld -> %ld bytes, a scan reads %d -> %d nodes\n", sizeBefore, sizeAfter,
+	       (int)readsBefore, (int)readsAfter);
+	ok = ok && check(after == before, "the same keys after pack()");
+	ok = ok && check(sizeAfter < sizeBefore && readsAfter < readsBefore, "smaller after pack()");
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 200000;
+
+	bool ok = test(nKeys, false) && test(nKeys, true);
+
+	// an empty index
+	{
+		Index ndx;
+		ndx.create(filename);
+		ndx.insert("a", 1);
+		ndx.remove("a");
+		ndx.pack();
+		ok = ok && check(ndx.valid() && ndx.count() == 0 && ndx.insert("b", 2) && ndx.find("b"), "empty index");
+	}
+
+	// not while a flusher writes the index
+	{
+		Index ndx;
+		ndx.create(filename);
+		ndx.insert("a", 1);
+		ndx.startFlusher();
+		bool refused = false;
+		try {
+			ndx.pack();
+		} catch (logic_error&) {
+			refused = true;
+		}
+		ndx.stopFlusher();
+		ok = ok && check(refused && ndx.valid() && ndx.find("a"), "pack() with a flusher");
+	}
+
+	remove(filename);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+/*  test_readers.cpp -- Many threads finding keys and scanning one index at once
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Bulk loads an index, switches it to concurrent read mode and runs 1, 2, 4...
+    threads, each with a cursor of its own, doing finds of random keys (and a short
+    scan after every 64th), first with a cache that holds every node and then with
+    a small one, so that readers also evict nodes and read them in.  Prints the
+    finds per second at each thread count and checks every key and data offset found.
+    Then makes the reads of the file fail while the readers run, and checks that each of
+    them gets an io_error (or finds nothing, like after close()), none uses the file closed
+    by the failure, and the index closes.
+
+    usage: test_readers [keys [finds per thread [max threads]]]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace nub;
+
+const char* filename = "test_readers.ndx";
+
+std::vector<std::string> keys;
+std::atomic<int>         errors(0);
+
+// A FileSystem whose reads fail after so many, closing the file as a failed read does
+struct FailingFileSystem : FileSystem
+{
+	static std::atomic<int> reads;   // # of reads until they fail
+
+	static void readAt(FileHandle fh, int64 pos, void* buffer, int size) // throw(...)
+	{
+		if (reads.fetch_sub(1) <= 0) {
+			char msg[1024];
+			sprintf(msg, "Read failure on file %s", getName(fh));
+			close(fh);
+			throw io_error(msg);
+		}
+		FileSystem::readAt(fh, pos, buffer, size);
+	}
+};
+
+std::atomic<int> FailingFileSystem::reads(0);
+
+typedef IndexT<IKeyASCIIZ, FailingFileSystem> FailingIndex;
+
+template <class IndexType>
+void reader(IndexType* ndx, int seed, int nFinds)
+{
+	typename IndexType::Cursor cursor(*ndx);
+	uint32 r = seed * 2654435761u + 1;
+	int    nKeys = (int)keys.size();
+	for (int n = 0; n < nFinds; n++) {
+		r = r * 1103515245 + 12345;
+		int i = (int)((r >> 8) % (uint32)nKeys);
+		void*  key;
+		uint32 offset;
+		if (!cursor.find(keys[i].c_str()) || !cursor.getCurKey(key, offset) ||
+			keys[i] != (char*)key || offset != (uint32)i) {
+			errors++;
+			return;
+		}
+		if (n % 64 == 0)                  // a short scan from the key found
+			for (int j = i + 1; j < i + 32 && j < nKeys; j++)
+				if (!cursor.next() || !cursor.getCurKey(key, offset) ||
+					keys[j] != (char*)key || offset != (uint32)j) {
+					errors++;
+					return;
+				}
+	}
+}
+
+bool run(int maxCache, int nFinds, int maxThreads)
+{
+	Index ndx(maxCache);
+	ndx.open(filename);
+	ndx.beginConcurrentReads();
+	printf("cache of %d nodes:\n", maxCache);
+	double base = 0;
+	for (int nThreads = 1; nThreads <= maxThreads; nThreads *= 2) {
+		ndx.resetCacheStats();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for (int t = 0; t < nThreads; t++)
+			threads.push_back(std::thread(reader<Index>, &ndx, t + 1, nFinds));
+		for (int t = 0; t < nThreads; t++)
+			threads[t].join();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		double rate = nThreads * (double)nFinds / seconds;
+		if (nThreads == 1)
+			base = rate;
+		printf("  %2d threads: %10.0f finds/s  (x%.2f)  hit rate %.3f\n", nThreads, rate, rate / base,
+		       ndx.cacheStats().hitRate());
+	}
+
+	bool ok = errors == 0;
+	if (!ok)
+		printf("FAILED: a reader found the wrong key\n");
+	try {
+		ndx.insert("~", 0);
+		printf("FAILED: insert in concurrent read mode\n");
+		ok = false;
+	} catch (logic_error&) {
+	}
+	ndx.endConcurrentReads();
+	if (!ndx.insert("~", 0) || !ndx.remove("~") || !ndx.valid() || ndx.count() != (int)keys.size()) {
+		printf("FAILED: insert and remove after concurrent reads\n");
+		ok = false;
+	}
+	return ok;
+}
+
+// the readers of a small cache while the reads of the file start failing
+std::atomic<int> failed(0);
+
+void failingReader(FailingIndex* ndx, int seed, int nFinds)
+{
+	try {
+		reader(ndx, seed, nFinds);
+	} catch (io_error&) {
+		failed++;
+	}
+}
+
+bool failures(int nThreads)
+{
+	FailingFileSystem::reads = 1 << 30;
+	FailingIndex ndx(4 * nThreads + 16);
+	ndx.open(filename);
+	ndx.beginConcurrentReads();
+	FailingFileSystem::reads = 1000;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nThreads; t++)
+		threads.push_back(std::thread(failingReader, &ndx, t + 1, 1 << 30));
+	for (int t = 0; t < nThreads; t++)
+		threads[t].join();
+	ndx.endConcurrentReads();
+	// one that starts a find once the file is closed finds nothing, like find() after close()
+	bool ok = failed > 0 && failed + errors == nThreads;
+	if (!ok)
+		printf("FAILED: %d of %d readers got an io_error when the reads failed\n", (int)failed, nThreads);
+	errors = 0;
+	ndx.close();                                  // the file is already closed
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys      = argc > 1 ? atoi(argv[1]) : 200000;
+	int nFinds     = argc > 2 ? atoi(argv[2]) : 200000;
+	int maxThreads = argc > 3 ? atoi(argv[3]) : std::max(8, (int)std::thread::hardware_concurrency());
+	printf("%d hardware threads\n", (int)std::thread::hardware_concurrency());
+
+	keys.resize(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[32];
+		sprintf(key, "%08x%07d", rand() * (unsigned)RAND_MAX + rand(), i);
+		keys[i] = key;
+	}
+	std::sort(keys.begin(), keys.end());
+
+	bool ok;
+	{
+		Index ndx;
+		ndx.create(filename);
+		ndx.beginLoad();
+		for (int i = 0; i < nKeys; i++)
+			ndx.load(keys[i].c_str(), i);
+		ndx.endLoad();
+	}
+	ok = run(nKeys / 50 + 100, nFinds, maxThreads);   // every node
+	ok = run(4 * maxThreads + 16, nFinds, maxThreads) && ok;   // 2 pinned per reader, and then some
+	ok = failures(maxThreads) && ok;
+
+	remove(filename);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+/*  test_remove.cpp -- Removes, checked against a std::multiset of the keys
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Inserts keys of many lengths, some of them more than once, into an index of small
+    nodes allowing duplicates, then removes them in a random order, in key order and in
+    reverse key order, so that leaves are emptied and freed, siblings are combined and
+    the root is emptied down to its only son.  After every so many removes, walks the
+    index with first()/next() and compares it to a std::multiset of the keys left, and
+    checks that find() finds the first of a key's duplicates.  Then checks that an index
+    emptied down to nothing takes keys again and is opened again.
+
+    usage: test_remove [keys]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace nub;
+
+typedef IndexT<IKeyASCIIZ, FileSystem, 512> SmallIndex;
+typedef std::pair<std::string, uint32>     Entry;
+
+const char* filename = "test_remove.ndx";
+
+std::vector<Entry>  entries;  // the keys and offsets inserted, some keys more than once
+std::multiset<Entry> there;   // the keys and offsets in the index
+
+bool check(bool ok, const char* what)
+{
+	if (!ok)
+		printf("FAILED: %s\n", what);
+	return ok;
+}
+
+// the index holds exactly the entries there, in order
+bool walk(SmallIndex& ndx)
+{
+	if (ndx.count() != (int)there.size())
+		return false;
+	std::multiset<Entry>::iterator it = there.begin();
+	for (bool more = ndx.first(); more; more = ndx.next(), ++it) {
+		void*  key;
+		uint32 offset;
+		if (it == there.end() || !ndx.getCurKey(key, offset) || it->first != (const char*)key || it->second != offset)
+			return false;
+	}
+	return it == there.end();
+}
+
+// find() of a key stops at its first duplicate, or fails when none are left
+bool finds(SmallIndex& ndx, int step)
+{
+	for (int i = 0; i < (int)entries.size(); i += step) {
+		std::multiset<Entry>::iterator it = there.lower_bound(Entry(entries[i].first, 0));
+		bool in = it != there.end() && it->first == entries[i].first;
+		void*  key;
+		uint32 offset;
+		if (ndx.find(entries[i].first.c_str()) != in ||
+			(in && (!ndx.getCurKey(key, offset) || offset != it->second)))
+			return false;
+	}
+	return true;
+}
+
+// inserts all the entries, then removes them in the order given
+bool removes(const std::vector<int>& order, const char* what)
+{
+	SmallIndex ndx(8);
+	ndx.create(filename, true);
+	there.clear();
+	for (int i = 0; i < (int)entries.size(); i++) {
+		ndx.insert(entries[i].first.c_str(), entries[i].second);
+		there.insert(entries[i]);
+	}
+	bool ok = check(walk(ndx), what) && check(finds(ndx, 7), what);
+	int n = (int)order.size();
+	for (int r = 0; ok && r < n; r++) {
+		const Entry& e = entries[order[r]];
+		ok = check(ndx.remove(e.first.c_str(), e.second), "remove()");
+		there.erase(there.find(e));
+		if (r % (n / 16) == 0 || n - r < 40)
+			ok = ok && check(walk(ndx), what) && check(finds(ndx, 13), what);
+	}
+	ok = ok && check(!ndx.first() && ndx.count() == 0, "emptied");
+	for (int i = 0; ok && i < 100; i++) {   // takes keys again
+		ndx.insert(entries[i].first.c_str(), entries[i].second);
+		there.insert(entries[i]);
+	}
+	ndx.close();
+	ndx.open(filename);
+	ok = ok && check(walk(ndx), "keys inserted after emptied");
+	ndx.close();
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 20000;
+
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[80];
+		int  length = sprintf(key, "%06x", rand() % 0x1000000);
+		for (int j = rand() % 40; j > 0; j--)       // of many lengths
+			key[length++] = 'a' + rand() % 26;
+		key[length] = '\0';
+		for (int d = rand() % 4 ? 1 : 3; d > 0; d--)  // some of them more than once
+			entries.push_back(Entry(key, (uint32)entries.size()));
+	}
+	int n = (int)entries.size();
+	std::vector<int> order(n);
+	for (int i = 0; i < n; i++)
+		order[i] = i;
+	std::random_shuffle(order.begin(), order.end());
+	bool ok = removes(order, "removes in random order");
+
+	std::vector<Entry> sorted(entries);
+	std::sort(sorted.begin(), sorted.end());
+	for (int i = 0; i < n; i++)
+		order[i] = sorted[i].second;
+	ok = ok && removes(order, "removes in key order");
+	std::reverse(order.begin(), order.end());
+	ok = ok && removes(order, "removes in reverse key order");
+
+	remove(filename);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
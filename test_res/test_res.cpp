@@ -42,5 +42,14 @@ int main()
     } while (is->gcount());
 
     delete is;
+
+    // several names at once
+    const char* names[2] = { resName, "not_there" };
+    nub::ResourceFile::datFilePosType offsets[2];
+    bool found[2];
+    if (res.resolve(names, 2, offsets, found) != 1 || !found[0] || found[1]) {
+        printf("resolve() FAILED\n");
+        return 1;
+    }
     return 0;
 }
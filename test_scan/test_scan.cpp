@@ -0,0 +1,173 @@
+/*  test_scan.cpp -- Range scans with scan(lo, hi, visitor) against find() and next()
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Checks that scan() visits the same keys and data offsets as find() followed by
+    next() and getCurKey() for ranges of all sizes, open ends, a visitor that stops
+    early, an empty range, a cursor and an index with leaves emptied by removes,
+    then times both ways over the whole index.
+
+    usage: test_scan [keys [ranges]]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+typedef IndexT<IKeyASCIIZ, FileSystem, 512> SmallIndex;
+
+const char* filename = "test_scan.ndx";
+
+std::vector<std::string> keys;
+
+// Collects the data offsets of the keys visited, up to a limit
+struct Collect
+{
+	std::vector<uint32> offsets;
+	int                 limit;
+
+	Collect(int limit = -1) : limit(limit) {}
+
+	bool operator()(const void* key, const uint32& offset)
+	{
+		if (keys[offset] != (const char*)key)
+			offsets.push_back(~0u);     // the key does not go with the offset
+		offsets.push_back(offset);
+		return (int)offsets.size() != limit;
+	}
+};
+
+// Adds up the offsets, to time the visits and not the visitor
+struct Sum
+{
+	uint64 sum;
+	Sum() : sum(0) {}
+	bool operator()(const void* key, const uint32& offset) { sum += offset; return true; }
+};
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// the same range with find(), next() and getCurKey()
+template <class Ndx>
+std::vector<uint32> stepped(Ndx& ndx, const char* lo, const char* hi)
+{
+	std::vector<uint32> offsets;
+	void*  key;
+	uint32 offset;
+	for (bool ok = lo ? (ndx.find(lo), ndx.getCurKey(key, offset)) : ndx.first(); ok; ok = ndx.next()) {
+		ndx.getCurKey(key, offset);
+		if (hi && strcmp((char*)key, hi) >= 0)
+			break;
+		offsets.push_back(offset);
+	}
+	return offsets;
+}
+
+bool check(bool ok, const char* what)
+{
+	if (!ok)
+		printf("FAILED: %s\n", what);
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys   = argc > 1 ? atoi(argv[1]) : 200000;
+	int nRanges = argc > 2 ? atoi(argv[2]) : 2000;
+
+	keys.resize(nKeys);
+	std::vector<std::string> sorted(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[32];
+		sprintf(key, "%06x%07d", (rand() * (unsigned)RAND_MAX + rand()) & 0xffffff, i);
+		sorted[i] = keys[i] = key;
+	}
+	std::sort(sorted.begin(), sorted.end());
+
+	Index ndx(100);
+	ndx.create(filename);
+	for (int i = 0; i < nKeys; i++)    // inserted, so that the nodes are not all full
+		ndx.insert(keys[i].c_str(), i);
+
+	bool ok = true;
+	for (int r = 0; ok && r < nRanges; r++) {
+		// ranges of up to 1000 keys, with bounds that are keys or fall between them
+		int a = rand() % nKeys, b = std::min(nKeys - 1, a + rand() % 1000);
+		std::string lo = sorted[a].substr(0, 3 + rand() % 8), hi = sorted[b];
+		const char* l = r % 50 == 0 ? 0 : lo.c_str();
+		const char* h = r % 70 == 0 ? 0 : hi.c_str();
+		Collect visited;
+		int n = ndx.scan(l, h, visited);
+		ok = check(n == (int)visited.offsets.size() && visited.offsets == stepped(ndx, l, h), "a range");
+	}
+
+	// a visitor that stops early leaves the current key there, so next() goes on
+	Collect some(10);
+	ok = ok && check(ndx.scan(sorted[100].c_str(), 0, some) == 10, "stop after 10 keys");
+	void*  key;
+	uint32 offset;
+	ok = ok && check(ndx.getCurKey(key, offset) && sorted[109] == (char*)key && ndx.next() &&
+	                 ndx.getCurKey(key, offset) && sorted[110] == (char*)key, "next() after a stop");
+
+	// an empty range, and hi that stops the scan at the first key not visited
+	Collect none, two;
+	ok = ok && check(ndx.scan(sorted[5].c_str(), sorted[5].c_str(), none) == 0, "empty range");
+	ok = ok && check(ndx.scan(sorted[5].c_str(), sorted[7].c_str(), two) == 2 &&
+	                 ndx.getCurKey(key, offset) && sorted[7] == (char*)key, "stop at hi");
+
+	// a cursor scans without moving the index's current key
+	Index::Cursor cursor(ndx);
+	Collect all;
+	ok = ok && check(cursor.scan(0, 0, all) == nKeys && ndx.getCurKey(key, offset) &&
+	                 sorted[7] == (char*)key, "cursor scan");
+	for (int i = 0; ok && i < nKeys; i++)
+		ok = check(keys[all.offsets[i]] == sorted[i], "keys in order");
+
+	// removes free the leaves they empty, leaving sons of 0 in the nodes above: runs of
+	//    keys in order, so the siblings of the leaves they shrink are too full to merge with
+	SmallIndex removed(100);
+	removed.create("test_scan.removed.ndx");
+	for (int i = 0; i < nKeys; i++)
+		removed.insert(keys[i].c_str(), i);
+	for (int i = 0; i < nKeys; i++)
+		if (i / 300 % 3 == 0)
+			removed.remove(sorted[i].c_str());
+	Collect left;
+	ok = ok && check(removed.scan(0, 0, left) == (int)left.offsets.size() &&
+	                 left.offsets == stepped(removed, 0, 0), "scan after removes");
+	removed.close();
+	remove("test_scan.removed.ndx");
+
+	// timing: the whole index both ways
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64 stepSum = 0;
+	for (bool more = ndx.first(); more; more = ndx.next()) {
+		ndx.getCurKey(key, offset);
+		stepSum += offset;
+	}
+	double stepTime = seconds(start);
+	start = std::chrono::steady_clock::now();
+	Sum sum;
+	ndx.scan(0, 0, sum);
+	double scanTime = seconds(start);
+	ok = ok && check(sum.sum == stepSum, "sums");
+	printf("%d keys: next()/getCurKey() %.1f ns/key, scan() %.1f ns/key\n", nKeys,
+	       stepTime * 1e9 / nKeys, scanTime * 1e9 / nKeys);
+
+	ndx.close();
+	remove(filename);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
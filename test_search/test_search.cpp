@@ -0,0 +1,92 @@
+/*  test_search.cpp -- Benchmark of the search within nodes: find() and insert() with
+                       every node cached, for random keys and for keys with long common prefixes
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    usage: test_search [keys [finds]]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+const char* filename = "test_search.ndx";
+
+const char* dirs[]  = { "textures/world/terrain/", "textures/world/props/", "textures/characters/",
+                        "models/world/terrain/", "models/characters/", "sounds/ambient/" };
+const char* kinds[] = { "grass", "rock", "sand", "snow", "water", "mud" };
+
+std::string randomKey(int)
+{
+	char key[17];
+	for (int j = 0; j < 16; j++)
+		key[j] = 'a' + rand() % 26;
+	key[16] = '\0';
+	return key;
+}
+
+std::string assetPath(int i)
+{
+	char name[256];
+	sprintf(name, "%sregion_%02d/%s_%05d.dds", dirs[rand() % 6], rand() % 40, kinds[rand() % 6], i);
+	return name;
+}
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class IndexType>
+bool run(const char* title, std::string (*makeKey)(int), int nKeys, int nFinds)
+{
+	std::vector<std::string> keys(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++)
+		keys[i] = makeKey(i);
+
+	IndexType ndx(nKeys / 10 + 100);   // room for every node
+	ndx.create(filename);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < nKeys; i++)
+		ndx.insert(keys[i].c_str(), i);
+	double insertTime = seconds(start);
+
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < nFinds; i++) {
+		int r = rand() % nKeys;
+		if (!ndx.find(keys[r].c_str())) {
+			printf("FAILED: %s find %s\n", title, keys[r].c_str());
+			return false;
+		}
+	}
+	double findTime = seconds(start);
+	bool ok = ndx.valid();
+	ndx.close();
+	remove(filename);
+
+	printf("%-26s %6.0f ns/insert  %6.0f ns/find\n", title,
+	       insertTime * 1e9 / nKeys, findTime * 1e9 / nFinds);
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys  = argc > 1 ? atoi(argv[1]) : 200000;
+	int nFinds = argc > 2 ? atoi(argv[2]) : 1000000;
+
+	typedef IndexT<IKeyASCIIZ, FileSystem, 4096, uint32, uint32, CacheLRU, NodeFrontCoded<> > FrontIndex;
+
+	bool ok = run<Index>("random keys", randomKey, nKeys, nFinds) &
+	          run<Index>("shared prefixes", assetPath, nKeys, nFinds) &
+	          run<FrontIndex>("shared prefixes, front", assetPath, nKeys, nFinds);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
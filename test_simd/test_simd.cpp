@@ -0,0 +1,181 @@
+/*  test_simd.cpp -- The SIMD key policies against the plain ones
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Checks that size(), compare() and common() of IKeyASCIIZSimd and IKeyUTF16Simd agree
+    with IKeyASCIIZ and IKeyUTF16 for keys of every length at every alignment, and for
+    keys that end at the end of a page followed by a page that cannot be read (on Linux).
+    Then times the policies alone and inside an index.
+
+    usage: test_simd [keys [finds]]
+*/
+
+#include <nub/IKeySimd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#if NUB_PLATFORM == NUB_PLATFORM_LINUX
+#include <sys/mman.h>
+#endif
+
+using namespace nub;
+
+const char* filename = "test_simd.ndx";
+
+const char* dirs[]  = { "textures/world/terrain/", "textures/world/props/", "textures/characters/",
+                        "models/world/terrain/", "models/characters/", "sounds/ambient/" };
+const char* kinds[] = { "grass", "rock", "sand", "snow", "water", "mud" };
+
+int sign(int x) { return (x > 0) - (x < 0); }
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Compare the policies on keys at a and b, which have room for len + 1 characters
+template <class Plain, class Simd, typename Char>
+bool check(Char* a, Char* b, int len, int diff)
+{
+	for (int i = 0; i < len; i++)
+		a[i] = b[i] = (Char)(1 + rand() % 200);
+	a[len] = b[len] = 0;
+	if (diff >= 0 && diff < len)
+		b[diff] = (Char)(rand() % 201);    // may end b early
+	bool ok = Simd::size(a) == Plain::size(a) && Simd::size(b) == Plain::size(b) &&
+	          sign(Simd::compare(a, b)) == sign(Plain::compare(a, b)) &&
+	          sign(Simd::compare(b, a)) == sign(Plain::compare(b, a)) &&
+	          Simd::common(a, b) == Plain::common(a, b) && Simd::common(b, a) == Plain::common(b, a);
+	if (!ok)
+		printf("FAILED: %d byte characters, length %d, difference at %d\n", (int)sizeof(Char), len, diff);
+	return ok;
+}
+
+template <class Plain, class Simd, typename Char>
+bool checkAll()
+{
+	const int maxLen = 80;
+	std::vector<Char> buf(2 * (maxLen + 64));
+	bool ok = true;
+	for (int len = 0; ok && len < maxLen; len++)
+		for (int align = 0; ok && align < 32; align++)
+			for (int diff = -1; ok && diff <= len; diff++)
+				ok = check<Plain, Simd>(&buf[align], &buf[maxLen + 64 + (align * 7) % 32], len, diff);
+
+#if NUB_PLATFORM == NUB_PLATFORM_LINUX
+	// keys that end at (or near) the end of a page, with an unreadable page after it
+	byte* pages = (byte*)mmap(0, 16384, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pages != MAP_FAILED && mprotect(pages + 4096, 4096, PROT_NONE) == 0 &&
+		mprotect(pages + 12288, 4096, PROT_NONE) == 0)
+	{
+		Char* end1 = (Char*)(pages + 4096);
+		Char* end2 = (Char*)(pages + 12288);
+		for (int len = 0; ok && len < maxLen; len++)
+			for (int diff = -1; ok && diff <= len; diff++)
+				ok = check<Plain, Simd>(end1 - len - 1, end2 - len - 1 - (diff + 1) % 8, len, diff) &&
+				     check<Plain, Simd>(end1 - len - 1 - (diff + 1) % 8, end2 - len - 1, len, diff);
+		if (!ok)
+			printf("FAILED: %d byte character keys at the end of a page\n", (int)sizeof(Char));
+	}
+	if (pages != MAP_FAILED)
+		munmap(pages, 16384);
+#endif
+	return ok;
+}
+
+// Time size() and compare() of a policy on 1000 keys (which stay in the cache),
+//     comparing each with the next one
+template <class IKey, typename Char>
+void timeKeys(const char* title, const std::vector<std::basic_string<Char> >& keys)
+{
+	const int n = 1000, reps = 10000;
+	std::vector<const Char*> k(n + 1);
+	for (int i = 0; i <= n; i++)
+		k[i] = keys[i % keys.size()].c_str();
+	int sum = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int rep = 0; rep < reps; rep++)
+		for (int i = 0; i < n; i++)
+			sum += IKey::size(k[i]);
+	double sizeTime = seconds(start);
+	start = std::chrono::steady_clock::now();
+	for (int rep = 0; rep < reps; rep++)
+		for (int i = 0; i < n; i++)
+			sum += IKey::compare(k[i], k[i + 1]) < 0;
+	double compareTime = seconds(start);
+	printf("%-26s %6.2f ns/size    %6.2f ns/compare  (%d)\n", title,
+	       sizeTime * 1e9 / ((double)reps * n), compareTime * 1e9 / ((double)reps * n), sum % 10);
+}
+
+template <class IndexType, typename Char>
+bool timeIndex(const char* title, const std::vector<std::basic_string<Char> >& keys, int nFinds)
+{
+	int nKeys = (int)keys.size();
+	IndexType ndx(nKeys / 10 + 100);   // room for every node
+	ndx.create(filename);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < nKeys; i++)
+		ndx.insert(keys[i].c_str(), i);
+	double insertTime = seconds(start);
+
+	srand(2);
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < nFinds; i++) {
+		int r = rand() % nKeys;
+		if (!ndx.find(keys[r].c_str())) {
+			printf("FAILED: %s find #%d\n", title, r);
+			return false;
+		}
+	}
+	double findTime = seconds(start);
+	bool ok = ndx.valid();
+	ndx.close();
+	remove(filename);
+
+	printf("%-26s %6.0f ns/insert  %6.0f ns/find\n", title,
+	       insertTime * 1e9 / nKeys, findTime * 1e9 / nFinds);
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys  = argc > 1 ? atoi(argv[1]) : 200000;
+	int nFinds = argc > 2 ? atoi(argv[2]) : 1000000;
+
+	srand(1);
+	bool ok = checkAll<IKeyASCIIZ, IKeyASCIIZSimd, byte>() &
+	          checkAll<IKeyUTF16,  IKeyUTF16Simd,  wchar_t>();
+#ifdef NUB_SIMD
+	printf("%s\n", simd::hasAVX2() ? "AVX2" : "SSE2");
+#else
+	printf("no SIMD, the policies are the plain ones\n");
+#endif
+
+	std::vector<std::string>  keys(nKeys);
+	std::vector<std::wstring> wkeys(nKeys);
+	for (int i = 0; i < nKeys; i++) {
+		char name[256];
+		sprintf(name, "%sregion_%02d/%s_%05d.dds", dirs[rand() % 6], rand() % 40, kinds[rand() % 6], i);
+		keys[i] = name;
+		wkeys[i].assign(keys[i].begin(), keys[i].end());
+	}
+	timeKeys<IKeyASCIIZ>    ("IKeyASCIIZ", keys);
+	timeKeys<IKeyASCIIZSimd>("IKeyASCIIZSimd", keys);
+	timeKeys<IKeyUTF16>     ("IKeyUTF16", wkeys);
+	timeKeys<IKeyUTF16Simd> ("IKeyUTF16Simd", wkeys);
+
+	typedef IndexT<IKeyASCIIZSimd> SimdIndex;
+	typedef IndexT<IKeyUTF16Simd>  SimdUniIndex;
+	ok = ok & timeIndex<Index>       ("Index", keys, nFinds) &
+	          timeIndex<SimdIndex>   ("IndexT<IKeyASCIIZSimd>", keys, nFinds) &
+	          timeIndex<UniIndex>    ("UniIndex", wkeys, nFinds) &
+	          timeIndex<SimdUniIndex>("IndexT<IKeyUTF16Simd>", wkeys, nFinds);
+
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,236 @@
+/*  test_snapshot.cpp -- Copy-on-write updates of an index read by snapshots at the same time
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Inserts and removes keys in batches in copy-on-write mode, with a cache too small
+    for the index, publishing most batches and discarding some, while a thread reads
+    a snapshot opened before them and checks that it still sees the index as it was.
+    Then "crashes": the writer is abandoned with changes not published, and the index
+    opened again must hold the keys as of the last publish().  Checks that the file
+    does not grow when no snapshot holds on to old nodes, and times batches of inserts
+    with a publish() after each against the same inserts without copy-on-write.
+
+    usage: test_snapshot [keys]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace nub;
+
+const char* filename = "test_snapshot.ndx";
+
+std::vector<std::string> keys;
+
+bool check(bool ok, const char* what)
+{
+	if (!ok)
+		printf("FAILED: %s\n", what);
+	return ok;
+}
+
+// keys i < n with i % skip != 0 (all of them if skip is 0) are there with data offset i
+bool holds(Index& ndx, int n, int skip)
+{
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		void*  key;
+		uint32 offset;
+		bool   there = skip && i % skip == 0;
+		bool   found = ndx.find(keys[i].c_str()) && ndx.getCurKey(key, offset) && offset == (uint32)i;
+		if (found == there)
+			return false;
+		count += found;
+	}
+	return ndx.valid() && ndx.count() == count;
+}
+
+// a reader thread: the snapshot, opened after keys [0, n) less every fourth, sees just them
+void reader(Index* ndx, int n, int rounds, bool* ok)
+{
+	for (int r = 0; *ok && r < rounds; r++)
+		*ok = holds(*ndx, n, 4);
+}
+
+// with the writer's batch b: insert keys [n + b * 100, n + b * 100 + 100), remove every fourth
+void batch(Index& ndx, int n, int b)
+{
+	for (int i = n + b * 100; i < n + b * 100 + 100; i++)
+		ndx.insert(keys[i].c_str(), i);
+	for (int i = n + b * 100; i < n + b * 100 + 100; i += 4)
+		ndx.remove(keys[i].c_str());
+}
+
+bool snapshots(int nKeys)
+{
+	int n = nKeys / 2, nBatches = (nKeys - n) / 100;
+	Index ndx(20);
+	ndx.create(filename);
+	for (int i = 0; i < n; i++)
+		ndx.insert(keys[i].c_str(), i);
+	for (int i = 0; i < n; i += 4)
+		ndx.remove(keys[i].c_str());
+	ndx.beginCopyOnWrite();
+
+	Index snapshot(30);
+	snapshot.openSnapshot(ndx);
+	bool readOk = true;
+	std::thread thread(reader, &snapshot, n, 3, &readOk);
+	int last = 0;                            // the batches published
+	for (int b = 0; b < nBatches; b++) {
+		batch(ndx, n, b);
+		if (b % 5 == 4)
+			ndx.discard();
+		else {
+			ndx.publish();
+			last = b + 1;
+		}
+	}
+	thread.join();
+	bool ok = check(readOk && holds(snapshot, n, 4), "a snapshot read while the index changed");
+	try {
+		snapshot.insert(keys[0].c_str(), 0);
+		ok = check(false, "insert into a snapshot");
+	} catch (logic_error&) {
+	}
+	try {
+		ndx.endCopyOnWrite();
+		ok = check(false, "endCopyOnWrite() with a snapshot open");
+	} catch (logic_error&) {
+	}
+	snapshot.close();
+
+	// the writer sees the batches published, and not the ones discarded
+	int count = n - (n + 3) / 4;
+	for (int b = 0; b < last; b++)
+		count += b % 5 == 4 ? 0 : 75;
+	ok = ok && check(ndx.valid() && ndx.count() == count, "the batches published");
+	for (int b = 0; ok && b < nBatches; b++) {
+		int i = n + b * 100 + 1;
+		ok = check(ndx.find(keys[i].c_str()) == (b < last && b % 5 != 4), "a batch discarded");
+	}
+	ndx.endCopyOnWrite();
+	ndx.close();
+
+	Index again(20);
+	again.open(filename);
+	ok = ok && check(again.valid() && again.count() == count, "reopened after endCopyOnWrite()");
+	again.close();
+	return ok;
+}
+
+// changes not published, and then the crash
+bool crash(int nKeys)
+{
+	int n = nKeys / 2;
+	Index* ndx = new Index(20);
+	ndx->create(filename);
+	ndx->beginCopyOnWrite();
+	for (int i = 0; i < n; i++) {
+		ndx->insert(keys[i].c_str(), i);
+		if (i % 1000 == 999)
+			ndx->publish();
+	}
+	int published = n - n % 1000;
+	for (int i = 0; i < published; i += 3)   // removes, not published
+		ndx->remove(keys[i].c_str());
+	// crash: the writer is not closed (the file stays open, as if the process died)
+
+	ndx = new Index(20);
+	ndx->open(filename);
+	bool ok = check(holds(*ndx, published, 0), "recovery of the last publish()");
+	ndx->close();
+	delete ndx;
+	return ok;
+}
+
+long fileSize()
+{
+	FILE* f = fopen(filename, "rb");
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+// the file does not grow when inserts and removes keep the number of keys the same
+bool reuse(int nKeys)
+{
+	Index ndx(20);
+	ndx.create(filename);
+	int n = nKeys / 2;
+	for (int i = 0; i < n; i++)
+		ndx.insert(keys[i].c_str(), i);
+	ndx.beginCopyOnWrite();
+	long size = 0;
+	for (int r = 0; r < 40; r++) {
+		int a = r * n / 40, b = (r + 1) * n / 40;
+		for (int i = a; i < b; i++)
+			ndx.remove(keys[i].c_str());
+		for (int i = a; i < b; i++)
+			ndx.insert(keys[i].c_str(), i);
+		ndx.publish();
+		if (r == 9)
+			size = fileSize();
+	}
+	bool ok = check(fileSize() <= size + size / 4, "nodes reused");
+	ndx.endCopyOnWrite();
+	ok = ok && check(holds(ndx, n, 0), "keys after reuse");
+	ndx.close();
+	return ok;
+}
+
+// nKeys inserts in batches of batchSize, with a publish() after each (if cow)
+double timeInserts(int nKeys, int batchSize, bool cow)
+{
+	Index ndx(1000);
+	ndx.create(filename);
+	if (cow)
+		ndx.beginCopyOnWrite();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < nKeys; i++) {
+		ndx.insert(keys[i].c_str(), i);
+		if (cow && i % batchSize == batchSize - 1)
+			ndx.publish();
+	}
+	if (cow)
+		ndx.endCopyOnWrite();
+	ndx.close();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return seconds * 1e6 / nKeys;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 20000;
+
+	keys.resize(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[32];
+		sprintf(key, "%08x%07d", rand() * (unsigned)RAND_MAX + rand(), i);
+		keys[i] = key;
+	}
+
+	bool ok = check(snapshots(nKeys), "snapshots") &&
+	          check(crash(nKeys), "recovery") &&
+	          check(reuse(nKeys), "reuse");
+
+	// timing
+	double plain = timeInserts(nKeys, 0, false);
+	printf("inserts: %.2f us without copy-on-write", plain);
+	for (int batchSize = 10; batchSize <= 1000; batchSize *= 10)
+		printf(", %.2f us with a publish() every %d", timeInserts(nKeys, batchSize, true), batchSize);
+	printf("\n");
+
+	remove(filename);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,224 @@
+/*  test_wal.cpp -- Crash safe updates of an index through a write-ahead log
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Inserts and removes keys in transactions through a log, with a cache too small
+    for the index, then "crashes": the index and the log are abandoned without being
+    closed, and opened again.  Checks that the committed transactions are all there
+    and the one left open is not, that a rollback leaves the index as it was, that a
+    log cut off in the middle of a transaction recovers the ones before it, and that
+    grouped commits share syncs.  Then times inserts without a log, with a sync at
+    every commit and with a sync for every 100 commits.
+
+    usage: test_wal [keys]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace nub;
+
+const char* filename = "test_wal.ndx";
+const char* logname  = "test_wal.log";
+
+std::vector<std::string> keys;
+
+bool check(bool ok, const char* what)
+{
+	if (!ok)
+		printf("FAILED: %s\n", what);
+	return ok;
+}
+
+// keys [0, n) are there with data offset i, keys [n, to) are not
+bool holds(Index& ndx, int n, int to)
+{
+	if (!ndx.valid() || ndx.count() != n)
+		return false;
+	for (int i = 0; i < to; i++) {
+		void*  key;
+		uint32 offset;
+		bool   found = ndx.find(keys[i].c_str()) && ndx.getCurKey(key, offset) && offset == (uint32)i;
+		if (found != (i < n))
+			return false;
+	}
+	return true;
+}
+
+// open the index and its log again after a "crash", replaying the log
+Index* recover(WriteAheadLog*& log)
+{
+	log = new WriteAheadLog;
+	Index* ndx = new Index(20);
+	ndx->open(filename);
+	if (log->open(logname))
+		ndx->attachLog(*log);
+	return ndx;
+}
+
+void closeAll(Index* ndx, WriteAheadLog* log)
+{
+	ndx->close();
+	log->close();
+	delete ndx;
+	delete log;
+}
+
+// transactions of 10 inserts, removes, a transaction left open, and then the crash
+bool crash(int nKeys, int syncCommits)
+{
+	Index*         ndx = new Index(20);
+	WriteAheadLog* log = new WriteAheadLog;
+	ndx->create(filename);
+	log->create(logname);
+	log->setSync(syncCommits);
+	ndx->attachLog(*log);
+	int committed = nKeys - nKeys % 10 - 50;
+	for (int i = 0; i < committed; i++) {
+		if (i % 10 == 0)
+			ndx->beginTransaction();
+		ndx->insert(keys[i].c_str(), i);
+		if (i % 10 == 9)
+			ndx->commit();
+	}
+	for (int i = 0; i < committed; i += 3)   // removes: one transaction each, left in the log
+		ndx->remove(keys[i].c_str());
+	ndx->beginTransaction();
+	for (int i = 1; i < committed; i += 3)   // not committed
+		ndx->remove(keys[i].c_str());
+	for (int i = committed; i < nKeys; i++)
+		ndx->insert(keys[i].c_str(), i);
+	// crash: neither is closed (the files stay open, as if the process died)
+
+	ndx = recover(log);
+	bool ok = ndx->valid() && ndx->count() == committed - (committed + 2) / 3;
+	for (int i = 0; ok && i < nKeys; i++)
+		ok = ndx->find(keys[i].c_str()) == (i < committed && i % 3 != 0);
+	closeAll(ndx, log);
+	return ok;
+}
+
+// a log torn in the middle of a transaction: the ones before it are replayed
+bool torn(int nKeys)
+{
+	Index*         ndx = new Index(20);
+	WriteAheadLog* log = new WriteAheadLog;
+	ndx->create(filename);
+	log->create(logname);
+	log->setSync(0);              // only a checkpoint would write the nodes to the index file
+	ndx->attachLog(*log);
+	int nTxns = nKeys / 10;
+	for (int t = 0; t < nTxns; t++) {
+		ndx->beginTransaction();
+		for (int i = t * 10; i < t * 10 + 10; i++)
+			ndx->insert(keys[i].c_str(), i);
+		ndx->commit();
+	}
+	// crash, and lose the last 100 bytes of the log (a commit logs a node or more)
+	FILE* f = fopen(logname, "rb");
+	fseek(f, 0, SEEK_END);
+	std::vector<char> data(ftell(f) - 100);
+	fseek(f, 0, SEEK_SET);
+	bool ok = fread(&data[0], 1, data.size(), f) == data.size();
+	fclose(f);
+	f = fopen(logname, "wb");
+	ok = ok && fwrite(&data[0], 1, data.size(), f) == data.size();
+	fclose(f);
+
+	ndx = recover(log);
+	ok = ok && holds(*ndx, (nTxns - 1) * 10, nKeys);
+	closeAll(ndx, log);
+	return ok;
+}
+
+bool rollback(int nKeys)
+{
+	Index         ndx(20);
+	WriteAheadLog log;
+	ndx.create(filename);
+	log.create(logname);
+	ndx.attachLog(log);
+	for (int i = 0; i < nKeys / 2; i++)
+		ndx.insert(keys[i].c_str(), i);
+	ndx.beginTransaction();
+	for (int i = nKeys / 2; i < nKeys; i++)
+		ndx.insert(keys[i].c_str(), i);
+	for (int i = 0; i < nKeys / 2; i += 2)
+		ndx.remove(keys[i].c_str());
+	ndx.rollback();
+	bool ok = holds(ndx, nKeys / 2, nKeys);
+	for (int i = nKeys / 2; i < nKeys; i++)   // and go on from there
+		ndx.insert(keys[i].c_str(), i);
+	ok = ok && holds(ndx, nKeys, nKeys);
+	try {
+		ndx.beginLoad();
+		ok = false;
+	} catch (logic_error&) {
+	}
+	ndx.close();
+	log.close();
+	return ok;
+}
+
+// nCommits single inserts with a sync every syncCommits (no log if 0): the time per insert
+double timeInserts(int nCommits, int syncCommits, int64* syncs)
+{
+	Index         ndx(1000);
+	WriteAheadLog log;
+	ndx.create(filename);
+	if (syncCommits) {
+		log.create(logname);
+		log.setSync(syncCommits);
+		ndx.attachLog(log);
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < nCommits; i++)
+		ndx.insert(keys[i].c_str(), i);
+	if (syncCommits)
+		log.sync();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	*syncs = log.syncs();
+	ndx.close();
+	log.close();
+	return seconds * 1e6 / nCommits;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys = argc > 1 ? atoi(argv[1]) : 20000;
+
+	keys.resize(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[32];
+		sprintf(key, "%08x%07d", rand() * (unsigned)RAND_MAX + rand(), i);
+		keys[i] = key;
+	}
+
+	bool ok = check(crash(nKeys, 1), "recovery, a sync every commit") &&
+	          check(crash(nKeys, 100), "recovery, a sync every 100 commits") &&
+	          check(crash(nKeys, 0), "recovery, no syncs") &&
+	          check(torn(nKeys), "recovery from a torn log") &&
+	          check(rollback(nKeys), "rollback");
+
+	// timing
+	int    nCommits = nKeys < 2000 ? nKeys : 2000;
+	int64  syncs[3];
+	double none    = timeInserts(nKeys, 0, &syncs[0]);
+	double each    = timeInserts(nCommits, 1, &syncs[1]);
+	double grouped = timeInserts(nKeys, 100, &syncs[2]);
+	ok = ok && check(syncs[1] == nCommits && syncs[2] == (nKeys + 99) / 100, "syncs of grouped commits");
+	printf("one insert per commit: no log %.2f us, a sync every commit %.2f us, every 100 commits %.2f us\n",
+	       none, each, grouped);
+
+	remove(filename);
+	remove(logname);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,192 @@
+/*  test_writers.cpp -- Many threads inserting and removing keys in one index at once
+    Copyright (c) 2020 by Gerald Lindsly
+
+    See <nub/Platform.h> for additional copyright information
+
+    Inserts random keys from 1, 2, 4... threads into a new index, first with every
+    insert holding one lock (as callers had to before) and then in concurrent write
+    mode, where inserts into different leaves run in parallel, and so do splits and
+    merges of leaves under different parents.  Then the threads
+    remove every third key.  Prints the inserts per second at each thread count
+    and checks the index and every key left in it, with a cache that holds every
+    node and with a small one (so that writers also evict and write back nodes).
+    Then writes concurrently in a tree that removes have left leaves emptied in.
+
+    usage: test_writers [keys [max threads]]
+*/
+
+#include <nub/Index.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace nub;
+
+typedef IndexT<IKeyASCIIZ, FileSystem, 512> SmallIndex;
+
+const char* filename = "test_writers.ndx";
+
+std::vector<std::string> keys;
+std::mutex               oneLock;
+
+// each thread inserts (and removes) the keys i with i % nThreads == t
+void writer(Index* ndx, int t, int nThreads, bool locked, bool removing, int* failed)
+{
+	for (int i = t; i < (int)keys.size(); i += nThreads) {
+		if (removing && i % 3)
+			continue;
+		bool ok;
+		if (locked) {
+			std::lock_guard<std::mutex> lock(oneLock);
+			ok = removing ? ndx->remove(keys[i].c_str()) : ndx->insert(keys[i].c_str(), i);
+		} else
+			ok = removing ? ndx->remove(keys[i].c_str()) : ndx->insert(keys[i].c_str(), i);
+		if (!ok)
+			(*failed)++;
+	}
+}
+
+// the time the threads take
+double run(Index& ndx, int nThreads, bool locked, bool removing, int* failed)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nThreads; t++)
+		threads.push_back(std::thread(writer, &ndx, t, nThreads, locked, removing, failed + t));
+	for (int t = 0; t < nThreads; t++)
+		threads[t].join();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool check(Index& ndx)
+{
+	int nKeys = (int)keys.size();
+	bool ok = ndx.valid() && ndx.count() == nKeys - (nKeys + 2) / 3;
+	for (int i = 0; ok && i < nKeys; i++) {
+		void*  key;
+		uint32 offset;
+		ok = i % 3 ? ndx.find(keys[i].c_str()) && ndx.getCurKey(key, offset) && offset == (uint32)i
+		           : !ndx.find(keys[i].c_str());
+	}
+	return ok;
+}
+
+bool test(int maxCache, int maxThreads)
+{
+	printf("cache of %d nodes:\n", maxCache);
+	int nKeys = (int)keys.size();
+	bool ok = true;
+	for (int nThreads = 1; ok && nThreads <= maxThreads; nThreads *= 2) {
+		double seconds[2];
+		for (int concurrent = 0; ok && concurrent < 2; concurrent++) {
+			std::vector<int> failed(nThreads, 0);
+			Index ndx(maxCache);
+			ndx.create(filename);
+			if (concurrent)
+				ndx.beginConcurrentWrites();
+			seconds[concurrent] = run(ndx, nThreads, !concurrent, false, &failed[0]);
+			run(ndx, nThreads, !concurrent, true, &failed[0]);
+			if (concurrent) {
+				try {
+					ndx.find(keys[0].c_str());
+					ok = false;
+				} catch (logic_error&) {
+				}
+				ndx.endConcurrentWrites();
+			}
+			for (int t = 0; t < nThreads; t++)
+				ok = ok && !failed[t];
+			ok = ok && check(ndx);
+			if (!ok)
+				printf("FAILED: %d threads, %s\n", nThreads, concurrent ? "concurrent writes" : "one lock");
+		}
+		printf("  %2d threads: %9.0f inserts/s with one lock, %9.0f in concurrent write mode\n",
+		       nThreads, nKeys / seconds[0], nKeys / seconds[1]);
+	}
+	remove(filename);
+	return ok;
+}
+
+// runs of 300 keys in order are removed first, then put back while every third key
+//    of the others is removed
+bool refilled(int i) { return i / 300 % 3 == 0; }
+bool removed(int i)  { return !refilled(i) && i % 3 == 0; }
+
+// each thread puts back and removes the keys i with i % nThreads == t
+void refiller(SmallIndex* ndx, const std::vector<std::string>* sorted, int t, int nThreads, int* failed)
+{
+	for (int i = t; i < (int)sorted->size(); i += nThreads)
+		if ((refilled(i) && !ndx->insert((*sorted)[i].c_str(), i)) ||
+		    (removed(i) && !ndx->remove((*sorted)[i].c_str())))
+			(*failed)++;
+}
+
+// removes free the leaves they empty, which leaves sons of 0 in the nodes above and
+//    lifts merged nodes a level, so the leaves writers latch are not all on one level
+bool emptiedLeaves(int nThreads)
+{
+	int nKeys = (int)keys.size();
+	std::vector<std::string> sorted(keys);
+	std::sort(sorted.begin(), sorted.end());
+	SmallIndex ndx(nKeys / 5 + 100);
+	ndx.create(filename);
+	for (int i = 0; i < nKeys; i++)
+		ndx.insert(sorted[i].c_str(), i);
+	for (int i = 0; i < nKeys; i++)
+		if (refilled(i))
+			ndx.remove(sorted[i].c_str());
+
+	ndx.beginConcurrentWrites();
+	std::vector<int>         failed(nThreads, 0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nThreads; t++)
+		threads.push_back(std::thread(refiller, &ndx, &sorted, t, nThreads, &failed[t]));
+	for (int t = 0; t < nThreads; t++)
+		threads[t].join();
+	ndx.endConcurrentWrites();
+
+	bool ok = ndx.valid();
+	int  left = 0;
+	for (int t = 0; t < nThreads; t++)
+		ok = ok && !failed[t];
+	for (int i = 0; ok && i < nKeys; i++) {
+		void*  key;
+		uint32 offset;
+		left += !removed(i);
+		ok = removed(i) ? !ndx.find(sorted[i].c_str())
+		                : ndx.find(sorted[i].c_str()) && ndx.getCurKey(key, offset) && offset == (uint32)i;
+	}
+	ok = ok && ndx.count() == left;
+	ndx.close();
+	remove(filename);
+	if (!ok)
+		printf("FAILED: concurrent writes after leaves were emptied\n");
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	int nKeys      = argc > 1 ? atoi(argv[1]) : 200000;
+	int maxThreads = argc > 2 ? atoi(argv[2]) : std::max(8, (int)std::thread::hardware_concurrency());
+	printf("%d hardware threads\n", (int)std::thread::hardware_concurrency());
+
+	keys.resize(nKeys);
+	srand(1);
+	for (int i = 0; i < nKeys; i++) {
+		char key[32];
+		sprintf(key, "%08x%07d", rand() * (unsigned)RAND_MAX + rand(), i);
+		keys[i] = key;
+	}
+
+	bool ok = test(nKeys / 30 + 100, maxThreads) &&   // every node
+	          test(4 * maxThreads + 16, maxThreads) &&  // 2 pinned per writer, and then some
+	          emptiedLeaves(maxThreads);
+	printf(ok ? "ok\n" : "FAILED\n");
+	return ok ? 0 : 1;
+}